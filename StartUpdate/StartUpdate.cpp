@@ -6,12 +6,24 @@
 
 #include "serviceinstall.h"
 #include "updatecommon.h"
+#include "commandpipe.h"
+#include "retrypolicy.h"
+#include "servicewait.h"
+#include "stagedupdates.h"
 
 #define ERROR_NOT_ENOUGH_ARGS -1
 #define ERROR_UPDATER_PATH_INVALID -2
 #define ERROR_REGISTRY_KEY_INVALID -3
 #define ERROR_REGISTRY_PATH_INVALID -4
 #define ERROR_SERVICE_ALREADY_STARTED -5
+#define ERROR_SERVICE_COMMAND_REJECTED -6
+
+// How long to wait for a resident service to take the command.
+#define COMMAND_PIPE_WAIT_MS 5000
+// How often a starting service is checked for its command pipe.
+#define COMMAND_PIPE_RETRY_MS 50
+// How long to wait for a stopping service to stop before starting it.
+#define SERVICE_STOP_WAIT_MS 10000
 
 void log(const wchar_t* msg) {
     std::wcout << msg << L"\n";
@@ -35,12 +47,25 @@ int wmain(int argc, wchar_t* argv[])
     SERVICE_STATUS_PROCESS ssStatus;
     DWORD dwBytesNeeded;
 
+    // With --stage the service copies and verifies the updater ahead of the
+    // update. The update can then name it by its token, staged: followed by
+    // the hex SHA-256 digest of the updater, instead of by its path.
+    const wchar_t* command = L"software-update";
+    if (argc > 1 && !wcscmp(argv[1], L"--stage")) {
+        command = L"stage";
+        --argc;
+        ++argv;
+    }
+
     if (argc < 3) {
         logError(L"Not enough arguments");
         return ERROR_NOT_ENOUGH_ARGS;
     }
 
-    if (!IsValidFullPath(argv[1])) {
+    bool stagedToken = !wcsncmp(argv[1], STAGED_TOKEN_PREFIX,
+        STAGED_TOKEN_PREFIX_LENGTH);
+    if (stagedToken ? !wcscmp(command, L"stage")
+                    : !IsValidFullPath(argv[1])) {
        std::wcerr << argv[1] << L" is not a valid full path\n";
        return ERROR_UPDATER_PATH_INVALID;
     }
@@ -107,40 +132,96 @@ int wmain(int argc, wchar_t* argv[])
         return logLastError(L"Could not query service status");
     }
 
-    if (ssStatus.dwCurrentState != SERVICE_STOPPED &&
-        ssStatus.dwCurrentState != SERVICE_STOP_PENDING)
-    {
-        logError(L"Could not start the service because it is already started");
-        return ERROR_SERVICE_ALREADY_STARTED;
-    }
-
     const wchar_t* args[] = {
-        L"software-update",
+        command,
         argv[1],
         installPath
     };
 
-    // Wait at most 5 seconds trying to start the service in case of errors
-    // like ERROR_SERVICE_DATABASE_LOCKED or ERROR_SERVICE_REQUEST_TIMEOUT.
-    const DWORD maxWaitMS = 5000;
-    DWORD currentWaitMS = 0;
-    DWORD lastError = ERROR_SUCCESS;
-    while (currentWaitMS < maxWaitMS) {
-        BOOL result = StartServiceW(schService.get(), 3, args);
-        if (result) {
-            lastError = ERROR_SUCCESS;
-            break;
+    if (ssStatus.dwCurrentState != SERVICE_STOPPED &&
+        ssStatus.dwCurrentState != SERVICE_STOP_PENDING)
+    {
+        // A resident service takes the command over its command pipe.
+        // A service which is still starting may not have created its
+        // command pipe yet.
+        ServiceCommandReply reply;
+        DWORD pipeError;
+        ULONGLONG pipeDeadline = GetTickCount64() + COMMAND_PIPE_WAIT_MS;
+        for (;;) {
+            pipeError = SendServiceCommand(ssStatus.dwProcessId, 3, args,
+                COMMAND_PIPE_WAIT_MS, reply);
+            if (pipeError != ERROR_FILE_NOT_FOUND ||
+                GetTickCount64() >= pipeDeadline ||
+                !QueryServiceStatusEx(
+                    schService.get(),
+                    SC_STATUS_PROCESS_INFO,
+                    (LPBYTE)&ssStatus,
+                    sizeof(SERVICE_STATUS_PROCESS),
+                    &dwBytesNeeded) ||
+                ssStatus.dwCurrentState != SERVICE_START_PENDING)
+            {
+                break;
+            }
+            Sleep(COMMAND_PIPE_RETRY_MS);
         }
-        else {
-            lastError = GetLastError();
+        if (pipeError == ERROR_SUCCESS) {
+            if (reply != SERVICE_COMMAND_QUEUED) {
+                logError(L"The service did not queue the command", reply);
+                return ERROR_SERVICE_COMMAND_REJECTED;
+            }
+            log(L"Service command queued...");
+            return ERROR_SUCCESS;
+        }
+
+        // The service may have stopped since, in which case it is started
+        // below.
+        if (!QueryServiceStatusEx(
+            schService.get(),
+            SC_STATUS_PROCESS_INFO,
+            (LPBYTE)&ssStatus,
+            sizeof(SERVICE_STATUS_PROCESS),
+            &dwBytesNeeded))
+        {
+            return logLastError(L"Could not query service status");
+        }
+
+        if (ssStatus.dwCurrentState != SERVICE_STOPPED &&
+            ssStatus.dwCurrentState != SERVICE_STOP_PENDING)
+        {
+            logError(L"Could not start the service because it is already started",
+                pipeError);
+            return ERROR_SERVICE_ALREADY_STARTED;
         }
-        Sleep(100);
-        currentWaitMS += 100;
+    }
+
+    // A resident service which went idle closed its command pipe and is
+    // stopping. It takes the command once it was started again.
+    if (ssStatus.dwCurrentState == SERVICE_STOP_PENDING) {
+        log(L"Waiting for the service to stop...");
+        SC_HANDLE waitService = OpenService(schSCManager.get(),
+            L"AveoSystemsUpdate", SERVICE_QUERY_STATUS);
+        if (waitService) {
+            ScmServiceStateSource source(waitService);
+            uint32_t elapsedMS;
+            WaitForServiceState(source, SERVICE_STOPPED, SERVICE_STOP_WAIT_MS,
+                elapsedMS);
+        }
+    }
+
+    // Retry for a while in case of errors like ERROR_SERVICE_DATABASE_LOCKED
+    // or ERROR_SERVICE_REQUEST_TIMEOUT. While the service is still stopping
+    // the start is retried too.
+    RetryStats stats;
+    DWORD lastError = StartServiceWithRetry(schService.get(), 3, args, stats);
+    if (stats.attempts > 1) {
+        std::wcout << L"Started the service after " << stats.attempts
+            << L" attempts in " << stats.elapsedMS << L" ms\n";
     }
 
     if (lastError != ERROR_SUCCESS)
     {
-        return logLastError(L"Start service failed");
+        logError(L"Start service failed", lastError);
+        return lastError;
     }
 
     log(L"Service start pending...");
@@ -0,0 +1,239 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <algorithm>
+#include <wchar.h>
+
+#include "allowlist.h"
+#include "updatecommon.h"
+
+#define MAX_KEY_LENGTH 255
+
+// Not in older SDKs, needs Windows 8. Without it the notification is
+// signaled when the thread that asked for it exits.
+#ifndef REG_NOTIFY_THREAD_AGNOSTIC
+#define REG_NOTIFY_THREAD_AGNOSTIC 0x10000000L
+#endif
+
+static int CompareAllowedCertificate(const AllowedCertificate& a,
+                                     LPCWSTR name, LPCWSTR issuer) {
+  int result = wcscmp(a.name, name);
+  return result ? result : wcscmp(a.issuer, issuer);
+}
+
+void SortAllowedCertificates(AllowedCertificateList& certificates) {
+  std::sort(certificates.begin(), certificates.end(),
+            [](const AllowedCertificate& a, const AllowedCertificate& b) {
+              return CompareAllowedCertificate(a, b.name, b.issuer) < 0;
+            });
+}
+
+/**
+ * Checks if a name and issuer pair is in a sorted list of allowed
+ * certificates.
+ */
+bool IsCertificateAllowed(const AllowedCertificateList& certificates,
+                          LPCWSTR name, LPCWSTR issuer) {
+  auto it = std::lower_bound(
+      certificates.begin(), certificates.end(), name,
+      [issuer](const AllowedCertificate& a, LPCWSTR value) {
+        return CompareAllowedCertificate(a, value, issuer) < 0;
+      });
+  return it != certificates.end() &&
+         CompareAllowedCertificate(*it, name, issuer) == 0;
+}
+
+RegistryAllowlistStore::~RegistryAllowlistStore() {
+  for (auto& watch : mWatches) {
+    RegCloseKey(watch.second.key);
+    CloseHandle(watch.second.changed);
+  }
+}
+
+void RegistryAllowlistStore::StopWatching(const std::wstring& keyPath) {
+  auto it = mWatches.find(keyPath);
+  if (it != mWatches.end()) {
+    RegCloseKey(it->second.key);
+    CloseHandle(it->second.changed);
+    mWatches.erase(it);
+  }
+}
+
+/**
+ * Reads every subkey of keyPath as an allowed certificate. Subkeys which
+ * can't be read are skipped. The key is watched for changes before it is
+ * read so a change made while reading is not missed.
+ *
+ * @param  keyPath      The key under HKEY_LOCAL_MACHINE
+ * @param  certificates Out parameter for the sorted allowed certificates
+ * @return ERROR_SUCCESS or the error from the registry.
+ */
+LONG RegistryAllowlistStore::Read(LPCWSTR keyPath,
+                                  AllowedCertificateList& certificates) {
+  certificates.clear();
+  StopWatching(keyPath);
+
+  // We use KEY_WOW64_64KEY to always force 64-bit view.
+  // The user may have both x86 and x64 applications installed
+  // which each register information.  We need a consistent place
+  // to put those certificate attributes in and hence why we always
+  // force the non redirected registry under Wow6432Node.
+  // This flag is ignored on 32bit systems.
+  HKEY baseKey;
+  LONG retCode = RegOpenKeyExW(HKEY_LOCAL_MACHINE, keyPath, 0,
+                               KEY_READ | KEY_NOTIFY | KEY_WOW64_64KEY,
+                               &baseKey);
+  if (retCode != ERROR_SUCCESS) {
+    return retCode;
+  }
+
+  KeyWatch watch = {baseKey, CreateEventW(nullptr, TRUE, FALSE, nullptr)};
+  LONG notifyCode = watch.changed ? ERROR_SUCCESS : (LONG)GetLastError();
+  if (watch.changed) {
+    notifyCode = RegNotifyChangeKeyValue(
+        baseKey, TRUE,
+        REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET |
+            REG_NOTIFY_THREAD_AGNOSTIC,
+        watch.changed, TRUE);
+  }
+  if (notifyCode == ERROR_SUCCESS) {
+    mWatches[keyPath] = watch;
+  } else {
+    // Without a watch the key is simply read again every time.
+    LOG_WARN(("Could not watch the allowed certificates key.  (%ld)",
+              notifyCode));
+    if (watch.changed) {
+      CloseHandle(watch.changed);
+    }
+    watch.key = nullptr;
+  }
+
+  // Get the number of subkeys.
+  DWORD subkeyCount = 0;
+  retCode = RegQueryInfoKeyW(baseKey, nullptr, nullptr, nullptr, &subkeyCount,
+                             nullptr, nullptr, nullptr, nullptr, nullptr,
+                             nullptr, nullptr);
+  if (retCode != ERROR_SUCCESS) {
+    LOG_WARN(("Could not query info key.  (%ld)", retCode));
+    if (!watch.key) {
+      RegCloseKey(baseKey);
+    }
+    return retCode;
+  }
+
+  // Enumerate the subkeys, each subkey represents an allowed certificate.
+  certificates.reserve(subkeyCount);
+  for (DWORD i = 0; i < subkeyCount; i++) {
+    WCHAR subkeyBuffer[MAX_KEY_LENGTH];
+    DWORD subkeyBufferCount = MAX_KEY_LENGTH;
+    retCode = RegEnumKeyExW(baseKey, i, subkeyBuffer, &subkeyBufferCount,
+                            nullptr, nullptr, nullptr, nullptr);
+    if (retCode != ERROR_SUCCESS) {
+      LOG_WARN(("Could not enum certs.  (%ld)", retCode));
+      certificates.clear();
+      if (!watch.key) {
+        RegCloseKey(baseKey);
+      }
+      return retCode;
+    }
+
+    // Open the subkey for the current certificate
+    HKEY subKey;
+    retCode = RegOpenKeyExW(baseKey, subkeyBuffer, 0,
+                            KEY_READ | KEY_WOW64_64KEY, &subKey);
+    if (retCode != ERROR_SUCCESS) {
+      LOG_WARN(("Could not open subkey.  (%ld)", retCode));
+      continue;  // Try the next subkey
+    }
+
+    DWORD valueBufSize = ALLOWLIST_NAME_LENGTH * sizeof(WCHAR);
+    AllowedCertificate allowed = {{L'\0'}, {L'\0'}};
+
+    // Get the name from the registry
+    retCode = RegQueryValueExW(subKey, L"name", 0, nullptr,
+                               (LPBYTE)allowed.name, &valueBufSize);
+    if (retCode != ERROR_SUCCESS) {
+      LOG_WARN(("Could not obtain name from registry.  (%ld)", retCode));
+      RegCloseKey(subKey);
+      continue;  // Try the next subkey
+    }
+
+    // Get the issuer from the registry
+    valueBufSize = ALLOWLIST_NAME_LENGTH * sizeof(WCHAR);
+    retCode = RegQueryValueExW(subKey, L"issuer", 0, nullptr,
+                               (LPBYTE)allowed.issuer, &valueBufSize);
+    if (retCode != ERROR_SUCCESS) {
+      LOG_WARN(("Could not obtain issuer from registry.  (%ld)", retCode));
+      RegCloseKey(subKey);
+      continue;  // Try the next subkey
+    }
+    RegCloseKey(subKey);
+
+    allowed.name[ALLOWLIST_NAME_LENGTH - 1] = L'\0';
+    allowed.issuer[ALLOWLIST_NAME_LENGTH - 1] = L'\0';
+    certificates.push_back(allowed);
+  }
+
+  // The key stays open while it is watched, closing it ends the watch.
+  if (!watch.key) {
+    RegCloseKey(baseKey);
+  }
+
+  SortAllowedCertificates(certificates);
+  return ERROR_SUCCESS;
+}
+
+bool RegistryAllowlistStore::HasChanged(LPCWSTR keyPath) {
+  auto it = mWatches.find(keyPath);
+  if (it == mWatches.end()) {
+    return true;
+  }
+  return WaitForSingleObject(it->second.changed, 0) != WAIT_TIMEOUT;
+}
+
+AllowlistSnapshot& AllowlistSnapshot::GetDefault() {
+  static RegistryAllowlistStore defaultStore;
+  static AllowlistSnapshot defaultSnapshot(defaultStore);
+  return defaultSnapshot;
+}
+
+/**
+ * Obtains the allowed certificates stored under a key. The key is only read
+ * the first time it is asked for and again after it changes. Keys which
+ * can't be read are not remembered.
+ *
+ * @param  keyPath      The key of the installation, see
+ *                      CalculateRegistryPathFromFilePath
+ * @param  certificates Out parameter for the sorted allowed certificates,
+ *                      valid until the next call to Get.
+ * @return ERROR_SUCCESS or the error reading the key.
+ */
+LONG AllowlistSnapshot::Get(LPCWSTR keyPath,
+                            const AllowedCertificateList*& certificates) {
+  certificates = nullptr;
+  std::wstring key(keyPath);
+  auto it = mLists.find(key);
+  if (it != mLists.end() && !mStore.HasChanged(keyPath)) {
+    certificates = &it->second;
+    return ERROR_SUCCESS;
+  }
+
+  AllowedCertificateList list;
+  LONG retCode = mStore.Read(keyPath, list);
+  if (retCode != ERROR_SUCCESS) {
+    if (it != mLists.end()) {
+      mLists.erase(it);
+    }
+    return retCode;
+  }
+
+  if (it != mLists.end()) {
+    LOG(("Allowed certificates changed, read them again."));
+  }
+  AllowedCertificateList& stored = mLists[key];
+  stored.swap(list);
+  certificates = &stored;
+  return ERROR_SUCCESS;
+}
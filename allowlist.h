@@ -0,0 +1,81 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _ALLOWLIST_H_
+#define _ALLOWLIST_H_
+
+#include <windows.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define ALLOWLIST_NAME_LENGTH 256
+
+struct AllowedCertificate {
+  WCHAR name[ALLOWLIST_NAME_LENGTH];
+  WCHAR issuer[ALLOWLIST_NAME_LENGTH];
+};
+
+// Sorted by name and then issuer, see SortAllowedCertificates.
+typedef std::vector<AllowedCertificate> AllowedCertificateList;
+
+void SortAllowedCertificates(AllowedCertificateList& certificates);
+bool IsCertificateAllowed(const AllowedCertificateList& certificates,
+                          LPCWSTR name, LPCWSTR issuer);
+
+/**
+ * Where the allowed certificates for an installation are stored. Each
+ * installation has its own key, see CalculateRegistryPathFromFilePath.
+ */
+class AllowlistStore {
+ public:
+  virtual ~AllowlistStore() {}
+
+  // Reads the allowed certificates stored under keyPath and starts watching
+  // it for changes. Returns ERROR_SUCCESS or the error opening the key.
+  virtual LONG Read(LPCWSTR keyPath, AllowedCertificateList& certificates) = 0;
+  // Returns true if keyPath may have changed since it was last read.
+  virtual bool HasChanged(LPCWSTR keyPath) = 0;
+};
+
+/**
+ * Reads allowed certificates from subkeys of HKLM, each holding a "name"
+ * and an "issuer" value, and watches the keys with RegNotifyChangeKeyValue.
+ */
+class RegistryAllowlistStore : public AllowlistStore {
+ public:
+  ~RegistryAllowlistStore();
+
+  LONG Read(LPCWSTR keyPath, AllowedCertificateList& certificates) override;
+  bool HasChanged(LPCWSTR keyPath) override;
+
+ private:
+  struct KeyWatch {
+    HKEY key;
+    HANDLE changed;
+  };
+  void StopWatching(const std::wstring& keyPath);
+
+  std::unordered_map<std::wstring, KeyWatch> mWatches;
+};
+
+/**
+ * The allowed certificates of every installation looked up during this run
+ * of the service, read once and only read again when the store reports a
+ * change.
+ */
+class AllowlistSnapshot {
+ public:
+  static AllowlistSnapshot& GetDefault();
+
+  explicit AllowlistSnapshot(AllowlistStore& store) : mStore(store) {}
+
+  LONG Get(LPCWSTR keyPath, const AllowedCertificateList*& certificates);
+
+ private:
+  AllowlistStore& mStore;
+  std::unordered_map<std::wstring, AllowedCertificateList> mLists;
+};
+
+#endif
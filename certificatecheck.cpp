@@ -7,6 +7,7 @@
 #include <windows.h>
 #include <softpub.h>
 #include <wintrust.h>
+#include <memory>
 
 #include "certificatecheck.h"
 #include "updatecommon.h"
@@ -14,27 +15,96 @@
 static const int ENCODING = X509_ASN_ENCODING | PKCS_7_ASN_ENCODING;
 
 /**
- * Checks to see if a file stored at filePath matches the specified info.
+ * Obtains one of the simple display names of a certificate.
  *
- * @param  filePath    The PE file path to check
- * @param  infoToMatch The acceptable information to match
- * @return ERROR_SUCCESS if successful, ERROR_NOT_FOUND if the info
- *         does not match, or the last error otherwise.
+ * @param  certContext The certificate to get the name of
+ * @param  flags       0 for the subject or CERT_NAME_ISSUER_FLAG for the issuer
+ * @return the name, or nullptr on errors
  */
-DWORD
-CheckCertificateForPEFile(LPCWSTR filePath, CertificateCheckInfo& infoToMatch) {
+static std::unique_ptr<WCHAR[]> GetCertificateName(PCCERT_CONTEXT certContext,
+                                                   DWORD flags) {
+  // Pass in nullptr to get the needed size of the name buffer.
+  DWORD nameSize = CertGetNameStringW(certContext, CERT_NAME_SIMPLE_DISPLAY_TYPE,
+                                      flags, nullptr, nullptr, 0);
+  if (!nameSize) {
+    LOG_WARN(("CertGetNameString failed.  (%lu)", GetLastError()));
+    return nullptr;
+  }
+
+  auto name = std::make_unique<WCHAR[]>(nameSize);
+  if (!CertGetNameStringW(certContext, CERT_NAME_SIMPLE_DISPLAY_TYPE, flags,
+                          nullptr, name.get(), nameSize)) {
+    LOG_WARN(("CertGetNameString failed.  (%lu)", GetLastError()));
+    return nullptr;
+  }
+  return name;
+}
+
+/**
+ * Reads the signer of an Authenticode signed PE file.
+ *
+ * @param  filePath The PE file path to read
+ * @return ERROR_SUCCESS if successful, or the last error otherwise.
+ */
+DWORD SignedFileInfo::LoadFromFile(LPCWSTR filePath) {
+  return Load(CERT_QUERY_OBJECT_FILE, filePath,
+              CERT_QUERY_CONTENT_FLAG_PKCS7_SIGNED_EMBED,
+              CERT_QUERY_FORMAT_FLAG_ALL);
+}
+
+/**
+ * Reads the signer of a PKCS #7 signed message, such as the signature
+ * extracted from a PE file's security directory.
+ *
+ * @param  data The DER encoded message
+ * @param  size The number of bytes in data
+ * @return ERROR_SUCCESS if successful, or the last error otherwise.
+ */
+DWORD SignedFileInfo::LoadFromBlob(const BYTE* data, DWORD size) {
+  CERT_BLOB blob;
+  blob.cbData = size;
+  blob.pbData = const_cast<BYTE*>(data);
+  return Load(CERT_QUERY_OBJECT_BLOB, &blob, CERT_QUERY_CONTENT_FLAG_PKCS7_SIGNED,
+              CERT_QUERY_FORMAT_FLAG_BINARY);
+}
+
+/**
+ * Sets the signer names directly, for certificate verifiers which don't
+ * read them from a signature.
+ */
+void SignedFileInfo::SetNames(LPCWSTR name, LPCWSTR issuer) {
+  size_t nameLen = wcslen(name) + 1;
+  mName = std::make_unique<WCHAR[]>(nameLen);
+  wcscpy_s(mName.get(), nameLen, name);
+
+  size_t issuerLen = wcslen(issuer) + 1;
+  mIssuer = std::make_unique<WCHAR[]>(issuerLen);
+  wcscpy_s(mIssuer.get(), issuerLen, issuer);
+}
+
+/**
+ * Finds the signer certificate of a signed object and keeps its subject and
+ * issuer names. This is the only place the signature is parsed, every
+ * allowed certificate is then matched against the names in memory.
+ *
+ * @return ERROR_SUCCESS if successful, or the last error otherwise.
+ */
+DWORD SignedFileInfo::Load(DWORD objectType, const void* object,
+                           DWORD contentFlags, DWORD formatFlags) {
   HCERTSTORE certStore = nullptr;
   HCRYPTMSG cryptMsg = nullptr;
   PCCERT_CONTEXT certContext = nullptr;
   PCMSG_SIGNER_INFO signerInfo = nullptr;
   DWORD lastError = ERROR_SUCCESS;
 
-  // Get the HCERTSTORE and HCRYPTMSG from the signed file.
+  mName.reset();
+  mIssuer.reset();
+
+  // Get the HCERTSTORE and HCRYPTMSG from the signed object.
   DWORD encoding, contentType, formatType;
-  BOOL result = CryptQueryObject(
-      CERT_QUERY_OBJECT_FILE, filePath,
-      CERT_QUERY_CONTENT_FLAG_PKCS7_SIGNED_EMBED, CERT_QUERY_CONTENT_FLAG_ALL,
-      0, &encoding, &contentType, &formatType, &certStore, &cryptMsg, nullptr);
+  BOOL result = CryptQueryObject(objectType, object, contentFlags, formatFlags,
+                                 0, &encoding, &contentType, &formatType,
+                                 &certStore, &cryptMsg, nullptr);
   if (!result) {
     lastError = GetLastError();
     LOG_WARN(("CryptQueryObject failed.  (%lu)", lastError));
@@ -82,9 +152,12 @@ CheckCertificateForPEFile(LPCWSTR filePath, CertificateCheckInfo& infoToMatch) {
     goto cleanup;
   }
 
-  if (!DoCertificateAttributesMatch(certContext, infoToMatch)) {
-    lastError = ERROR_NOT_FOUND;
-    LOG_WARN(("Certificate did not match issuer or name.  (%lu)", lastError));
+  mIssuer = GetCertificateName(certContext, CERT_NAME_ISSUER_FLAG);
+  mName = GetCertificateName(certContext, 0);
+  if (!mIssuer || !mName) {
+    mName.reset();
+    mIssuer.reset();
+    lastError = ERROR_INVALID_DATA;
     goto cleanup;
   }
 
@@ -104,6 +177,49 @@ cleanup:
   return lastError;
 }
 
+/**
+ * Checks to see if the signer matches the specified info. A null name or
+ * issuer in infoToMatch matches anything, like DoCertificateAttributesMatch.
+ *
+ * @param  infoToMatch The acceptable information to match
+ * @return true if the signer was read and matches.
+ */
+bool SignedFileInfo::Matches(const CertificateCheckInfo& infoToMatch) const {
+  if (!mName || !mIssuer) {
+    return false;
+  }
+  if (infoToMatch.issuer && wcscmp(mIssuer.get(), infoToMatch.issuer)) {
+    return false;
+  }
+  if (infoToMatch.name && wcscmp(mName.get(), infoToMatch.name)) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Checks to see if a file stored at filePath matches the specified info.
+ *
+ * @param  filePath    The PE file path to check
+ * @param  infoToMatch The acceptable information to match
+ * @return ERROR_SUCCESS if successful, ERROR_NOT_FOUND if the info
+ *         does not match, or the last error otherwise.
+ */
+DWORD
+CheckCertificateForPEFile(LPCWSTR filePath, CertificateCheckInfo& infoToMatch) {
+  SignedFileInfo signer;
+  DWORD lastError = signer.LoadFromFile(filePath);
+  if (lastError != ERROR_SUCCESS) {
+    return lastError;
+  }
+
+  if (!signer.Matches(infoToMatch)) {
+    lastError = ERROR_NOT_FOUND;
+    LOG_WARN(("Certificate did not match issuer or name.  (%lu)", lastError));
+  }
+  return lastError;
+}
+
 /**
  * Checks to see if a file stored at filePath matches the specified info.
  *
@@ -7,16 +7,64 @@
 
 #include <windows.h>
 #include <wincrypt.h>
+#include <memory>
 
 struct CertificateCheckInfo {
   LPCWSTR name;
   LPCWSTR issuer;
 };
 
+/**
+ * The signer certificate names of a signed file, read from its signature
+ * once so they can be matched against any number of allowed certificates.
+ */
+class SignedFileInfo {
+ public:
+  DWORD LoadFromFile(LPCWSTR filePath);
+  DWORD LoadFromBlob(const BYTE* data, DWORD size);
+  void SetNames(LPCWSTR name, LPCWSTR issuer);
+
+  bool Matches(const CertificateCheckInfo& infoToMatch) const;
+  LPCWSTR Name() const { return mName.get(); }
+  LPCWSTR Issuer() const { return mIssuer.get(); }
+
+ private:
+  DWORD Load(DWORD objectType, const void* object, DWORD contentFlags,
+             DWORD formatFlags);
+
+  std::unique_ptr<WCHAR[]> mName;
+  std::unique_ptr<WCHAR[]> mIssuer;
+};
+
 BOOL DoCertificateAttributesMatch(PCCERT_CONTEXT pCertContext,
                                   CertificateCheckInfo& infoToMatch);
 DWORD VerifyCertificateTrustForFile(LPCWSTR filePath);
 DWORD CheckCertificateForPEFile(LPCWSTR filePath,
                                 CertificateCheckInfo& infoToMatch);
 
+/**
+ * The certificate checks used to decide if a binary is allowed to run.
+ * Callers which don't need to substitute the checks use
+ * WinTrustCertificateVerifier.
+ */
+class CertificateVerifier {
+ public:
+  virtual ~CertificateVerifier() {}
+
+  // Reads the signer of the file, returns ERROR_SUCCESS if it was read.
+  virtual DWORD ReadSigner(LPCWSTR filePath, SignedFileInfo& signer) = 0;
+  // Returns ERROR_SUCCESS if the file's signature is trusted by the system.
+  virtual DWORD VerifyTrust(LPCWSTR filePath) = 0;
+};
+
+class WinTrustCertificateVerifier : public CertificateVerifier {
+ public:
+  DWORD ReadSigner(LPCWSTR filePath, SignedFileInfo& signer) override {
+    return signer.LoadFromFile(filePath);
+  }
+  DWORD VerifyTrust(LPCWSTR filePath) override {
+    return VerifyCertificateTrustForFile(filePath);
+  }
+};
+
 #endif
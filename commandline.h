@@ -0,0 +1,273 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _COMMANDLINE_H_
+#define _COMMANDLINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+#include <memory>
+
+// COMMAND_LINE_NO_SSE2 leaves only the scalar scan, for the test to cover it.
+#if (defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)) && \
+    WCHAR_MAX == 0xffff && !defined(COMMAND_LINE_NO_SSE2)
+#include <emmintrin.h>
+#define COMMAND_LINE_SSE2
+#endif
+
+/**
+ * What is needed to quote an argument, found in a single scan of it.
+ */
+struct ArgInfo {
+  size_t length;
+  // Backslashes added to escape doublequotes and the backslashes in front of
+  // them.
+  size_t escapes;
+  // Backslashes at the end, which are doubled in front of a final doublequote.
+  size_t trailingBackslashes;
+  bool hasDoubleQuote;
+  // The argument is empty or contains a space or a tab
+  bool addDoubleQuotes;
+};
+
+/**
+ * Scans an argument once. Eight characters at a time are skipped while none
+ * of them is a space, tab, doublequote, backslash or the terminator.
+ */
+inline ArgInfo ClassifyArg(const wchar_t* s) {
+  ArgInfo info = {0, 0, 0, false, false};
+  size_t backslashes = 0;
+  const wchar_t* p = s;
+  for (;;) {
+#ifdef COMMAND_LINE_SSE2
+    // Aligned loads never cross into the next page, so reading past the
+    // terminator is safe.
+    if (!(reinterpret_cast<uintptr_t>(p) & 15)) {
+      __m128i chars = _mm_load_si128(reinterpret_cast<const __m128i*>(p));
+      __m128i special = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi16(chars, _mm_set1_epi16(L' ')),
+                       _mm_cmpeq_epi16(chars, _mm_set1_epi16(L'\t'))),
+          _mm_or_si128(
+              _mm_or_si128(_mm_cmpeq_epi16(chars, _mm_set1_epi16(L'"')),
+                           _mm_cmpeq_epi16(chars, _mm_set1_epi16(L'\\'))),
+              _mm_cmpeq_epi16(chars, _mm_setzero_si128())));
+      if (!_mm_movemask_epi8(special)) {
+        p += 8;
+        backslashes = 0;
+        continue;
+      }
+    }
+#endif
+    wchar_t c = *p;
+    if (!c) {
+      break;
+    }
+    if (c == L'\\') {
+      ++backslashes;
+    } else {
+      if (c == L'"') {
+        // Escape the doublequote and all backslashes preceding the
+        // doublequote
+        info.hasDoubleQuote = true;
+        info.escapes += backslashes + 1;
+      } else if (c == L' ' || c == L'\t') {
+        info.addDoubleQuotes = true;
+      }
+      backslashes = 0;
+    }
+    ++p;
+  }
+
+  info.length = static_cast<size_t>(p - s);
+  info.trailingBackslashes = backslashes;
+  if (!info.length) {
+    info.addDoubleQuotes = true;
+  }
+  return info;
+}
+
+inline size_t ArgStrLen(const ArgInfo& info) {
+  size_t len = info.length + info.escapes;
+  if (info.addDoubleQuotes) {
+    // initial and final doublequote
+    len += 2 + info.trailingBackslashes;
+  }
+  return len;
+}
+
+/**
+ * Copy string "s" to string "d", quoting the argument as appropriate and
+ * escaping doublequotes along with any backslashes that immediately precede
+ * doublequotes or the final doublequote.
+ * The CRT parses this to retrieve the original argc/argv that we meant,
+ * see STDARGV.C in the MSVC CRT sources.
+ *
+ * @param d    Must have room for ArgStrLen(info) characters
+ * @param info ClassifyArg(s)
+ * @return the end of the string
+ */
+inline wchar_t* ArgToString(wchar_t* d, const wchar_t* s, const ArgInfo& info) {
+  if (info.addDoubleQuotes) {
+    *d++ = L'"';  // initial doublequote
+  }
+
+  if (info.hasDoubleQuote) {
+    size_t backslashes = 0;
+    for (size_t i = 0; i < info.length; ++i) {
+      if (s[i] == L'\\') {
+        ++backslashes;
+      } else {
+        if (s[i] == L'"') {
+          for (size_t j = 0; j <= backslashes; ++j) {
+            *d++ = L'\\';
+          }
+        }
+        backslashes = 0;
+      }
+      *d++ = s[i];
+    }
+  } else {
+    memcpy(d, s, info.length * sizeof(wchar_t));
+    d += info.length;
+  }
+
+  if (info.addDoubleQuotes) {
+    for (size_t i = 0; i < info.trailingBackslashes; ++i) {
+      *d++ = L'\\';
+    }
+    *d++ = L'"';  // final doublequote
+  }
+
+  return d;
+}
+
+/**
+ * Builds a command line in one buffer: text which is copied as it is, like
+ * the program path and switches, and arguments which are quoted as needed.
+ * The caller's storage is used until the command line outgrows it.
+ */
+class CommandLineBuilder {
+ public:
+  /**
+   * @param storage  Where to build the command line, may be null
+   * @param capacity The size of @storage in characters
+   */
+  CommandLineBuilder(wchar_t* storage, size_t capacity)
+      : mData(storage), mLength(0), mCapacity(storage ? capacity : 0) {
+    if (mCapacity) {
+      mData[0] = L'\0';
+    }
+  }
+
+  CommandLineBuilder(const CommandLineBuilder&) = delete;
+  CommandLineBuilder& operator=(const CommandLineBuilder&) = delete;
+
+  void AppendText(const wchar_t* text) {
+    size_t len = wcslen(text);
+    wchar_t* d = Reserve(len);
+    memcpy(d, text, len * sizeof(wchar_t));
+    Commit(d + len);
+  }
+
+  void AppendArg(const wchar_t* arg) {
+    ArgInfo info = ClassifyArg(arg);
+    Commit(ArgToString(Reserve(ArgStrLen(info)), arg, info));
+  }
+
+  /**
+   * Appends the arguments separated by spaces.
+   */
+  void AppendArgs(int argc, const wchar_t* const* argv) {
+    for (int i = 0; i < argc; ++i) {
+      ArgInfo info = ClassifyArg(argv[i]);
+      size_t sep = i ? 1 : 0;
+      wchar_t* d = Reserve(ArgStrLen(info) + sep);
+      if (sep) {
+        *d++ = L' ';
+      }
+      Commit(ArgToString(d, argv[i], info));
+    }
+  }
+
+  /**
+   * @return the null terminated command line, it can be modified, as
+   *         CreateProcessW may do.
+   */
+  wchar_t* Get() {
+    if (!mCapacity) {
+      Commit(Reserve(0));
+    }
+    return mData;
+  }
+
+  size_t Length() const { return mLength; }
+
+  /**
+   * Hands the command line over, copying it if it is in the caller's storage.
+   */
+  std::unique_ptr<wchar_t[]> Release() {
+    Get();
+    if (mHeap) {
+      return std::move(mHeap);
+    }
+    auto s = std::make_unique<wchar_t[]>(mLength + 1);
+    memcpy(s.get(), mData, (mLength + 1) * sizeof(wchar_t));
+    return s;
+  }
+
+ private:
+  // Makes room for count more characters and the terminator.
+  wchar_t* Reserve(size_t count) {
+    size_t needed = mLength + count + 1;
+    if (needed > mCapacity) {
+      size_t capacity = mCapacity * 2;
+      if (capacity < needed) {
+        capacity = needed;
+      }
+      auto heap = std::make_unique<wchar_t[]>(capacity);
+      if (mLength) {
+        memcpy(heap.get(), mData, mLength * sizeof(wchar_t));
+      }
+      mHeap = std::move(heap);
+      mData = mHeap.get();
+      mCapacity = capacity;
+    }
+    return mData + mLength;
+  }
+
+  void Commit(wchar_t* end) {
+    *end = L'\0';
+    mLength = static_cast<size_t>(end - mData);
+  }
+
+  std::unique_ptr<wchar_t[]> mHeap;
+  wchar_t* mData;
+  size_t mLength;
+  size_t mCapacity;
+};
+
+/**
+ * Creates a command line from a list of arguments.
+ *
+ * @param argc Number of elements in |argv|
+ * @param argv Array of arguments
+ * @param aArgcExtra Number of elements in |aArgvExtra|
+ * @param aArgvExtra Optional array of arguments to be appended to the resulting
+ *                   command line after those provided by |argv|.
+ */
+inline std::unique_ptr<wchar_t[]> MakeCommandLine(
+    int argc, const wchar_t* const* argv, int aArgcExtra = 0,
+    const wchar_t* const* aArgvExtra = nullptr) {
+  CommandLineBuilder builder(nullptr, 0);
+  builder.AppendArgs(argc, argv);
+  if (argc && aArgcExtra) {
+    builder.AppendText(L" ");
+  }
+  builder.AppendArgs(aArgcExtra, aArgvExtra);
+  return builder.Release();
+}
+
+#endif
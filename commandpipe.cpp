@@ -0,0 +1,240 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <sddl.h>
+
+#include "commandpipe.h"
+#include "updatecommon.h"
+
+// How often the idle timeout is checked while nobody connects.
+#define COMMAND_PIPE_POLL_MS 1000
+// How long a connected client has to send its command.
+#define COMMAND_PIPE_READ_TIMEOUT_MS 5000
+
+// SYSTEM and administrators, plus the interactive user and local service
+// which may also start the service, see SetUserAccessServiceDACL.
+#define COMMAND_PIPE_SDDL \
+  L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GRGW;;;IU)(A;;GRGW;;;LS)"
+
+/**
+ * Waits for an overlapped pipe operation. It is cancelled if it doesn't
+ * complete within timeoutMS or once stopEvent is set.
+ *
+ * @return TRUE if the operation completed successfully.
+ */
+static BOOL WaitForPipeIO(HANDLE pipe, OVERLAPPED& overlapped,
+                          HANDLE stopEvent, DWORD timeoutMS,
+                          DWORD& transferred) {
+  HANDLE handles[] = {overlapped.hEvent, stopEvent};
+  DWORD waitResult = WaitForMultipleObjects(stopEvent ? 2 : 1, handles, FALSE,
+                                            timeoutMS);
+  if (WAIT_OBJECT_0 != waitResult) {
+    CancelIoEx(pipe, &overlapped);
+  }
+  // The operation may still have completed before it was cancelled.
+  return GetOverlappedResult(pipe, &overlapped, &transferred, TRUE);
+}
+
+/**
+ * Reads one command from a connected client, queues it and replies whether
+ * it was queued.
+ */
+static void HandleCommandClient(HANDLE pipe, HANDLE ioEvent,
+                                CommandDispatcher& dispatcher,
+                                HANDLE stopEvent, std::vector<uint8_t>& buffer) {
+  OVERLAPPED overlapped = {};
+  overlapped.hEvent = ioEvent;
+  DWORD readAmount = 0;
+  BOOL readDone = ReadFile(pipe, buffer.data(),
+                           static_cast<DWORD>(buffer.size()), nullptr,
+                           &overlapped);
+  if (!readDone && GetLastError() != ERROR_IO_PENDING) {
+    LOG_WARN(("Could not read from the command pipe.  (%lu)",
+              GetLastError()));
+    return;
+  }
+  if (!WaitForPipeIO(pipe, overlapped, stopEvent,
+                     COMMAND_PIPE_READ_TIMEOUT_MS, readAmount)) {
+    // ERROR_MORE_DATA means the message was too large.
+    LOG_WARN(("Could not read a command from the pipe.  (%lu)",
+              GetLastError()));
+    return;
+  }
+
+  ServiceCommandArgs args;
+  ServiceCommandReply reply = SERVICE_COMMAND_INVALID;
+  if (DecodeServiceCommand(buffer.data(), readAmount, args)) {
+    LOG(("Received service command %ls over the command pipe.",
+         args[0].c_str()));
+    reply = dispatcher.Submit(std::move(args)) ? SERVICE_COMMAND_QUEUED
+                                               : SERVICE_COMMAND_REJECTED;
+  }
+  if (reply != SERVICE_COMMAND_QUEUED) {
+    LOG_WARN(("Service command not queued, reply: %u.", reply));
+  }
+
+  uint32_t replyValue = reply;
+  DWORD wrote = 0;
+  overlapped = {};
+  overlapped.hEvent = ioEvent;
+  if ((WriteFile(pipe, &replyValue, sizeof(replyValue), nullptr,
+                 &overlapped) ||
+       GetLastError() == ERROR_IO_PENDING) &&
+      WaitForPipeIO(pipe, overlapped, stopEvent, COMMAND_PIPE_READ_TIMEOUT_MS,
+                    wrote)) {
+    FlushFileBuffers(pipe);
+  }
+}
+
+/**
+ * Creates the command pipe. Clients can connect to it from then on, their
+ * commands are taken once RunCommandPipe runs.
+ *
+ * @return The pipe, or null if it could not be created, for example because
+ *         something else created it first.
+ */
+HANDLE CreateCommandPipe() {
+  SECURITY_ATTRIBUTES sa = {sizeof(sa), nullptr, FALSE};
+  if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+          COMMAND_PIPE_SDDL, SDDL_REVISION_1, &sa.lpSecurityDescriptor,
+          nullptr)) {
+    LOG_WARN(("Could not create the command pipe security descriptor.  (%lu)",
+              GetLastError()));
+    return nullptr;
+  }
+
+  HANDLE pipe = CreateNamedPipeW(
+      SERVICE_COMMAND_PIPE_NAME,
+      PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+      PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT |
+          PIPE_REJECT_REMOTE_CLIENTS,
+      1, sizeof(uint32_t), SERVICE_COMMAND_MESSAGE_MAX, 0, &sa);
+  DWORD lastError = GetLastError();
+  LocalFree(sa.lpSecurityDescriptor);
+  if (INVALID_HANDLE_VALUE == pipe) {
+    LOG_WARN(("Could not create the command pipe.  (%lu)", lastError));
+    return nullptr;
+  }
+  return pipe;
+}
+
+/**
+ * Takes commands from the command pipe and queues them on the dispatcher,
+ * one client at a time. Returns once stopEvent is set or the dispatcher has
+ * been idle for idleTimeoutMS.
+ *
+ * @param  pipe The pipe from CreateCommandPipe
+ * @return FALSE if the pipe could not be served.
+ */
+BOOL RunCommandPipe(HANDLE pipe, CommandDispatcher& dispatcher,
+                    DWORD idleTimeoutMS, HANDLE stopEvent) {
+  autoHandle ioEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  if (!ioEvent) {
+    LOG_WARN(("Could not create the command pipe event.  (%lu)",
+              GetLastError()));
+    return FALSE;
+  }
+
+  std::vector<uint8_t> buffer(SERVICE_COMMAND_MESSAGE_MAX);
+  for (;;) {
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = ioEvent.get();
+    DWORD unused = 0;
+    BOOL connected = ConnectNamedPipe(pipe, &overlapped);
+    if (!connected) {
+      DWORD lastError = GetLastError();
+      if (ERROR_PIPE_CONNECTED == lastError) {
+        connected = TRUE;
+      } else if (ERROR_IO_PENDING == lastError) {
+        connected = WaitForPipeIO(pipe, overlapped, stopEvent,
+                                  COMMAND_PIPE_POLL_MS, unused);
+      } else {
+        LOG_WARN(("Could not wait for a command pipe client.  (%lu)",
+                  lastError));
+        return FALSE;
+      }
+    }
+
+    if (connected) {
+      HandleCommandClient(pipe, ioEvent.get(), dispatcher, stopEvent,
+                          buffer);
+      DisconnectNamedPipe(pipe);
+    }
+
+    if (stopEvent && WaitForSingleObject(stopEvent, 0) == WAIT_OBJECT_0) {
+      LOG(("Service stopping, closing the command pipe."));
+      return TRUE;
+    }
+    if (dispatcher.IdleFor(std::chrono::milliseconds(idleTimeoutMS))) {
+      LOG(("No service commands for %lu ms, closing the command pipe.",
+           idleTimeoutMS));
+      return TRUE;
+    }
+  }
+}
+
+/**
+ * Sends a command to the resident service.
+ *
+ * @param serviceProcessId The process ID of the service, the command is only
+ *                         sent if that process serves the pipe
+ * @param argc             The number of arguments in argv
+ * @param argv             The arguments the service would otherwise be
+ *                         started with
+ * @param timeoutMS        How long to wait for the pipe to become available
+ * @param reply            Whether the service queued the command
+ * @return ERROR_SUCCESS if a reply was received, ERROR_FILE_NOT_FOUND if the
+ *         service is not resident.
+ */
+DWORD SendServiceCommand(DWORD serviceProcessId, int argc, LPCWSTR* argv,
+                         DWORD timeoutMS, ServiceCommandReply& reply) {
+  ServiceCommandArgs args(argv, argv + argc);
+  std::vector<uint8_t> message;
+  if (!EncodeServiceCommand(args, message)) {
+    return ERROR_INVALID_PARAMETER;
+  }
+
+  if (!WaitNamedPipeW(SERVICE_COMMAND_PIPE_NAME, timeoutMS)) {
+    return GetLastError();
+  }
+
+  // The service only needs to know who we are, not act as us.
+  autoHandle pipe(CreateFileW(SERVICE_COMMAND_PIPE_NAME,
+                              GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                              OPEN_EXISTING,
+                              SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION,
+                              nullptr));
+  if (INVALID_HANDLE_VALUE == pipe.get()) {
+    return GetLastError();
+  }
+
+  // Make sure it is the service on the other end and not a squatter.
+  ULONG serverProcessId = 0;
+  if (!GetNamedPipeServerProcessId(pipe.get(), &serverProcessId)) {
+    return GetLastError();
+  }
+  if (serverProcessId != serviceProcessId) {
+    return ERROR_ACCESS_DENIED;
+  }
+
+  DWORD mode = PIPE_READMODE_MESSAGE;
+  if (!SetNamedPipeHandleState(pipe.get(), &mode, nullptr, nullptr)) {
+    return GetLastError();
+  }
+
+  uint32_t replyValue = 0;
+  DWORD readAmount = 0;
+  if (!TransactNamedPipe(pipe.get(), message.data(),
+                         static_cast<DWORD>(message.size()), &replyValue,
+                         sizeof(replyValue), &readAmount, nullptr)) {
+    return GetLastError();
+  }
+  if (readAmount != sizeof(replyValue)) {
+    return ERROR_INVALID_DATA;
+  }
+
+  reply = static_cast<ServiceCommandReply>(replyValue);
+  return ERROR_SUCCESS;
+}
@@ -0,0 +1,20 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _COMMANDPIPE_H_
+#define _COMMANDPIPE_H_
+
+#include <windows.h>
+#include "commandqueue.h"
+
+// The pipe a resident service takes further commands on.
+#define SERVICE_COMMAND_PIPE_NAME L"\\\\.\\pipe\\AveoSystemsUpdate"
+
+HANDLE CreateCommandPipe();
+BOOL RunCommandPipe(HANDLE pipe, CommandDispatcher& dispatcher,
+                    DWORD idleTimeoutMS, HANDLE stopEvent);
+DWORD SendServiceCommand(DWORD serviceProcessId, int argc, LPCWSTR* argv,
+                         DWORD timeoutMS, ServiceCommandReply& reply);
+
+#endif
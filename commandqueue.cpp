@@ -0,0 +1,158 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "commandqueue.h"
+#include "sealedfile.h"
+
+/**
+ * Serializes a service command for the command pipe.
+ *
+ * @return false if there are too many arguments or they are too long.
+ */
+bool EncodeServiceCommand(const ServiceCommandArgs& args,
+                          std::vector<uint8_t>& message) {
+  if (args.empty() || args.size() > SERVICE_COMMAND_ARGS_MAX) {
+    return false;
+  }
+
+  message.clear();
+  Put32(message, SERVICE_COMMAND_MAGIC);
+  Put32(message, static_cast<uint32_t>(args.size()));
+  for (const std::wstring& arg : args) {
+    Put32(message, static_cast<uint32_t>(arg.size()));
+    for (wchar_t c : arg) {
+      message.push_back(static_cast<uint8_t>(c));
+      message.push_back(static_cast<uint8_t>(c >> 8));
+    }
+    if (message.size() > SERVICE_COMMAND_MESSAGE_MAX) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Parses a message from the command pipe. Anything which isn't exactly one
+ * well formed command is rejected.
+ */
+bool DecodeServiceCommand(const uint8_t* message, size_t messageSize,
+                          ServiceCommandArgs& args) {
+  if (messageSize < 8 || messageSize > SERVICE_COMMAND_MESSAGE_MAX ||
+      Read32(message) != SERVICE_COMMAND_MAGIC) {
+    return false;
+  }
+
+  uint32_t argCount = Read32(message + 4);
+  if (!argCount || argCount > SERVICE_COMMAND_ARGS_MAX) {
+    return false;
+  }
+
+  args.clear();
+  size_t pos = 8;
+  for (uint32_t i = 0; i < argCount; ++i) {
+    if (messageSize - pos < 4) {
+      return false;
+    }
+    size_t length = Read32(message + pos);
+    pos += 4;
+    if (length > (messageSize - pos) / 2) {
+      return false;
+    }
+
+    std::wstring arg(length, L'\0');
+    for (size_t j = 0; j < length; ++j, pos += 2) {
+      wchar_t c = static_cast<wchar_t>(message[pos] | (message[pos + 1] << 8));
+      // Arguments are handed on as C strings.
+      if (!c) {
+        return false;
+      }
+      arg[j] = c;
+    }
+    args.push_back(std::move(arg));
+  }
+  return pos == messageSize;
+}
+
+/**
+ * @param handler       Runs a command, on one of the worker threads
+ * @param maxQueued     The most commands waiting to run, further ones are
+ *                      rejected by Submit
+ * @param maxConcurrent The number of worker threads
+ */
+CommandDispatcher::CommandDispatcher(Handler handler, size_t maxQueued,
+                                     size_t maxConcurrent)
+    : mHandler(std::move(handler)),
+      mMaxQueued(maxQueued),
+      mRunning(0),
+      mStopping(false),
+      mLastActivity(std::chrono::steady_clock::now()) {
+  for (size_t i = 0; i < maxConcurrent; ++i) {
+    mWorkers.emplace_back(&CommandDispatcher::RunWorker, this);
+  }
+}
+
+CommandDispatcher::~CommandDispatcher() { Stop(); }
+
+/**
+ * Queues a command.
+ *
+ * @return false if the queue is full or the dispatcher is stopping.
+ */
+bool CommandDispatcher::Submit(ServiceCommandArgs args) {
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mStopping || mQueue.size() >= mMaxQueued) {
+      return false;
+    }
+    mQueue.push_back(std::move(args));
+  }
+  mQueued.notify_one();
+  return true;
+}
+
+/**
+ * @return true if no command was queued or running for at least duration.
+ */
+bool CommandDispatcher::IdleFor(std::chrono::milliseconds duration) {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mQueue.empty() && !mRunning &&
+         std::chrono::steady_clock::now() - mLastActivity >= duration;
+}
+
+/**
+ * Stops accepting commands and waits for the running ones to finish. Queued
+ * commands which haven't started are dropped.
+ */
+void CommandDispatcher::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    mStopping = true;
+    mQueue.clear();
+  }
+  mQueued.notify_all();
+  for (std::thread& worker : mWorkers) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+}
+
+void CommandDispatcher::RunWorker() {
+  std::unique_lock<std::mutex> lock(mLock);
+  for (;;) {
+    mQueued.wait(lock, [this] { return mStopping || !mQueue.empty(); });
+    if (mStopping) {
+      return;
+    }
+
+    ServiceCommandArgs args = std::move(mQueue.front());
+    mQueue.pop_front();
+    ++mRunning;
+    lock.unlock();
+    mHandler(args);
+    lock.lock();
+    --mRunning;
+    mLastActivity = std::chrono::steady_clock::now();
+  }
+}
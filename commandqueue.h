@@ -0,0 +1,84 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _COMMANDQUEUE_H_
+#define _COMMANDQUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Limits for a command sent to the resident service.
+#define SERVICE_COMMAND_ARGS_MAX 16
+#define SERVICE_COMMAND_MESSAGE_MAX (64 * 1024)
+
+/**
+ * A command message is, all little endian:
+ *   uint32 "AUCM"
+ *   uint32 number of arguments
+ * followed by each argument as a uint32 length and that many UTF-16 code
+ * units. The arguments are those the service would otherwise be started
+ * with, starting with the service command.
+ *
+ * The reply is a single uint32 ServiceCommandReply.
+ */
+#define SERVICE_COMMAND_MAGIC 0x4d435541  // "AUCM"
+
+enum ServiceCommandReply : uint32_t {
+  SERVICE_COMMAND_QUEUED = 1,
+  // The message was malformed
+  SERVICE_COMMAND_INVALID = 2,
+  // The queue is full or the service is stopping
+  SERVICE_COMMAND_REJECTED = 3
+};
+
+typedef std::vector<std::wstring> ServiceCommandArgs;
+
+bool EncodeServiceCommand(const ServiceCommandArgs& args,
+                          std::vector<uint8_t>& message);
+bool DecodeServiceCommand(const uint8_t* message, size_t messageSize,
+                          ServiceCommandArgs& args);
+
+/**
+ * Runs queued service commands on worker threads, at most maxConcurrent of
+ * them at a time and in the order they were submitted. The transport the
+ * commands arrive on only deals with Submit and IdleFor.
+ */
+class CommandDispatcher {
+ public:
+  typedef std::function<bool(const ServiceCommandArgs& args)> Handler;
+
+  CommandDispatcher(Handler handler, size_t maxQueued, size_t maxConcurrent);
+  ~CommandDispatcher();
+
+  CommandDispatcher(const CommandDispatcher&) = delete;
+  CommandDispatcher& operator=(const CommandDispatcher&) = delete;
+
+  bool Submit(ServiceCommandArgs args);
+  bool IdleFor(std::chrono::milliseconds duration);
+  void Stop();
+
+ private:
+  void RunWorker();
+
+  Handler mHandler;
+  size_t mMaxQueued;
+  std::mutex mLock;
+  std::condition_variable mQueued;
+  std::deque<ServiceCommandArgs> mQueue;
+  std::vector<std::thread> mWorkers;
+  size_t mRunning;
+  bool mStopping;
+  // When the last command finished or the dispatcher was created
+  std::chrono::steady_clock::time_point mLastActivity;
+};
+
+#endif
@@ -0,0 +1,648 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string.h>
+
+#include "eventlog.h"
+#include "sealedfile.h"
+
+// Arguments beyond this many make a record malformed.
+#define EVENT_ARGS_MAX 16
+
+// FILETIME is in 100 nanosecond intervals since January 1, 1601.
+#define FILETIME_TICKS_PER_MILLISECOND 10000ULL
+#define DAYS_FROM_1601_TO_1970 134774
+
+const uint8_t kEventLogFileHeader[EVENT_LOG_FILE_HEADER_SIZE] = {
+    'A', 'U', 'E', 'V', 1, 0, 0, 0};
+
+namespace {
+
+struct EventDescription {
+  uint16_t id;
+  const char* name;
+  bool warning;
+  const char* text;
+};
+
+const EventDescription kEvents[] = {
+#define DESCRIBE_EVENT(id, name, argCount, warning, text) \
+  {id, #name, warning, text},
+    UPDATE_EVENTS(DESCRIBE_EVENT)
+#undef DESCRIBE_EVENT
+};
+
+const EventDescription* FindEvent(uint16_t id) {
+  for (const EventDescription& event : kEvents) {
+    if (event.id == id) {
+      return &event;
+    }
+  }
+  return nullptr;
+}
+
+struct EventArg {
+  uint8_t type;
+  uint64_t number;
+  const uint8_t* data;
+  uint16_t length;
+};
+
+/**
+ * Encodes a code point as UTF-8.
+ *
+ * @return The number of bytes, at most 4.
+ */
+size_t EncodeUtf8(uint32_t c, uint8_t out[4]) {
+  if (c < 0x80) {
+    out[0] = static_cast<uint8_t>(c);
+    return 1;
+  }
+  if (c < 0x800) {
+    out[0] = static_cast<uint8_t>(0xc0 | (c >> 6));
+    out[1] = static_cast<uint8_t>(0x80 | (c & 0x3f));
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = static_cast<uint8_t>(0xe0 | (c >> 12));
+    out[1] = static_cast<uint8_t>(0x80 | ((c >> 6) & 0x3f));
+    out[2] = static_cast<uint8_t>(0x80 | (c & 0x3f));
+    return 3;
+  }
+  out[0] = static_cast<uint8_t>(0xf0 | (c >> 18));
+  out[1] = static_cast<uint8_t>(0x80 | ((c >> 12) & 0x3f));
+  out[2] = static_cast<uint8_t>(0x80 | ((c >> 6) & 0x3f));
+  out[3] = static_cast<uint8_t>(0x80 | (c & 0x3f));
+  return 4;
+}
+
+/**
+ * Bounded text output. Anything past the end is cut off, the text is always
+ * terminated.
+ */
+class TextOutput {
+ public:
+  TextOutput(char* out, size_t size)
+      : mOut(out), mSize(size), mLength(0), mEscapeJson(false) {}
+
+  void SetEscapeJson(bool escape) { mEscapeJson = escape; }
+
+  void Put(char c) {
+    if (mEscapeJson) {
+      unsigned char u = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\') {
+        PutRaw('\\');
+      } else if (u < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", u);
+        PutRawString(escaped);
+        return;
+      }
+    }
+    PutRaw(c);
+  }
+
+  void PutString(const char* s) {
+    while (*s) {
+      Put(*s++);
+    }
+  }
+
+  void PutBytes(const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+      Put(static_cast<char>(data[i]));
+    }
+  }
+
+  void PutRawString(const char* s) {
+    while (*s) {
+      PutRaw(*s++);
+    }
+  }
+
+  void PutUnsigned(uint64_t value) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%llu",
+             static_cast<unsigned long long>(value));
+    PutRawString(digits);
+  }
+
+  void PutSigned(int64_t value) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(value));
+    PutRawString(digits);
+  }
+
+  // Writes UTF-16LE code units as UTF-8.
+  void PutUtf16(const uint8_t* units, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t c = Read16(units + i * 2);
+      if (c >= 0xd800 && c < 0xdc00 && i + 1 < count) {
+        uint32_t low = Read16(units + (i + 1) * 2);
+        if (low >= 0xdc00 && low < 0xe000) {
+          c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+          ++i;
+        }
+      }
+      if (c >= 0xd800 && c < 0xe000) {
+        c = 0xfffd;  // An unpaired surrogate
+      }
+      if (c < 0x80) {
+        Put(static_cast<char>(c));
+        continue;
+      }
+      uint8_t bytes[4];
+      size_t size = EncodeUtf8(c, bytes);
+      for (size_t j = 0; j < size; ++j) {
+        PutRaw(static_cast<char>(bytes[j]));
+      }
+    }
+  }
+
+  size_t Finish() {
+    mOut[mLength] = '\0';
+    return mLength;
+  }
+
+ private:
+  void PutRaw(char c) {
+    if (mLength + 1 < mSize) {
+      mOut[mLength++] = c;
+    }
+  }
+
+  char* mOut;
+  size_t mSize;
+  size_t mLength;
+  bool mEscapeJson;
+};
+
+void PutArg(TextOutput& out, const EventArg& arg, bool json) {
+  switch (arg.type) {
+    case EVENT_ARG_U32:
+    case EVENT_ARG_U64:
+      out.PutUnsigned(arg.number);
+      return;
+    case EVENT_ARG_I32:
+    case EVENT_ARG_I64:
+      out.PutSigned(static_cast<int64_t>(arg.number));
+      return;
+    case EVENT_ARG_STRING:
+    case EVENT_ARG_WIDE_STRING:
+      if (json) {
+        out.PutRawString("\"");
+        out.SetEscapeJson(true);
+      }
+      if (arg.type == EVENT_ARG_STRING) {
+        out.PutBytes(arg.data, arg.length);
+      } else {
+        out.PutUtf16(arg.data, arg.length);
+      }
+      if (json) {
+        out.SetEscapeJson(false);
+        out.PutRawString("\"");
+      }
+      return;
+  }
+}
+
+void PutMessage(TextOutput& out, uint16_t id, const EventArg* args,
+                size_t argCount) {
+  const EventDescription* event = FindEvent(id);
+  if (!event) {
+    out.PutString("Unknown event ");
+    out.PutUnsigned(id);
+    for (size_t i = 0; i < argCount; ++i) {
+      out.PutString(i ? ", " : ": ");
+      PutArg(out, args[i], false);
+    }
+    return;
+  }
+
+  if (event->warning) {
+    out.PutString("*** Warning: ");
+  }
+  for (const char* p = event->text; *p; ++p) {
+    if (p[0] == '{' && p[1] >= '0' && p[1] <= '9' && p[2] == '}') {
+      size_t index = static_cast<size_t>(p[1] - '0');
+      if (index < argCount) {
+        PutArg(out, args[index], false);
+      }
+      p += 2;
+      continue;
+    }
+    out.Put(*p);
+  }
+  if (event->warning) {
+    out.PutString("***");
+  }
+}
+
+/**
+ * Writes a FILETIME as an ISO 8601 date and time in UTC.
+ */
+void PutTime(TextOutput& out, uint64_t time, bool json) {
+  uint64_t milliseconds = time / FILETIME_TICKS_PER_MILLISECOND;
+  int64_t days = static_cast<int64_t>(milliseconds / 86400000ULL) -
+                 DAYS_FROM_1601_TO_1970;
+  uint64_t dayMilliseconds = milliseconds % 86400000ULL;
+
+  // Converts days since 1970-01-01 to a civil date, see
+  // http://howardhinnant.github.io/date_algorithms.html#civil_from_days
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t dayOfEra = days - era * 146097;
+  int64_t yearOfEra =
+      (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) /
+      365;
+  int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 -
+                                  yearOfEra / 100);
+  int64_t monthIndex = (5 * dayOfYear + 2) / 153;
+  int64_t day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+  int64_t month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+  int64_t year = yearOfEra + era * 400 + (month <= 2);
+
+  char text[40];
+  snprintf(text, sizeof(text), "%04lld-%02lld-%02lld%c%02u:%02u:%02u.%03u%s",
+           static_cast<long long>(year), static_cast<long long>(month),
+           static_cast<long long>(day), json ? 'T' : ' ',
+           static_cast<unsigned>(dayMilliseconds / 3600000),
+           static_cast<unsigned>(dayMilliseconds / 60000 % 60),
+           static_cast<unsigned>(dayMilliseconds / 1000 % 60),
+           static_cast<unsigned>(dayMilliseconds % 1000), json ? "Z" : "");
+  out.PutRawString(text);
+}
+
+}  // namespace
+
+void EventRecordWriter::Begin(LogEventId id, uint32_t threadId,
+                              uint64_t time) {
+  mLength = 0;
+  if (mCapacity < EVENT_RECORD_HEADER_SIZE) {
+    mCapacity = 0;
+    return;
+  }
+  Put16(0);  // The size is filled in by Finish
+  Put16(id);
+  Put32(threadId);
+  Put64(time);
+  mBuffer[mLength++] = 0;
+}
+
+bool EventRecordWriter::Reserve(size_t size) {
+  return mCapacity && mLength + size <= mCapacity &&
+         mLength + size <= UINT16_MAX;
+}
+
+void EventRecordWriter::Put16(uint16_t value) {
+  Write16(mBuffer + mLength, value);
+  mLength += 2;
+}
+
+void EventRecordWriter::Put32(uint32_t value) {
+  Write32(mBuffer + mLength, value);
+  mLength += 4;
+}
+
+void EventRecordWriter::Put64(uint64_t value) {
+  Write64(mBuffer + mLength, value);
+  mLength += 8;
+}
+
+void EventRecordWriter::AddU32(uint32_t value) {
+  if (Reserve(5)) {
+    mBuffer[mLength++] = EVENT_ARG_U32;
+    Put32(value);
+    ++mBuffer[EVENT_RECORD_HEADER_SIZE - 1];
+  }
+}
+
+void EventRecordWriter::AddI32(int32_t value) {
+  if (Reserve(5)) {
+    mBuffer[mLength++] = EVENT_ARG_I32;
+    Put32(static_cast<uint32_t>(value));
+    ++mBuffer[EVENT_RECORD_HEADER_SIZE - 1];
+  }
+}
+
+void EventRecordWriter::AddU64(uint64_t value) {
+  if (Reserve(9)) {
+    mBuffer[mLength++] = EVENT_ARG_U64;
+    Put64(value);
+    ++mBuffer[EVENT_RECORD_HEADER_SIZE - 1];
+  }
+}
+
+void EventRecordWriter::AddI64(int64_t value) {
+  if (Reserve(9)) {
+    mBuffer[mLength++] = EVENT_ARG_I64;
+    Put64(static_cast<uint64_t>(value));
+    ++mBuffer[EVENT_RECORD_HEADER_SIZE - 1];
+  }
+}
+
+void EventRecordWriter::Add(int value) { AddI32(value); }
+
+void EventRecordWriter::Add(long value) {
+  if (sizeof(long) == sizeof(int32_t)) {
+    AddI32(static_cast<int32_t>(value));
+  } else {
+    AddI64(value);
+  }
+}
+
+void EventRecordWriter::Add(unsigned int value) { AddU32(value); }
+
+void EventRecordWriter::Add(unsigned long value) {
+  if (sizeof(unsigned long) == sizeof(uint32_t)) {
+    AddU32(static_cast<uint32_t>(value));
+  } else {
+    AddU64(value);
+  }
+}
+
+void EventRecordWriter::Add(unsigned long long value) { AddU64(value); }
+
+void EventRecordWriter::Add(const char* value) {
+  if (!value) {
+    value = "(null)";
+  }
+  if (!Reserve(3)) {
+    return;
+  }
+  size_t length = strlen(value);
+  size_t available = mCapacity - mLength - 3;
+  if (length > available) {
+    length = available;
+  }
+  if (length > UINT16_MAX - mLength - 3) {
+    length = UINT16_MAX - mLength - 3;
+  }
+  mBuffer[mLength++] = EVENT_ARG_STRING;
+  Put16(static_cast<uint16_t>(length));
+  memcpy(mBuffer + mLength, value, length);
+  mLength += length;
+  ++mBuffer[EVENT_RECORD_HEADER_SIZE - 1];
+}
+
+/**
+ * Stores a wide string as UTF-8, like a narrow one. A string which doesn't
+ * fit is cut short between code points.
+ */
+void EventRecordWriter::Add(const wchar_t* value) {
+  if (!value) {
+    value = L"(null)";
+  }
+  if (!Reserve(3)) {
+    return;
+  }
+  mBuffer[mLength++] = EVENT_ARG_STRING;
+  size_t lengthOffset = mLength;
+  Put16(0);
+
+  size_t start = mLength;
+  for (; *value; ++value) {
+    // wchar_t is UTF-16 on Windows and UTF-32 on some other platforms.
+    uint32_t c = static_cast<uint32_t>(*value);
+    uint32_t next = static_cast<uint32_t>(value[1]);
+    if (c >= 0xd800 && c < 0xdc00 && next >= 0xdc00 && next < 0xe000) {
+      c = 0x10000 + ((c - 0xd800) << 10) + (next - 0xdc00);
+      ++value;
+    }
+    if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+      c = 0xfffd;  // An unpaired surrogate
+    }
+    uint8_t bytes[4];
+    size_t size = EncodeUtf8(c, bytes);
+    if (!Reserve(size)) {
+      break;
+    }
+    memcpy(mBuffer + mLength, bytes, size);
+    mLength += size;
+  }
+  Write16(mBuffer + lengthOffset, static_cast<uint16_t>(mLength - start));
+  ++mBuffer[EVENT_RECORD_HEADER_SIZE - 1];
+}
+
+/**
+ * @return The size of the record, or 0 if the buffer couldn't hold one.
+ */
+size_t EventRecordWriter::Finish() {
+  if (!mCapacity) {
+    return 0;
+  }
+  Write16(mBuffer, static_cast<uint16_t>(mLength));
+  return mLength;
+}
+
+/**
+ * Renders a record as text.
+ *
+ * @param  record     The record
+ * @param  recordSize The size of @record in bytes
+ * @param  mode       How to render the record
+ * @param  out        A buffer for the text, which is always terminated
+ * @param  outSize    The size of @out, longer text is cut off
+ * @return The length of the text, 0 if the record is malformed.
+ */
+size_t RenderEventRecord(const uint8_t* record, size_t recordSize,
+                         EventRenderMode mode, char* out, size_t outSize) {
+  if (!outSize) {
+    return 0;
+  }
+  out[0] = '\0';
+  if (recordSize < EVENT_RECORD_HEADER_SIZE ||
+      Read16(record) != recordSize) {
+    return 0;
+  }
+
+  uint16_t id = Read16(record + 2);
+  uint32_t threadId = Read32(record + 4);
+  uint64_t time = Read64(record + 8);
+  size_t argCount = record[16];
+  if (argCount > EVENT_ARGS_MAX) {
+    return 0;
+  }
+
+  EventArg args[EVENT_ARGS_MAX];
+  size_t offset = EVENT_RECORD_HEADER_SIZE;
+  for (size_t i = 0; i < argCount; ++i) {
+    if (offset + 1 > recordSize) {
+      return 0;
+    }
+    EventArg& arg = args[i];
+    arg.type = record[offset++];
+    arg.number = 0;
+    arg.data = nullptr;
+    arg.length = 0;
+    size_t size;
+    switch (arg.type) {
+      case EVENT_ARG_U32:
+      case EVENT_ARG_I32:
+        size = 4;
+        if (offset + size > recordSize) {
+          return 0;
+        }
+        arg.number = Read32(record + offset);
+        if (arg.type == EVENT_ARG_I32) {
+          arg.number = static_cast<uint64_t>(
+              static_cast<int64_t>(static_cast<int32_t>(arg.number)));
+        }
+        break;
+      case EVENT_ARG_U64:
+      case EVENT_ARG_I64:
+        size = 8;
+        if (offset + size > recordSize) {
+          return 0;
+        }
+        arg.number = Read64(record + offset);
+        break;
+      case EVENT_ARG_STRING:
+      case EVENT_ARG_WIDE_STRING:
+        if (offset + 2 > recordSize) {
+          return 0;
+        }
+        arg.length = Read16(record + offset);
+        offset += 2;
+        size = arg.length;
+        if (arg.type == EVENT_ARG_WIDE_STRING) {
+          size *= 2;
+        }
+        if (offset + size > recordSize) {
+          return 0;
+        }
+        arg.data = record + offset;
+        break;
+      default:
+        return 0;
+    }
+    offset += size;
+  }
+  if (offset != recordSize) {
+    return 0;
+  }
+
+  TextOutput text(out, outSize);
+  if (EVENT_RENDER_JSON == mode) {
+    const EventDescription* event = FindEvent(id);
+    text.PutRawString("{\"time\":\"");
+    PutTime(text, time, true);
+    text.PutRawString("\",\"thread\":");
+    text.PutUnsigned(threadId);
+    text.PutRawString(",\"id\":");
+    text.PutUnsigned(id);
+    if (event) {
+      text.PutRawString(",\"event\":\"");
+      text.PutRawString(event->name);
+      text.PutRawString("\"");
+    }
+    text.PutRawString(",\"args\":[");
+    for (size_t i = 0; i < argCount; ++i) {
+      if (i) {
+        text.PutRawString(",");
+      }
+      PutArg(text, args[i], true);
+    }
+    text.PutRawString("],\"message\":\"");
+    text.SetEscapeJson(true);
+    PutMessage(text, id, args, argCount);
+    text.SetEscapeJson(false);
+    text.PutRawString("\"}");
+  } else {
+    if (EVENT_RENDER_TEXT == mode) {
+      PutTime(text, time, false);
+      text.PutRawString(" [");
+      text.PutUnsigned(threadId);
+      text.PutRawString("] ");
+    }
+    PutMessage(text, id, args, argCount);
+  }
+  return text.Finish();
+}
+
+/**
+ * Renders every record of an event log, one per line.
+ *
+ * @param  in   The event log
+ * @param  mode How to render the records
+ * @param  out  Where to write the text
+ * @return true if the whole log was read, false if it isn't an event log or
+ *         a record is malformed. Everything up to that record is written.
+ */
+bool DecodeEventLog(FILE* in, EventRenderMode mode, FILE* out) {
+  uint8_t header[EVENT_LOG_FILE_HEADER_SIZE];
+  if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+      memcmp(header, kEventLogFileHeader, sizeof(header))) {
+    return false;
+  }
+
+  uint8_t record[EVENT_RECORD_MAX];
+  // Every byte of a record may turn into a JSON escape sequence.
+  static char text[EVENT_RECORD_MAX * 8];
+  for (;;) {
+    size_t read = fread(record, 1, 2, in);
+    if (!read) {
+      return true;
+    }
+    uint16_t size = read == 2 ? Read16(record) : 0;
+    if (size < EVENT_RECORD_HEADER_SIZE || size > EVENT_RECORD_MAX ||
+        fread(record + 2, 1, size - 2u, in) != size - 2u) {
+      return false;
+    }
+    if (!RenderEventRecord(record, size, mode, text, sizeof(text))) {
+      return false;
+    }
+    fputs(text, out);
+    fputc('\n', out);
+  }
+}
+
+#ifdef _WIN32
+// An event log which grew past this is started over.
+#define EVENT_LOG_MAX_SIZE (16 * 1024 * 1024)
+
+static DWORD RenderEventForLog(const BYTE* record, DWORD recordSize,
+                               char* text, DWORD textSize) {
+  return static_cast<DWORD>(RenderEventRecord(
+      record, recordSize, EVENT_RENDER_MESSAGE, text, textSize));
+}
+
+/**
+ * Starts writing events to an event log file next to the text log. Events
+ * are also rendered into the text log. Must be called after LogInit.
+ */
+void InitEventLog(LPWSTR eventLogPath) {
+  UpdateLog& log = UpdateLog::GetPrimaryLog();
+  log.SetRecordRenderer(RenderEventForLog);
+  if (eventLogPath) {
+    log.InitRecords(eventLogPath, kEventLogFileHeader,
+                    EVENT_LOG_FILE_HEADER_SIZE, EVENT_LOG_MAX_SIZE);
+  }
+}
+
+/**
+ * Renders an event log file as text or JSON lines.
+ *
+ * @param  eventLogPath The event log to read
+ * @param  outputPath   The file to write the text to
+ * @param  mode         How to render the records
+ * @return TRUE if the whole event log was rendered.
+ */
+BOOL DecodeEventLogFile(LPCWSTR eventLogPath, LPCWSTR outputPath,
+                        EventRenderMode mode) {
+  FILE* in = nullptr;
+  if (_wfopen_s(&in, eventLogPath, L"rb") || !in) {
+    return FALSE;
+  }
+  FILE* out = nullptr;
+  if (_wfopen_s(&out, outputPath, L"w") || !out) {
+    fclose(in);
+    return FALSE;
+  }
+  bool decoded = DecodeEventLog(in, mode, out);
+  fclose(out);
+  fclose(in);
+  return decoded;
+}
+#endif
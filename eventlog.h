@@ -0,0 +1,160 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _EVENTLOG_H_
+#define _EVENTLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Every structured event the service logs: its ID, which must never be
+ * reused once shipped, the number of arguments, whether it is a warning and
+ * how it is rendered as text. {n} is replaced with the n-th argument.
+ */
+#define UPDATE_EVENTS(EVENT)                                                 \
+  EVENT(1, SERVICE_ARGUMENT, 2, false, "arg[{0}] = {1}")                     \
+  EVENT(2, SERVICE_COMMAND_STARTED, 2, false,                                \
+        "Executing service command {0}, ID: {1}")                            \
+  EVENT(3, SERVICE_COMMAND_UNKNOWN, 1, true,                                 \
+        "Service command not recognized: {0}.")                              \
+  EVENT(4, SERVICE_COMMAND_FINISHED, 2, false,                               \
+        "Service command {0} complete with result: {1}.")                    \
+  EVENT(5, UPDATER_CHECKING, 1, false, "Checking updater validity: {0}")     \
+  EVENT(6, UPDATER_STARTING, 2, false, "Starting {0} with cmdline: {1}")     \
+  EVENT(7, UPDATER_FINISHED, 1, false,                                       \
+        "Process finished with return code {0}.")                            \
+  EVENT(8, UPDATER_USAGE, 6, false,                                          \
+        "Updater processes: {0} active, {1} total; CPU: {2} ms; "            \
+        "read: {3} bytes; written: {4} bytes; peak memory: {5} bytes")       \
+  EVENT(9, UPDATER_TIMED_OUT, 1, true,                                       \
+        "Updater did not finish within {0} ms, terminating it.")
+
+enum LogEventId : uint16_t {
+#define DEFINE_EVENT_ID(id, name, argCount, warning, text) EVENT_##name = id,
+  UPDATE_EVENTS(DEFINE_EVENT_ID)
+#undef DEFINE_EVENT_ID
+};
+
+constexpr int EventArgCount(LogEventId id) {
+  return
+#define EVENT_ARG_COUNT(eventId, name, argCount, warning, text) \
+  id == EVENT_##name ? argCount:
+      UPDATE_EVENTS(EVENT_ARG_COUNT)
+#undef EVENT_ARG_COUNT
+      -1;
+}
+
+// An event log file starts with "AUEV" followed by the format version.
+#define EVENT_LOG_FILE_HEADER_SIZE 8
+extern const uint8_t kEventLogFileHeader[EVENT_LOG_FILE_HEADER_SIZE];
+
+/**
+ * A record is, all little endian:
+ *   uint16 size of the whole record
+ *   uint16 event ID
+ *   uint32 thread ID
+ *   uint64 time as a FILETIME
+ *   uint8  number of arguments
+ * followed by the arguments, each a type byte and the value. Strings are a
+ * uint16 length followed by the bytes, wide strings are stored as UTF-8.
+ * EVENT_ARG_WIDE_STRING, a length followed by UTF-16 code units, is no longer
+ * written but still read.
+ */
+#define EVENT_RECORD_HEADER_SIZE 17
+#define EVENT_RECORD_MAX 1024
+
+enum EventArgType : uint8_t {
+  EVENT_ARG_U32 = 1,
+  EVENT_ARG_I32 = 2,
+  EVENT_ARG_U64 = 3,
+  EVENT_ARG_STRING = 4,
+  EVENT_ARG_WIDE_STRING = 5,
+  EVENT_ARG_I64 = 6
+};
+
+/**
+ * Serializes one event into a caller supplied buffer. Arguments which don't
+ * fit are left out, strings are cut short first.
+ */
+class EventRecordWriter {
+ public:
+  EventRecordWriter(uint8_t* buffer, size_t capacity)
+      : mBuffer(buffer), mCapacity(capacity), mLength(0) {}
+
+  void Begin(LogEventId id, uint32_t threadId, uint64_t time);
+  void Add(int value);
+  void Add(long value);
+  void Add(unsigned int value);
+  void Add(unsigned long value);
+  void Add(unsigned long long value);
+  void Add(const char* value);
+  void Add(const wchar_t* value);
+  size_t Finish();
+
+ private:
+  bool Reserve(size_t size);
+  void Put16(uint16_t value);
+  void Put32(uint32_t value);
+  void Put64(uint64_t value);
+  void AddU32(uint32_t value);
+  void AddI32(int32_t value);
+  void AddU64(uint64_t value);
+  void AddI64(int64_t value);
+
+  uint8_t* mBuffer;
+  size_t mCapacity;
+  size_t mLength;
+};
+
+enum EventRenderMode {
+  // Just the message, the way the text log shows it.
+  EVENT_RENDER_MESSAGE,
+  // The time and thread followed by the message.
+  EVENT_RENDER_TEXT,
+  // A JSON object with the time, thread, event name, arguments and message.
+  EVENT_RENDER_JSON
+};
+
+size_t RenderEventRecord(const uint8_t* record, size_t recordSize,
+                         EventRenderMode mode, char* out, size_t outSize);
+bool DecodeEventLog(FILE* in, EventRenderMode mode, FILE* out);
+
+#ifdef _WIN32
+#include <windows.h>
+#include "updatecommon.h"
+
+static_assert(EVENT_RECORD_MAX <= LOG_LINE_MAX,
+              "Event records must fit in a log slot");
+
+void InitEventLog(LPWSTR eventLogPath);
+BOOL DecodeEventLogFile(LPCWSTR eventLogPath, LPCWSTR outputPath,
+                        EventRenderMode mode);
+
+/**
+ * Logs a structured event. The arguments are stored as they are, the
+ * message is only formatted by the log writer thread or the decoder.
+ */
+template <LogEventId id, typename... Args>
+void LogEvent(Args... args) {
+  static_assert(static_cast<int>(sizeof...(Args)) == EventArgCount(id),
+                "Wrong number of arguments for this event");
+  uint8_t record[EVENT_RECORD_MAX];
+  EventRecordWriter writer(record, sizeof(record));
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  writer.Begin(id, GetCurrentThreadId(),
+               (static_cast<uint64_t>(now.dwHighDateTime) << 32) |
+                   now.dwLowDateTime);
+  int unused[] = {0, (writer.Add(args), 0)...};
+  (void)unused;
+  size_t size = writer.Finish();
+  UpdateLog::GetPrimaryLog().AppendRecord(record, static_cast<DWORD>(size));
+}
+
+#define LOG_EVENT(NAME, ...) LogEvent<EVENT_##NAME>(__VA_ARGS__)
+#endif
+
+#endif
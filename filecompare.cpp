@@ -0,0 +1,293 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <string.h>
+#include <memory>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#  include <intrin.h>
+#  include <immintrin.h>
+#  define FILECOMPARE_X86
+#endif
+
+#include "filecompare.h"
+#include "updatecommon.h"
+
+struct ViewDeleter {
+  void operator()(void* view) const {
+    if (view) {
+      UnmapViewOfFile(view);
+    }
+  }
+};
+typedef std::unique_ptr<void, ViewDeleter> autoView;
+
+typedef size_t (*DifferenceKernel)(const BYTE* buf1, const BYTE* buf2,
+                                   size_t length);
+
+/**
+ * Finds the first differing byte 8 bytes at a time.
+ *
+ * @return the offset of the first difference, or length if there is none
+ */
+static size_t FindFirstDifferenceScalar(const BYTE* buf1, const BYTE* buf2,
+                                        size_t length) {
+  size_t i = 0;
+  for (; i + sizeof(ULONGLONG) <= length; i += sizeof(ULONGLONG)) {
+    ULONGLONG word1, word2;
+    memcpy(&word1, buf1 + i, sizeof(word1));
+    memcpy(&word2, buf2 + i, sizeof(word2));
+    if (word1 != word2) {
+      break;
+    }
+  }
+
+  for (; i < length; ++i) {
+    if (buf1[i] != buf2[i]) {
+      return i;
+    }
+  }
+
+  return length;
+}
+
+#ifdef FILECOMPARE_X86
+/**
+ * Finds the first differing byte 16 bytes at a time with SSE2.
+ *
+ * @return the offset of the first difference, or length if there is none
+ */
+static size_t FindFirstDifferenceSSE2(const BYTE* buf1, const BYTE* buf2,
+                                      size_t length) {
+  size_t i = 0;
+  for (; i + sizeof(__m128i) <= length; i += sizeof(__m128i)) {
+    __m128i block1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf1 + i));
+    __m128i block2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf2 + i));
+    unsigned int equalMask =
+        static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(block1, block2)));
+    if (equalMask != 0xFFFF) {
+      unsigned long bit;
+      _BitScanForward(&bit, ~equalMask);
+      return i + bit;
+    }
+  }
+
+  return i + FindFirstDifferenceScalar(buf1 + i, buf2 + i, length - i);
+}
+
+/**
+ * Finds the first differing byte 64 bytes at a time with AVX2. Only called
+ * after SupportsAVX2 has confirmed that the CPU and OS support it.
+ *
+ * @return the offset of the first difference, or length if there is none
+ */
+static size_t FindFirstDifferenceAVX2(const BYTE* buf1, const BYTE* buf2,
+                                      size_t length) {
+  const size_t stride = 2 * sizeof(__m256i);
+  size_t i = 0;
+  for (; i + stride <= length; i += stride) {
+    const __m256i* p1 = reinterpret_cast<const __m256i*>(buf1 + i);
+    const __m256i* p2 = reinterpret_cast<const __m256i*>(buf2 + i);
+    __m256i equalLow =
+        _mm256_cmpeq_epi8(_mm256_loadu_si256(p1), _mm256_loadu_si256(p2));
+    __m256i equalHigh = _mm256_cmpeq_epi8(_mm256_loadu_si256(p1 + 1),
+                                          _mm256_loadu_si256(p2 + 1));
+    if (_mm256_movemask_epi8(_mm256_and_si256(equalLow, equalHigh)) != -1) {
+      // Something in this stride differs, find out which byte.
+      unsigned int mask =
+          static_cast<unsigned int>(_mm256_movemask_epi8(equalLow));
+      size_t base = i;
+      if (mask == 0xFFFFFFFF) {
+        mask = static_cast<unsigned int>(_mm256_movemask_epi8(equalHigh));
+        base += sizeof(__m256i);
+      }
+      unsigned long bit;
+      _BitScanForward(&bit, ~mask);
+      return base + bit;
+    }
+  }
+
+  return i + FindFirstDifferenceSSE2(buf1 + i, buf2 + i, length - i);
+}
+
+/**
+ * Determines if both the CPU and the OS (saving the YMM registers) support
+ * AVX2.
+ */
+static bool SupportsAVX2() {
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+
+  // OSXSAVE (bit 27) and AVX (bit 28)
+  __cpuid(info, 1);
+  const int osxsaveAndAVX = (1 << 27) | (1 << 28);
+  if ((info[2] & osxsaveAndAVX) != osxsaveAndAVX) {
+    return false;
+  }
+
+  // The OS must save both the XMM and the YMM state.
+  if ((_xgetbv(0) & 0x6) != 0x6) {
+    return false;
+  }
+
+  // AVX2 (bit 5)
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+}
+#endif
+
+static DifferenceKernel SelectDifferenceKernel() {
+#ifdef FILECOMPARE_X86
+  if (SupportsAVX2()) {
+    return FindFirstDifferenceAVX2;
+  }
+  // Every x64 CPU and every CPU we support for the x86 build has SSE2.
+  return FindFirstDifferenceSSE2;
+#else
+  return FindFirstDifferenceScalar;
+#endif
+}
+
+/**
+ * Finds the first byte that differs between 2 buffers using the fastest
+ * comparison the CPU supports.
+ *
+ * @param  buf1   The first buffer
+ * @param  buf2   The second buffer
+ * @param  length The number of bytes to compare
+ * @return the offset of the first difference, or length if the buffers
+ *         are equal.
+ */
+size_t FindFirstDifference(const void* buf1, const void* buf2, size_t length) {
+  static const DifferenceKernel kernel = SelectDifferenceKernel();
+  return kernel(static_cast<const BYTE*>(buf1), static_cast<const BYTE*>(buf2),
+                length);
+}
+
+/**
+ * Compares 2 mapped views. A read error on a mapped file is raised as an
+ * EXCEPTION_IN_PAGE_ERROR so it is turned into a failure here. This is kept
+ * separate from the caller because __try can't be used in a function which
+ * needs object unwinding.
+ *
+ * @return FALSE if either view could not be read.
+ */
+static BOOL CompareViews(const void* view1, const void* view2, size_t length,
+                         size_t& firstDifference) {
+  __try {
+    firstDifference = FindFirstDifference(view1, view2, length);
+  } __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+                  ? EXCEPTION_EXECUTE_HANDLER
+                  : EXCEPTION_CONTINUE_SEARCH) {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * Compares the contents of 2 open files through read only file mappings.
+ *
+ * @param  file1           Handle of the first file, opened with GENERIC_READ
+ * @param  file2           Handle of the second file, opened with GENERIC_READ
+ * @param  firstDifference Out parameter, the offset of the first byte that
+ *                         differs or FILE_COMPARE_NO_DIFFERENCE. When one file
+ *                         is a prefix of the other this is the size of the
+ *                         shorter file.
+ * @return TRUE if there was no error comparing the files.
+ */
+BOOL CompareFileHandles(HANDLE file1, HANDLE file2,
+                        ULONGLONG& firstDifference) {
+  firstDifference = FILE_COMPARE_NO_DIFFERENCE;
+
+  LARGE_INTEGER fileSize1, fileSize2;
+  if (!GetFileSizeEx(file1, &fileSize1) || !GetFileSizeEx(file2, &fileSize2)) {
+    return FALSE;
+  }
+
+  ULONGLONG size1 = static_cast<ULONGLONG>(fileSize1.QuadPart);
+  ULONGLONG size2 = static_cast<ULONGLONG>(fileSize2.QuadPart);
+  ULONGLONG commonSize = size1 < size2 ? size1 : size2;
+
+  // Empty files can't be mapped, but there is nothing to compare anyway.
+  if (commonSize > 0) {
+    autoHandle mapping1(
+        CreateFileMappingW(file1, nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping1.get()) {
+      return FALSE;
+    }
+    autoHandle mapping2(
+        CreateFileMappingW(file2, nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping2.get()) {
+      return FALSE;
+    }
+
+    for (ULONGLONG offset = 0; offset < commonSize;
+         offset += COMPARE_VIEW_SIZE) {
+      ULONGLONG remaining = commonSize - offset;
+      SIZE_T viewSize = static_cast<SIZE_T>(
+          remaining < COMPARE_VIEW_SIZE ? remaining : COMPARE_VIEW_SIZE);
+      DWORD offsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD offsetLow = static_cast<DWORD>(offset);
+
+      autoView view1(MapViewOfFile(mapping1.get(), FILE_MAP_READ, offsetHigh,
+                                   offsetLow, viewSize));
+      if (!view1.get()) {
+        return FALSE;
+      }
+      autoView view2(MapViewOfFile(mapping2.get(), FILE_MAP_READ, offsetHigh,
+                                   offsetLow, viewSize));
+      if (!view2.get()) {
+        return FALSE;
+      }
+
+      size_t viewDifference;
+      if (!CompareViews(view1.get(), view2.get(), viewSize, viewDifference)) {
+        SetLastError(ERROR_READ_FAULT);
+        return FALSE;
+      }
+
+      if (viewDifference != viewSize) {
+        firstDifference = offset + viewDifference;
+        return TRUE;
+      }
+    }
+  }
+
+  if (size1 != size2) {
+    firstDifference = commonSize;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Compares the contents of 2 files.
+ *
+ * @param  file1Path       The first file to compare.
+ * @param  file2Path       The second file to compare.
+ * @param  firstDifference Out parameter, see CompareFileHandles.
+ * @return TRUE if there was no error comparing the files.
+ */
+BOOL CompareFiles(LPCWSTR file1Path, LPCWSTR file2Path,
+                  ULONGLONG& firstDifference) {
+  firstDifference = FILE_COMPARE_NO_DIFFERENCE;
+  autoHandle file1(CreateFileW(file1Path, GENERIC_READ, FILE_SHARE_READ,
+                               nullptr, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+  if (INVALID_HANDLE_VALUE == file1.get()) {
+    return FALSE;
+  }
+  autoHandle file2(CreateFileW(file2Path, GENERIC_READ, FILE_SHARE_READ,
+                               nullptr, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+  if (INVALID_HANDLE_VALUE == file2.get()) {
+    return FALSE;
+  }
+
+  return CompareFileHandles(file1.get(), file2.get(), firstDifference);
+}
@@ -0,0 +1,24 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _FILECOMPARE_H_
+#define _FILECOMPARE_H_
+
+#include <windows.h>
+
+// Returned through firstDifference when the compared files are identical.
+#define FILE_COMPARE_NO_DIFFERENCE ((ULONGLONG)-1)
+
+// The files are compared through read only views of this many bytes at a
+// time. It must be a multiple of the system allocation granularity (64KiB)
+// and is kept modest so 32-bit builds don't run out of address space.
+#define COMPARE_VIEW_SIZE (32 * 1024 * 1024)
+
+size_t FindFirstDifference(const void* buf1, const void* buf2, size_t length);
+BOOL CompareFileHandles(HANDLE file1, HANDLE file2,
+                        ULONGLONG& firstDifference);
+BOOL CompareFiles(LPCWSTR file1Path, LPCWSTR file2Path,
+                  ULONGLONG& firstDifference);
+
+#endif
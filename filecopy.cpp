@@ -0,0 +1,336 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <string.h>
+#include <memory>
+
+#include "filecopy.h"
+#include "updatecommon.h"
+
+namespace {
+
+// A chunk moves through the stages in this order and then back to
+// SlotFree once it has been written.
+enum SlotState { SlotFree, SlotRead, SlotHashed };
+
+struct CopySlot {
+  std::unique_ptr<BYTE[]> data;
+  DWORD length;
+  bool last;
+  SlotState state;
+};
+
+/**
+ * Puts the calling thread in background mode, which lowers its I/O as well
+ * as its CPU priority.
+ *
+ * @return TRUE if EndBackgroundIO has to be called, FALSE if background is
+ *         FALSE or the thread already was in background mode.
+ */
+BOOL BeginBackgroundIO(BOOL background) {
+  return background &&
+         SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+}
+
+void EndBackgroundIO(BOOL began) {
+  if (began) {
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+  }
+}
+
+/**
+ * Copies a file while hashing it. The file is read on the calling thread,
+ * hashed on a second thread and written on a third, with the chunks handed
+ * between them through a small ring of buffers.
+ */
+class CopyPipeline {
+ public:
+  CopyPipeline(HANDLE source, HANDLE dest, BOOL background)
+      : mSource(source),
+        mDest(dest),
+        mBackground(background),
+        mFailed(false),
+        mError(ERROR_SUCCESS) {
+    InitializeSRWLock(&mLock);
+    InitializeConditionVariable(&mChanged);
+  }
+
+  BOOL Run(BYTE digest[SHA256_DIGEST_LENGTH]);
+
+ private:
+  static DWORD WINAPI HashThreadProc(LPVOID param);
+  static DWORD WINAPI WriteThreadProc(LPVOID param);
+
+  void ReadStage();
+  void HashStage();
+  void WriteStage();
+
+  bool WaitForState(CopySlot& slot, SlotState state);
+  void SetState(CopySlot& slot, SlotState state);
+  void Fail(DWORD error);
+
+  HANDLE mSource;
+  HANDLE mDest;
+  // Every stage runs in background mode, which is per thread.
+  BOOL mBackground;
+  SHA256Hash mHash;
+  CopySlot mSlots[COPY_PIPELINE_DEPTH];
+  SRWLOCK mLock;
+  CONDITION_VARIABLE mChanged;
+  bool mFailed;
+  DWORD mError;
+};
+
+DWORD WINAPI CopyPipeline::HashThreadProc(LPVOID param) {
+  CopyPipeline* pipeline = static_cast<CopyPipeline*>(param);
+  BOOL background = BeginBackgroundIO(pipeline->mBackground);
+  pipeline->HashStage();
+  EndBackgroundIO(background);
+  return 0;
+}
+
+DWORD WINAPI CopyPipeline::WriteThreadProc(LPVOID param) {
+  CopyPipeline* pipeline = static_cast<CopyPipeline*>(param);
+  BOOL background = BeginBackgroundIO(pipeline->mBackground);
+  pipeline->WriteStage();
+  EndBackgroundIO(background);
+  return 0;
+}
+
+/**
+ * Blocks until the slot reaches the specified state.
+ *
+ * @return false if another stage failed and the copy is being abandoned.
+ */
+bool CopyPipeline::WaitForState(CopySlot& slot, SlotState state) {
+  AcquireSRWLockExclusive(&mLock);
+  while (slot.state != state && !mFailed) {
+    SleepConditionVariableSRW(&mChanged, &mLock, INFINITE, 0);
+  }
+  bool failed = mFailed;
+  ReleaseSRWLockExclusive(&mLock);
+  return !failed;
+}
+
+void CopyPipeline::SetState(CopySlot& slot, SlotState state) {
+  AcquireSRWLockExclusive(&mLock);
+  slot.state = state;
+  ReleaseSRWLockExclusive(&mLock);
+  WakeAllConditionVariable(&mChanged);
+}
+
+void CopyPipeline::Fail(DWORD error) {
+  AcquireSRWLockExclusive(&mLock);
+  if (!mFailed) {
+    mFailed = true;
+    mError = error;
+  }
+  ReleaseSRWLockExclusive(&mLock);
+  WakeAllConditionVariable(&mChanged);
+}
+
+void CopyPipeline::ReadStage() {
+  for (size_t i = 0;; ++i) {
+    CopySlot& slot = mSlots[i % COPY_PIPELINE_DEPTH];
+    if (!WaitForState(slot, SlotFree)) {
+      return;
+    }
+
+    DWORD readAmount = 0;
+    if (!ReadFile(mSource, slot.data.get(), COPY_CHUNK_SIZE, &readAmount,
+                  nullptr)) {
+      Fail(GetLastError());
+      return;
+    }
+
+    // A zero byte read is the end of the file and is passed down the pipeline
+    // so the other stages know to stop.
+    slot.length = readAmount;
+    slot.last = readAmount == 0;
+    SetState(slot, SlotRead);
+    if (slot.last) {
+      return;
+    }
+  }
+}
+
+void CopyPipeline::HashStage() {
+  for (size_t i = 0;; ++i) {
+    CopySlot& slot = mSlots[i % COPY_PIPELINE_DEPTH];
+    if (!WaitForState(slot, SlotRead)) {
+      return;
+    }
+
+    if (slot.length && !mHash.Update(slot.data.get(), slot.length)) {
+      Fail(GetLastError());
+      return;
+    }
+
+    bool last = slot.last;
+    SetState(slot, SlotHashed);
+    if (last) {
+      return;
+    }
+  }
+}
+
+void CopyPipeline::WriteStage() {
+  for (size_t i = 0;; ++i) {
+    CopySlot& slot = mSlots[i % COPY_PIPELINE_DEPTH];
+    if (!WaitForState(slot, SlotHashed)) {
+      return;
+    }
+
+    DWORD written = 0;
+    while (written < slot.length) {
+      DWORD wrote;
+      if (!WriteFile(mDest, slot.data.get() + written, slot.length - written,
+                     &wrote, nullptr)) {
+        Fail(GetLastError());
+        return;
+      }
+      written += wrote;
+    }
+
+    bool last = slot.last;
+    SetState(slot, SlotFree);
+    if (last) {
+      return;
+    }
+  }
+}
+
+/**
+ * Runs the copy to completion.
+ *
+ * @param  digest Out buffer for the SHA-256 digest of the bytes read.
+ * @return TRUE if every chunk was read, hashed and written.
+ */
+BOOL CopyPipeline::Run(BYTE digest[SHA256_DIGEST_LENGTH]) {
+  if (!mHash.Init()) {
+    return FALSE;
+  }
+
+  for (size_t i = 0; i < COPY_PIPELINE_DEPTH; ++i) {
+    mSlots[i].data = std::make_unique<BYTE[]>(COPY_CHUNK_SIZE);
+    mSlots[i].length = 0;
+    mSlots[i].last = false;
+    mSlots[i].state = SlotFree;
+  }
+
+  HANDLE threads[2];
+  threads[0] = CreateThread(nullptr, 0, HashThreadProc, this, 0, nullptr);
+  if (!threads[0]) {
+    return FALSE;
+  }
+  threads[1] = CreateThread(nullptr, 0, WriteThreadProc, this, 0, nullptr);
+  if (!threads[1]) {
+    DWORD lastError = GetLastError();
+    Fail(lastError);
+    WaitForSingleObject(threads[0], INFINITE);
+    CloseHandle(threads[0]);
+    SetLastError(lastError);
+    return FALSE;
+  }
+
+  BOOL background = BeginBackgroundIO(mBackground);
+  ReadStage();
+  EndBackgroundIO(background);
+
+  WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+  CloseHandle(threads[0]);
+  CloseHandle(threads[1]);
+
+  if (mFailed) {
+    SetLastError(mError);
+    return FALSE;
+  }
+
+  return mHash.Finish(digest);
+}
+
+}  // namespace
+
+/**
+ * Copies a file and verifies the copy in fewer passes than a copy followed
+ * by a byte for byte comparison. The source is read exactly once, hashed
+ * while it is written to the destination, and then only the destination is
+ * read back and hashed again.
+ *
+ * The source is opened without write sharing and the destination without
+ * any sharing for the whole operation so neither can change underneath us.
+ *
+ * @param  sourcePath   The file to copy.
+ * @param  destPath     The path of the copy, replaced if it exists.
+ * @param  sameContent  Out parameter, TRUE if the destination read back
+ *                      matches what was read from the source.
+ * @param  sourceDigest Optional out buffer for the SHA-256 of the source.
+ * @param  background   TRUE to do the I/O in background mode, so it yields
+ *                      to that of other processes.
+ * @return TRUE if there was no error copying or verifying the file.
+ */
+BOOL CopyAndVerifyFile(LPCWSTR sourcePath, LPCWSTR destPath,
+                       BOOL& sameContent,
+                       BYTE sourceDigest[SHA256_DIGEST_LENGTH],
+                       BOOL background) {
+  sameContent = FALSE;
+
+  autoHandle source(CreateFileW(sourcePath, GENERIC_READ, FILE_SHARE_READ,
+                                nullptr, OPEN_EXISTING,
+                                FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+  if (INVALID_HANDLE_VALUE == source.get()) {
+    return FALSE;
+  }
+
+  LARGE_INTEGER sourceSize;
+  if (!GetFileSizeEx(source.get(), &sourceSize)) {
+    return FALSE;
+  }
+
+  autoHandle dest(CreateFileW(destPath, GENERIC_READ | GENERIC_WRITE, 0,
+                              nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                              nullptr));
+  if (INVALID_HANDLE_VALUE == dest.get()) {
+    return FALSE;
+  }
+
+  // Reserve the full size up front so the file system can allocate it in
+  // one go instead of extending the file on every write.
+  LARGE_INTEGER start;
+  start.QuadPart = 0;
+  if (!SetFilePointerEx(dest.get(), sourceSize, nullptr, FILE_BEGIN) ||
+      !SetEndOfFile(dest.get()) ||
+      !SetFilePointerEx(dest.get(), start, nullptr, FILE_BEGIN)) {
+    return FALSE;
+  }
+
+  BYTE copiedDigest[SHA256_DIGEST_LENGTH];
+  CopyPipeline pipeline(source.get(), dest.get(), background);
+  if (!pipeline.Run(copiedDigest)) {
+    return FALSE;
+  }
+
+  // The source might have been shorter than reported if it was truncated
+  // through another handle opened before ours, make sure we don't leave
+  // trailing zeroes from the reservation behind.
+  if (!SetEndOfFile(dest.get())) {
+    return FALSE;
+  }
+
+  BYTE destDigest[SHA256_DIGEST_LENGTH];
+  BOOL hashBackground = BeginBackgroundIO(background);
+  BOOL hashed = HashFileHandle(dest.get(), destDigest);
+  EndBackgroundIO(hashBackground);
+  if (!hashed) {
+    return FALSE;
+  }
+
+  if (sourceDigest) {
+    memcpy(sourceDigest, copiedDigest, SHA256_DIGEST_LENGTH);
+  }
+  sameContent = memcmp(copiedDigest, destDigest, SHA256_DIGEST_LENGTH) == 0;
+  return TRUE;
+}
@@ -0,0 +1,21 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _FILECOPY_H_
+#define _FILECOPY_H_
+
+#include <windows.h>
+#include "filehash.h"
+
+// Each stage of the copy pipeline works on chunks of this size and up to
+// COPY_PIPELINE_DEPTH chunks are in flight at once.
+#define COPY_CHUNK_SIZE (1024 * 1024)
+#define COPY_PIPELINE_DEPTH 4
+
+BOOL CopyAndVerifyFile(LPCWSTR sourcePath, LPCWSTR destPath,
+                       BOOL& sameContent,
+                       BYTE sourceDigest[SHA256_DIGEST_LENGTH] = nullptr,
+                       BOOL background = FALSE);
+
+#endif
@@ -0,0 +1,131 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <bcrypt.h>
+#include <memory>
+
+#include "filehash.h"
+
+#pragma comment(lib, "bcrypt.lib")
+
+// 1MiB reads keep the number of ReadFile calls low for large installers.
+#define HASH_READ_SIZE (1024 * 1024)
+
+SHA256Hash::SHA256Hash() : mAlgorithm(nullptr), mHash(nullptr) {}
+
+SHA256Hash::~SHA256Hash() { Reset(); }
+
+void SHA256Hash::Reset() {
+  if (mHash) {
+    BCryptDestroyHash(mHash);
+    mHash = nullptr;
+  }
+  if (mAlgorithm) {
+    BCryptCloseAlgorithmProvider(mAlgorithm, 0);
+    mAlgorithm = nullptr;
+  }
+}
+
+/**
+ * Starts a new hash, discarding any previous state.
+ *
+ * @return TRUE if successful
+ */
+BOOL SHA256Hash::Init() {
+  Reset();
+  NTSTATUS status = BCryptOpenAlgorithmProvider(
+      &mAlgorithm, BCRYPT_SHA256_ALGORITHM, nullptr, 0);
+  if (!BCRYPT_SUCCESS(status)) {
+    mAlgorithm = nullptr;
+    SetLastError(static_cast<DWORD>(status));
+    return FALSE;
+  }
+
+  status = BCryptCreateHash(mAlgorithm, &mHash, nullptr, 0, nullptr, 0, 0);
+  if (!BCRYPT_SUCCESS(status)) {
+    mHash = nullptr;
+    SetLastError(static_cast<DWORD>(status));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Adds data to the hash.
+ *
+ * @param  data   The data to hash
+ * @param  length The number of bytes in data
+ * @return TRUE if successful
+ */
+BOOL SHA256Hash::Update(const void* data, DWORD length) {
+  if (!mHash) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+
+  NTSTATUS status =
+      BCryptHashData(mHash, static_cast<PUCHAR>(const_cast<void*>(data)),
+                     length, 0);
+  if (!BCRYPT_SUCCESS(status)) {
+    SetLastError(static_cast<DWORD>(status));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * Completes the hash. Init must be called again before reusing the object.
+ *
+ * @param  digest Out buffer for the SHA-256 digest
+ * @return TRUE if successful
+ */
+BOOL SHA256Hash::Finish(BYTE digest[SHA256_DIGEST_LENGTH]) {
+  if (!mHash) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+
+  NTSTATUS status = BCryptFinishHash(mHash, digest, SHA256_DIGEST_LENGTH, 0);
+  Reset();
+  if (!BCRYPT_SUCCESS(status)) {
+    SetLastError(static_cast<DWORD>(status));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * Calculates the SHA-256 digest of an open file from its beginning.
+ *
+ * @param  file   A handle opened with GENERIC_READ, its file pointer is moved.
+ * @param  digest Out buffer for the SHA-256 digest
+ * @return TRUE if successful
+ */
+BOOL HashFileHandle(HANDLE file, BYTE digest[SHA256_DIGEST_LENGTH]) {
+  LARGE_INTEGER start;
+  start.QuadPart = 0;
+  if (!SetFilePointerEx(file, start, nullptr, FILE_BEGIN)) {
+    return FALSE;
+  }
+
+  SHA256Hash hash;
+  if (!hash.Init()) {
+    return FALSE;
+  }
+
+  auto buffer = std::make_unique<BYTE[]>(HASH_READ_SIZE);
+  DWORD readAmount;
+  do {
+    if (!ReadFile(file, buffer.get(), HASH_READ_SIZE, &readAmount, nullptr)) {
+      return FALSE;
+    }
+    if (readAmount && !hash.Update(buffer.get(), readAmount)) {
+      return FALSE;
+    }
+  } while (readAmount);
+
+  return hash.Finish(digest);
+}
@@ -0,0 +1,36 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _FILEHASH_H_
+#define _FILEHASH_H_
+
+#include <windows.h>
+#include <bcrypt.h>
+
+#define SHA256_DIGEST_LENGTH 32
+
+/**
+ * Incremental SHA-256 over the CNG (BCrypt) primitives.
+ */
+class SHA256Hash {
+ public:
+  SHA256Hash();
+  ~SHA256Hash();
+
+  BOOL Init();
+  BOOL Update(const void* data, DWORD length);
+  BOOL Finish(BYTE digest[SHA256_DIGEST_LENGTH]);
+
+ private:
+  SHA256Hash(const SHA256Hash&) = delete;
+  SHA256Hash& operator=(const SHA256Hash&) = delete;
+  void Reset();
+
+  BCRYPT_ALG_HANDLE mAlgorithm;
+  BCRYPT_HASH_HANDLE mHash;
+};
+
+BOOL HashFileHandle(HANDLE file, BYTE digest[SHA256_DIGEST_LENGTH]);
+
+#endif
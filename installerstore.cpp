@@ -0,0 +1,434 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string.h>
+
+#include "installerstore.h"
+#include "sealedfile.h"
+
+#define INSTALLER_STORE_MAGIC 0x53495541  // "AUIS"
+#define INSTALLER_STORE_VERSION 1
+#define INSTALLER_STORE_HEADER_SIZE 24
+#define INSTALLER_STORE_ENTRY_SIZE (INSTALLER_DIGEST_LENGTH + 16)
+// More entries than this is never a valid index, whatever the limits.
+#define INSTALLER_STORE_ENTRIES_LIMIT 1024
+
+InstallerStoreIndex::InstallerStoreIndex(uint64_t maxSize, size_t maxEntries)
+    : mMaxSize(maxSize), mMaxEntries(maxEntries), mUseCounter(0) {}
+
+std::vector<InstallerStoreEntry>::iterator InstallerStoreIndex::FindEntry(
+    const uint8_t* digest) {
+  auto it = mEntries.begin();
+  for (; it != mEntries.end(); ++it) {
+    if (!memcmp(it->digest, digest, INSTALLER_DIGEST_LENGTH)) {
+      break;
+    }
+  }
+  return it;
+}
+
+const InstallerStoreEntry* InstallerStoreIndex::Find(
+    const uint8_t* digest) const {
+  for (const InstallerStoreEntry& entry : mEntries) {
+    if (!memcmp(entry.digest, digest, INSTALLER_DIGEST_LENGTH)) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Makes an installer the most recently used one.
+ */
+void InstallerStoreIndex::Touch(const uint8_t* digest) {
+  auto it = FindEntry(digest);
+  if (it != mEntries.end()) {
+    it->lastUsed = ++mUseCounter;
+  }
+}
+
+/**
+ * Adds an installer as the most recently used one, and evicts the least
+ * recently used ones until the store is within its limits again. The new
+ * installer itself is never evicted, even if it is larger than the store.
+ *
+ * @param digest  The digest of the installer
+ * @param size    The size of the installer
+ * @param evicted Set to the entries which were evicted, their files are
+ *                for the caller to delete
+ */
+void InstallerStoreIndex::Insert(const uint8_t* digest, uint64_t size,
+                                 std::vector<InstallerStoreEntry>& evicted) {
+  evicted.clear();
+  auto it = FindEntry(digest);
+  if (it == mEntries.end()) {
+    InstallerStoreEntry entry;
+    memcpy(entry.digest, digest, INSTALLER_DIGEST_LENGTH);
+    mEntries.push_back(entry);
+    it = mEntries.end() - 1;
+  }
+  it->size = size;
+  it->lastUsed = ++mUseCounter;
+
+  while (mEntries.size() > 1 &&
+         (mEntries.size() > mMaxEntries || TotalSize() > mMaxSize)) {
+    auto oldest = mEntries.end();
+    for (auto candidate = mEntries.begin(); candidate != mEntries.end();
+         ++candidate) {
+      if (candidate->lastUsed != mUseCounter &&
+          (oldest == mEntries.end() ||
+           candidate->lastUsed < oldest->lastUsed)) {
+        oldest = candidate;
+      }
+    }
+    evicted.push_back(*oldest);
+    mEntries.erase(oldest);
+  }
+}
+
+void InstallerStoreIndex::Remove(const uint8_t* digest) {
+  auto it = FindEntry(digest);
+  if (it != mEntries.end()) {
+    mEntries.erase(it);
+  }
+}
+
+void InstallerStoreIndex::Clear() {
+  mEntries.clear();
+  mUseCounter = 0;
+}
+
+uint64_t InstallerStoreIndex::TotalSize() const {
+  uint64_t total = 0;
+  for (const InstallerStoreEntry& entry : mEntries) {
+    total += entry.size;
+  }
+  return total;
+}
+
+void InstallerStoreIndex::Serialize(std::vector<uint8_t>& data) const {
+  data.clear();
+  Put32(data, INSTALLER_STORE_MAGIC);
+  Put32(data, INSTALLER_STORE_VERSION);
+  Put32(data, static_cast<uint32_t>(mEntries.size()));
+  Put32(data, 0);
+  Put64(data, mUseCounter);
+  for (const InstallerStoreEntry& entry : mEntries) {
+    data.insert(data.end(), entry.digest,
+                entry.digest + INSTALLER_DIGEST_LENGTH);
+    Put64(data, entry.size);
+    Put64(data, entry.lastUsed);
+  }
+  AppendSeal(data);
+}
+
+/**
+ * Reads a serialized index. The index is left empty unless all of it is
+ * well formed and the seal matches.
+ *
+ * @return false if the data isn't a valid index.
+ */
+bool InstallerStoreIndex::Deserialize(const uint8_t* data, size_t size) {
+  Clear();
+  if (size < INSTALLER_STORE_HEADER_SIZE + SEAL_SIZE ||
+      Read32(data) != INSTALLER_STORE_MAGIC ||
+      Read32(data + 4) != INSTALLER_STORE_VERSION) {
+    return false;
+  }
+  uint32_t count = Read32(data + 8);
+  if (count > INSTALLER_STORE_ENTRIES_LIMIT ||
+      size != INSTALLER_STORE_HEADER_SIZE +
+                  count * INSTALLER_STORE_ENTRY_SIZE + SEAL_SIZE ||
+      !HasValidSeal(data, size)) {
+    return false;
+  }
+
+  uint64_t useCounter = Read64(data + 16);
+  std::vector<InstallerStoreEntry> entries;
+  const uint8_t* p = data + INSTALLER_STORE_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; ++i, p += INSTALLER_STORE_ENTRY_SIZE) {
+    InstallerStoreEntry entry;
+    memcpy(entry.digest, p, INSTALLER_DIGEST_LENGTH);
+    entry.size = Read64(p + INSTALLER_DIGEST_LENGTH);
+    entry.lastUsed = Read64(p + INSTALLER_DIGEST_LENGTH + 8);
+    for (const InstallerStoreEntry& other : entries) {
+      if (!memcmp(other.digest, entry.digest, INSTALLER_DIGEST_LENGTH)) {
+        return false;
+      }
+    }
+    if (entry.lastUsed > useCounter) {
+      useCounter = entry.lastUsed;
+    }
+    entries.push_back(entry);
+  }
+  mEntries.swap(entries);
+  mUseCounter = useCounter;
+  return true;
+}
+
+void FormatInstallerDigest(const uint8_t* digest,
+                           wchar_t hex[INSTALLER_DIGEST_LENGTH * 2 + 1]) {
+  static const wchar_t kHexDigits[] = L"0123456789abcdef";
+  for (size_t i = 0; i < INSTALLER_DIGEST_LENGTH; ++i) {
+    hex[2 * i] = kHexDigits[digest[i] >> 4];
+    hex[2 * i + 1] = kHexDigits[digest[i] & 0xf];
+  }
+  hex[INSTALLER_DIGEST_LENGTH * 2] = L'\0';
+}
+
+#ifdef _WIN32
+#include <shlwapi.h>
+#include <string>
+
+#include "filecopy.h"
+#include "updatecommon.h"
+#include "updateutils_win.h"
+
+#define INSTALLER_STORE_INDEX_NAME L"index.dat"
+#define INSTALLER_STORE_INCOMING_NAME L"incoming.tmp"
+// Far larger than any index within the entry limit.
+#define INSTALLER_STORE_INDEX_MAX_SIZE (64 * 1024)
+
+/**
+ * Obtains the directory of the installer store, the installers subdirectory
+ * of the secure update directory alongside the service binary. It is
+ * created if needed.
+ *
+ * @param  directory A buffer of size MAX_PATH + 1 to store the result.
+ * @return TRUE if successful
+ */
+static BOOL GetInstallerStoreDirectory(LPWSTR directory) {
+  if (!GetModuleFileNameW(nullptr, directory, MAX_PATH) ||
+      !PathRemoveFileSpecW(directory) ||
+      !PathAppendSafe(directory, L"update")) {
+    return FALSE;
+  }
+  CreateDirectoryW(directory, nullptr);
+  if (!PathAppendSafe(directory, L"installers")) {
+    return FALSE;
+  }
+  CreateDirectoryW(directory, nullptr);
+  return TRUE;
+}
+
+/**
+ * Hashes a file without letting anyone write to it while it is read.
+ */
+BOOL HashUpdaterFile(LPCWSTR path, BYTE digest[SHA256_DIGEST_LENGTH]) {
+  autoHandle file(CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                              nullptr));
+  if (INVALID_HANDLE_VALUE == file.get()) {
+    return FALSE;
+  }
+  return HashFileHandle(file.get(), digest);
+}
+
+/**
+ * The default directory, or an empty one if it can't be determined.
+ */
+static std::wstring GetDefaultInstallerStoreDirectory() {
+  WCHAR directory[MAX_PATH + 1] = {L'\0'};
+  if (!GetInstallerStoreDirectory(directory)) {
+    return std::wstring();
+  }
+  return directory;
+}
+
+InstallerStore& InstallerStore::GetDefault() {
+  static InstallerStore defaultStore(
+      GetDefaultInstallerStoreDirectory().c_str());
+  return defaultStore;
+}
+
+/**
+ * @param directory The directory to keep the installers in. If this is
+ *                  empty the store never finds or keeps anything.
+ */
+InstallerStore::InstallerStore(LPCWSTR directory)
+    : mLoaded(false),
+      mIndex(INSTALLER_STORE_MAX_SIZE, INSTALLER_STORE_MAX_ENTRIES) {
+  wcsncpy_s(mDirectory, MAX_PATH + 1, directory, MAX_PATH);
+}
+
+BOOL InstallerStore::GetEntryPath(const BYTE digest[SHA256_DIGEST_LENGTH],
+                                  WCHAR path[MAX_PATH + 1]) const {
+  WCHAR name[SHA256_DIGEST_LENGTH * 2 + 5];
+  FormatInstallerDigest(digest, name);
+  wcscat_s(name, L".exe");
+  wcsncpy_s(path, MAX_PATH + 1, mDirectory, MAX_PATH);
+  return PathAppendSafe(path, name);
+}
+
+/**
+ * Reads the index. A missing, unreadable or invalid index is treated as an
+ * empty store, the installers it listed are then left for the uninstaller.
+ *
+ * @return TRUE if the store can be used.
+ */
+BOOL InstallerStore::Load() {
+  if (mLoaded) {
+    return TRUE;
+  }
+  if (!mDirectory[0]) {
+    return FALSE;
+  }
+  mLoaded = true;
+  mIndex.Clear();
+
+  WCHAR indexPath[MAX_PATH + 1];
+  wcsncpy_s(indexPath, MAX_PATH + 1, mDirectory, MAX_PATH);
+  if (!PathAppendSafe(indexPath, INSTALLER_STORE_INDEX_NAME)) {
+    return FALSE;
+  }
+  std::vector<uint8_t> data;
+  if (!ReadSmallFile(indexPath, data, INSTALLER_STORE_INDEX_MAX_SIZE)) {
+    if (GetLastError() != ERROR_FILE_NOT_FOUND) {
+      LOG_WARN(("Ignoring unreadable installer store index: %ls", indexPath));
+    }
+    return TRUE;
+  }
+  if (!mIndex.Deserialize(data.data(), data.size())) {
+    LOG_WARN(("Ignoring invalid installer store index: %ls", indexPath));
+  }
+  return TRUE;
+}
+
+/**
+ * Replaces the index so a reader never sees a partially written one.
+ *
+ * @return TRUE if successful
+ */
+BOOL InstallerStore::Save() {
+  WCHAR indexPath[MAX_PATH + 1];
+  wcsncpy_s(indexPath, MAX_PATH + 1, mDirectory, MAX_PATH);
+  if (!PathAppendSafe(indexPath, INSTALLER_STORE_INDEX_NAME)) {
+    return FALSE;
+  }
+
+  std::vector<uint8_t> data;
+  mIndex.Serialize(data);
+  return WriteFileAtomically(indexPath, data.data(), data.size());
+}
+
+void InstallerStore::DeleteEntryFile(const BYTE digest[SHA256_DIGEST_LENGTH]) {
+  WCHAR path[MAX_PATH + 1];
+  if (!GetEntryPath(digest, path)) {
+    return;
+  }
+  if (!DeleteFileW(path) && GetLastError() != ERROR_FILE_NOT_FOUND) {
+    // Still running or being scanned, it goes on the next restart instead.
+    LOG_WARN(("Could not delete the stored installer %ls.  (%lu)", path,
+              GetLastError()));
+    MoveFileExW(path, nullptr, MOVEFILE_DELAY_UNTIL_REBOOT);
+  }
+}
+
+/**
+ * Looks up an installer which was copied and verified before. The stored
+ * copy is hashed again, so one which was altered or damaged since is
+ * dropped rather than used.
+ *
+ * @param  digest The SHA-256 digest of the installer
+ * @param  path   Out parameter for the path of the stored copy
+ * @return TRUE if the installer is in the store.
+ */
+BOOL InstallerStore::Lookup(const BYTE digest[SHA256_DIGEST_LENGTH],
+                            WCHAR path[MAX_PATH + 1]) {
+  if (!Load() || !mIndex.Find(digest) || !GetEntryPath(digest, path)) {
+    return FALSE;
+  }
+
+  BYTE storedDigest[SHA256_DIGEST_LENGTH];
+  if (!HashUpdaterFile(path, storedDigest) ||
+      memcmp(storedDigest, digest, SHA256_DIGEST_LENGTH)) {
+    LOG_WARN(("The stored installer %ls is missing or was altered.", path));
+    Remove(digest);
+    return FALSE;
+  }
+
+  mIndex.Touch(digest);
+  Save();
+  return TRUE;
+}
+
+/**
+ * Copies an installer into the store and verifies the copy. The copy is
+ * named after the digest of what was read from the source, so a source
+ * which changes along the way is stored under its new content.
+ *
+ * @param  sourcePath The installer to copy
+ * @param  digest     Out parameter for the digest of the installer
+ * @param  path       Out parameter for the path of the stored copy
+ * @param  background TRUE to copy in background I/O mode
+ * @return TRUE if the installer was copied and the copy matches it.
+ */
+BOOL InstallerStore::Add(LPCWSTR sourcePath, BYTE digest[SHA256_DIGEST_LENGTH],
+                         WCHAR path[MAX_PATH + 1], BOOL background) {
+  if (!Load()) {
+    SetLastError(ERROR_PATH_NOT_FOUND);
+    return FALSE;
+  }
+
+  WCHAR incomingPath[MAX_PATH + 1];
+  wcsncpy_s(incomingPath, MAX_PATH + 1, mDirectory, MAX_PATH);
+  if (!PathAppendSafe(incomingPath, INSTALLER_STORE_INCOMING_NAME)) {
+    return FALSE;
+  }
+  DeleteFileW(incomingPath);
+
+  BOOL sameContent = FALSE;
+  if (!CopyAndVerifyFile(sourcePath, incomingPath, sameContent, digest,
+                         background)) {
+    DWORD lastError = GetLastError();
+    DeleteFileW(incomingPath);
+    SetLastError(lastError);
+    return FALSE;
+  }
+  if (!sameContent) {
+    LOG_WARN(("The copy of %ls does not match it.", sourcePath));
+    DeleteFileW(incomingPath);
+    SetLastError(ERROR_FILE_INVALID);
+    return FALSE;
+  }
+
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetEntryPath(digest, path) ||
+      !GetFileAttributesExW(incomingPath, GetFileExInfoStandard,
+                            &attributes) ||
+      !MoveFileExW(incomingPath, path,
+                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+    DWORD lastError = GetLastError();
+    DeleteFileW(incomingPath);
+    SetLastError(lastError);
+    return FALSE;
+  }
+
+  ULARGE_INTEGER size;
+  size.LowPart = attributes.nFileSizeLow;
+  size.HighPart = attributes.nFileSizeHigh;
+  std::vector<InstallerStoreEntry> evicted;
+  mIndex.Insert(digest, size.QuadPart, evicted);
+  for (const InstallerStoreEntry& entry : evicted) {
+    DeleteEntryFile(entry.digest);
+  }
+  if (!Save()) {
+    LOG_WARN(("Could not save the installer store index.  (%lu)",
+              GetLastError()));
+  }
+  return TRUE;
+}
+
+/**
+ * Drops an installer from the store.
+ */
+void InstallerStore::Remove(const BYTE digest[SHA256_DIGEST_LENGTH]) {
+  if (!Load()) {
+    return;
+  }
+  DeleteEntryFile(digest);
+  mIndex.Remove(digest);
+  Save();
+}
+#endif
@@ -0,0 +1,102 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _INSTALLERSTORE_H_
+#define _INSTALLERSTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Installers are stored by their SHA-256 digest.
+#define INSTALLER_DIGEST_LENGTH 32
+// The least recently used installers are evicted past either limit.
+#define INSTALLER_STORE_MAX_ENTRIES 8
+#define INSTALLER_STORE_MAX_SIZE (512ULL * 1024 * 1024)
+
+struct InstallerStoreEntry {
+  uint8_t digest[INSTALLER_DIGEST_LENGTH];
+  uint64_t size;
+  // Larger is more recent.
+  uint64_t lastUsed;
+};
+
+/**
+ * The index of the installer store: which installers it holds and which
+ * were used last. Uses are counted rather than timed, so a clock change
+ * can't reorder them.
+ *
+ * The serialized index is sealed with a checksum over all of it, so a torn
+ * or corrupted index is never mistaken for a valid one. Protecting it from
+ * being altered is up to the directory it is kept in.
+ */
+class InstallerStoreIndex {
+ public:
+  InstallerStoreIndex(uint64_t maxSize, size_t maxEntries);
+
+  const InstallerStoreEntry* Find(const uint8_t* digest) const;
+  void Touch(const uint8_t* digest);
+  void Insert(const uint8_t* digest, uint64_t size,
+              std::vector<InstallerStoreEntry>& evicted);
+  void Remove(const uint8_t* digest);
+  void Clear();
+
+  size_t Count() const { return mEntries.size(); }
+  uint64_t TotalSize() const;
+
+  void Serialize(std::vector<uint8_t>& data) const;
+  bool Deserialize(const uint8_t* data, size_t size);
+
+ private:
+  std::vector<InstallerStoreEntry>::iterator FindEntry(const uint8_t* digest);
+
+  uint64_t mMaxSize;
+  size_t mMaxEntries;
+  uint64_t mUseCounter;
+  std::vector<InstallerStoreEntry> mEntries;
+};
+
+void FormatInstallerDigest(const uint8_t* digest,
+                           wchar_t hex[INSTALLER_DIGEST_LENGTH * 2 + 1]);
+
+#ifdef _WIN32
+#include <windows.h>
+#include "filehash.h"
+
+static_assert(INSTALLER_DIGEST_LENGTH == SHA256_DIGEST_LENGTH,
+              "Installers are keyed by their SHA-256 digest");
+
+/**
+ * Copied and verified installers, kept in the installers subdirectory of the
+ * secure update directory so a retry of the same installer doesn't copy it
+ * again. Only the service uses it, and it runs one command at a time.
+ */
+class InstallerStore {
+ public:
+  static InstallerStore& GetDefault();
+
+  explicit InstallerStore(LPCWSTR directory);
+
+  BOOL Lookup(const BYTE digest[SHA256_DIGEST_LENGTH],
+              WCHAR path[MAX_PATH + 1]);
+  BOOL Add(LPCWSTR sourcePath, BYTE digest[SHA256_DIGEST_LENGTH],
+           WCHAR path[MAX_PATH + 1], BOOL background = FALSE);
+  void Remove(const BYTE digest[SHA256_DIGEST_LENGTH]);
+
+ private:
+  BOOL Load();
+  BOOL Save();
+  BOOL GetEntryPath(const BYTE digest[SHA256_DIGEST_LENGTH],
+                    WCHAR path[MAX_PATH + 1]) const;
+  void DeleteEntryFile(const BYTE digest[SHA256_DIGEST_LENGTH]);
+
+  WCHAR mDirectory[MAX_PATH + 1];
+  bool mLoaded;
+  InstallerStoreIndex mIndex;
+};
+
+BOOL HashUpdaterFile(LPCWSTR path, BYTE digest[SHA256_DIGEST_LENGTH]);
+#endif
+
+#endif
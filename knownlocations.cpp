@@ -0,0 +1,207 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "knownlocations.h"
+
+KnownLocations::KnownLocations(KnownLocationSource& source)
+    : mSource(source) {
+  for (Entry& entry : mEntries) {
+    entry.resolved = false;
+    entry.created = false;
+  }
+}
+
+/**
+ * Resolves a location unless it was already. The caller holds mLock.
+ */
+bool KnownLocations::Resolve(KnownLocation location, Entry*& entry) {
+  entry = &mEntries[location];
+  if (entry->resolved) {
+    return true;
+  }
+
+  std::wstring path;
+  if (!mSource.Resolve(location, path) || path.empty()) {
+    return false;
+  }
+  wchar_t separator = mSource.Separator();
+  // A root like C:\ keeps its separator.
+  while (path.size() > 1 && path.back() == separator &&
+         path[path.size() - 2] != L':') {
+    path.pop_back();
+  }
+
+  entry->path = path;
+  entry->prefix = path;
+  for (wchar_t& c : entry->prefix) {
+    c = Fold(c);
+  }
+  if (entry->prefix.back() != separator) {
+    entry->prefix.push_back(separator);
+  }
+  entry->resolved = true;
+  return true;
+}
+
+/**
+ * @param  path Set to the location, without a trailing separator unless it
+ *              is a root
+ * @return false if the location can't be resolved.
+ */
+bool KnownLocations::GetPath(KnownLocation location, std::wstring& path) {
+  std::lock_guard<std::mutex> lock(mLock);
+  Entry* entry;
+  if (!Resolve(location, entry)) {
+    return false;
+  }
+  path = entry->path;
+  return true;
+}
+
+/**
+ * Checks whether a path is in a location, without regard to ASCII case.
+ *
+ * @return false if it isn't, or the location can't be resolved.
+ */
+bool KnownLocations::Contains(KnownLocation location, const wchar_t* path) {
+  std::lock_guard<std::mutex> lock(mLock);
+  Entry* entry;
+  if (!Resolve(location, entry)) {
+    return false;
+  }
+  const std::wstring& prefix = entry->prefix;
+  for (size_t i = 0; i < prefix.size(); ++i) {
+    if (!path[i] || Fold(path[i]) != prefix[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Creates the directory of a location the first time this is called for
+ * it. It isn't created again if it is removed while the process runs.
+ *
+ * @return false if the location can't be resolved or created.
+ */
+bool KnownLocations::EnsureCreated(KnownLocation location) {
+  std::lock_guard<std::mutex> lock(mLock);
+  Entry* entry;
+  if (!Resolve(location, entry)) {
+    return false;
+  }
+  if (!entry->created) {
+    entry->created = mSource.CreateDirectories(location, entry->path);
+  }
+  return entry->created;
+}
+
+#ifdef _WIN32
+#include <windows.h>
+#include <shlobj.h>
+
+#include "updatecommon.h"
+
+#ifndef RRF_SUBKEY_WOW6464KEY
+#  define RRF_SUBKEY_WOW6464KEY 0x00010000
+#endif
+
+// The secure output directory, under Program Files (x86).
+#define SECURE_OUTPUT_PARENT_DIR L"Aveo System\\Update Service"
+#define SECURE_OUTPUT_DIR L"UpdateLogs"
+
+namespace {
+
+bool GetKnownFolder(REFKNOWNFOLDERID folder, DWORD flags,
+                    std::wstring& path) {
+  PWSTR folderPath = nullptr;
+  if (FAILED(SHGetKnownFolderPath(folder, flags, nullptr, &folderPath))) {
+    return false;
+  }
+  path = folderPath;
+  CoTaskMemFree(folderPath);
+  return true;
+}
+
+class SystemKnownLocationSource : public KnownLocationSource {
+ public:
+  bool Resolve(KnownLocation location, std::wstring& path) override {
+    switch (location) {
+      case KNOWN_LOCATION_PROGRAM_FILES_X86:
+        // FOLDERID_ProgramFilesX86 gets native Program Files directory on a
+        // 32-bit OS or the (x86) directory on a 64-bit OS regardless of this
+        // binary's bitness.
+        return GetKnownFolder(FOLDERID_ProgramFilesX86, 0, path);
+      case KNOWN_LOCATION_PROGRAM_FILES_NATIVE:
+        return GetNativeProgramFiles(path);
+      case KNOWN_LOCATION_SECURE_OUTPUT:
+        if (!GetKnownFolder(FOLDERID_ProgramFilesX86, KF_FLAG_CREATE, path)) {
+          return false;
+        }
+        path += L"\\" SECURE_OUTPUT_PARENT_DIR L"\\" SECURE_OUTPUT_DIR;
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  bool CreateDirectories(KnownLocation location,
+                         const std::wstring& path) override {
+    if (KNOWN_LOCATION_SECURE_OUTPUT == location) {
+      // Create the Update Service directory in case it doesn't exist.
+      std::wstring parent =
+          path.substr(0, path.size() - wcslen(L"\\" SECURE_OUTPUT_DIR));
+      if (!CreateDirectoryW(parent.c_str(), nullptr) &&
+          GetLastError() != ERROR_ALREADY_EXISTS) {
+        return false;
+      }
+    }
+    return CreateDirectoryW(path.c_str(), nullptr) ||
+           GetLastError() == ERROR_ALREADY_EXISTS;
+  }
+
+  wchar_t Separator() const override { return L'\\'; }
+
+ private:
+  // In case we're a 32-bit binary on 64-bit Windows, there is no FOLDERID_*
+  // value that returns the native Program Files, so it is read out of its
+  // canonical registry location instead. On a 32-bit OS this is the same
+  // path as FOLDERID_ProgramFilesX86.
+  static bool GetNativeProgramFiles(std::wstring& path) {
+    DWORD length = 0;
+    if (RegGetValueW(HKEY_LOCAL_MACHINE,
+                     L"Software\\Microsoft\\Windows\\CurrentVersion",
+                     L"ProgramFilesDir", RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+                     nullptr, nullptr, &length) != ERROR_SUCCESS) {
+      LOG_WARN(("Failed getting native Program Files length"));
+      return false;
+    }
+    // RegGetValue returns the length including the terminator, but it's in
+    // bytes, so convert that to characters.
+    DWORD lengthChars = length / sizeof(wchar_t);
+    if (lengthChars <= 1) {
+      LOG_WARN(("Failed length native"));
+      return false;
+    }
+    path.assign(lengthChars, L'\0');
+    if (RegGetValueW(HKEY_LOCAL_MACHINE,
+                     L"Software\\Microsoft\\Windows\\CurrentVersion",
+                     L"ProgramFilesDir", RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
+                     nullptr, &path[0], &length) != ERROR_SUCCESS) {
+      LOG_WARN(("Failed getting native Program Files"));
+      return false;
+    }
+    path.resize(wcsnlen_s(path.c_str(), lengthChars));
+    return true;
+  }
+};
+
+}  // namespace
+
+KnownLocations& KnownLocations::GetDefault() {
+  static SystemKnownLocationSource source;
+  static KnownLocations defaultLocations(source);
+  return defaultLocations;
+}
+#endif
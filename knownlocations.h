@@ -0,0 +1,74 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _KNOWNLOCATIONS_H_
+#define _KNOWNLOCATIONS_H_
+
+#include <stddef.h>
+#include <mutex>
+#include <string>
+
+enum KnownLocation {
+  // Program Files (x86) on a 64-bit OS, Program Files on a 32-bit one.
+  KNOWN_LOCATION_PROGRAM_FILES_X86,
+  // The native Program Files, whatever the bitness of this binary.
+  KNOWN_LOCATION_PROGRAM_FILES_NATIVE,
+  // Where the status and log files of updates are written, see
+  // GetSecureOutputDirectoryPath.
+  KNOWN_LOCATION_SECURE_OUTPUT,
+  KNOWN_LOCATION_COUNT
+};
+
+/**
+ * Where KnownLocations gets the locations from: the system, or a fake.
+ */
+class KnownLocationSource {
+ public:
+  virtual ~KnownLocationSource() {}
+
+  virtual bool Resolve(KnownLocation location, std::wstring& path) = 0;
+  virtual bool CreateDirectories(KnownLocation location,
+                                 const std::wstring& path) = 0;
+  virtual wchar_t Separator() const = 0;
+};
+
+/**
+ * The known locations, each resolved once the first time it is used. After
+ * that, getting a location or checking whether a path is in it is only
+ * string work. A location which can't be resolved is tried again the next
+ * time.
+ */
+class KnownLocations {
+ public:
+  static KnownLocations& GetDefault();
+
+  explicit KnownLocations(KnownLocationSource& source);
+
+  bool GetPath(KnownLocation location, std::wstring& path);
+  bool Contains(KnownLocation location, const wchar_t* path);
+  bool EnsureCreated(KnownLocation location);
+
+ private:
+  struct Entry {
+    bool resolved;
+    bool created;
+    // As resolved, without a trailing separator.
+    std::wstring path;
+    // Case folded, with a trailing separator, so a prefix match can't match
+    // a sibling whose name starts the same.
+    std::wstring prefix;
+  };
+
+  bool Resolve(KnownLocation location, Entry*& entry);
+  static wchar_t Fold(wchar_t c) {
+    return (c >= L'A' && c <= L'Z') ? static_cast<wchar_t>(c - L'A' + L'a')
+                                    : c;
+  }
+
+  KnownLocationSource& mSource;
+  std::mutex mLock;
+  Entry mEntries[KNOWN_LOCATION_COUNT];
+};
+
+#endif
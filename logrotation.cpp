@@ -0,0 +1,282 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <wchar.h>
+
+#include "logrotation.h"
+#include "updatecommon.h"
+#include "updateutils_win.h"
+
+#define LOG_INDEX_MAGIC 0x494c5541  // "AULI"
+#define LOG_INDEX_VERSION 1
+
+struct LogIndex {
+  DWORD magic;
+  DWORD version;
+  ULONGLONG nextNumber;
+};
+
+struct NumberedLog {
+  ULONGLONG number;
+  ULONGLONG size;
+  WCHAR fileName[MAX_PATH];
+};
+
+/**
+ * @param directory    The directory the logs are in
+ * @param prefix       The name of the logs up to the number, a log named
+ *                     <prefix>.log left by an older version is pruned too.
+ * @param logsToKeep   The most logs to keep, including the current one
+ * @param maxTotalSize The most space all kept logs may take up together. The
+ *                     logs of the current run are kept regardless.
+ */
+LogRotation::LogRotation(LPCWSTR directory, LPCWSTR prefix, DWORD logsToKeep,
+                         ULONGLONG maxTotalSize)
+    : mLogsToKeep(logsToKeep),
+      mMaxTotalSize(maxTotalSize),
+      mFirstLogOfRun(0),
+      mPruneThread(nullptr),
+      mStopPruning(false) {
+  wcsncpy_s(mDirectory, MAX_PATH + 1, directory, _TRUNCATE);
+  wcsncpy_s(mPrefix, LOG_PREFIX_LENGTH, prefix, _TRUNCATE);
+}
+
+LogRotation::~LogRotation() {
+  if (mPruneThread) {
+    CloseHandle(mPruneThread);
+  }
+}
+
+BOOL LogRotation::GetLogPath(ULONGLONG number, LPWSTR path) const {
+  WCHAR logName[LOG_PREFIX_LENGTH + 32] = {L'\0'};
+  if (swprintf(logName, sizeof(logName) / sizeof(logName[0]), L"%ls-%llu.log",
+               mPrefix, number) < 0) {
+    return FALSE;
+  }
+  wcsncpy_s(path, MAX_PATH + 1, mDirectory, MAX_PATH);
+  return PathAppendSafe(path, logName);
+}
+
+/**
+ * Obtains the number of a log from its file name.
+ *
+ * @return TRUE if the file name is <prefix>-<number>.log
+ */
+BOOL LogRotation::ParseLogNumber(LPCWSTR fileName, ULONGLONG& number) const {
+  size_t prefixLen = wcslen(mPrefix);
+  if (_wcsnicmp(fileName, mPrefix, prefixLen) || fileName[prefixLen] != L'-') {
+    return FALSE;
+  }
+
+  LPCWSTR digits = fileName + prefixLen + 1;
+  number = 0;
+  LPCWSTR p = digits;
+  for (; *p >= L'0' && *p <= L'9'; ++p) {
+    if (number > (ULLONG_MAX - 9) / 10) {
+      return FALSE;
+    }
+    number = number * 10 + (*p - L'0');
+  }
+  return p != digits && !_wcsicmp(p, L".log");
+}
+
+/**
+ * Looks for the highest numbered log, for when the index file is missing or
+ * unreadable.
+ */
+ULONGLONG LogRotation::FindHighestLogNumber() const {
+  WCHAR pattern[MAX_PATH + 1];
+  wcsncpy_s(pattern, MAX_PATH + 1, mDirectory, MAX_PATH);
+  WCHAR patternName[LOG_PREFIX_LENGTH + 8];
+  swprintf(patternName, sizeof(patternName) / sizeof(patternName[0]),
+           L"%ls-*.log", mPrefix);
+  if (!PathAppendSafe(pattern, patternName)) {
+    return 0;
+  }
+
+  ULONGLONG highest = 0;
+  WIN32_FIND_DATAW findData;
+  HANDLE find = FindFirstFileExW(pattern, FindExInfoBasic, &findData,
+                                 FindExSearchNameMatch, nullptr, 0);
+  if (INVALID_HANDLE_VALUE == find) {
+    return 0;
+  }
+  do {
+    ULONGLONG number;
+    if (ParseLogNumber(findData.cFileName, number) && number > highest) {
+      highest = number;
+    }
+  } while (FindNextFileW(find, &findData));
+  FindClose(find);
+  return highest;
+}
+
+/**
+ * Claims the next log number. This only reads and rewrites the index file,
+ * no existing log is touched.
+ *
+ * @param  path The out buffer for the path of the new log of size
+ *              MAX_PATH + 1
+ * @return TRUE if successful.
+ */
+BOOL LogRotation::NextLogPath(LPWSTR path) {
+  WCHAR indexPath[MAX_PATH + 1];
+  WCHAR indexName[LOG_PREFIX_LENGTH + 16];
+  wcsncpy_s(indexPath, MAX_PATH + 1, mDirectory, MAX_PATH);
+  swprintf(indexName, sizeof(indexName) / sizeof(indexName[0]),
+           L"%ls.logindex", mPrefix);
+  if (!PathAppendSafe(indexPath, indexName)) {
+    return FALSE;
+  }
+
+  autoHandle indexFile(CreateFileW(indexPath, GENERIC_READ | GENERIC_WRITE, 0,
+                                   nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                                   nullptr));
+  if (INVALID_HANDLE_VALUE == indexFile.get()) {
+    return FALSE;
+  }
+
+  LogIndex index;
+  DWORD readAmount = 0;
+  if (!ReadFile(indexFile.get(), &index, sizeof(index), &readAmount,
+                nullptr) ||
+      readAmount != sizeof(index) || index.magic != LOG_INDEX_MAGIC ||
+      index.version != LOG_INDEX_VERSION || !index.nextNumber) {
+    index.magic = LOG_INDEX_MAGIC;
+    index.version = LOG_INDEX_VERSION;
+    index.nextNumber = FindHighestLogNumber() + 1;
+  }
+
+  ULONGLONG number = index.nextNumber++;
+  DWORD wrote = 0;
+  LARGE_INTEGER start = {};
+  if (!SetFilePointerEx(indexFile.get(), start, nullptr, FILE_BEGIN) ||
+      !WriteFile(indexFile.get(), &index, sizeof(index), &wrote, nullptr) ||
+      wrote != sizeof(index)) {
+    return FALSE;
+  }
+
+  if (!mFirstLogOfRun) {
+    mFirstLogOfRun = number;
+  }
+  return GetLogPath(number, path);
+}
+
+/**
+ * Deletes the oldest logs until at most mLogsToKeep of them are left and they
+ * fit in mMaxTotalSize. Logs of the current run are never deleted.
+ */
+void LogRotation::Prune() {
+  WCHAR pattern[MAX_PATH + 1];
+  wcsncpy_s(pattern, MAX_PATH + 1, mDirectory, MAX_PATH);
+  WCHAR patternName[LOG_PREFIX_LENGTH + 8];
+  swprintf(patternName, sizeof(patternName) / sizeof(patternName[0]),
+           L"%ls*.log", mPrefix);
+  if (!PathAppendSafe(pattern, patternName)) {
+    return;
+  }
+
+  WCHAR legacyName[LOG_PREFIX_LENGTH + 8];
+  swprintf(legacyName, sizeof(legacyName) / sizeof(legacyName[0]), L"%ls.log",
+           mPrefix);
+
+  std::vector<NumberedLog> logs;
+  WIN32_FIND_DATAW findData;
+  HANDLE find = FindFirstFileExW(pattern, FindExInfoBasic, &findData,
+                                 FindExSearchNameMatch, nullptr,
+                                 FIND_FIRST_EX_LARGE_FETCH);
+  if (INVALID_HANDLE_VALUE == find) {
+    return;
+  }
+  do {
+    NumberedLog log;
+    // The unnumbered log of older versions goes first.
+    if (!_wcsicmp(findData.cFileName, legacyName)) {
+      log.number = 0;
+    } else if (!ParseLogNumber(findData.cFileName, log.number)) {
+      continue;
+    }
+    log.size = (static_cast<ULONGLONG>(findData.nFileSizeHigh) << 32) |
+               findData.nFileSizeLow;
+    wcsncpy_s(log.fileName, MAX_PATH, findData.cFileName, _TRUNCATE);
+    logs.push_back(log);
+  } while (FindNextFileW(find, &findData));
+  FindClose(find);
+
+  std::sort(logs.begin(), logs.end(),
+            [](const NumberedLog& a, const NumberedLog& b) {
+              return a.number > b.number;
+            });
+
+  DWORD kept = 0;
+  ULONGLONG keptSize = 0;
+  bool pruning = false;
+  for (const NumberedLog& log : logs) {
+    if (mStopPruning.load()) {
+      return;
+    }
+    bool ofThisRun = mFirstLogOfRun && log.number >= mFirstLogOfRun;
+    // Once one log goes, every older one goes too.
+    pruning = pruning || kept >= mLogsToKeep ||
+              keptSize + log.size > mMaxTotalSize;
+    if (ofThisRun || !pruning) {
+      ++kept;
+      keptSize += log.size;
+      continue;
+    }
+
+    WCHAR path[MAX_PATH + 1];
+    wcsncpy_s(path, MAX_PATH + 1, mDirectory, MAX_PATH);
+    if (PathAppendSafe(path, log.fileName) && !DeleteFileW(path)) {
+      LOG_WARN(("Could not delete old log %ls.  (%lu)", log.fileName,
+                GetLastError()));
+    }
+  }
+}
+
+DWORD WINAPI LogRotation::PruneThreadProc(LPVOID param) {
+  SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+  static_cast<LogRotation*>(param)->Prune();
+  return 0;
+}
+
+/**
+ * Prunes old logs on a low priority thread so it doesn't hold up starting
+ * the service. FinishPruning must be called before the log is finished.
+ *
+ * @return TRUE if the thread was started.
+ */
+BOOL LogRotation::StartPruning() {
+  if (mPruneThread) {
+    return FALSE;
+  }
+  mStopPruning.store(false);
+  mPruneThread =
+      CreateThread(nullptr, 0, PruneThreadProc, this, 0, nullptr);
+  return mPruneThread ? TRUE : FALSE;
+}
+
+/**
+ * Stops the pruning thread after the log it is deleting and waits for it, so
+ * it doesn't log after the log is finished.
+ *
+ * @param  timeoutMS How long to wait for the thread
+ * @return TRUE if no pruning thread is left running.
+ */
+BOOL LogRotation::FinishPruning(DWORD timeoutMS) {
+  if (!mPruneThread) {
+    return TRUE;
+  }
+  mStopPruning.store(true);
+  if (WaitForSingleObject(mPruneThread, timeoutMS) != WAIT_OBJECT_0) {
+    return FALSE;
+  }
+  CloseHandle(mPruneThread);
+  mPruneThread = nullptr;
+  return TRUE;
+}
@@ -0,0 +1,47 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _LOGROTATION_H_
+#define _LOGROTATION_H_
+
+#include <windows.h>
+#include <atomic>
+
+#define LOG_PREFIX_LENGTH 64
+
+/**
+ * Numbered logs: every log gets the next number from a small index file,
+ * <prefix>-<number>.log, so starting a new log never renames the old ones.
+ * Old logs are deleted by Prune once there are too many of them or they
+ * take up too much space.
+ */
+class LogRotation {
+ public:
+  LogRotation(LPCWSTR directory, LPCWSTR prefix, DWORD logsToKeep,
+              ULONGLONG maxTotalSize);
+  ~LogRotation();
+
+  BOOL NextLogPath(LPWSTR path);
+  void Prune();
+  BOOL StartPruning();
+  BOOL FinishPruning(DWORD timeoutMS);
+
+ private:
+  BOOL GetLogPath(ULONGLONG number, LPWSTR path) const;
+  BOOL ParseLogNumber(LPCWSTR fileName, ULONGLONG& number) const;
+  ULONGLONG FindHighestLogNumber() const;
+  static DWORD WINAPI PruneThreadProc(LPVOID param);
+
+  WCHAR mDirectory[MAX_PATH + 1];
+  WCHAR mPrefix[LOG_PREFIX_LENGTH];
+  DWORD mLogsToKeep;
+  ULONGLONG mMaxTotalSize;
+  // The first log of this run, it and everything after it is never pruned.
+  ULONGLONG mFirstLogOfRun;
+  HANDLE mPruneThread;
+  // Set by FinishPruning, Prune stops deleting logs once it is set.
+  std::atomic<bool> mStopPruning;
+};
+
+#endif
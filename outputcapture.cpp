@@ -0,0 +1,336 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "outputcapture.h"
+
+/**
+ * Adds output to the current line, handing on every completed line. Carriage
+ * returns are dropped so "\r\n" ends a line like "\n" does.
+ */
+void OutputLineFramer::Append(const char* data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    char c = data[i];
+    if ('\n' == c) {
+      EmitLine();
+    } else if ('\r' != c) {
+      if (OUTPUT_LINE_MAX == mLength) {
+        EmitLine();
+      }
+      mLine[mLength++] = c;
+    }
+  }
+}
+
+/**
+ * Hands on a last line which wasn't terminated.
+ */
+void OutputLineFramer::Finish() {
+  if (mLength) {
+    EmitLine();
+  }
+}
+
+void OutputLineFramer::EmitLine() {
+  if (!mLength) {
+    return;
+  }
+  if (mLogged + mLength > mMaxLogged) {
+    // Once over the limit nothing more is logged, so the log isn't left with
+    // only the odd short line.
+    mLogged = mMaxLogged;
+    mDropped += mLength;
+  } else {
+    mHandler(mContext, mLine, mLength);
+    mLogged += mLength;
+  }
+  mLength = 0;
+}
+
+#ifdef _WIN32
+#include <stdio.h>
+#include <atomic>
+
+#define OUTPUT_PIPE_BUFFER (64 * 1024)
+
+OutputCapture::OutputCapture() : mAttributes(nullptr) {
+  mStreams[0].name = "stdout";
+  mStreams[1].name = "stderr";
+  for (Stream& stream : mStreams) {
+    ZeroMemory(&stream.overlapped, sizeof(stream.overlapped));
+    stream.open = false;
+  }
+}
+
+OutputCapture::~OutputCapture() {
+  if (mThread) {
+    SetEvent(mStopEvent.get());
+    WaitForSingleObject(mThread.get(), INFINITE);
+  }
+  if (mAttributes) {
+    DeleteProcThreadAttributeList(mAttributes);
+    HeapFree(GetProcessHeap(), 0, mAttributes);
+  }
+}
+
+/**
+ * Creates an overlapped pipe to read from and an inheritable handle to
+ * write to it for the child. Anonymous pipes can't be overlapped, so the
+ * pipe is named after this process and a counter.
+ */
+BOOL OutputCapture::CreateStream(Stream& stream) {
+  static std::atomic<unsigned long> pipeCounter(0);
+  wchar_t pipeName[64];
+  swprintf_s(pipeName, L"\\\\.\\pipe\\AveoSystemsUpdate-output-%lu-%lu",
+             GetCurrentProcessId(), pipeCounter.fetch_add(1));
+
+  // Only the first instance, so no other process can have made the pipe.
+  stream.read.reset(CreateNamedPipeW(
+      pipeName,
+      PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+          PIPE_REJECT_REMOTE_CLIENTS,
+      1, 0, OUTPUT_PIPE_BUFFER, 0, nullptr));
+  if (INVALID_HANDLE_VALUE == stream.read.get()) {
+    return FALSE;
+  }
+
+  SECURITY_ATTRIBUTES inheritable = {sizeof(inheritable), nullptr, TRUE};
+  stream.write.reset(CreateFileW(pipeName, GENERIC_WRITE, 0, &inheritable,
+                                 OPEN_EXISTING, 0, nullptr));
+  if (INVALID_HANDLE_VALUE == stream.write.get()) {
+    return FALSE;
+  }
+
+  stream.event.reset(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  if (!stream.event) {
+    return FALSE;
+  }
+  stream.overlapped.hEvent = stream.event.get();
+  stream.open = true;
+  return TRUE;
+}
+
+/**
+ * Sets up the pipes and points the standard handles of the child at them.
+ * The child inherits only those handles, nothing else the service has open.
+ *
+ * @param  si The startup info for the child, left as it was on failure
+ * @return TRUE if the child must be created with inheritable handles and
+ *         EXTENDED_STARTUPINFO_PRESENT.
+ */
+BOOL OutputCapture::PrepareStartupInfo(STARTUPINFOEXW& si) {
+  mStopEvent.reset(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  if (!mStopEvent) {
+    LOG_WARN(("Could not create the updater output stop event.  (%lu)",
+              GetLastError()));
+    return FALSE;
+  }
+
+  SECURITY_ATTRIBUTES inheritable = {sizeof(inheritable), nullptr, TRUE};
+  mNul.reset(CreateFileW(L"NUL", GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, &inheritable,
+                         OPEN_EXISTING, 0, nullptr));
+  if (INVALID_HANDLE_VALUE == mNul.get()) {
+    LOG_WARN(("Could not open NUL for the updater input.  (%lu)",
+              GetLastError()));
+    return FALSE;
+  }
+
+  for (Stream& stream : mStreams) {
+    if (!CreateStream(stream)) {
+      LOG_WARN(("Could not create the pipe for the updater %s.  (%lu)",
+                stream.name, GetLastError()));
+      return FALSE;
+    }
+  }
+
+  SIZE_T size = 0;
+  InitializeProcThreadAttributeList(nullptr, 1, 0, &size);
+  mAttributes = static_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(
+      HeapAlloc(GetProcessHeap(), 0, size));
+  if (!mAttributes) {
+    LOG_WARN(("Could not allocate the updater attribute list."));
+    return FALSE;
+  }
+  if (!InitializeProcThreadAttributeList(mAttributes, 1, 0, &size)) {
+    LOG_WARN(("Could not initialize the updater attribute list.  (%lu)",
+              GetLastError()));
+    HeapFree(GetProcessHeap(), 0, mAttributes);
+    mAttributes = nullptr;
+    return FALSE;
+  }
+  mInherited[0] = mNul.get();
+  mInherited[1] = mStreams[0].write.get();
+  mInherited[2] = mStreams[1].write.get();
+  if (!UpdateProcThreadAttribute(mAttributes, 0,
+                                 PROC_THREAD_ATTRIBUTE_HANDLE_LIST, mInherited,
+                                 sizeof(mInherited), nullptr, nullptr)) {
+    LOG_WARN(("Could not restrict the handles the updater inherits.  (%lu)",
+              GetLastError()));
+    return FALSE;
+  }
+
+  si.StartupInfo.cb = sizeof(si);
+  si.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+  si.StartupInfo.hStdInput = mNul.get();
+  si.StartupInfo.hStdOutput = mStreams[0].write.get();
+  si.StartupInfo.hStdError = mStreams[1].write.get();
+  si.lpAttributeList = mAttributes;
+  return TRUE;
+}
+
+/**
+ * Starts reading once the child was created. Our copies of the child's
+ * handles are closed, so the pipes break as soon as the child and anything
+ * it passed them on to are done with them.
+ *
+ * @return FALSE if the output can't be read, the pipes are then closed so
+ *         the child gets errors writing to them instead of blocking.
+ */
+BOOL OutputCapture::Start() {
+  mNul.reset();
+  for (Stream& stream : mStreams) {
+    stream.write.reset();
+  }
+
+  mThread.reset(CreateThread(nullptr, 0, ReaderThreadProc, this, 0, nullptr));
+  if (!mThread) {
+    LOG_WARN(("Could not start reading the updater output.  (%lu)",
+              GetLastError()));
+    for (Stream& stream : mStreams) {
+      stream.read.reset();
+      stream.open = false;
+    }
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * Waits for the rest of the output once the child exited. Processes it
+ * started may have inherited the pipes and keep them open for much longer,
+ * so after graceMS the reader gives up on them.
+ */
+void OutputCapture::Finish(DWORD graceMS) {
+  if (!mThread) {
+    return;
+  }
+  if (WAIT_TIMEOUT == WaitForSingleObject(mThread.get(), graceMS)) {
+    LOG(("The updater output is still open after %lu ms, no longer reading "
+         "it.",
+         graceMS));
+    SetEvent(mStopEvent.get());
+    WaitForSingleObject(mThread.get(), INFINITE);
+  }
+  mThread.reset();
+}
+
+/**
+ * Starts an overlapped read, its completion signals the stream's event.
+ *
+ * @return FALSE if the stream is done.
+ */
+BOOL OutputCapture::IssueRead(Stream& stream) {
+  if (!ReadFile(stream.read.get(), stream.buffer, sizeof(stream.buffer),
+                nullptr, &stream.overlapped) &&
+      ERROR_IO_PENDING != GetLastError()) {
+    DWORD lastError = GetLastError();
+    if (ERROR_BROKEN_PIPE != lastError) {
+      LOG_WARN(("Could not read the updater %s.  (%lu)", stream.name,
+                lastError));
+    }
+    stream.open = false;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void OutputCapture::LogLine(void* context, const char* line, size_t length) {
+  const Stream* stream = static_cast<const Stream*>(context);
+  LOG(("updater %s: %.*s", stream->name, static_cast<int>(length), line));
+}
+
+DWORD WINAPI OutputCapture::ReaderThreadProc(LPVOID param) {
+  static_cast<OutputCapture*>(param)->RunReader();
+  return 0;
+}
+
+/**
+ * Reads both pipes until they break or the reader is stopped. Reading never
+ * waits on anything but the log, and past OUTPUT_LOG_MAX not even on that,
+ * so the child is held up at most while the log catches up.
+ */
+void OutputCapture::RunReader() {
+  OutputLineFramer framers[2] = {
+      OutputLineFramer(OUTPUT_LOG_MAX, LogLine, &mStreams[0]),
+      OutputLineFramer(OUTPUT_LOG_MAX, LogLine, &mStreams[1])};
+
+  for (Stream& stream : mStreams) {
+    IssueRead(stream);
+  }
+
+  for (;;) {
+    HANDLE waitHandles[3];
+    size_t streamIndex[3];
+    DWORD count = 0;
+    waitHandles[count++] = mStopEvent.get();
+    for (size_t i = 0; i < 2; ++i) {
+      if (mStreams[i].open) {
+        streamIndex[count] = i;
+        waitHandles[count++] = mStreams[i].event.get();
+      }
+    }
+    if (1 == count) {
+      break;
+    }
+
+    DWORD waitRes = WaitForMultipleObjects(count, waitHandles, FALSE, INFINITE);
+    if (WAIT_OBJECT_0 == waitRes) {
+      break;
+    }
+    if (waitRes >= WAIT_OBJECT_0 + count) {
+      LOG_WARN(("Could not wait on the updater output.  (%lu)",
+                GetLastError()));
+      break;
+    }
+
+    size_t i = streamIndex[waitRes - WAIT_OBJECT_0];
+    Stream& stream = mStreams[i];
+    DWORD bytesRead = 0;
+    if (GetOverlappedResult(stream.read.get(), &stream.overlapped, &bytesRead,
+                            FALSE)) {
+      framers[i].Append(stream.buffer, bytesRead);
+      IssueRead(stream);
+    } else {
+      DWORD lastError = GetLastError();
+      if (ERROR_BROKEN_PIPE != lastError) {
+        LOG_WARN(("Could not read the updater %s.  (%lu)", stream.name,
+                  lastError));
+      }
+      stream.open = false;
+    }
+  }
+
+  for (size_t i = 0; i < 2; ++i) {
+    Stream& stream = mStreams[i];
+    if (stream.open) {
+      // The buffer must not go away with a read still pending. A read which
+      // completed before it was cancelled still counts.
+      CancelIoEx(stream.read.get(), &stream.overlapped);
+      DWORD bytesRead = 0;
+      if (GetOverlappedResult(stream.read.get(), &stream.overlapped,
+                              &bytesRead, TRUE)) {
+        framers[i].Append(stream.buffer, bytesRead);
+      }
+      stream.open = false;
+    }
+    framers[i].Finish();
+    if (framers[i].Dropped()) {
+      LOG_WARN(("%llu bytes of the updater %s were not logged.",
+                static_cast<unsigned long long>(framers[i].Dropped()),
+                stream.name));
+    }
+  }
+}
+#endif
@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _OUTPUTCAPTURE_H_
+#define _OUTPUTCAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longer lines are split.
+#define OUTPUT_LINE_MAX 512
+// Output past this many bytes per process is read but not logged.
+#define OUTPUT_LOG_MAX (1024 * 1024)
+
+/**
+ * Splits the output of a process into lines. At most maxLogged bytes are
+ * handed on, the rest is only counted so the process is never held up.
+ */
+class OutputLineFramer {
+ public:
+  typedef void (*LineHandler)(void* context, const char* line, size_t length);
+
+  OutputLineFramer(size_t maxLogged, LineHandler handler, void* context)
+      : mLength(0),
+        mLogged(0),
+        mMaxLogged(maxLogged),
+        mDropped(0),
+        mHandler(handler),
+        mContext(context) {}
+
+  void Append(const char* data, size_t size);
+  void Finish();
+  uint64_t Dropped() const { return mDropped; }
+
+ private:
+  void EmitLine();
+
+  char mLine[OUTPUT_LINE_MAX];
+  size_t mLength;
+  size_t mLogged;
+  size_t mMaxLogged;
+  uint64_t mDropped;
+  LineHandler mHandler;
+  void* mContext;
+};
+
+#ifdef _WIN32
+#include <windows.h>
+#include "updatecommon.h"
+
+/**
+ * Captures the stdout and stderr of a child process into the log. Both are
+ * overlapped pipes drained by a reader thread, so a noisy child never
+ * blocks on a full pipe and the log never holds up the child.
+ */
+class OutputCapture {
+ public:
+  OutputCapture();
+  ~OutputCapture();
+
+  OutputCapture(const OutputCapture&) = delete;
+  OutputCapture& operator=(const OutputCapture&) = delete;
+
+  BOOL PrepareStartupInfo(STARTUPINFOEXW& si);
+  BOOL Start();
+  void Finish(DWORD graceMS);
+
+ private:
+  struct Stream {
+    const char* name;
+    autoHandle read;
+    autoHandle write;
+    autoHandle event;
+    OVERLAPPED overlapped;
+    bool open;
+    char buffer[4096];
+  };
+
+  BOOL CreateStream(Stream& stream);
+  BOOL IssueRead(Stream& stream);
+  void RunReader();
+  static DWORD WINAPI ReaderThreadProc(LPVOID param);
+  static void LogLine(void* context, const char* line, size_t length);
+
+  Stream mStreams[2];
+  autoHandle mNul;
+  autoHandle mStopEvent;
+  autoHandle mThread;
+  LPPROC_THREAD_ATTRIBUTE_LIST mAttributes;
+  HANDLE mInherited[3];
+};
+#endif
+
+#endif
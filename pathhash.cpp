@@ -3,81 +3,180 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <windows.h>
-#include <wincrypt.h>
+#include <stdint.h>
 #include "pathhash.h"
 
+#define MD5_DIGEST_LENGTH 16
+#define MD5_BLOCK_SIZE 64
+
+namespace {
+
+// Per round shift amounts and sine derived constants from RFC 1321.
+constexpr uint32_t kMD5Shifts[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+constexpr uint32_t kMD5Constants[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+
+constexpr char kHexDigits[] = "0123456789abcdef";
+
 /**
- * Converts a binary sequence into a hex string
- *
- * @param hash      The binary data sequence
- * @param hashSize  The size of the binary data sequence
- * @param hexString A buffer to store the hex string, must be of
- *                  size 2 * @hashSize
+ * A plain MD5 implementation. The registry key of an installation only needs
+ * a stable name for its path, this isn't used for anything security related.
+ * Everything is constexpr so it can also be evaluated at compile time.
  */
-static void BinaryDataToHexString(const BYTE* hash, DWORD& hashSize,
-                                  LPWSTR hexString) {
-  WCHAR* p = hexString;
-  for (DWORD i = 0; i < hashSize; ++i) {
-    wsprintfW(p, L"%.2x", hash[i]);
-    p += 2;
+class MD5 {
+ public:
+  constexpr MD5()
+      : mState{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476},
+        mBuffer{},
+        mLength(0) {}
+
+  constexpr void Update(const uint8_t* data, size_t size) {
+    size_t used = static_cast<size_t>(mLength % MD5_BLOCK_SIZE);
+    mLength += size;
+    for (size_t i = 0; i < size; ++i) {
+      mBuffer[used++] = data[i];
+      if (used == MD5_BLOCK_SIZE) {
+        Transform(mBuffer);
+        used = 0;
+      }
+    }
   }
-}
 
-/**
- * Calculates an MD5 hash for the given input binary data
- *
- * @param  data     Any sequence of bytes
- * @param  dataSize The number of bytes inside @data
- * @param  hash     Output buffer to store hash, must be freed by the caller
- * @param  hashSize The number of bytes in the output buffer
- * @return TRUE on success
- */
-static BOOL CalculateMD5(const char* data, DWORD dataSize, BYTE** hash,
-                         DWORD& hashSize) {
-  HCRYPTPROV hProv = 0;
-  HCRYPTHASH hHash = 0;
-
-  if (!CryptAcquireContext(&hProv, nullptr, nullptr, PROV_RSA_FULL,
-                           CRYPT_VERIFYCONTEXT)) {
-    if ((DWORD)NTE_BAD_KEYSET != GetLastError()) {
-      return FALSE;
+  constexpr void Finish(uint8_t digest[MD5_DIGEST_LENGTH]) {
+    uint64_t bitLength = mLength * 8;
+    const uint8_t padding[1] = {0x80};
+    Update(padding, 1);
+    const uint8_t zero[1] = {0};
+    while (mLength % MD5_BLOCK_SIZE != MD5_BLOCK_SIZE - 8) {
+      Update(zero, 1);
+    }
+    uint8_t length[8] = {};
+    for (int i = 0; i < 8; ++i) {
+      length[i] = static_cast<uint8_t>(bitLength >> (8 * i));
     }
+    Update(length, 8);
 
-    // Maybe it doesn't exist, try to create it.
-    if (!CryptAcquireContext(&hProv, nullptr, nullptr, PROV_RSA_FULL,
-                             CRYPT_VERIFYCONTEXT | CRYPT_NEWKEYSET)) {
-      return FALSE;
+    for (int i = 0; i < MD5_DIGEST_LENGTH; ++i) {
+      digest[i] = static_cast<uint8_t>(mState[i / 4] >> (8 * (i % 4)));
     }
   }
 
-  if (!CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash)) {
-    return FALSE;
+ private:
+  static constexpr uint32_t RotateLeft(uint32_t value, uint32_t shift) {
+    return (value << shift) | (value >> (32 - shift));
   }
 
-  if (!CryptHashData(hHash, reinterpret_cast<const BYTE*>(data), dataSize, 0)) {
-    return FALSE;
-  }
+  constexpr void Transform(const uint8_t block[MD5_BLOCK_SIZE]) {
+    uint32_t words[16] = {};
+    for (int i = 0; i < 16; ++i) {
+      words[i] = static_cast<uint32_t>(block[i * 4]) |
+                 (static_cast<uint32_t>(block[i * 4 + 1]) << 8) |
+                 (static_cast<uint32_t>(block[i * 4 + 2]) << 16) |
+                 (static_cast<uint32_t>(block[i * 4 + 3]) << 24);
+    }
 
-  DWORD dwCount = sizeof(DWORD);
-  if (!CryptGetHashParam(hHash, HP_HASHSIZE, (BYTE*)&hashSize, &dwCount, 0)) {
-    return FALSE;
-  }
+    uint32_t a = mState[0];
+    uint32_t b = mState[1];
+    uint32_t c = mState[2];
+    uint32_t d = mState[3];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t f = 0;
+      int g = 0;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      uint32_t next = d;
+      d = c;
+      c = b;
+      b = b + RotateLeft(a + f + kMD5Constants[i] + words[g], kMD5Shifts[i]);
+      a = next;
+    }
 
-  *hash = new BYTE[hashSize];
-  ZeroMemory(*hash, hashSize);
-  if (!CryptGetHashParam(hHash, HP_HASHVAL, *hash, &hashSize, 0)) {
-    return FALSE;
+    mState[0] += a;
+    mState[1] += b;
+    mState[2] += c;
+    mState[3] += d;
   }
 
-  if (hHash) {
-    CryptDestroyHash(hHash);
-  }
+  uint32_t mState[4];
+  uint8_t mBuffer[MD5_BLOCK_SIZE];
+  uint64_t mLength;
+};
 
-  if (hProv) {
-    CryptReleaseContext(hProv, 0);
+/**
+ * Hashes the lowercase UTF-16LE bytes of a path, the same bytes the
+ * lowercased copy of the path used to be hashed from. Only ASCII letters
+ * are lowercased, like _wcslwr_s does in the "C" locale the service runs in.
+ *
+ * @param path       The path to hash
+ * @param pathLength The number of characters of @path to hash
+ * @param digest     Output buffer for the hash
+ */
+constexpr void CalculateLowercasePathMD5(const wchar_t* path,
+                                         size_t pathLength,
+                                         uint8_t digest[MD5_DIGEST_LENGTH]) {
+  MD5 md5;
+  uint8_t chunk[MD5_BLOCK_SIZE] = {};
+  size_t chunkSize = 0;
+  for (size_t i = 0; i < pathLength; ++i) {
+    uint16_t ch = static_cast<uint16_t>(path[i]);
+    if (ch >= L'A' && ch <= L'Z') {
+      ch = static_cast<uint16_t>(ch - L'A' + L'a');
+    }
+    chunk[chunkSize++] = static_cast<uint8_t>(ch);
+    chunk[chunkSize++] = static_cast<uint8_t>(ch >> 8);
+    if (chunkSize == sizeof(chunk)) {
+      md5.Update(chunk, chunkSize);
+      chunkSize = 0;
+    }
   }
+  md5.Update(chunk, chunkSize);
+  md5.Finish(digest);
+}
 
-  return TRUE;
+}  // namespace
+
+/**
+ * Converts a binary sequence into a hex string
+ *
+ * @param hash      The binary data sequence
+ * @param hashSize  The size of the binary data sequence
+ * @param hexString A buffer to store the hex string, must be of
+ *                  size 2 * @hashSize + 1
+ */
+static void BinaryDataToHexString(const BYTE* hash, DWORD hashSize,
+                                  LPWSTR hexString) {
+  WCHAR* p = hexString;
+  for (DWORD i = 0; i < hashSize; ++i) {
+    *p++ = kHexDigits[hash[i] >> 4];
+    *p++ = kHexDigits[hash[i] & 0xf];
+  }
+  *p = L'\0';
 }
 
 /**
@@ -100,27 +199,14 @@ BOOL CalculateRegistryPathFromFilePath(const LPCWSTR filePath,
     filePathLen--;
   }
 
-  // Copy in the full path into our own buffer.
-  // Copying in the extra slash is OK because we calculate the hash
-  // based on the filePathLen which excludes the slash.
-  // +2 to account for the possibly trailing slash and the null terminator.
-  WCHAR* lowercasePath = new WCHAR[filePathLen + 2];
-  memset(lowercasePath, 0, (filePathLen + 2) * sizeof(WCHAR));
-  wcsncpy_s(lowercasePath, filePathLen + 2, filePath, filePathLen + 1);
-  _wcslwr_s(lowercasePath, filePathLen + 2);
-
-  BYTE* hash;
-  DWORD hashSize = 0;
-  if (!CalculateMD5(reinterpret_cast<const char*>(lowercasePath),
-      static_cast<DWORD>(filePathLen * 2), &hash, hashSize)) {
-    delete[] lowercasePath;
-    return FALSE;
-  }
-  delete[] lowercasePath;
+  BYTE hash[MD5_DIGEST_LENGTH];
+  CalculateLowercasePathMD5(filePath, filePathLen, hash);
 
-  LPCWSTR baseRegPath = L"SOFTWARE\\Aveo Systems\\Update Service\\";
-  wcsncpy_s(registryPath, MAX_PATH + 1, baseRegPath, MAX_PATH);
-  BinaryDataToHexString(hash, hashSize, registryPath + wcslen(baseRegPath));
-  delete[] hash;
+  static const WCHAR baseRegPath[] = L"SOFTWARE\\Aveo Systems\\Update Service\\";
+  const size_t baseRegPathLen = _countof(baseRegPath) - 1;
+  static_assert(_countof(baseRegPath) + 2 * MD5_DIGEST_LENGTH <= MAX_PATH + 1,
+                "The registry path must fit in MAX_PATH");
+  memcpy(registryPath, baseRegPath, baseRegPathLen * sizeof(WCHAR));
+  BinaryDataToHexString(hash, MD5_DIGEST_LENGTH, registryPath + baseRegPathLen);
   return TRUE;
 }
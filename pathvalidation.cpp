@@ -0,0 +1,160 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string.h>
+#include <wchar.h>
+
+#include "pathvalidation.h"
+
+static wchar_t FoldCase(wchar_t c) {
+  return (c >= L'A' && c <= L'Z') ? static_cast<wchar_t>(c - L'A' + L'a') : c;
+}
+
+std::wstring PathValidationMemo::Key(const wchar_t* path) {
+  std::wstring key(path);
+  for (wchar_t& c : key) {
+    c = FoldCase(c);
+  }
+  return key;
+}
+
+/**
+ * @return true if path was validated before and still leads to id.
+ */
+bool PathValidationMemo::Lookup(const wchar_t* path, const PathFileId& id) {
+  std::wstring key = Key(path);
+  std::lock_guard<std::mutex> lock(mLock);
+  auto it = mValidated.find(key);
+  if (it == mValidated.end()) {
+    return false;
+  }
+  if (it->second.volume != id.volume ||
+      memcmp(it->second.file, id.file, sizeof(id.file))) {
+    // Something else is there now, it has to be validated again.
+    mValidated.erase(it);
+    return false;
+  }
+  return true;
+}
+
+void PathValidationMemo::Store(const wchar_t* path, const PathFileId& id) {
+  std::wstring key = Key(path);
+  std::lock_guard<std::mutex> lock(mLock);
+  mValidated[key] = id;
+}
+
+void PathValidationMemo::Clear() {
+  std::lock_guard<std::mutex> lock(mLock);
+  mValidated.clear();
+}
+
+/**
+ * Compares a path with the final path of what it opened, as
+ * GetFinalPathNameByHandleW returns it. Only ASCII case differences are
+ * ignored, anything else counts as different.
+ *
+ * @return true if the path led there without any link or alternate name.
+ */
+bool IsSameFinalPath(const wchar_t* path, const wchar_t* finalPath) {
+  static const wchar_t kUNCPrefix[] = L"\\\\?\\UNC\\";
+  static const wchar_t kLocalPrefix[] = L"\\\\?\\";
+  const size_t uncPrefixLength = wcslen(kUNCPrefix);
+  const size_t localPrefixLength = wcslen(kLocalPrefix);
+
+  if (!wcsncmp(finalPath, kUNCPrefix, uncPrefixLength)) {
+    // \\?\UNC\server\share is \\server\share
+    if (path[0] != L'\\' || path[1] != L'\\') {
+      return false;
+    }
+    path += 2;
+    finalPath += uncPrefixLength;
+  } else if (!wcsncmp(finalPath, kLocalPrefix, localPrefixLength)) {
+    finalPath += localPrefixLength;
+  }
+
+  for (; *path && *finalPath; ++path, ++finalPath) {
+    if (FoldCase(*path) != FoldCase(*finalPath)) {
+      return false;
+    }
+  }
+  return *path == *finalPath;
+}
+
+#ifdef _WIN32
+#include <windows.h>
+
+#include "updatecommon.h"
+
+bool PathContainsInvalidLinks(wchar_t* const fullPath);
+
+static PathValidationMemo gValidatedPaths;
+
+static bool GetPathFileId(HANDLE file, PathFileId& id) {
+  ZeroMemory(&id, sizeof(id));
+  FILE_ID_INFO idInfo;
+  if (GetFileInformationByHandleEx(file, FileIdInfo, &idInfo,
+                                   sizeof(idInfo))) {
+    id.volume = idInfo.VolumeSerialNumber;
+    static_assert(sizeof(id.file) == sizeof(idInfo.FileId.Identifier),
+                  "FILE_ID_128 fits");
+    memcpy(id.file, idInfo.FileId.Identifier, sizeof(id.file));
+    return true;
+  }
+
+  // FileIdInfo isn't supported by every file system.
+  BY_HANDLE_FILE_INFORMATION fileInfo;
+  if (!GetFileInformationByHandle(file, &fileInfo)) {
+    return false;
+  }
+  id.volume = fileInfo.dwVolumeSerialNumber;
+  memcpy(id.file, &fileInfo.nFileIndexLow, sizeof(DWORD));
+  memcpy(id.file + sizeof(DWORD), &fileInfo.nFileIndexHigh, sizeof(DWORD));
+  return true;
+}
+
+/**
+ * Checks that a canonical full path has no links, other than those to local
+ * paths which PathContainsInvalidLinks allows.
+ *
+ * The path is opened once and its final path compared with it. When they
+ * match nothing on the way was a link, whatever the depth of the path. Only
+ * when they don't, or the path doesn't exist, is each component looked at.
+ * Paths found valid are remembered for the run, bound to what they led to.
+ *
+ * @param  fullPath The canonical full path to check
+ * @return true if the path can be used.
+ */
+bool PathHasOnlyAllowedLinks(const wchar_t* fullPath) {
+  autoHandle path(CreateFileW(
+      fullPath, FILE_READ_ATTRIBUTES,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr));
+  PathFileId id;
+  bool identified =
+      INVALID_HANDLE_VALUE != path.get() && GetPathFileId(path.get(), id);
+  if (identified) {
+    if (gValidatedPaths.Lookup(fullPath, id)) {
+      return true;
+    }
+
+    wchar_t finalPath[MAXPATHLEN + 8];
+    DWORD length = GetFinalPathNameByHandleW(
+        path.get(), finalPath, ARRAYSIZE(finalPath),
+        FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+    if (length && length < ARRAYSIZE(finalPath) &&
+        IsSameFinalPath(fullPath, finalPath)) {
+      gValidatedPaths.Store(fullPath, id);
+      return true;
+    }
+  }
+
+  if (PathContainsInvalidLinks(const_cast<wchar_t*>(fullPath))) {
+    return false;
+  }
+  if (identified) {
+    gValidatedPaths.Store(fullPath, id);
+  }
+  return true;
+}
+#endif
@@ -0,0 +1,44 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _PATHVALIDATION_H_
+#define _PATHVALIDATION_H_
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Identifies a file or directory for as long as it exists, so a path which
+// now leads somewhere else is noticed.
+struct PathFileId {
+  uint64_t volume;
+  uint8_t file[16];
+};
+
+/**
+ * The paths which were found free of disallowed links during this run,
+ * with the file or directory each led to. A path is only taken as valid
+ * again while it still leads to the same one.
+ */
+class PathValidationMemo {
+ public:
+  bool Lookup(const wchar_t* path, const PathFileId& id);
+  void Store(const wchar_t* path, const PathFileId& id);
+  void Clear();
+
+ private:
+  static std::wstring Key(const wchar_t* path);
+
+  std::mutex mLock;
+  std::unordered_map<std::wstring, PathFileId> mValidated;
+};
+
+bool IsSameFinalPath(const wchar_t* path, const wchar_t* finalPath);
+
+#ifdef _WIN32
+bool PathHasOnlyAllowedLinks(const wchar_t* fullPath);
+#endif
+
+#endif
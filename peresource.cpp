@@ -0,0 +1,423 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <stddef.h>
+#include <string.h>
+#include <memory>
+
+#include "peresource.h"
+#include "updatecommon.h"
+
+// The DOS header, PE headers and section table of any image we care about
+// fit well within this much of the start of the file.
+#define PE_HEADERS_VIEW_SIZE (64 * 1024)
+
+struct ResourceViewDeleter {
+  void operator()(void* view) const {
+    if (view) {
+      UnmapViewOfFile(view);
+    }
+  }
+};
+typedef std::unique_ptr<void, ResourceViewDeleter> autoResourceView;
+
+struct PEHeaders {
+  const IMAGE_SECTION_HEADER* sections;
+  WORD numberOfSections;
+  DWORD resourceRVA;
+  ULONGLONG sectionTableEnd;
+};
+
+/**
+ * Bounds checked access to the mapped image.
+ *
+ * @return a pointer to size bytes at offset, or nullptr if any of them fall
+ *         outside of the image.
+ */
+static const BYTE* ImageAt(const BYTE* image, size_t imageSize,
+                           ULONGLONG offset, ULONGLONG size) {
+  if (offset > imageSize || size > imageSize - offset) {
+    return nullptr;
+  }
+  return image + offset;
+}
+
+/**
+ * Locates the section table and the resource data directory.
+ *
+ * @return TRUE if the image has valid PE headers.
+ */
+static BOOL ParsePEHeaders(const BYTE* image, size_t imageSize,
+                           PEHeaders& headers) {
+  const IMAGE_DOS_HEADER* dosHeader = reinterpret_cast<const IMAGE_DOS_HEADER*>(
+      ImageAt(image, imageSize, 0, sizeof(IMAGE_DOS_HEADER)));
+  if (!dosHeader || dosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
+    return FALSE;
+  }
+
+  ULONGLONG ntOffset = static_cast<DWORD>(dosHeader->e_lfanew);
+  const BYTE* ntHeaders = ImageAt(image, imageSize, ntOffset,
+                                  sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER));
+  if (!ntHeaders ||
+      *reinterpret_cast<const DWORD*>(ntHeaders) != IMAGE_NT_SIGNATURE) {
+    return FALSE;
+  }
+
+  const IMAGE_FILE_HEADER* fileHeader =
+      reinterpret_cast<const IMAGE_FILE_HEADER*>(ntHeaders + sizeof(DWORD));
+  ULONGLONG optionalOffset =
+      ntOffset + sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER);
+  const BYTE* optionalHeader = ImageAt(image, imageSize, optionalOffset,
+                                       fileHeader->SizeOfOptionalHeader);
+  if (!optionalHeader || fileHeader->SizeOfOptionalHeader < sizeof(WORD)) {
+    return FALSE;
+  }
+
+  // The data directories are at a different offset in PE32 and PE32+ images.
+  const IMAGE_DATA_DIRECTORY* dataDirectory = nullptr;
+  DWORD numberOfRvaAndSizes = 0;
+  size_t dataDirectoryOffset = 0;
+  WORD magic = *reinterpret_cast<const WORD*>(optionalHeader);
+  if (magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC &&
+      fileHeader->SizeOfOptionalHeader >= sizeof(IMAGE_OPTIONAL_HEADER32)) {
+    const IMAGE_OPTIONAL_HEADER32* header32 =
+        reinterpret_cast<const IMAGE_OPTIONAL_HEADER32*>(optionalHeader);
+    numberOfRvaAndSizes = header32->NumberOfRvaAndSizes;
+    dataDirectory = header32->DataDirectory;
+    dataDirectoryOffset = offsetof(IMAGE_OPTIONAL_HEADER32, DataDirectory);
+  } else if (magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC &&
+             fileHeader->SizeOfOptionalHeader >=
+                 sizeof(IMAGE_OPTIONAL_HEADER64)) {
+    const IMAGE_OPTIONAL_HEADER64* header64 =
+        reinterpret_cast<const IMAGE_OPTIONAL_HEADER64*>(optionalHeader);
+    numberOfRvaAndSizes = header64->NumberOfRvaAndSizes;
+    dataDirectory = header64->DataDirectory;
+    dataDirectoryOffset = offsetof(IMAGE_OPTIONAL_HEADER64, DataDirectory);
+  } else {
+    return FALSE;
+  }
+
+  headers.resourceRVA = 0;
+  if (numberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_RESOURCE &&
+      dataDirectoryOffset + (IMAGE_DIRECTORY_ENTRY_RESOURCE + 1) *
+                                sizeof(IMAGE_DATA_DIRECTORY) <=
+          fileHeader->SizeOfOptionalHeader) {
+    headers.resourceRVA =
+        dataDirectory[IMAGE_DIRECTORY_ENTRY_RESOURCE].VirtualAddress;
+  }
+
+  ULONGLONG sectionsOffset = optionalOffset + fileHeader->SizeOfOptionalHeader;
+  ULONGLONG sectionsSize = static_cast<ULONGLONG>(fileHeader->NumberOfSections) *
+                           sizeof(IMAGE_SECTION_HEADER);
+  headers.sections = reinterpret_cast<const IMAGE_SECTION_HEADER*>(
+      ImageAt(image, imageSize, sectionsOffset, sectionsSize));
+  if (!headers.sections) {
+    return FALSE;
+  }
+  headers.numberOfSections = fileHeader->NumberOfSections;
+  headers.sectionTableEnd = sectionsOffset + sectionsSize;
+  return TRUE;
+}
+
+/**
+ * Converts a relative virtual address to a file offset.
+ *
+ * @param  headers   The parsed PE headers
+ * @param  rva       The relative virtual address to convert
+ * @param  offset    Out parameter for the file offset
+ * @param  available Out parameter for the number of bytes of the section's
+ *                   raw data from offset onwards
+ * @return TRUE if the address is backed by a section's raw data.
+ */
+static BOOL RVAToFileOffset(const PEHeaders& headers, DWORD rva,
+                            ULONGLONG& offset, ULONGLONG& available) {
+  for (WORD i = 0; i < headers.numberOfSections; ++i) {
+    const IMAGE_SECTION_HEADER& section = headers.sections[i];
+    if (rva >= section.VirtualAddress &&
+        rva - section.VirtualAddress < section.SizeOfRawData) {
+      DWORD delta = rva - section.VirtualAddress;
+      offset = static_cast<ULONGLONG>(section.PointerToRawData) + delta;
+      available = section.SizeOfRawData - delta;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/**
+ * Finds an entry in a resource directory.
+ *
+ * @param  resources    The start of the resource section
+ * @param  resourceSize The number of bytes available in the resource section
+ * @param  dirOffset    The offset of the directory within the section
+ * @param  id           The integer ID to look for, or 0 for the first entry
+ * @param  entryData    Out parameter for the OffsetToData of the entry
+ * @return TRUE if the entry was found.
+ */
+static BOOL FindResourceDirectoryEntry(const BYTE* resources,
+                                       size_t resourceSize, DWORD dirOffset,
+                                       WORD id, DWORD& entryData) {
+  const IMAGE_RESOURCE_DIRECTORY* dir =
+      reinterpret_cast<const IMAGE_RESOURCE_DIRECTORY*>(ImageAt(
+          resources, resourceSize, dirOffset, sizeof(IMAGE_RESOURCE_DIRECTORY)));
+  if (!dir) {
+    return FALSE;
+  }
+
+  DWORD entryCount = dir->NumberOfNamedEntries + dir->NumberOfIdEntries;
+  const IMAGE_RESOURCE_DIRECTORY_ENTRY* entries =
+      reinterpret_cast<const IMAGE_RESOURCE_DIRECTORY_ENTRY*>(ImageAt(
+          resources, resourceSize,
+          static_cast<ULONGLONG>(dirOffset) + sizeof(IMAGE_RESOURCE_DIRECTORY),
+          static_cast<ULONGLONG>(entryCount) *
+              sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY)));
+  if (!entries) {
+    return FALSE;
+  }
+
+  if (id == 0) {
+    if (entryCount == 0) {
+      return FALSE;
+    }
+    entryData = entries[0].OffsetToData;
+    return TRUE;
+  }
+
+  // Named entries always come first, we only look up integer IDs.
+  for (DWORD i = dir->NumberOfNamedEntries; i < entryCount; ++i) {
+    if (!(entries[i].Name & IMAGE_RESOURCE_NAME_IS_STRING) &&
+        static_cast<WORD>(entries[i].Name) == id) {
+      entryData = entries[i].OffsetToData;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/**
+ * Determines how much of the start of a PE file holds its headers and
+ * section data. Anything past this, such as the payload NSIS appends to its
+ * installers, doesn't need to be mapped to read resources.
+ *
+ * @param  image     A view of at least the PE headers and section table
+ * @param  imageSize The size of the view
+ * @param  extent    Out parameter for the end of the last section's raw data
+ * @return TRUE if the view starts with valid PE headers.
+ */
+BOOL GetPEImageExtent(const BYTE* image, size_t imageSize, ULONGLONG& extent) {
+  PEHeaders headers;
+  if (!ParsePEHeaders(image, imageSize, headers)) {
+    SetLastError(ERROR_BAD_EXE_FORMAT);
+    return FALSE;
+  }
+
+  extent = headers.sectionTableEnd;
+  for (WORD i = 0; i < headers.numberOfSections; ++i) {
+    ULONGLONG sectionEnd =
+        static_cast<ULONGLONG>(headers.sections[i].PointerToRawData) +
+        headers.sections[i].SizeOfRawData;
+    if (sectionEnd > extent) {
+      extent = sectionEnd;
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * Locates a resource in a PE image without loading it, by walking the
+ * resource directory of a read only view of the file. The first language
+ * found for the resource is used.
+ *
+ * @param  image     A view of the PE file starting at offset 0
+ * @param  imageSize The size of the view
+ * @param  type      The integer resource type
+ * @param  id        The integer resource ID
+ * @param  data      Out parameter pointing at the resource data in the view
+ * @param  dataSize  Out parameter for the size of the resource data
+ * @return TRUE if the resource was found, otherwise FALSE with the last
+ *         error set.
+ */
+BOOL FindPEResource(const BYTE* image, size_t imageSize, WORD type, WORD id,
+                    const BYTE*& data, DWORD& dataSize) {
+  PEHeaders headers;
+  if (!ParsePEHeaders(image, imageSize, headers)) {
+    SetLastError(ERROR_BAD_EXE_FORMAT);
+    return FALSE;
+  }
+
+  ULONGLONG resourceOffset, resourceAvailable;
+  if (!headers.resourceRVA ||
+      !RVAToFileOffset(headers, headers.resourceRVA, resourceOffset,
+                       resourceAvailable)) {
+    SetLastError(ERROR_RESOURCE_DATA_NOT_FOUND);
+    return FALSE;
+  }
+  const BYTE* resources =
+      ImageAt(image, imageSize, resourceOffset, resourceAvailable);
+  if (!resources) {
+    SetLastError(ERROR_BAD_EXE_FORMAT);
+    return FALSE;
+  }
+  size_t resourceSize = static_cast<size_t>(resourceAvailable);
+
+  // Type, then name, then language.
+  DWORD entryData;
+  if (!FindResourceDirectoryEntry(resources, resourceSize, 0, type,
+                                  entryData) ||
+      !(entryData & IMAGE_RESOURCE_DATA_IS_DIRECTORY)) {
+    SetLastError(ERROR_RESOURCE_TYPE_NOT_FOUND);
+    return FALSE;
+  }
+  if (!FindResourceDirectoryEntry(resources, resourceSize,
+                                  entryData & ~IMAGE_RESOURCE_DATA_IS_DIRECTORY,
+                                  id, entryData) ||
+      !(entryData & IMAGE_RESOURCE_DATA_IS_DIRECTORY)) {
+    SetLastError(ERROR_RESOURCE_NAME_NOT_FOUND);
+    return FALSE;
+  }
+  if (!FindResourceDirectoryEntry(resources, resourceSize,
+                                  entryData & ~IMAGE_RESOURCE_DATA_IS_DIRECTORY,
+                                  0, entryData) ||
+      (entryData & IMAGE_RESOURCE_DATA_IS_DIRECTORY)) {
+    SetLastError(ERROR_RESOURCE_LANG_NOT_FOUND);
+    return FALSE;
+  }
+
+  const IMAGE_RESOURCE_DATA_ENTRY* dataEntry =
+      reinterpret_cast<const IMAGE_RESOURCE_DATA_ENTRY*>(ImageAt(
+          resources, resourceSize, entryData,
+          sizeof(IMAGE_RESOURCE_DATA_ENTRY)));
+  if (!dataEntry) {
+    SetLastError(ERROR_BAD_EXE_FORMAT);
+    return FALSE;
+  }
+
+  // Unlike the directory offsets, the data offset is an RVA.
+  ULONGLONG dataOffset, dataAvailable;
+  if (!RVAToFileOffset(headers, dataEntry->OffsetToData, dataOffset,
+                       dataAvailable) ||
+      dataEntry->Size > dataAvailable) {
+    SetLastError(ERROR_BAD_EXE_FORMAT);
+    return FALSE;
+  }
+  data = ImageAt(image, imageSize, dataOffset, dataEntry->Size);
+  if (!data) {
+    SetLastError(ERROR_BAD_EXE_FORMAT);
+    return FALSE;
+  }
+  dataSize = dataEntry->Size;
+  return TRUE;
+}
+
+/**
+ * GetPEImageExtent for a mapped view, where a read error is raised as an
+ * EXCEPTION_IN_PAGE_ERROR. __try can't be used in a function which needs
+ * object unwinding so this is kept separate.
+ */
+static BOOL GetMappedPEImageExtent(const BYTE* view, size_t viewSize,
+                                   ULONGLONG& extent) {
+  __try {
+    return GetPEImageExtent(view, viewSize, extent);
+  } __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+                  ? EXCEPTION_EXECUTE_HANDLER
+                  : EXCEPTION_CONTINUE_SEARCH) {
+    SetLastError(ERROR_READ_FAULT);
+    return FALSE;
+  }
+}
+
+/**
+ * Finds a resource in a mapped view and compares it in place, see
+ * GetMappedPEImageExtent for why this is separate.
+ */
+static BOOL MatchMappedPEResource(const BYTE* view, size_t viewSize,
+                                  WORD type, WORD id, const char* expected,
+                                  BOOL& matches) {
+  __try {
+    const BYTE* data;
+    DWORD dataSize;
+    if (!FindPEResource(view, viewSize, type, id, data, dataSize)) {
+      return FALSE;
+    }
+
+    // The resource holds the string, optionally null terminated.
+    size_t expectedLen = strlen(expected);
+    matches = dataSize >= expectedLen &&
+              memcmp(data, expected, expectedLen) == 0 &&
+              (dataSize == expectedLen || data[expectedLen] == '\0');
+    return TRUE;
+  } __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+                  ? EXCEPTION_EXECUTE_HANDLER
+                  : EXCEPTION_CONTINUE_SEARCH) {
+    SetLastError(ERROR_READ_FAULT);
+    return FALSE;
+  }
+}
+
+/**
+ * Determines if a string resource of a PE file matches the expected value.
+ * Only the headers and section data of the file are mapped, any payload
+ * appended to the image is never read.
+ *
+ * @param  file     A handle to the PE file opened with GENERIC_READ
+ * @param  type     The integer resource type
+ * @param  id       The integer resource ID
+ * @param  expected The expected resource contents
+ * @param  matches  Out parameter, TRUE if the resource matches
+ * @return TRUE if the resource was found and compared, otherwise FALSE with
+ *         the last error set.
+ */
+BOOL DoesPEFileResourceMatch(HANDLE file, WORD type, WORD id,
+                             const char* expected, BOOL& matches) {
+  matches = FALSE;
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize)) {
+    return FALSE;
+  }
+  if (fileSize.QuadPart == 0) {
+    SetLastError(ERROR_BAD_EXE_FORMAT);
+    return FALSE;
+  }
+  ULONGLONG size = static_cast<ULONGLONG>(fileSize.QuadPart);
+
+  autoHandle mapping(
+      CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr));
+  if (!mapping.get()) {
+    return FALSE;
+  }
+
+  SIZE_T viewSize = static_cast<SIZE_T>(
+      size < PE_HEADERS_VIEW_SIZE ? size : PE_HEADERS_VIEW_SIZE);
+  autoResourceView view(
+      MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, viewSize));
+  if (!view.get()) {
+    return FALSE;
+  }
+
+  ULONGLONG extent;
+  if (!GetMappedPEImageExtent(static_cast<const BYTE*>(view.get()), viewSize,
+                              extent)) {
+    return FALSE;
+  }
+  if (extent > size) {
+    extent = size;
+  }
+
+  if (extent > viewSize) {
+    if (extent > static_cast<SIZE_T>(-1)) {
+      SetLastError(ERROR_FILE_TOO_LARGE);
+      return FALSE;
+    }
+    viewSize = static_cast<SIZE_T>(extent);
+    view.reset(MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, viewSize));
+    if (!view.get()) {
+      return FALSE;
+    }
+  }
+
+  return MatchMappedPEResource(static_cast<const BYTE*>(view.get()), viewSize,
+                               type, id, expected, matches);
+}
@@ -0,0 +1,16 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _PERESOURCE_H_
+#define _PERESOURCE_H_
+
+#include <windows.h>
+
+BOOL GetPEImageExtent(const BYTE* image, size_t imageSize, ULONGLONG& extent);
+BOOL FindPEResource(const BYTE* image, size_t imageSize, WORD type, WORD id,
+                    const BYTE*& data, DWORD& dataSize);
+BOOL DoesPEFileResourceMatch(HANDLE file, WORD type, WORD id,
+                             const char* expected, BOOL& matches);
+
+#endif
@@ -0,0 +1,119 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "processlist.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+/**
+ * FNV-1a over the case folded name.
+ */
+uint32_t ProcessNameSet::Hash(const wchar_t* name, size_t& length) {
+  uint32_t hash = FNV_OFFSET_BASIS;
+  const wchar_t* p = name;
+  for (; *p; ++p) {
+    uint32_t c = static_cast<uint16_t>(Fold(*p));
+    hash = (hash ^ (c & 0xff)) * FNV_PRIME;
+    hash = (hash ^ (c >> 8)) * FNV_PRIME;
+  }
+  length = static_cast<size_t>(p - name);
+  return hash;
+}
+
+ProcessNameSet::ProcessNameSet(const wchar_t* const* names, size_t count) {
+  size_t tableSize = 4;
+  while (tableSize < count * 2) {
+    tableSize *= 2;
+  }
+  mTable.assign(tableSize, Entry{0, -1});
+
+  mFolded.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    size_t length;
+    uint32_t hash = Hash(names[i], length);
+    std::wstring folded(names[i], length);
+    for (wchar_t& c : folded) {
+      c = Fold(c);
+    }
+    mFolded.push_back(std::move(folded));
+
+    // A name given twice matches the first.
+    if (Find(names[i]) >= 0) {
+      continue;
+    }
+    size_t slot = hash & (tableSize - 1);
+    while (mTable[slot].index >= 0) {
+      slot = (slot + 1) & (tableSize - 1);
+    }
+    mTable[slot] = Entry{hash, static_cast<ptrdiff_t>(i)};
+  }
+}
+
+ptrdiff_t ProcessNameSet::Find(const wchar_t* name) const {
+  size_t length;
+  uint32_t hash = Hash(name, length);
+  size_t mask = mTable.size() - 1;
+  for (size_t slot = hash & mask; mTable[slot].index >= 0;
+       slot = (slot + 1) & mask) {
+    const Entry& entry = mTable[slot];
+    const std::wstring& folded = mFolded[entry.index];
+    if (entry.hash != hash || folded.size() != length) {
+      continue;
+    }
+    size_t i = 0;
+    while (i < length && Fold(name[i]) == folded[i]) {
+      ++i;
+    }
+    if (i == length) {
+      return entry.index;
+    }
+  }
+  return -1;
+}
+
+#ifdef _WIN32
+#include <tlhelp32.h>
+#include "updatecommon.h"
+
+/**
+ * Finds the running instances of several executables from a single
+ * snapshot of the processes in the system, across every session for any
+ * user.
+ *
+ * @param  filenames The executables to look for
+ * @param  count     The number of elements in filenames
+ * @param  running   Set to the process IDs for each of filenames, empty for
+ *                   those which aren't running
+ * @return ERROR_SUCCESS, or a Win32 system error code if the processes could
+ *         not be enumerated.
+ */
+DWORD FindRunningProcesses(const LPCWSTR* filenames, size_t count,
+                           ProcessIdMap& running) {
+  running.clear();
+  for (size_t i = 0; i < count; ++i) {
+    running[filenames[i]];
+  }
+
+  autoHandle snapshot(CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0));
+  if (INVALID_HANDLE_VALUE == snapshot.get()) {
+    return GetLastError();
+  }
+
+  PROCESSENTRY32W processEntry;
+  processEntry.dwSize = sizeof(PROCESSENTRY32W);
+  if (!Process32FirstW(snapshot.get(), &processEntry)) {
+    return GetLastError();
+  }
+
+  ProcessNameSet names(filenames, count);
+  do {
+    ptrdiff_t index = names.Find(processEntry.szExeFile);
+    if (index >= 0) {
+      running[filenames[index]].push_back(processEntry.th32ProcessID);
+    }
+  } while (Process32NextW(snapshot.get(), &processEntry));
+  return ERROR_SUCCESS;
+}
+#endif
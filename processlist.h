@@ -0,0 +1,54 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _PROCESSLIST_H_
+#define _PROCESSLIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A set of executable names, matched without regard to ASCII case the way
+ * _wcsicmp does in the "C" locale. The names are case folded and hashed
+ * once, so a lookup hashes the candidate name once and compares it with at
+ * most a few names.
+ */
+class ProcessNameSet {
+ public:
+  ProcessNameSet(const wchar_t* const* names, size_t count);
+
+  // @return the index of the matching name, or -1.
+  ptrdiff_t Find(const wchar_t* name) const;
+
+ private:
+  static wchar_t Fold(wchar_t c) {
+    return (c >= L'A' && c <= L'Z') ? static_cast<wchar_t>(c - L'A' + L'a')
+                                    : c;
+  }
+  static uint32_t Hash(const wchar_t* name, size_t& length);
+
+  struct Entry {
+    uint32_t hash;
+    ptrdiff_t index;
+  };
+
+  std::vector<std::wstring> mFolded;
+  // Open addressing, a power of two in size and at most half full.
+  std::vector<Entry> mTable;
+};
+
+#ifdef _WIN32
+#include <windows.h>
+
+// The process IDs of the running instances of each executable.
+typedef std::unordered_map<std::wstring, std::vector<DWORD>> ProcessIdMap;
+
+DWORD FindRunningProcesses(const LPCWSTR* filenames, size_t count,
+                           ProcessIdMap& running);
+#endif
+
+#endif
@@ -7,15 +7,37 @@
 #include <windows.h>
 
 #include "registrycertificates.h"
+#include "allowlist.h"
 #include "pathhash.h"
 #include "updatecommon.h"
 #include "updatehelper.h"
-#define MAX_KEY_LENGTH 255
+#include "verifycache.h"
+
+/**
+ * Verifies if the file path matches any certificate stored in the registry,
+ * using the allowed certificates read during this run of the service, the
+ * system's certificate checks and the default verification cache.
+ */
+BOOL DoesBinaryMatchAllowedCertificates(LPCWSTR basePathForUpdate,
+                                        LPCWSTR filePath,
+                                        BOOL allowFallbackKeySkip) {
+  WinTrustCertificateVerifier verifier;
+  return DoesBinaryMatchAllowedCertificates(basePathForUpdate, filePath,
+                                            AllowlistSnapshot::GetDefault(),
+                                            verifier,
+                                            &VerificationCache::GetDefault(),
+                                            allowFallbackKeySkip);
+}
 
 /**
  * Verifies if the file path matches any certificate stored in the registry.
  *
  * @param  filePath The file path of the application to check if allowed.
+ * @param  allowlist The allowed certificates of each installation.
+ * @param  verifier The certificate checks to run.
+ * @param  cache    Optional cache of previous successful verifications, a
+ *                  file with the same contents as one verified before is
+ *                  allowed as long as the certificate it matched still is.
  * @param  allowFallbackKeySkip when this is TRUE the fallback registry key will
  *   be used to skip the certificate check.  This is the default since the
  *   fallback registry key is located under HKEY_LOCAL_MACHINE which can't be
@@ -26,6 +48,9 @@
  */
 BOOL DoesBinaryMatchAllowedCertificates(LPCWSTR basePathForUpdate,
                                         LPCWSTR filePath,
+                                        AllowlistSnapshot& allowlist,
+                                        CertificateVerifier& verifier,
+                                        VerificationCache* cache,
                                         BOOL allowFallbackKeySkip) {
   WCHAR maintenanceServiceKey[MAX_PATH + 1];
   if (!CalculateRegistryPathFromFilePath(basePathForUpdate,
@@ -33,22 +58,14 @@ BOOL DoesBinaryMatchAllowedCertificates(LPCWSTR basePathForUpdate,
     return FALSE;
   }
 
-  // We use KEY_WOW64_64KEY to always force 64-bit view.
-  // The user may have both x86 and x64 applications installed
-  // which each register information.  We need a consistent place
-  // to put those certificate attributes in and hence why we always
-  // force the non redirected registry under Wow6432Node.
-  // This flag is ignored on 32bit systems.
-  HKEY baseKey;
-  LONG retCode = RegOpenKeyExW(HKEY_LOCAL_MACHINE, maintenanceServiceKey, 0,
-                               KEY_READ | KEY_WOW64_64KEY, &baseKey);
+  const AllowedCertificateList* allowedCertificates = nullptr;
+  LONG retCode = allowlist.Get(maintenanceServiceKey, allowedCertificates);
   if (retCode != ERROR_SUCCESS) {
     LOG_WARN(("Could not open key.  (%ld)", retCode));
     // Our tests run with a different apply directory for each test.
     // We use this registry key on our test machines to store the
     // allowed name/issuers.
-    retCode = RegOpenKeyExW(HKEY_LOCAL_MACHINE, TEST_ONLY_FALLBACK_KEY_PATH, 0,
-                            KEY_READ | KEY_WOW64_64KEY, &baseKey);
+    retCode = allowlist.Get(TEST_ONLY_FALLBACK_KEY_PATH, allowedCertificates);
     if (retCode != ERROR_SUCCESS) {
       LOG_WARN(("Could not open fallback key.  (%ld)", retCode));
       return FALSE;
@@ -57,92 +74,74 @@ BOOL DoesBinaryMatchAllowedCertificates(LPCWSTR basePathForUpdate,
           ("Fallback key present, skipping VerifyCertificateTrustForFile "
            "check and the certificate attribute registry matching "
            "check."));
-      RegCloseKey(baseKey);
       return TRUE;
     }
   }
 
-  // Get the number of subkeys.
-  DWORD subkeyCount = 0;
-  retCode = RegQueryInfoKeyW(baseKey, nullptr, nullptr, nullptr, &subkeyCount,
-                             nullptr, nullptr, nullptr, nullptr, nullptr,
-                             nullptr, nullptr);
-  if (retCode != ERROR_SUCCESS) {
-    LOG_WARN(("Could not query info key.  (%ld)", retCode));
-    RegCloseKey(baseKey);
-    return FALSE;
-  }
-
-  // Enumerate the subkeys, each subkey represents an allowed certificate.
-  for (DWORD i = 0; i < subkeyCount; i++) {
-    WCHAR subkeyBuffer[MAX_KEY_LENGTH];
-    DWORD subkeyBufferCount = MAX_KEY_LENGTH;
-    retCode = RegEnumKeyExW(baseKey, i, subkeyBuffer, &subkeyBufferCount,
-                            nullptr, nullptr, nullptr, nullptr);
-    if (retCode != ERROR_SUCCESS) {
-      LOG_WARN(("Could not enum certs.  (%ld)", retCode));
-      RegCloseKey(baseKey);
-      return FALSE;
+  // Hold the file without write sharing so it can't change between working
+  // out its identity and checking its signature.
+  SignedFileIdentity identity;
+  bool haveIdentity = false;
+  autoHandle fileLock(CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ,
+                                  nullptr, OPEN_EXISTING,
+                                  FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+  if (cache) {
+    haveIdentity = INVALID_HANDLE_VALUE != fileLock.get() &&
+                   GetSignedFileIdentity(fileLock.get(), identity);
+    if (!haveIdentity) {
+      LOG_WARN(("Could not identify file for the verification cache.  (%lu)",
+                GetLastError()));
     }
+  }
 
-    // Open the subkey for the current certificate
-    HKEY subKey;
-    retCode = RegOpenKeyExW(baseKey, subkeyBuffer, 0,
-                            KEY_READ | KEY_WOW64_64KEY, &subKey);
-    if (retCode != ERROR_SUCCESS) {
-      LOG_WARN(("Could not open subkey.  (%ld)", retCode));
-      continue;  // Try the next subkey
+  // A file which was already verified only needs the certificate it matched
+  // back then to still be allowed.
+  VerificationCacheEntry cached;
+  if (haveIdentity && cache->Lookup(identity, cached)) {
+    if (IsCertificateAllowed(*allowedCertificates, cached.name,
+                             cached.issuer)) {
+      LOG(("Using the cached signature verification for \"%ls\".",
+           filePath));
+      return TRUE;
     }
+    LOG(("The cached signature verification no longer matches an allowed "
+         "certificate."));
+  }
 
-    const int MAX_CHAR_COUNT = 256;
-    DWORD valueBufSize = MAX_CHAR_COUNT * sizeof(WCHAR);
-    WCHAR name[MAX_CHAR_COUNT] = {L'\0'};
-    WCHAR issuer[MAX_CHAR_COUNT] = {L'\0'};
-
-    // Get the name from the registry
-    retCode = RegQueryValueExW(subKey, L"name", 0, nullptr, (LPBYTE)name,
-                               &valueBufSize);
-    if (retCode != ERROR_SUCCESS) {
-      LOG_WARN(("Could not obtain name from registry.  (%ld)", retCode));
-      RegCloseKey(subKey);
-      continue;  // Try the next subkey
-    }
+  // Read the signature once and match its signer against every allowed
+  // certificate in memory, so the cost doesn't grow with the allowlist.
+  SignedFileInfo signer;
+  retCode = verifier.ReadSigner(filePath, signer);
+  if (retCode != ERROR_SUCCESS) {
+    LOG_WARN(("Error on certificate check.  (%ld)", retCode));
+    return FALSE;
+  }
 
-    // Get the issuer from the registry
-    valueBufSize = MAX_CHAR_COUNT * sizeof(WCHAR);
-    retCode = RegQueryValueExW(subKey, L"issuer", 0, nullptr, (LPBYTE)issuer,
-                               &valueBufSize);
-    if (retCode != ERROR_SUCCESS) {
-      LOG_WARN(("Could not obtain issuer from registry.  (%ld)", retCode));
-      RegCloseKey(subKey);
-      continue;  // Try the next subkey
+  for (const AllowedCertificate& allowed : *allowedCertificates) {
+    CertificateCheckInfo allowedCertificate = {allowed.name, allowed.issuer};
+    if (!signer.Matches(allowedCertificate)) {
+      continue;  // Try the next certificate
     }
 
-    CertificateCheckInfo allowedCertificate = {
-        name,
-        issuer,
-    };
-
-    retCode = CheckCertificateForPEFile(filePath, allowedCertificate);
+    // Trust only depends on the file, so it is checked at most once.
+    retCode = verifier.VerifyTrust(filePath);
     if (retCode != ERROR_SUCCESS) {
-      LOG_WARN(("Error on certificate check.  (%ld)", retCode));
-      RegCloseKey(subKey);
-      continue;  // Try the next subkey
+      LOG_WARN(("Error on certificate trust check.  (%ld)", retCode));
+      return FALSE;
     }
 
-    retCode = VerifyCertificateTrustForFile(filePath);
-    if (retCode != ERROR_SUCCESS) {
-      LOG_WARN(("Error on certificate trust check.  (%ld)", retCode));
-      RegCloseKey(subKey);
-      continue;  // Try the next subkey
+    if (haveIdentity &&
+        !cache->Store(identity, allowed.name, allowed.issuer)) {
+      LOG_WARN(("Could not update the verification cache.  (%lu)",
+                GetLastError()));
     }
 
-    RegCloseKey(baseKey);
     // Raise the roof, we found a match!
     return TRUE;
   }
 
-  RegCloseKey(baseKey);
+  LOG_WARN(("Certificate did not match any allowed issuer and name.  "
+            "(%ls, %ls)", signer.Name(), signer.Issuer()));
   // No certificates match, :'(
   return FALSE;
 }
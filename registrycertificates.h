@@ -7,8 +7,17 @@
 
 #include "certificatecheck.h"
 
+class AllowlistSnapshot;
+class VerificationCache;
+
+BOOL DoesBinaryMatchAllowedCertificates(LPCWSTR basePathForUpdate,
+                                        LPCWSTR filePath,
+                                        BOOL allowFallbackKeySkip = TRUE);
 BOOL DoesBinaryMatchAllowedCertificates(LPCWSTR basePathForUpdate,
                                         LPCWSTR filePath,
+                                        AllowlistSnapshot& allowlist,
+                                        CertificateVerifier& verifier,
+                                        VerificationCache* cache,
                                         BOOL allowFallbackKeySkip = TRUE);
 
 #endif
@@ -0,0 +1,182 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "retrypolicy.h"
+
+const RetryPolicy kStartServiceRetryPolicy = {
+    5000,  // deadlineMS
+    50,    // transientDelayMS
+    10,    // contendedDelayMS
+    500,   // maxDelayMS
+    50     // jitterPercent
+};
+
+static uint32_t NextDelay(uint32_t delayMS, uint32_t maxDelayMS) {
+  return delayMS < maxDelayMS / 2 ? delayMS * 2 : maxDelayMS;
+}
+
+/**
+ * Runs an operation until it succeeds, fails with a permanent error or the
+ * deadline passes. Transient errors and contention each back off
+ * exponentially on their own, so contention which clears up is retried
+ * quickly even after a run of transient errors.
+ *
+ * @param  operation What to run
+ * @param  clock     Where the time comes from
+ * @param  policy    How long and how often to retry
+ * @param  stats     Set to the number and timing of the attempts
+ * @return 0 on success, otherwise the error of the last attempt.
+ */
+uint32_t RunWithRetry(RetryOperation& operation, RetryClock& clock,
+                      const RetryPolicy& policy, RetryStats& stats) {
+  stats.attempts = 0;
+  stats.elapsedMS = 0;
+
+  uint64_t start = clock.NowMS();
+  uint32_t transientDelayMS = policy.transientDelayMS;
+  uint32_t contendedDelayMS = policy.contendedDelayMS;
+  for (;;) {
+    uint64_t attemptStart = clock.NowMS();
+    uint32_t error = operation.Attempt();
+    uint64_t now = clock.NowMS();
+    stats.elapsedMS = static_cast<uint32_t>(now - start);
+    if (stats.attempts < RETRY_RECORDED_ATTEMPTS_MAX) {
+      RetryAttempt& attempt = stats.recorded[stats.attempts];
+      attempt.startMS = static_cast<uint32_t>(attemptStart - start);
+      attempt.durationMS = static_cast<uint32_t>(now - attemptStart);
+      attempt.error = error;
+    }
+    ++stats.attempts;
+
+    if (!error) {
+      return 0;
+    }
+    RetryDisposition disposition = operation.Classify(error);
+    if (RETRY_PERMANENT == disposition ||
+        stats.elapsedMS >= policy.deadlineMS) {
+      return error;
+    }
+
+    uint32_t delayMS;
+    if (RETRY_CONTENDED == disposition) {
+      delayMS = contendedDelayMS;
+      contendedDelayMS = NextDelay(contendedDelayMS, policy.maxDelayMS);
+    } else {
+      delayMS = transientDelayMS;
+      transientDelayMS = NextDelay(transientDelayMS, policy.maxDelayMS);
+    }
+    uint32_t jitterMS =
+        static_cast<uint32_t>(static_cast<uint64_t>(delayMS) *
+                              policy.jitterPercent / 100);
+    if (jitterMS) {
+      delayMS -= clock.Random() % (jitterMS + 1);
+    }
+    uint32_t remainingMS = policy.deadlineMS - stats.elapsedMS;
+    clock.Sleep(delayMS < remainingMS ? delayMS : remainingMS);
+  }
+}
+
+#ifdef _WIN32
+SystemRetryClock::SystemRetryClock()
+    : mState(static_cast<uint32_t>(GetTickCount64()) ^
+             (GetCurrentProcessId() << 16) ^ GetCurrentThreadId()) {
+  if (!mState) {
+    mState = 1;
+  }
+}
+
+uint64_t SystemRetryClock::NowMS() { return GetTickCount64(); }
+
+void SystemRetryClock::Sleep(uint32_t timeoutMS) { ::Sleep(timeoutMS); }
+
+/**
+ * xorshift32, only used to spread out retries.
+ */
+uint32_t SystemRetryClock::Random() {
+  mState ^= mState << 13;
+  mState ^= mState >> 17;
+  mState ^= mState << 5;
+  return mState;
+}
+
+/**
+ * Sorts the errors of StartServiceW. Anything unknown is retried, as every
+ * error was before.
+ */
+RetryDisposition ClassifyStartServiceError(DWORD error) {
+  switch (error) {
+    case ERROR_SERVICE_DATABASE_LOCKED:
+      return RETRY_CONTENDED;
+    case ERROR_ACCESS_DENIED:
+    case ERROR_INVALID_HANDLE:
+    case ERROR_INVALID_PARAMETER:
+    case ERROR_FILE_NOT_FOUND:
+    case ERROR_PATH_NOT_FOUND:
+    case ERROR_BAD_EXE_FORMAT:
+    case ERROR_SERVICE_DISABLED:
+    case ERROR_SERVICE_DOES_NOT_EXIST:
+    case ERROR_SERVICE_MARKED_FOR_DELETE:
+    case ERROR_SERVICE_LOGON_FAILED:
+    // The service is up but didn't get this start's arguments. Retrying
+    // can't change that, the caller has to hand the command over another
+    // way. StartServiceWithRetry still retries while the service stops.
+    case ERROR_SERVICE_ALREADY_RUNNING:
+      return RETRY_PERMANENT;
+    default:
+      return RETRY_TRANSIENT;
+  }
+}
+
+namespace {
+class StartServiceOperation : public RetryOperation {
+ public:
+  StartServiceOperation(SC_HANDLE service, DWORD argc, LPCWSTR* argv)
+      : mService(service), mArgc(argc), mArgv(argv) {}
+
+  uint32_t Attempt() override {
+    return StartServiceW(mService, mArgc, mArgv) ? ERROR_SUCCESS
+                                                 : GetLastError();
+  }
+  RetryDisposition Classify(uint32_t error) override {
+    // The SCM also refuses the start while the last instance is stopping.
+    // The start after it stopped runs with these arguments.
+    if (ERROR_SERVICE_ALREADY_RUNNING == error && IsStopPending()) {
+      return RETRY_TRANSIENT;
+    }
+    return ClassifyStartServiceError(error);
+  }
+
+ private:
+  bool IsStopPending() {
+    SERVICE_STATUS_PROCESS status;
+    DWORD bytesNeeded;
+    return QueryServiceStatusEx(mService, SC_STATUS_PROCESS_INFO,
+                                reinterpret_cast<LPBYTE>(&status),
+                                sizeof(status), &bytesNeeded) &&
+           SERVICE_STOP_PENDING == status.dwCurrentState;
+  }
+
+  SC_HANDLE mService;
+  DWORD mArgc;
+  LPCWSTR* mArgv;
+};
+}  // namespace
+
+/**
+ * Starts a service, retrying with kStartServiceRetryPolicy.
+ *
+ * @param  service A handle to the service with SERVICE_START and
+ *                 SERVICE_QUERY_STATUS access
+ * @param  argc    The number of arguments in argv
+ * @param  argv    The arguments for the service
+ * @param  stats   Set to the number and timing of the attempts
+ * @return ERROR_SUCCESS, or the error of the last StartServiceW call.
+ */
+DWORD StartServiceWithRetry(SC_HANDLE service, DWORD argc, LPCWSTR* argv,
+                            RetryStats& stats) {
+  StartServiceOperation operation(service, argc, argv);
+  SystemRetryClock clock;
+  return RunWithRetry(operation, clock, kStartServiceRetryPolicy, stats);
+}
+#endif
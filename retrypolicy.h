@@ -0,0 +1,102 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _RETRYPOLICY_H_
+#define _RETRYPOLICY_H_
+
+#include <stdint.h>
+
+// How many attempts RetryStats keeps the timing of.
+#define RETRY_RECORDED_ATTEMPTS_MAX 16
+
+enum RetryDisposition {
+  // Retrying won't help, like access denied.
+  RETRY_PERMANENT,
+  // May go away, retried with the regular backoff.
+  RETRY_TRANSIENT,
+  // Someone else holds a lock which is usually released quickly, retried
+  // with a shorter backoff.
+  RETRY_CONTENDED
+};
+
+struct RetryPolicy {
+  // No attempt is started after this long.
+  uint32_t deadlineMS;
+  // The first delay after a transient error, doubled after each one.
+  uint32_t transientDelayMS;
+  // The first delay after contention, doubled after each one.
+  uint32_t contendedDelayMS;
+  uint32_t maxDelayMS;
+  // Each delay is shortened by a random amount of up to this share of it,
+  // so clients which failed together don't retry together.
+  uint32_t jitterPercent;
+};
+
+// Retries StartServiceW for up to 5 seconds, like it was retried before.
+extern const RetryPolicy kStartServiceRetryPolicy;
+
+struct RetryAttempt {
+  // When the attempt started, since the first one.
+  uint32_t startMS;
+  uint32_t durationMS;
+  uint32_t error;
+};
+
+struct RetryStats {
+  uint32_t attempts;
+  uint32_t elapsedMS;
+  // The first attempts, at most RETRY_RECORDED_ATTEMPTS_MAX of them.
+  RetryAttempt recorded[RETRY_RECORDED_ATTEMPTS_MAX];
+};
+
+/**
+ * The operation RunWithRetry retries: StartServiceW, a file replace, or a
+ * fake one.
+ */
+class RetryOperation {
+ public:
+  virtual ~RetryOperation() {}
+
+  // @return 0 on success, or an error code.
+  virtual uint32_t Attempt() = 0;
+  virtual RetryDisposition Classify(uint32_t error) = 0;
+};
+
+/**
+ * The time and randomness RunWithRetry uses: the system's, or a fake.
+ */
+class RetryClock {
+ public:
+  virtual ~RetryClock() {}
+
+  virtual uint64_t NowMS() = 0;
+  virtual void Sleep(uint32_t timeoutMS) = 0;
+  virtual uint32_t Random() = 0;
+};
+
+uint32_t RunWithRetry(RetryOperation& operation, RetryClock& clock,
+                      const RetryPolicy& policy, RetryStats& stats);
+
+#ifdef _WIN32
+#include <windows.h>
+
+class SystemRetryClock : public RetryClock {
+ public:
+  SystemRetryClock();
+
+  uint64_t NowMS() override;
+  void Sleep(uint32_t timeoutMS) override;
+  uint32_t Random() override;
+
+ private:
+  uint32_t mState;
+};
+
+RetryDisposition ClassifyStartServiceError(DWORD error);
+
+DWORD StartServiceWithRetry(SC_HANDLE service, DWORD argc, LPCWSTR* argv,
+                            RetryStats& stats);
+#endif
+
+#endif
@@ -0,0 +1,201 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "sealedfile.h"
+
+void Put32(std::vector<uint8_t>& out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+void Put64(std::vector<uint8_t>& out, uint64_t value) {
+  for (int i = 0; i < 8; ++i) {
+    out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+void Write16(uint8_t* p, uint16_t value) {
+  p[0] = static_cast<uint8_t>(value);
+  p[1] = static_cast<uint8_t>(value >> 8);
+}
+
+void Write32(uint8_t* p, uint32_t value) {
+  Write16(p, static_cast<uint16_t>(value));
+  Write16(p + 2, static_cast<uint16_t>(value >> 16));
+}
+
+void Write64(uint8_t* p, uint64_t value) {
+  Write32(p, static_cast<uint32_t>(value));
+  Write32(p + 4, static_cast<uint32_t>(value >> 32));
+}
+
+uint16_t Read16(const uint8_t* p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t Read32(const uint8_t* p) {
+  return static_cast<uint32_t>(Read16(p)) |
+         (static_cast<uint32_t>(Read16(p + 2)) << 16);
+}
+
+uint64_t Read64(const uint8_t* p) {
+  return static_cast<uint64_t>(Read32(p)) |
+         (static_cast<uint64_t>(Read32(p + 4)) << 32);
+}
+
+/**
+ * @param hash Where to start, to continue an earlier hash.
+ */
+uint64_t Fnv1a64(const uint8_t* data, size_t size, uint64_t hash) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * FNV64_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * Seals everything in data so far.
+ */
+void AppendSeal(std::vector<uint8_t>& data) {
+  Put64(data, Fnv1a64(data.data(), data.size()));
+}
+
+/**
+ * @param  size The size of data including the seal at its end.
+ * @return true if the seal matches the rest of data.
+ */
+bool HasValidSeal(const uint8_t* data, size_t size) {
+  if (size < SEAL_SIZE) {
+    return false;
+  }
+  size_t sealPos = size - SEAL_SIZE;
+  return Read64(data + sealPos) == Fnv1a64(data, sealPos);
+}
+
+#ifdef _WIN32
+#include "updatecommon.h"
+#include "retrypolicy.h"
+
+// Readers only hold a file open for one read, so a replace which runs into
+// one succeeds shortly after.
+static const RetryPolicy kReplaceFileRetryPolicy = {
+    500,  // deadlineMS
+    5,    // transientDelayMS
+    5,    // contendedDelayMS
+    50,   // maxDelayMS
+    50    // jitterPercent
+};
+
+namespace {
+
+class ReplaceFileOperation : public RetryOperation {
+ public:
+  ReplaceFileOperation(LPCWSTR tmpPath, LPCWSTR path)
+      : mTmpPath(tmpPath), mPath(path) {}
+
+  uint32_t Attempt() override {
+    return MoveFileExW(mTmpPath, mPath,
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)
+               ? 0
+               : GetLastError();
+  }
+
+  RetryDisposition Classify(uint32_t error) override {
+    switch (error) {
+      case ERROR_ACCESS_DENIED:
+      case ERROR_SHARING_VIOLATION:
+      case ERROR_LOCK_VIOLATION:
+      case ERROR_USER_MAPPED_FILE:
+        return RETRY_CONTENDED;
+      default:
+        return RETRY_PERMANENT;
+    }
+  }
+
+ private:
+  LPCWSTR mTmpPath;
+  LPCWSTR mPath;
+};
+
+}  // namespace
+
+/**
+ * Reads all of a small file with one read. The file is closed right after,
+ * so a reader holds up WriteFileAtomically for as little as possible.
+ *
+ * @param  data    Set to the contents of the file
+ * @param  maxSize The largest file accepted
+ * @return FALSE if the file can't be read or is larger than maxSize.
+ */
+BOOL ReadSmallFile(LPCWSTR path, std::vector<uint8_t>& data, size_t maxSize) {
+  autoHandle file(CreateFileW(
+      path, GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, 0, nullptr));
+  if (INVALID_HANDLE_VALUE == file.get()) {
+    return FALSE;
+  }
+  // One byte more than allowed, so a larger file is noticed.
+  data.resize(maxSize + 1);
+  DWORD readAmount = 0;
+  if (!ReadFile(file.get(), data.data(), static_cast<DWORD>(data.size()),
+                &readAmount, nullptr)) {
+    data.clear();
+    return FALSE;
+  }
+  if (readAmount > maxSize) {
+    data.clear();
+    SetLastError(ERROR_FILE_TOO_LARGE);
+    return FALSE;
+  }
+  data.resize(readAmount);
+  return TRUE;
+}
+
+/**
+ * Writes data to a temporary file next to path, flushes it and moves it over
+ * path, so the file at path always holds either all of the previous or all
+ * of the new data, even across a crash.
+ *
+ * @return TRUE if successful
+ */
+BOOL WriteFileAtomically(LPCWSTR path, const uint8_t* data, size_t size) {
+  WCHAR tmpPath[MAX_PATH + 1] = {L'\0'};
+  wcsncpy_s(tmpPath, MAX_PATH + 1, path, MAX_PATH);
+  if (wcslen(tmpPath) + wcslen(L".tmp") > MAX_PATH) {
+    return FALSE;
+  }
+  wcsncat_s(tmpPath, MAX_PATH + 1, L".tmp", MAX_PATH - wcslen(tmpPath));
+
+  {
+    autoHandle file(CreateFileW(tmpPath, GENERIC_WRITE, 0, nullptr,
+                                CREATE_ALWAYS, 0, nullptr));
+    if (INVALID_HANDLE_VALUE == file.get()) {
+      return FALSE;
+    }
+    DWORD wrote;
+    if (!WriteFile(file.get(), data, static_cast<DWORD>(size), &wrote,
+                   nullptr) ||
+        wrote != size || !FlushFileBuffers(file.get())) {
+      DWORD lastError = GetLastError();
+      file.reset();
+      DeleteFileW(tmpPath);
+      SetLastError(lastError);
+      return FALSE;
+    }
+  }
+
+  ReplaceFileOperation replace(tmpPath, path);
+  SystemRetryClock clock;
+  RetryStats stats;
+  DWORD error = RunWithRetry(replace, clock, kReplaceFileRetryPolicy, stats);
+  if (error) {
+    DeleteFileW(tmpPath);
+    SetLastError(error);
+    return FALSE;
+  }
+  return TRUE;
+}
+#endif
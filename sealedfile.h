@@ -0,0 +1,47 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _SEALEDFILE_H_
+#define _SEALEDFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * What the binary formats of the service share: little endian fields, and a
+ * seal at the end which is an FNV-1a hash of everything before it, so a torn
+ * or corrupted file is never mistaken for a valid one. Protecting a file
+ * from being altered on purpose is up to the directory it is kept in.
+ */
+#define SEAL_SIZE 8
+
+#define FNV64_OFFSET_BASIS 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+void Put32(std::vector<uint8_t>& out, uint32_t value);
+void Put64(std::vector<uint8_t>& out, uint64_t value);
+
+void Write16(uint8_t* p, uint16_t value);
+void Write32(uint8_t* p, uint32_t value);
+void Write64(uint8_t* p, uint64_t value);
+
+uint16_t Read16(const uint8_t* p);
+uint32_t Read32(const uint8_t* p);
+uint64_t Read64(const uint8_t* p);
+
+uint64_t Fnv1a64(const uint8_t* data, size_t size,
+                 uint64_t hash = FNV64_OFFSET_BASIS);
+
+void AppendSeal(std::vector<uint8_t>& data);
+bool HasValidSeal(const uint8_t* data, size_t size);
+
+#ifdef _WIN32
+#include <windows.h>
+
+BOOL ReadSmallFile(LPCWSTR path, std::vector<uint8_t>& data, size_t maxSize);
+BOOL WriteFileAtomically(LPCWSTR path, const uint8_t* data, size_t size);
+#endif
+
+#endif
@@ -3,6 +3,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "servicebase.h"
+#include "filecompare.h"
 
 /**
  * Verifies if 2 files are byte for byte equivalent.
@@ -14,67 +15,18 @@
  */
 BOOL VerifySameFiles(LPCWSTR file1Path, LPCWSTR file2Path, BOOL& sameContent) {
   sameContent = FALSE;
-  autoHandle file1(CreateFileW(file1Path, GENERIC_READ, FILE_SHARE_READ,
-                                 nullptr, OPEN_EXISTING, 0, nullptr));
-  if (INVALID_HANDLE_VALUE == file1.get()) {
-    return FALSE;
-  }
-  autoHandle file2(CreateFileW(file2Path, GENERIC_READ, FILE_SHARE_READ,
-                                 nullptr, OPEN_EXISTING, 0, nullptr));
-  if (INVALID_HANDLE_VALUE == file2.get()) {
-    return FALSE;
-  }
 
-  DWORD fileSize1 = GetFileSize(file1.get(), nullptr);
-  DWORD fileSize2 = GetFileSize(file2.get(), nullptr);
-  if (INVALID_FILE_SIZE == fileSize1 || INVALID_FILE_SIZE == fileSize2) {
+  ULONGLONG firstDifference;
+  if (!CompareFiles(file1Path, file2Path, firstDifference)) {
     return FALSE;
   }
 
-  if (fileSize1 != fileSize2) {
+  if (firstDifference != FILE_COMPARE_NO_DIFFERENCE) {
+    LOG_WARN(("The files differ starting at offset %llu.", firstDifference));
     // sameContent is already set to FALSE
     return TRUE;
   }
 
-  char buf1[COMPARE_BLOCKSIZE];
-  char buf2[COMPARE_BLOCKSIZE];
-  DWORD numBlocks = fileSize1 / COMPARE_BLOCKSIZE;
-  DWORD leftOver = fileSize1 % COMPARE_BLOCKSIZE;
-  DWORD readAmount;
-  for (DWORD i = 0; i < numBlocks; i++) {
-    if (!ReadFile(file1.get(), buf1, COMPARE_BLOCKSIZE, &readAmount, nullptr) ||
-        readAmount != COMPARE_BLOCKSIZE) {
-      return FALSE;
-    }
-
-    if (!ReadFile(file2.get(), buf2, COMPARE_BLOCKSIZE, &readAmount, nullptr) ||
-        readAmount != COMPARE_BLOCKSIZE) {
-      return FALSE;
-    }
-
-    if (memcmp(buf1, buf2, COMPARE_BLOCKSIZE)) {
-      // sameContent is already set to FALSE
-      return TRUE;
-    }
-  }
-
-  if (leftOver) {
-    if (!ReadFile(file1.get(), buf1, leftOver, &readAmount, nullptr) ||
-        readAmount != leftOver) {
-      return FALSE;
-    }
-
-    if (!ReadFile(file2.get(), buf2, leftOver, &readAmount, nullptr) ||
-        readAmount != leftOver) {
-      return FALSE;
-    }
-
-    if (memcmp(buf1, buf2, leftOver)) {
-      // sameContent is already set to FALSE
-      return TRUE;
-    }
-  }
-
   sameContent = TRUE;
   return TRUE;
 }
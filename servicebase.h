@@ -7,11 +7,6 @@
 
 BOOL VerifySameFiles(LPCWSTR file1Path, LPCWSTR file2Path, BOOL& sameContent);
 
-// 32KiB for comparing files at a time seems reasonable.
-// The bigger the better for speed, but this will be used
-// on the stack so I don't want it to be too big.
-#define COMPARE_BLOCKSIZE 32768
-
 // The following string resource value is used to uniquely identify the signed
 // Aveo Systems application as an installer.  Before the update service will
 // execute the installer it must have this installer identity string in its string
@@ -0,0 +1,156 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "servicewait.h"
+
+/**
+ * Waits for a service to enter a state. Changes are waited for when the
+ * source supports it, otherwise the state is polled with a backoff which
+ * starts short and doubles up to SERVICE_WAIT_MAX_BACKOFF_MS.
+ *
+ * @param  source       Where the state comes from
+ * @param  desiredState The state to wait for, like SERVICE_STOPPED
+ * @param  timeoutMS    The longest to wait
+ * @param  elapsedMS    How long the wait took
+ * @return the last state of the service, or the error code from the source
+ *         if it could not be queried.
+ */
+uint32_t WaitForServiceState(ServiceStateSource& source, uint32_t desiredState,
+                             uint32_t timeoutMS, uint32_t& elapsedMS) {
+  uint64_t start = source.NowMS();
+  uint32_t lastState = SERVICE_STATE_NOT_SET;
+  uint32_t backoffMS = SERVICE_WAIT_MIN_BACKOFF_MS;
+  elapsedMS = 0;
+  while (elapsedMS < timeoutMS) {
+    uint32_t state;
+    ServiceQueryResult result = source.QueryState(state);
+    if (SERVICE_QUERY_FAILED == result) {
+      return state;
+    }
+    if (SERVICE_QUERY_OK == result) {
+      lastState = state;
+      if (state == desiredState) {
+        break;
+      }
+    }
+
+    elapsedMS = static_cast<uint32_t>(source.NowMS() - start);
+    if (elapsedMS >= timeoutMS) {
+      break;
+    }
+    uint32_t remainingMS = timeoutMS - elapsedMS;
+    // While the state can't be queried a change notification may never come.
+    if (SERVICE_QUERY_RETRY == result ||
+        !source.WaitForChange(desiredState, remainingMS)) {
+      source.Sleep(backoffMS < remainingMS ? backoffMS : remainingMS);
+      if (backoffMS < SERVICE_WAIT_MAX_BACKOFF_MS) {
+        backoffMS *= 2;
+        if (backoffMS > SERVICE_WAIT_MAX_BACKOFF_MS) {
+          backoffMS = SERVICE_WAIT_MAX_BACKOFF_MS;
+        }
+      }
+    }
+    elapsedMS = static_cast<uint32_t>(source.NowMS() - start);
+  }
+  return lastState;
+}
+
+#ifdef _WIN32
+ScmServiceStateSource::ScmServiceStateSource(SC_HANDLE service)
+    : mService(service), mNotifyPending(false), mNotifyUnavailable(false) {
+  ZeroMemory(&mNotify, sizeof(mNotify));
+}
+
+ScmServiceStateSource::~ScmServiceStateSource() {
+  // Closing the handle cancels a pending notification. One which was
+  // already queued runs now, while mNotify is still around.
+  CloseServiceHandle(mService);
+  if (mNotifyPending) {
+    SleepEx(0, TRUE);
+  }
+}
+
+ServiceQueryResult ScmServiceStateSource::QueryState(uint32_t& state) {
+  SERVICE_STATUS_PROCESS ssp;
+  DWORD bytesNeeded;
+  if (QueryServiceStatusEx(mService, SC_STATUS_PROCESS_INFO,
+                           reinterpret_cast<LPBYTE>(&ssp),
+                           sizeof(SERVICE_STATUS_PROCESS), &bytesNeeded)) {
+    state = ssp.dwCurrentState;
+    return SERVICE_QUERY_OK;
+  }
+
+  switch (GetLastError()) {
+    case ERROR_INVALID_HANDLE:
+      state = 0x000000D9;
+      break;
+    case ERROR_ACCESS_DENIED:
+      state = 0x000000DA;
+      break;
+    case ERROR_INSUFFICIENT_BUFFER:
+      state = 0x000000DB;
+      break;
+    case ERROR_INVALID_PARAMETER:
+      state = 0x000000DC;
+      break;
+    case ERROR_INVALID_LEVEL:
+      state = 0x000000DD;
+      break;
+    case ERROR_SHUTDOWN_IN_PROGRESS:
+      state = 0x000000DE;
+      break;
+    // These 3 errors can occur when the service is not yet stopped but
+    // it is stopping.
+    case ERROR_INVALID_SERVICE_CONTROL:
+    case ERROR_SERVICE_CANNOT_ACCEPT_CTRL:
+    case ERROR_SERVICE_NOT_ACTIVE:
+      return SERVICE_QUERY_RETRY;
+    default:
+      state = 0x000000DF;
+  }
+  return SERVICE_QUERY_FAILED;
+}
+
+void CALLBACK ScmServiceStateSource::NotifyCallback(PVOID context) {
+  auto notify = static_cast<SERVICE_NOTIFYW*>(context);
+  static_cast<ScmServiceStateSource*>(notify->pContext)->mNotifyPending =
+      false;
+}
+
+/**
+ * Registers for a change notification, unless one is still pending, and
+ * waits alertably for it. The SERVICE_NOTIFY_* flag of a state is
+ * 1 << (state - 1).
+ */
+bool ScmServiceStateSource::WaitForChange(uint32_t desiredState,
+                                          uint32_t timeoutMS) {
+  if (mNotifyUnavailable || desiredState < SERVICE_STOPPED ||
+      desiredState > SERVICE_PAUSED) {
+    return false;
+  }
+
+  if (!mNotifyPending) {
+    ZeroMemory(&mNotify, sizeof(mNotify));
+    mNotify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+    mNotify.pfnNotifyCallback = NotifyCallback;
+    mNotify.pContext = this;
+    DWORD result = NotifyServiceStatusChangeW(
+        mService, 1 << (desiredState - 1), &mNotify);
+    if (ERROR_SUCCESS != result) {
+      // For example ERROR_SERVICE_NOTIFY_CLIENT_LAGGING, poll from now on.
+      mNotifyUnavailable = true;
+      return false;
+    }
+    mNotifyPending = true;
+  }
+
+  // Returns early once the notification callback ran.
+  SleepEx(timeoutMS, TRUE);
+  return true;
+}
+
+void ScmServiceStateSource::Sleep(uint32_t timeoutMS) { ::Sleep(timeoutMS); }
+
+uint64_t ScmServiceStateSource::NowMS() { return GetTickCount64(); }
+#endif
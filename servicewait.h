@@ -0,0 +1,75 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _SERVICEWAIT_H_
+#define _SERVICEWAIT_H_
+
+#include <stdint.h>
+
+// Returned when the wait ended before the state could be queried once.
+#define SERVICE_STATE_NOT_SET 0x000000CF
+
+// The backoff between queries when state change notifications can't be used.
+#define SERVICE_WAIT_MIN_BACKOFF_MS 5
+#define SERVICE_WAIT_MAX_BACKOFF_MS 250
+
+enum ServiceQueryResult {
+  SERVICE_QUERY_OK,
+  // The state can't be queried right now, for example while the service is
+  // stopping. Keep waiting.
+  SERVICE_QUERY_RETRY,
+  // The state can't be queried, the state is an error code to return.
+  SERVICE_QUERY_FAILED
+};
+
+/**
+ * Where WaitForServiceState gets the state of a service from: the SCM, or a
+ * fake one.
+ */
+class ServiceStateSource {
+ public:
+  virtual ~ServiceStateSource() {}
+
+  virtual ServiceQueryResult QueryState(uint32_t& state) = 0;
+  // Blocks until the service may have entered desiredState or timeoutMS
+  // passed. Returns false right away if changes can't be waited for.
+  virtual bool WaitForChange(uint32_t desiredState, uint32_t timeoutMS) = 0;
+  virtual void Sleep(uint32_t timeoutMS) = 0;
+  virtual uint64_t NowMS() = 0;
+};
+
+uint32_t WaitForServiceState(ServiceStateSource& source, uint32_t desiredState,
+                             uint32_t timeoutMS, uint32_t& elapsedMS);
+
+#ifdef _WIN32
+#include <windows.h>
+
+/**
+ * Waits on the SCM, with NotifyServiceStatusChangeW where it is available.
+ */
+class ScmServiceStateSource : public ServiceStateSource {
+ public:
+  // Takes ownership of service, which needs SERVICE_QUERY_STATUS access.
+  explicit ScmServiceStateSource(SC_HANDLE service);
+  ~ScmServiceStateSource();
+
+  ScmServiceStateSource(const ScmServiceStateSource&) = delete;
+  ScmServiceStateSource& operator=(const ScmServiceStateSource&) = delete;
+
+  ServiceQueryResult QueryState(uint32_t& state) override;
+  bool WaitForChange(uint32_t desiredState, uint32_t timeoutMS) override;
+  void Sleep(uint32_t timeoutMS) override;
+  uint64_t NowMS() override;
+
+ private:
+  static void CALLBACK NotifyCallback(PVOID context);
+
+  SC_HANDLE mService;
+  SERVICE_NOTIFYW mNotify;
+  bool mNotifyPending;
+  bool mNotifyUnavailable;
+};
+#endif
+
+#endif
@@ -0,0 +1,345 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string.h>
+#include <wchar.h>
+
+#include "sealedfile.h"
+#include "stagedupdates.h"
+
+#define STAGING_MAGIC 0x54535541  // "AUST"
+#define STAGING_VERSION 1
+#define STAGING_HEADER_SIZE 12
+#define STAGING_RECORD_SIZE (INSTALLER_DIGEST_LENGTH + 20)
+
+namespace {
+
+int HexValue(wchar_t c) {
+  if (c >= L'0' && c <= L'9') {
+    return c - L'0';
+  }
+  if (c >= L'a' && c <= L'f') {
+    return c - L'a' + 10;
+  }
+  if (c >= L'A' && c <= L'F') {
+    return c - L'A' + 10;
+  }
+  return -1;
+}
+
+}  // namespace
+
+const StagingRecord* StagingTable::Find(const uint8_t* digest) const {
+  for (const StagingRecord& record : mRecords) {
+    if (!memcmp(record.digest, digest, INSTALLER_DIGEST_LENGTH)) {
+      return &record;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Starts staging an installer for an installation, replacing what was
+ * staged with it before. The record which changed least recently makes
+ * room if the table is full.
+ */
+void StagingTable::Begin(const uint8_t* digest, uint64_t target,
+                         uint64_t nowSeconds) {
+  Remove(digest);
+  if (mRecords.size() >= STAGING_MAX_ENTRIES) {
+    size_t oldest = 0;
+    for (size_t i = 1; i < mRecords.size(); ++i) {
+      if (mRecords[i].changedSeconds < mRecords[oldest].changedSeconds) {
+        oldest = i;
+      }
+    }
+    mRecords.erase(mRecords.begin() + oldest);
+  }
+
+  StagingRecord record;
+  memcpy(record.digest, digest, INSTALLER_DIGEST_LENGTH);
+  record.target = target;
+  record.state = STAGING_IN_PROGRESS;
+  record.changedSeconds = nowSeconds;
+  mRecords.push_back(record);
+}
+
+/**
+ * Ends staging an installer. Nothing changes unless it is being staged.
+ */
+void StagingTable::Finish(const uint8_t* digest, bool succeeded,
+                          uint64_t nowSeconds) {
+  for (StagingRecord& record : mRecords) {
+    if (!memcmp(record.digest, digest, INSTALLER_DIGEST_LENGTH) &&
+        STAGING_IN_PROGRESS == record.state) {
+      record.state = succeeded ? STAGING_READY : STAGING_FAILED;
+      record.changedSeconds = nowSeconds;
+    }
+  }
+}
+
+/**
+ * Checks that an installer is staged and ready for an installation.
+ */
+StagingRedeemResult StagingTable::Redeem(const uint8_t* digest,
+                                         uint64_t target,
+                                         uint64_t nowSeconds) const {
+  const StagingRecord* record = Find(digest);
+  if (!record) {
+    return STAGING_REDEEM_UNKNOWN;
+  }
+  if (STAGING_READY != record->state) {
+    return STAGING_REDEEM_NOT_READY;
+  }
+  // A record from the future means the clock was changed, don't trust it.
+  if (record->changedSeconds > nowSeconds ||
+      nowSeconds - record->changedSeconds > STAGING_TTL_SECONDS) {
+    return STAGING_REDEEM_EXPIRED;
+  }
+  if (record->target != target) {
+    return STAGING_REDEEM_WRONG_TARGET;
+  }
+  return STAGING_REDEEM_OK;
+}
+
+void StagingTable::Remove(const uint8_t* digest) {
+  for (auto it = mRecords.begin(); it != mRecords.end(); ++it) {
+    if (!memcmp(it->digest, digest, INSTALLER_DIGEST_LENGTH)) {
+      mRecords.erase(it);
+      return;
+    }
+  }
+}
+
+/**
+ * Serializes the table, sealed with a checksum over all of it.
+ */
+void StagingTable::Serialize(std::vector<uint8_t>& data) const {
+  data.clear();
+  Put32(data, STAGING_MAGIC);
+  Put32(data, STAGING_VERSION);
+  Put32(data, static_cast<uint32_t>(mRecords.size()));
+  for (const StagingRecord& record : mRecords) {
+    data.insert(data.end(), record.digest,
+                record.digest + INSTALLER_DIGEST_LENGTH);
+    Put64(data, record.target);
+    Put32(data, record.state);
+    Put64(data, record.changedSeconds);
+  }
+  AppendSeal(data);
+}
+
+/**
+ * Reads a serialized table. The table is left empty unless all of it is
+ * well formed and the seal matches.
+ *
+ * @return false if the data isn't a valid table.
+ */
+bool StagingTable::Deserialize(const uint8_t* data, size_t size) {
+  mRecords.clear();
+  if (size < STAGING_HEADER_SIZE + SEAL_SIZE ||
+      Read32(data) != STAGING_MAGIC || Read32(data + 4) != STAGING_VERSION) {
+    return false;
+  }
+  uint32_t count = Read32(data + 8);
+  if (count > STAGING_MAX_ENTRIES ||
+      size != STAGING_HEADER_SIZE + count * STAGING_RECORD_SIZE + SEAL_SIZE ||
+      !HasValidSeal(data, size)) {
+    return false;
+  }
+
+  std::vector<StagingRecord> records;
+  const uint8_t* p = data + STAGING_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; ++i, p += STAGING_RECORD_SIZE) {
+    StagingRecord record;
+    memcpy(record.digest, p, INSTALLER_DIGEST_LENGTH);
+    record.target = Read64(p + INSTALLER_DIGEST_LENGTH);
+    record.state = Read32(p + INSTALLER_DIGEST_LENGTH + 8);
+    record.changedSeconds = Read64(p + INSTALLER_DIGEST_LENGTH + 12);
+    if (record.state < STAGING_IN_PROGRESS || record.state > STAGING_FAILED) {
+      return false;
+    }
+    records.push_back(record);
+  }
+  mRecords.swap(records);
+  return true;
+}
+
+/**
+ * Identifies an installation directory without regard to ASCII case or a
+ * trailing backslash.
+ */
+uint64_t HashStagingTarget(const wchar_t* installDir) {
+  size_t length = wcslen(installDir);
+  while (length && L'\\' == installDir[length - 1]) {
+    --length;
+  }
+  uint64_t hash = FNV64_OFFSET_BASIS;
+  for (size_t i = 0; i < length; ++i) {
+    wchar_t c = installDir[i];
+    if (c >= L'A' && c <= L'Z') {
+      c = static_cast<wchar_t>(c - L'A' + L'a');
+    }
+    uint8_t unit[2];
+    Write16(unit, static_cast<uint16_t>(c));
+    hash = Fnv1a64(unit, sizeof(unit), hash);
+  }
+  return hash;
+}
+
+/**
+ * Parses a staged token, see STAGED_TOKEN_PREFIX.
+ *
+ * @return false if token isn't a staged token.
+ */
+bool ParseStagedToken(const wchar_t* token,
+                      uint8_t digest[INSTALLER_DIGEST_LENGTH]) {
+  if (wcsncmp(token, STAGED_TOKEN_PREFIX, STAGED_TOKEN_PREFIX_LENGTH)) {
+    return false;
+  }
+  const wchar_t* hex = token + STAGED_TOKEN_PREFIX_LENGTH;
+  for (size_t i = 0; i < INSTALLER_DIGEST_LENGTH; ++i) {
+    int high = HexValue(hex[2 * i]);
+    int low = high < 0 ? -1 : HexValue(hex[2 * i + 1]);
+    if (low < 0) {
+      return false;
+    }
+    digest[i] = static_cast<uint8_t>((high << 4) | low);
+  }
+  return L'\0' == hex[INSTALLER_DIGEST_LENGTH * 2];
+}
+
+#ifdef _WIN32
+#include <shlwapi.h>
+#include <string>
+
+#include "updatecommon.h"
+#include "updateutils_win.h"
+
+// FILETIME is in 100 nanosecond intervals.
+#define FILETIME_TICKS_PER_SECOND 10000000ULL
+
+static uint64_t NowSeconds() {
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  ULARGE_INTEGER ticks;
+  ticks.LowPart = now.dwLowDateTime;
+  ticks.HighPart = now.dwHighDateTime;
+  return ticks.QuadPart / FILETIME_TICKS_PER_SECOND;
+}
+
+/**
+ * Obtains the path of the staging state, in the update subdirectory of the
+ * service binary.
+ *
+ * @param  path A buffer of size MAX_PATH + 1 to store the result.
+ * @return TRUE if successful
+ */
+static BOOL GetStagedUpdatesPath(LPWSTR path) {
+  if (!GetModuleFileNameW(nullptr, path, MAX_PATH) ||
+      !PathRemoveFileSpecW(path) || !PathAppendSafe(path, L"update")) {
+    return FALSE;
+  }
+  CreateDirectoryW(path, nullptr);
+  return PathAppendSafe(path, L"staged.dat");
+}
+
+/**
+ * The default path, or an empty one if it can't be determined.
+ */
+static std::wstring GetDefaultStagedUpdatesPath() {
+  WCHAR path[MAX_PATH + 1] = {L'\0'};
+  if (!GetStagedUpdatesPath(path)) {
+    return std::wstring();
+  }
+  return path;
+}
+
+StagedUpdates& StagedUpdates::GetDefault() {
+  static StagedUpdates defaultStaged(
+      GetDefaultStagedUpdatesPath().c_str());
+  return defaultStaged;
+}
+
+/**
+ * @param stateFilePath The file to keep the table in. If this is empty
+ *                      nothing is ever staged.
+ */
+StagedUpdates::StagedUpdates(LPCWSTR stateFilePath) : mLoaded(false) {
+  wcsncpy_s(mPath, MAX_PATH + 1, stateFilePath, MAX_PATH);
+}
+
+/**
+ * Reads the table. A missing, unreadable or invalid file is treated as an
+ * empty table.
+ *
+ * @return TRUE if the table can be used.
+ */
+BOOL StagedUpdates::Load() {
+  if (mLoaded) {
+    return TRUE;
+  }
+  if (!mPath[0]) {
+    return FALSE;
+  }
+  mLoaded = true;
+
+  std::vector<uint8_t> data;
+  if (!ReadSmallFile(mPath, data,
+                     STAGING_HEADER_SIZE +
+                         STAGING_MAX_ENTRIES * STAGING_RECORD_SIZE +
+                         SEAL_SIZE)) {
+    if (GetLastError() != ERROR_FILE_NOT_FOUND) {
+      LOG_WARN(("Ignoring unreadable staging state: %ls", mPath));
+    }
+    return TRUE;
+  }
+  if (!mTable.Deserialize(data.data(), data.size())) {
+    LOG_WARN(("Ignoring invalid staging state: %ls", mPath));
+  }
+  return TRUE;
+}
+
+/**
+ * Replaces the state file so a reader never sees a partially written table.
+ *
+ * @return TRUE if successful
+ */
+BOOL StagedUpdates::Save() {
+  std::vector<uint8_t> data;
+  mTable.Serialize(data);
+  return WriteFileAtomically(mPath, data.data(), data.size());
+}
+
+void StagedUpdates::Begin(const BYTE digest[SHA256_DIGEST_LENGTH],
+                          LPCWSTR installDir) {
+  if (Load()) {
+    mTable.Begin(digest, HashStagingTarget(installDir), NowSeconds());
+    Save();
+  }
+}
+
+void StagedUpdates::Finish(const BYTE digest[SHA256_DIGEST_LENGTH],
+                           BOOL succeeded) {
+  if (Load()) {
+    mTable.Finish(digest, succeeded != FALSE, NowSeconds());
+    Save();
+  }
+}
+
+StagingRedeemResult StagedUpdates::Redeem(
+    const BYTE digest[SHA256_DIGEST_LENGTH], LPCWSTR installDir) {
+  if (!Load()) {
+    return STAGING_REDEEM_UNKNOWN;
+  }
+  return mTable.Redeem(digest, HashStagingTarget(installDir), NowSeconds());
+}
+
+void StagedUpdates::Remove(const BYTE digest[SHA256_DIGEST_LENGTH]) {
+  if (Load()) {
+    mTable.Remove(digest);
+    Save();
+  }
+}
+#endif
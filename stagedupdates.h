@@ -0,0 +1,107 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _STAGEDUPDATES_H_
+#define _STAGEDUPDATES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "installerstore.h"
+
+// A software-update command can name a staged installer by its token,
+// STAGED_TOKEN_PREFIX followed by the hex SHA-256 digest of the installer,
+// instead of by its path.
+#define STAGED_TOKEN_PREFIX L"staged:"
+#define STAGED_TOKEN_PREFIX_LENGTH 7
+// A staged installer which isn't used within this long is staged again.
+#define STAGING_TTL_SECONDS (7 * 24 * 60 * 60)
+#define STAGING_MAX_ENTRIES 8
+
+enum StagingState {
+  STAGING_IN_PROGRESS = 1,
+  STAGING_READY = 2,
+  STAGING_FAILED = 3
+};
+
+enum StagingRedeemResult {
+  STAGING_REDEEM_OK,
+  STAGING_REDEEM_UNKNOWN,
+  // Still being staged, or staging failed.
+  STAGING_REDEEM_NOT_READY,
+  STAGING_REDEEM_EXPIRED,
+  // Staged for another installation.
+  STAGING_REDEEM_WRONG_TARGET
+};
+
+struct StagingRecord {
+  uint8_t digest[INSTALLER_DIGEST_LENGTH];
+  // HashStagingTarget of the installation the installer was staged for.
+  uint64_t target;
+  uint32_t state;
+  // When the state last changed, in seconds.
+  uint64_t changedSeconds;
+};
+
+/**
+ * What was staged for which installation. Staging an installer moves it
+ * from STAGING_IN_PROGRESS to STAGING_READY or STAGING_FAILED, and only a
+ * ready one can be redeemed. Redeeming doesn't change the state, so a
+ * failed update can be retried with the same token until it succeeds.
+ */
+class StagingTable {
+ public:
+  StagingTable() {}
+
+  void Begin(const uint8_t* digest, uint64_t target, uint64_t nowSeconds);
+  void Finish(const uint8_t* digest, bool succeeded, uint64_t nowSeconds);
+  StagingRedeemResult Redeem(const uint8_t* digest, uint64_t target,
+                             uint64_t nowSeconds) const;
+  void Remove(const uint8_t* digest);
+
+  const StagingRecord* Find(const uint8_t* digest) const;
+  size_t Count() const { return mRecords.size(); }
+
+  void Serialize(std::vector<uint8_t>& data) const;
+  bool Deserialize(const uint8_t* data, size_t size);
+
+ private:
+  std::vector<StagingRecord> mRecords;
+};
+
+uint64_t HashStagingTarget(const wchar_t* installDir);
+bool ParseStagedToken(const wchar_t* token,
+                      uint8_t digest[INSTALLER_DIGEST_LENGTH]);
+
+#ifdef _WIN32
+#include <windows.h>
+
+/**
+ * The staging table of the service, kept alongside the installer store so
+ * a token stays valid across restarts of the service.
+ */
+class StagedUpdates {
+ public:
+  static StagedUpdates& GetDefault();
+
+  explicit StagedUpdates(LPCWSTR stateFilePath);
+
+  void Begin(const BYTE digest[SHA256_DIGEST_LENGTH], LPCWSTR installDir);
+  void Finish(const BYTE digest[SHA256_DIGEST_LENGTH], BOOL succeeded);
+  StagingRedeemResult Redeem(const BYTE digest[SHA256_DIGEST_LENGTH],
+                             LPCWSTR installDir);
+  void Remove(const BYTE digest[SHA256_DIGEST_LENGTH]);
+
+ private:
+  BOOL Load();
+  BOOL Save();
+
+  WCHAR mPath[MAX_PATH + 1];
+  bool mLoaded;
+  StagingTable mTable;
+};
+#endif
+
+#endif
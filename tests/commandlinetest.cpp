@@ -0,0 +1,263 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks the quoting in commandline.h against the rules CommandLineToArgvW
+ * and the CRT split a command line by. CMakeLists.txt builds it once as it
+ * is, and once with COMMAND_LINE_NO_SSE2 defined to cover the scalar scan on
+ * its own.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "commandline.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <shellapi.h>
+#endif
+
+namespace {
+
+struct QuoteCase {
+  const wchar_t* arg;
+  const wchar_t* quoted;
+};
+
+const QuoteCase kQuoteCases[] = {
+    {L"a", L"a"},
+    {L"", L"\"\""},
+    {L"a b", L"\"a b\""},
+    {L"a\tb", L"\"a\tb\""},
+    {L" ", L"\" \""},
+    {L"\"", L"\\\""},
+    {L"a\"b", L"a\\\"b"},
+    {L"\" \"", L"\"\\\" \\\"\""},
+    // Backslashes in front of a doublequote are escaped along with it.
+    {L"a\\\"b", L"a\\\\\\\"b"},
+    {L"a\\\\\"b", L"a\\\\\\\\\\\"b"},
+    {L"a\\\\\\\"b", L"a\\\\\\\\\\\\\\\"b"},
+    // Other backslashes are left alone.
+    {L"a\\b", L"a\\b"},
+    {L"\\\\server\\share", L"\\\\server\\share"},
+    {L"a\\", L"a\\"},
+    // Trailing backslashes are doubled in front of the final doublequote.
+    {L"a b\\", L"\"a b\\\\\""},
+    {L"a b\\\\", L"\"a b\\\\\\\\\""},
+    {L"\\ ", L"\"\\ \""},
+    {L"a \\\"", L"\"a \\\\\\\"\""},
+    // Longer than 16 bytes, so the fast scan takes part.
+    {L"abcdefghijklmnopqrstuvwxyz0123456789",
+     L"abcdefghijklmnopqrstuvwxyz0123456789"},
+    {L"C:\\Program Files\\Aveo\\updater.exe",
+     L"\"C:\\Program Files\\Aveo\\updater.exe\""},
+    {L"abcdefghijklmnopqrstuvwxyz \\\\",
+     L"\"abcdefghijklmnopqrstuvwxyz \\\\\\\\\""},
+    {L"abcdefghijklmnopqrst\"uvwxyz", L"abcdefghijklmnopqrst\\\"uvwxyz"},
+    {L"abcdefghijklmnopqrst\\\\\"uvwxyz",
+     L"abcdefghijklmnopqrst\\\\\\\\\\\"uvwxyz"},
+    {L"abcdefghijklmnopqrstuvwxyz\\", L"abcdefghijklmnopqrstuvwxyz\\"},
+    {L"abcdefghijklmnopqrstuvwxyz\t", L"\"abcdefghijklmnopqrstuvwxyz\t\""},
+};
+
+struct BuildCase {
+  std::vector<const wchar_t*> args;
+  const wchar_t* commandLine;
+};
+
+const BuildCase kBuildCases[] = {
+    {{L"a", L"b"}, L"a b"},
+    {{L"a", L"", L"b c"}, L"a \"\" \"b c\""},
+    {{L"", L""}, L"\"\" \"\""},
+    {{L"a b\\", L"c"}, L"\"a b\\\\\" c"},
+    {{L"x\\\"y", L"\\"}, L"x\\\\\\\"y \\"},
+    {{L"C:\\Program Files\\Aveo\\updater.exe", L"/S", L"abcdefghijklmnopq r"},
+     L"\"C:\\Program Files\\Aveo\\updater.exe\" /S \"abcdefghijklmnopq r\""},
+};
+
+int gFailures = 0;
+
+void Fail(const char* what, const std::wstring& expected,
+          const std::wstring& actual) {
+  ++gFailures;
+  printf("FAIL %s\n  expected [%ls]\n  actual   [%ls]\n", what,
+         expected.c_str(), actual.c_str());
+}
+
+/**
+ * Splits the arguments which follow the program name of a command line the
+ * way CommandLineToArgvW and the CRT do.
+ */
+std::vector<std::wstring> SplitArgs(const wchar_t* p) {
+  std::vector<std::wstring> args;
+  for (;;) {
+    while (*p == L' ' || *p == L'\t') {
+      ++p;
+    }
+    if (!*p) {
+      return args;
+    }
+    std::wstring arg;
+    bool inQuotes = false;
+    while (*p && (inQuotes || (*p != L' ' && *p != L'\t'))) {
+      if (*p == L'\\') {
+        size_t backslashes = 0;
+        while (*p == L'\\') {
+          ++backslashes;
+          ++p;
+        }
+        if (*p == L'"') {
+          // 2n backslashes give n and leave the doublequote to be a quote,
+          // 2n + 1 give n and a literal doublequote.
+          arg.append(backslashes / 2, L'\\');
+          if (backslashes % 2) {
+            arg += L'"';
+            ++p;
+          }
+        } else {
+          arg.append(backslashes, L'\\');
+        }
+      } else if (*p == L'"') {
+        if (inQuotes && p[1] == L'"') {
+          arg += L'"';
+          p += 2;
+        } else {
+          inQuotes = !inQuotes;
+          ++p;
+        }
+      } else {
+        arg += *p++;
+      }
+    }
+    args.push_back(arg);
+  }
+}
+
+void CheckSplit(const char* what, const wchar_t* commandLine,
+                const std::vector<std::wstring>& expected) {
+  std::vector<std::wstring> actual = SplitArgs(commandLine);
+  if (actual != expected) {
+    Fail(what, commandLine, L"(split differently)");
+  }
+#ifdef _WIN32
+  std::wstring withProgram = std::wstring(L"program ") + commandLine;
+  int argc = 0;
+  LPWSTR* argv = CommandLineToArgvW(withProgram.c_str(), &argc);
+  if (!argv) {
+    Fail(what, commandLine, L"(CommandLineToArgvW failed)");
+    return;
+  }
+  std::vector<std::wstring> system(argv + 1, argv + argc);
+  LocalFree(argv);
+  if (system != expected) {
+    Fail(what, commandLine, L"(CommandLineToArgvW split differently)");
+  }
+#endif
+}
+
+/**
+ * Quotes the argument from every alignment within 16 bytes, so the fast
+ * scan starts at each position in it.
+ */
+void CheckQuote(const QuoteCase& test) {
+  size_t length = wcslen(test.arg);
+  alignas(16) wchar_t buffer[64 + 16];
+  for (size_t offset = 0; offset < 16; ++offset) {
+    wchar_t* arg = buffer + offset;
+    memcpy(arg, test.arg, (length + 1) * sizeof(wchar_t));
+
+    ArgInfo info = ClassifyArg(arg);
+    if (info.length != length) {
+      Fail("ClassifyArg length", test.arg, L"(wrong length)");
+    }
+    std::wstring quoted(ArgStrLen(info), L'\0');
+    wchar_t* end = ArgToString(&quoted[0], arg, info);
+    if (static_cast<size_t>(end - quoted.data()) != quoted.size()) {
+      Fail("ArgStrLen", test.quoted, quoted);
+    }
+    if (quoted != test.quoted) {
+      Fail("ArgToString", test.quoted, quoted);
+    }
+  }
+  CheckSplit("split quoted", test.quoted, {test.arg});
+}
+
+/**
+ * Builds the command line in storage which is too small for it as well as in
+ * storage which fits it, and on the heap.
+ */
+void CheckBuild(const BuildCase& test) {
+  std::vector<std::wstring> args(test.args.begin(), test.args.end());
+  int argc = static_cast<int>(test.args.size());
+  size_t length = wcslen(test.commandLine);
+
+  wchar_t small[4];
+  std::vector<wchar_t> fits(length + 1);
+  CommandLineBuilder smallBuilder(small, 4);
+  CommandLineBuilder fitsBuilder(fits.data(), fits.size());
+  CommandLineBuilder heapBuilder(nullptr, 0);
+  for (CommandLineBuilder* builder :
+       {&smallBuilder, &fitsBuilder, &heapBuilder}) {
+    builder->AppendArgs(argc, test.args.data());
+    if (builder->Length() != length ||
+        builder->Get() != std::wstring(test.commandLine)) {
+      Fail("CommandLineBuilder::AppendArgs", test.commandLine,
+           builder->Get());
+    }
+  }
+  if (fitsBuilder.Get() != fits.data()) {
+    Fail("CommandLineBuilder storage", test.commandLine,
+         L"(moved to the heap)");
+  }
+
+  std::unique_ptr<wchar_t[]> made = MakeCommandLine(argc, test.args.data());
+  if (std::wstring(made.get()) != test.commandLine) {
+    Fail("MakeCommandLine", test.commandLine, made.get());
+  }
+  CheckSplit("split built", test.commandLine, args);
+}
+
+void CheckAppend() {
+  wchar_t storage[8];
+  CommandLineBuilder builder(storage, 8);
+  builder.AppendArg(L"C:\\Program Files\\x.exe");
+  builder.AppendText(L" /S ");
+  builder.AppendArg(L"");
+  const wchar_t* expected = L"\"C:\\Program Files\\x.exe\" /S \"\"";
+  std::unique_ptr<wchar_t[]> released = builder.Release();
+  if (std::wstring(released.get()) != expected) {
+    Fail("CommandLineBuilder::AppendArg", expected, released.get());
+  }
+
+  const wchar_t* argv[] = {L"a b", L"c"};
+  const wchar_t* extra[] = {L"d\\", L"e f\\"};
+  expected = L"\"a b\" c d\\ \"e f\\\\\"";
+  std::unique_ptr<wchar_t[]> made = MakeCommandLine(2, argv, 2, extra);
+  if (std::wstring(made.get()) != expected) {
+    Fail("MakeCommandLine extra", expected, made.get());
+  }
+}
+
+}  // namespace
+
+int main() {
+  for (const QuoteCase& test : kQuoteCases) {
+    CheckQuote(test);
+  }
+  for (const BuildCase& test : kBuildCases) {
+    CheckBuild(test);
+  }
+  CheckAppend();
+#ifdef COMMAND_LINE_SSE2
+  printf("SSE2 scan: ");
+#else
+  printf("Scalar scan: ");
+#endif
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
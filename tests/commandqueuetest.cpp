@@ -0,0 +1,187 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks the encoding of the commands sent over the command pipe and the
+ * dispatcher which runs them in the resident service.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "commandqueue.h"
+#include "sealedfile.h"
+
+namespace {
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+const ServiceCommandArgs kCommands[] = {
+    {L"software-update"},
+    {L"software-update", L"C:\\Program Files\\Aveo\\updater.exe", L"", L"/S"},
+    // Characters outside of ASCII are sent as UTF-16 code units.
+    {L"stage", L"C:\\\x00e9t\x00e9\\\xd83d\xde00.exe"},
+};
+
+void CheckRoundTrip() {
+  for (const ServiceCommandArgs& args : kCommands) {
+    std::vector<uint8_t> message;
+    Check(EncodeServiceCommand(args, message), "EncodeServiceCommand");
+    ServiceCommandArgs decoded;
+    Check(DecodeServiceCommand(message.data(), message.size(), decoded) &&
+              decoded == args,
+          "DecodeServiceCommand round trip");
+  }
+
+  std::vector<uint8_t> message;
+  Check(!EncodeServiceCommand({}, message), "encode without arguments");
+  ServiceCommandArgs tooMany(SERVICE_COMMAND_ARGS_MAX + 1, L"a");
+  Check(!EncodeServiceCommand(tooMany, message), "encode too many arguments");
+  ServiceCommandArgs tooLong = {
+      std::wstring(SERVICE_COMMAND_MESSAGE_MAX, L'a')};
+  Check(!EncodeServiceCommand(tooLong, message), "encode too long");
+}
+
+bool Decodes(const std::vector<uint8_t>& message) {
+  ServiceCommandArgs args;
+  return DecodeServiceCommand(message.data(), message.size(), args);
+}
+
+void CheckMalformed() {
+  std::vector<uint8_t> valid;
+  EncodeServiceCommand({L"ab", L"c"}, valid);
+  Check(Decodes(valid), "decode valid");
+
+  std::vector<uint8_t> message = valid;
+  message[0] ^= 1;
+  Check(!Decodes(message), "decode wrong magic");
+
+  for (size_t size = 0; size < valid.size(); ++size) {
+    std::vector<uint8_t> truncated(valid.begin(), valid.begin() + size);
+    Check(!Decodes(truncated), "decode truncated");
+  }
+
+  message = valid;
+  message.push_back(0);
+  Check(!Decodes(message), "decode trailing byte");
+
+  message = valid;
+  Write32(&message[4], 0);
+  Check(!Decodes(message), "decode no arguments");
+
+  message = valid;
+  Write32(&message[4], SERVICE_COMMAND_ARGS_MAX + 1);
+  Check(!Decodes(message), "decode too many arguments");
+
+  // The first argument claims to run past the end of the message.
+  message = valid;
+  Write32(&message[8], 0xffffffff);
+  Check(!Decodes(message), "decode argument too long");
+
+  // A NUL would cut the argument short once it is handed on.
+  message = valid;
+  message[12] = 0;
+  message[13] = 0;
+  Check(!Decodes(message), "decode embedded NUL");
+}
+
+/**
+ * Lets the handler run one command at a time, so the queue can be filled
+ * while it is busy.
+ */
+class Gate {
+ public:
+  void Enter() {
+    std::unique_lock<std::mutex> lock(mLock);
+    ++mEntered;
+    mChanged.notify_all();
+    mChanged.wait(lock, [this] { return mPermits > 0; });
+    --mPermits;
+    ++mLeft;
+    mChanged.notify_all();
+  }
+
+  void Release(int count) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mPermits += count;
+    mChanged.notify_all();
+  }
+
+  bool WaitForEntered(int count) {
+    std::unique_lock<std::mutex> lock(mLock);
+    return mChanged.wait_for(lock, std::chrono::seconds(10),
+                             [&] { return mEntered >= count; });
+  }
+
+  bool WaitForLeft(int count) {
+    std::unique_lock<std::mutex> lock(mLock);
+    return mChanged.wait_for(lock, std::chrono::seconds(10),
+                             [&] { return mLeft >= count; });
+  }
+
+ private:
+  std::mutex mLock;
+  std::condition_variable mChanged;
+  int mEntered = 0;
+  int mLeft = 0;
+  int mPermits = 0;
+};
+
+void CheckDispatcher() {
+  Gate gate;
+  CommandDispatcher dispatcher(
+      [&](const ServiceCommandArgs&) {
+        gate.Enter();
+        return true;
+      },
+      2, 1);
+  Check(dispatcher.IdleFor(std::chrono::milliseconds(0)), "idle at first");
+
+  Check(dispatcher.Submit({L"1"}), "submit");
+  Check(gate.WaitForEntered(1), "command started");
+  Check(!dispatcher.IdleFor(std::chrono::milliseconds(0)),
+        "busy while running");
+  Check(dispatcher.Submit({L"2"}) && dispatcher.Submit({L"3"}),
+        "submit while running");
+  Check(!dispatcher.Submit({L"4"}), "submit to a full queue");
+
+  gate.Release(3);
+  Check(gate.WaitForLeft(3), "queued commands ran");
+  // The worker marks the end of a command just after the handler returns.
+  bool idle = false;
+  for (int i = 0; i < 1000 && !idle; ++i) {
+    idle = dispatcher.IdleFor(std::chrono::milliseconds(0));
+    if (!idle) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  Check(idle, "idle after the commands");
+  Check(!dispatcher.IdleFor(std::chrono::hours(1)), "idle for too short");
+
+  dispatcher.Stop();
+  Check(!dispatcher.Submit({L"5"}), "submit after stop");
+}
+
+}  // namespace
+
+int main() {
+  CheckRoundTrip();
+  CheckMalformed();
+  CheckDispatcher();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
@@ -0,0 +1,160 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks the eviction and the serialization of the installer store index.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "installerstore.h"
+
+namespace {
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+struct Digest {
+  explicit Digest(uint8_t seed) {
+    for (size_t i = 0; i < INSTALLER_DIGEST_LENGTH; ++i) {
+      bytes[i] = static_cast<uint8_t>(seed + i);
+    }
+  }
+
+  uint8_t bytes[INSTALLER_DIGEST_LENGTH];
+};
+
+bool WasEvicted(const std::vector<InstallerStoreEntry>& evicted,
+                const Digest& digest) {
+  return evicted.size() == 1 &&
+         !memcmp(evicted[0].digest, digest.bytes, INSTALLER_DIGEST_LENGTH);
+}
+
+void CheckEvictByCount() {
+  InstallerStoreIndex index(1000, 3);
+  std::vector<InstallerStoreEntry> evicted;
+  Digest a(1), b(2), c(3), d(4);
+  index.Insert(a.bytes, 10, evicted);
+  index.Insert(b.bytes, 10, evicted);
+  index.Insert(c.bytes, 10, evicted);
+  Check(evicted.empty() && index.Count() == 3, "within the entry limit");
+
+  // a is used again, so b is now the least recently used.
+  index.Touch(a.bytes);
+  index.Insert(d.bytes, 10, evicted);
+  Check(WasEvicted(evicted, b), "evicts the least recently used");
+  Check(index.Count() == 3 && index.Find(a.bytes) && !index.Find(b.bytes),
+        "entries after eviction");
+}
+
+void CheckEvictBySize() {
+  InstallerStoreIndex index(100, 8);
+  std::vector<InstallerStoreEntry> evicted;
+  Digest a(1), b(2), c(3);
+  index.Insert(a.bytes, 40, evicted);
+  index.Insert(b.bytes, 40, evicted);
+  index.Insert(c.bytes, 40, evicted);
+  Check(WasEvicted(evicted, a), "evicts past the size limit");
+  Check(index.TotalSize() == 80, "size after eviction");
+
+  // An installer larger than the store is kept on its own.
+  Digest large(4);
+  index.Insert(large.bytes, 500, evicted);
+  Check(evicted.size() == 2 && index.Count() == 1 && index.Find(large.bytes),
+        "keeps an installer larger than the store");
+}
+
+void CheckReinsert() {
+  InstallerStoreIndex index(1000, 2);
+  std::vector<InstallerStoreEntry> evicted;
+  Digest a(1), b(2), c(3);
+  index.Insert(a.bytes, 10, evicted);
+  index.Insert(b.bytes, 10, evicted);
+  // Inserting a again updates it instead of adding it twice.
+  index.Insert(a.bytes, 20, evicted);
+  Check(evicted.empty() && index.Count() == 2 && index.TotalSize() == 30,
+        "insert again");
+  index.Insert(c.bytes, 10, evicted);
+  Check(WasEvicted(evicted, b), "insert again makes it recent");
+
+  index.Remove(a.bytes);
+  Check(!index.Find(a.bytes) && index.Count() == 1, "remove");
+}
+
+void CheckSerialize() {
+  InstallerStoreIndex index(1000, 8);
+  std::vector<InstallerStoreEntry> evicted;
+  Digest a(1), b(2);
+  index.Insert(a.bytes, 10, evicted);
+  index.Insert(b.bytes, 20, evicted);
+  index.Touch(a.bytes);
+
+  std::vector<uint8_t> data;
+  index.Serialize(data);
+  InstallerStoreIndex copy(1000, 8);
+  Check(copy.Deserialize(data.data(), data.size()), "deserialize");
+  const InstallerStoreEntry* entry = copy.Find(a.bytes);
+  Check(copy.Count() == 2 && entry && entry->size == 10 &&
+            entry->lastUsed == index.Find(a.bytes)->lastUsed,
+        "deserialized entries");
+
+  // The use counter carries on, so new entries are more recent.
+  uint64_t lastUsed = entry ? entry->lastUsed : 0;
+  Digest c(3);
+  copy.Insert(c.bytes, 30, evicted);
+  Check(copy.Find(c.bytes)->lastUsed > lastUsed, "use counter carries on");
+
+  for (size_t i = 0; i < data.size(); ++i) {
+    std::vector<uint8_t> corrupt = data;
+    corrupt[i] ^= 0x10;
+    if (copy.Deserialize(corrupt.data(), corrupt.size())) {
+      Check(false, "deserialize corrupted");
+      break;
+    }
+  }
+  Check(copy.Count() == 0, "left empty by a failed deserialize");
+  for (size_t size = 0; size < data.size(); ++size) {
+    if (copy.Deserialize(data.data(), size)) {
+      Check(false, "deserialize truncated");
+      break;
+    }
+  }
+
+  InstallerStoreIndex empty(1000, 8);
+  empty.Serialize(data);
+  Check(copy.Deserialize(data.data(), data.size()) && copy.Count() == 0,
+        "deserialize empty");
+}
+
+void CheckFormat() {
+  uint8_t digest[INSTALLER_DIGEST_LENGTH] = {0x01, 0xab, 0xff};
+  wchar_t hex[INSTALLER_DIGEST_LENGTH * 2 + 1];
+  FormatInstallerDigest(digest, hex);
+  Check(std::wstring(hex) ==
+            L"01abff" + std::wstring(INSTALLER_DIGEST_LENGTH * 2 - 6, L'0'),
+        "FormatInstallerDigest");
+}
+
+}  // namespace
+
+int main() {
+  CheckEvictByCount();
+  CheckEvictBySize();
+  CheckReinsert();
+  CheckSerialize();
+  CheckFormat();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
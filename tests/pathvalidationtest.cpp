@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks the comparison of a path with the final path of what it opened, and
+ * the memo of paths which were validated.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+
+#include "pathvalidation.h"
+
+namespace {
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+struct FinalPathCase {
+  const wchar_t* path;
+  const wchar_t* finalPath;
+  bool same;
+};
+
+const FinalPathCase kFinalPathCases[] = {
+    {L"C:\\Program Files\\Aveo", L"\\\\?\\C:\\Program Files\\Aveo", true},
+    {L"c:\\program files\\aveo", L"\\\\?\\C:\\Program Files\\Aveo", true},
+    {L"C:\\Aveo", L"C:\\Aveo", true},
+    {L"\\\\server\\share\\Aveo", L"\\\\?\\UNC\\server\\share\\Aveo", true},
+    // A link or junction leads somewhere else.
+    {L"C:\\Link\\Aveo", L"\\\\?\\D:\\Target\\Aveo", false},
+    // A short name is an alternate name.
+    {L"C:\\PROGRA~1\\Aveo", L"\\\\?\\C:\\Program Files\\Aveo", false},
+    {L"C:\\Aveo", L"\\\\?\\C:\\Aveo\\", false},
+    {L"C:\\Aveo\\", L"\\\\?\\C:\\Aveo", false},
+    {L"C:\\Aveo", L"\\\\?\\C:\\Aveo2", false},
+    {L"C:\\server\\share", L"\\\\?\\UNC\\server\\share", false},
+    // Only ASCII case differences are ignored.
+    {L"C:\\\x00e9t\x00e9", L"\\\\?\\C:\\\x00c9t\x00c9", false},
+};
+
+void CheckFinalPath() {
+  for (const FinalPathCase& test : kFinalPathCases) {
+    if (IsSameFinalPath(test.path, test.finalPath) != test.same) {
+      ++gFailures;
+      printf("FAIL IsSameFinalPath [%ls] [%ls]\n", test.path,
+             test.finalPath);
+    }
+  }
+}
+
+PathFileId MakeId(uint64_t volume, uint8_t file) {
+  PathFileId id = {volume, {0}};
+  id.file[15] = file;
+  return id;
+}
+
+void CheckMemo() {
+  PathValidationMemo memo;
+  PathFileId id = MakeId(1, 1);
+  Check(!memo.Lookup(L"C:\\Aveo", id), "lookup before store");
+  memo.Store(L"C:\\Aveo", id);
+  Check(memo.Lookup(L"C:\\Aveo", id), "lookup after store");
+  Check(memo.Lookup(L"c:\\AVEO", id), "lookup in another case");
+  Check(!memo.Lookup(L"C:\\Aveo2", id), "lookup another path");
+
+  // Something else at the path has to be validated again, even if what was
+  // there before comes back.
+  Check(!memo.Lookup(L"C:\\Aveo", MakeId(1, 2)), "lookup another file");
+  Check(!memo.Lookup(L"C:\\Aveo", id), "forgotten after another file");
+
+  memo.Store(L"C:\\Aveo", id);
+  Check(!memo.Lookup(L"C:\\Aveo", MakeId(2, 1)), "lookup another volume");
+
+  memo.Store(L"C:\\Aveo", id);
+  memo.Clear();
+  Check(!memo.Lookup(L"C:\\Aveo", id), "lookup after clear");
+}
+
+}  // namespace
+
+int main() {
+  CheckFinalPath();
+  CheckMemo();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
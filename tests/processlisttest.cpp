@@ -0,0 +1,85 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks that ProcessNameSet matches executable names the way _wcsicmp does
+ * in the "C" locale.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "processlist.h"
+
+namespace {
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+void CheckFind() {
+  const wchar_t* names[] = {L"updater.exe", L"Aveo.exe", L"helper.EXE"};
+  ProcessNameSet set(names, 3);
+  Check(set.Find(L"updater.exe") == 0, "exact name");
+  Check(set.Find(L"AVEO.EXE") == 1 && set.Find(L"aveo.exe") == 1,
+        "name in another case");
+  Check(set.Find(L"Helper.exe") == 2, "name in mixed case");
+  Check(set.Find(L"updater.ex") == -1 && set.Find(L"updater.exe2") == -1,
+        "prefix and extension");
+  Check(set.Find(L"") == -1, "empty name");
+  // Only ASCII letters are folded, as in the "C" locale.
+  const wchar_t* accented[] = {L"\x00e9t\x00e9.exe"};
+  ProcessNameSet accentedSet(accented, 1);
+  Check(accentedSet.Find(L"\x00e9T\x00e9.EXE") == 0 &&
+            accentedSet.Find(L"\x00c9t\x00c9.exe") == -1,
+        "non-ASCII name");
+}
+
+void CheckDuplicates() {
+  const wchar_t* names[] = {L"a.exe", L"A.EXE", L"b.exe"};
+  ProcessNameSet set(names, 3);
+  Check(set.Find(L"a.exe") == 0, "a name given twice matches the first");
+  Check(set.Find(L"b.exe") == 2, "name after a duplicate");
+}
+
+void CheckMany() {
+  // Enough names to grow the table past its first size and make collisions.
+  std::vector<std::wstring> names;
+  for (int i = 0; i < 300; ++i) {
+    names.push_back(L"process" + std::to_wstring(i) + L".exe");
+  }
+  std::vector<const wchar_t*> pointers;
+  for (const std::wstring& name : names) {
+    pointers.push_back(name.c_str());
+  }
+  ProcessNameSet set(pointers.data(), pointers.size());
+  bool allFound = true;
+  for (size_t i = 0; i < names.size(); ++i) {
+    std::wstring upper = L"PROCESS" + std::to_wstring(i) + L".EXE";
+    allFound = allFound && set.Find(upper.c_str()) == static_cast<ptrdiff_t>(i);
+  }
+  Check(allFound, "every one of many names");
+  Check(set.Find(L"process300.exe") == -1, "missing one of many names");
+
+  ProcessNameSet empty(nullptr, 0);
+  Check(empty.Find(L"a.exe") == -1, "empty set");
+}
+
+}  // namespace
+
+int main() {
+  CheckFind();
+  CheckDuplicates();
+  CheckMany();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
@@ -0,0 +1,215 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks RunWithRetry with operations which fail a given number of times, on
+ * a clock which only moves when an attempt runs or the retry sleeps.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <vector>
+
+#include "retrypolicy.h"
+
+namespace {
+
+const uint32_t kTransientError = 1;
+const uint32_t kContendedError = 2;
+const uint32_t kPermanentError = 3;
+
+const RetryPolicy kNoJitterPolicy = {
+    1000,  // deadlineMS
+    50,    // transientDelayMS
+    10,    // contendedDelayMS
+    500,   // maxDelayMS
+    0      // jitterPercent
+};
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+class FakeRetryClock : public RetryClock {
+ public:
+  explicit FakeRetryClock(uint32_t random = 0)
+      : mNowMS(0), mRandom(random) {}
+
+  uint64_t NowMS() override { return mNowMS; }
+
+  void Sleep(uint32_t timeoutMS) override {
+    mSleeps.push_back(timeoutMS);
+    mNowMS += timeoutMS;
+  }
+
+  uint32_t Random() override { return mRandom; }
+
+  void Advance(uint32_t ms) { mNowMS += ms; }
+  const std::vector<uint32_t>& Sleeps() const { return mSleeps; }
+
+ private:
+  uint64_t mNowMS;
+  uint32_t mRandom;
+  std::vector<uint32_t> mSleeps;
+};
+
+/**
+ * Fails with the given errors in turn, then succeeds, or with repeatLast
+ * keeps failing with the last of them. Each attempt takes durationMS.
+ */
+class ScriptedOperation : public RetryOperation {
+ public:
+  ScriptedOperation(FakeRetryClock& clock, std::vector<uint32_t> errors,
+                    bool repeatLast = false, uint32_t durationMS = 0)
+      : mClock(clock),
+        mErrors(errors),
+        mRepeatLast(repeatLast),
+        mDurationMS(durationMS),
+        mNext(0) {}
+
+  uint32_t Attempt() override {
+    mClock.Advance(mDurationMS);
+    if (mNext < mErrors.size()) {
+      return mErrors[mNext++];
+    }
+    return mRepeatLast ? mErrors.back() : 0;
+  }
+
+  RetryDisposition Classify(uint32_t error) override {
+    switch (error) {
+      case kTransientError:
+        return RETRY_TRANSIENT;
+      case kContendedError:
+        return RETRY_CONTENDED;
+      default:
+        return RETRY_PERMANENT;
+    }
+  }
+
+ private:
+  FakeRetryClock& mClock;
+  std::vector<uint32_t> mErrors;
+  bool mRepeatLast;
+  uint32_t mDurationMS;
+  size_t mNext;
+};
+
+void CheckSucceeds() {
+  FakeRetryClock clock;
+  ScriptedOperation operation(clock, {});
+  RetryStats stats;
+  Check(RunWithRetry(operation, clock, kNoJitterPolicy, stats) == 0,
+        "succeeds at once");
+  Check(stats.attempts == 1 && clock.Sleeps().empty(),
+        "succeeds at once, one attempt");
+}
+
+void CheckBackoff() {
+  FakeRetryClock clock;
+  ScriptedOperation operation(
+      clock, {kTransientError, kTransientError, kTransientError});
+  RetryStats stats;
+  Check(RunWithRetry(operation, clock, kNoJitterPolicy, stats) == 0,
+        "transient errors are retried");
+  Check(clock.Sleeps() == std::vector<uint32_t>({50, 100, 200}),
+        "transient delays double");
+  Check(stats.attempts == 4 && stats.elapsedMS == 350, "transient stats");
+}
+
+void CheckSeparateBackoff() {
+  FakeRetryClock clock;
+  ScriptedOperation operation(clock, {kTransientError, kContendedError,
+                                      kContendedError, kTransientError});
+  RetryStats stats;
+  Check(RunWithRetry(operation, clock, kNoJitterPolicy, stats) == 0,
+        "contention is retried");
+  Check(clock.Sleeps() == std::vector<uint32_t>({50, 10, 20, 100}),
+        "contention backs off on its own");
+}
+
+void CheckPermanent() {
+  FakeRetryClock clock;
+  ScriptedOperation operation(clock, {kTransientError, kPermanentError});
+  RetryStats stats;
+  Check(RunWithRetry(operation, clock, kNoJitterPolicy, stats) ==
+            kPermanentError,
+        "permanent error is returned");
+  Check(stats.attempts == 2 && clock.Sleeps().size() == 1,
+        "permanent error is not retried");
+}
+
+void CheckDeadline() {
+  FakeRetryClock clock;
+  ScriptedOperation operation(clock, {kTransientError}, true);
+  RetryStats stats;
+  Check(RunWithRetry(operation, clock, kNoJitterPolicy, stats) ==
+            kTransientError,
+        "deadline returns the last error");
+  // The last sleep is cut short so one more attempt is made at the deadline.
+  Check(clock.Sleeps() == std::vector<uint32_t>({50, 100, 200, 400, 250}),
+        "deadline delays");
+  Check(stats.attempts == 6 && stats.elapsedMS == 1000, "deadline stats");
+}
+
+void CheckJitter() {
+  RetryPolicy policy = kNoJitterPolicy;
+  policy.jitterPercent = 50;
+
+  FakeRetryClock noJitter(0);
+  ScriptedOperation first(noJitter, {kTransientError});
+  RetryStats stats;
+  RunWithRetry(first, noJitter, policy, stats);
+  Check(noJitter.Sleeps() == std::vector<uint32_t>({50}), "least jitter");
+
+  // Up to half of the 50ms delay is taken off.
+  FakeRetryClock mostJitter(25);
+  ScriptedOperation second(mostJitter, {kTransientError});
+  RunWithRetry(second, mostJitter, policy, stats);
+  Check(mostJitter.Sleeps() == std::vector<uint32_t>({25}), "most jitter");
+
+  FakeRetryClock wrappedJitter(26);
+  ScriptedOperation third(wrappedJitter, {kTransientError});
+  RunWithRetry(third, wrappedJitter, policy, stats);
+  Check(wrappedJitter.Sleeps() == std::vector<uint32_t>({50}),
+        "jitter wraps around");
+}
+
+void CheckStats() {
+  FakeRetryClock clock;
+  ScriptedOperation operation(clock, {kContendedError}, true, 3);
+  RetryPolicy policy = kNoJitterPolicy;
+  policy.contendedDelayMS = 1;
+  policy.maxDelayMS = 1;
+  RetryStats stats;
+  RunWithRetry(operation, clock, policy, stats);
+  Check(stats.attempts > RETRY_RECORDED_ATTEMPTS_MAX,
+        "more attempts than recorded");
+  Check(stats.recorded[0].startMS == 0 && stats.recorded[0].durationMS == 3 &&
+            stats.recorded[0].error == kContendedError,
+        "first attempt recorded");
+  const RetryAttempt& last = stats.recorded[RETRY_RECORDED_ATTEMPTS_MAX - 1];
+  Check(last.startMS == (RETRY_RECORDED_ATTEMPTS_MAX - 1) * 4 &&
+            last.durationMS == 3,
+        "last recorded attempt");
+}
+
+}  // namespace
+
+int main() {
+  CheckSucceeds();
+  CheckBackoff();
+  CheckSeparateBackoff();
+  CheckPermanent();
+  CheckDeadline();
+  CheckJitter();
+  CheckStats();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
@@ -0,0 +1,174 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks WaitForServiceState against a service whose state changes on a
+ * schedule, with a clock which only moves when the wait sleeps or waits.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <vector>
+
+#include "servicewait.h"
+
+namespace {
+
+// The values of the winsvc.h states.
+const uint32_t kStopped = 1;
+const uint32_t kStopPending = 3;
+const uint32_t kRunning = 4;
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+struct ScheduledState {
+  // From when the service reports this.
+  uint64_t atMS;
+  ServiceQueryResult result;
+  uint32_t state;
+};
+
+class FakeServiceStateSource : public ServiceStateSource {
+ public:
+  FakeServiceStateSource(std::vector<ScheduledState> schedule, bool notifies)
+      : mSchedule(schedule), mNotifies(notifies), mNowMS(0), mQueries(0) {}
+
+  ServiceQueryResult QueryState(uint32_t& state) override {
+    ++mQueries;
+    const ScheduledState* current = &mSchedule[0];
+    for (const ScheduledState& entry : mSchedule) {
+      if (entry.atMS <= mNowMS) {
+        current = &entry;
+      }
+    }
+    state = current->state;
+    return current->result;
+  }
+
+  bool WaitForChange(uint32_t, uint32_t timeoutMS) override {
+    if (!mNotifies) {
+      return false;
+    }
+    uint64_t untilMS = mNowMS + timeoutMS;
+    for (const ScheduledState& entry : mSchedule) {
+      if (entry.atMS > mNowMS && entry.atMS < untilMS) {
+        untilMS = entry.atMS;
+      }
+    }
+    mNowMS = untilMS;
+    return true;
+  }
+
+  void Sleep(uint32_t timeoutMS) override {
+    mSleeps.push_back(timeoutMS);
+    mNowMS += timeoutMS;
+  }
+
+  uint64_t NowMS() override { return mNowMS; }
+
+  int Queries() const { return mQueries; }
+  const std::vector<uint32_t>& Sleeps() const { return mSleeps; }
+
+ private:
+  std::vector<ScheduledState> mSchedule;
+  bool mNotifies;
+  uint64_t mNowMS;
+  int mQueries;
+  std::vector<uint32_t> mSleeps;
+};
+
+void CheckAlreadyInState() {
+  FakeServiceStateSource source({{0, SERVICE_QUERY_OK, kStopped}}, true);
+  uint32_t elapsedMS;
+  Check(WaitForServiceState(source, kStopped, 1000, elapsedMS) == kStopped,
+        "already in state");
+  Check(elapsedMS == 0 && source.Queries() == 1, "already in state, at once");
+}
+
+void CheckNotified() {
+  FakeServiceStateSource source(
+      {{0, SERVICE_QUERY_OK, kStopPending}, {300, SERVICE_QUERY_OK, kStopped}},
+      true);
+  uint32_t elapsedMS;
+  Check(WaitForServiceState(source, kStopped, 5000, elapsedMS) == kStopped,
+        "notified");
+  Check(elapsedMS == 300 && source.Queries() == 2 && source.Sleeps().empty(),
+        "notified, queried once per change");
+}
+
+void CheckPolled() {
+  FakeServiceStateSource source(
+      {{0, SERVICE_QUERY_OK, kStopPending}, {2000, SERVICE_QUERY_OK, kStopped}},
+      false);
+  uint32_t elapsedMS;
+  Check(WaitForServiceState(source, kStopped, 5000, elapsedMS) == kStopped,
+        "polled");
+  const std::vector<uint32_t> expected = {5,   10,  20,  40,  80,  160, 250,
+                                          250, 250, 250, 250, 250, 250};
+  Check(source.Sleeps() == expected, "polled with a doubling backoff");
+  Check(elapsedMS == 2065, "polled, stopped at the first query after");
+}
+
+void CheckTimeout() {
+  FakeServiceStateSource source({{0, SERVICE_QUERY_OK, kRunning}}, false);
+  uint32_t elapsedMS;
+  Check(WaitForServiceState(source, kStopped, 1000, elapsedMS) == kRunning,
+        "timeout returns the last state");
+  Check(elapsedMS == 1000, "timeout, no sleep past it");
+
+  FakeServiceStateSource notifying({{0, SERVICE_QUERY_OK, kRunning}}, true);
+  Check(WaitForServiceState(notifying, kStopped, 1000, elapsedMS) ==
+                kRunning &&
+            elapsedMS == 1000,
+        "timeout while notified");
+}
+
+void CheckRetry() {
+  // Changes can't be waited for while the state can't be queried.
+  FakeServiceStateSource source(
+      {{0, SERVICE_QUERY_RETRY, 0}, {20, SERVICE_QUERY_OK, kStopped}}, true);
+  uint32_t elapsedMS;
+  Check(WaitForServiceState(source, kStopped, 1000, elapsedMS) == kStopped,
+        "retry");
+  const std::vector<uint32_t> expected = {5, 10, 20};
+  Check(source.Sleeps() == expected, "retry sleeps");
+
+  FakeServiceStateSource never({{0, SERVICE_QUERY_RETRY, 0}}, true);
+  Check(WaitForServiceState(never, kStopped, 1000, elapsedMS) ==
+            SERVICE_STATE_NOT_SET,
+        "never queried");
+}
+
+void CheckFailed() {
+  const uint32_t kAccessDenied = 5;
+  FakeServiceStateSource source(
+      {{0, SERVICE_QUERY_OK, kStopPending},
+       {100, SERVICE_QUERY_FAILED, kAccessDenied}},
+      true);
+  uint32_t elapsedMS;
+  Check(WaitForServiceState(source, kStopped, 1000, elapsedMS) ==
+            kAccessDenied,
+        "failed query returns its error");
+}
+
+}  // namespace
+
+int main() {
+  CheckAlreadyInState();
+  CheckNotified();
+  CheckPolled();
+  CheckTimeout();
+  CheckRetry();
+  CheckFailed();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
@@ -0,0 +1,176 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks the staging table, its serialization and the staged tokens which
+ * name a staged installer.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "stagedupdates.h"
+
+namespace {
+
+const uint64_t kNow = 1700000000;
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+struct Digest {
+  explicit Digest(uint8_t seed) {
+    for (size_t i = 0; i < INSTALLER_DIGEST_LENGTH; ++i) {
+      bytes[i] = static_cast<uint8_t>(seed + i);
+    }
+  }
+
+  uint8_t bytes[INSTALLER_DIGEST_LENGTH];
+};
+
+void CheckRedeem() {
+  StagingTable table;
+  Digest a(1), unknown(2);
+  uint64_t target = HashStagingTarget(L"C:\\Program Files\\Aveo");
+  uint64_t otherTarget = HashStagingTarget(L"C:\\Program Files\\Other");
+
+  Check(table.Redeem(unknown.bytes, target, kNow) == STAGING_REDEEM_UNKNOWN,
+        "redeem unknown");
+  table.Begin(a.bytes, target, kNow);
+  Check(table.Redeem(a.bytes, target, kNow) == STAGING_REDEEM_NOT_READY,
+        "redeem in progress");
+  table.Finish(a.bytes, true, kNow + 10);
+  Check(table.Redeem(a.bytes, target, kNow + 10) == STAGING_REDEEM_OK,
+        "redeem ready");
+  Check(table.Redeem(a.bytes, otherTarget, kNow + 10) ==
+            STAGING_REDEEM_WRONG_TARGET,
+        "redeem for another installation");
+  Check(table.Redeem(a.bytes, target, kNow + 10 + STAGING_TTL_SECONDS) ==
+            STAGING_REDEEM_OK,
+        "redeem at the end of the TTL");
+  Check(table.Redeem(a.bytes, target, kNow + 11 + STAGING_TTL_SECONDS) ==
+            STAGING_REDEEM_EXPIRED,
+        "redeem after the TTL");
+  Check(table.Redeem(a.bytes, target, kNow) == STAGING_REDEEM_EXPIRED,
+        "redeem from the future");
+
+  // Finishing again doesn't change a finished record.
+  table.Finish(a.bytes, false, kNow + 20);
+  Check(table.Find(a.bytes)->state == STAGING_READY &&
+            table.Find(a.bytes)->changedSeconds == kNow + 10,
+        "finish twice");
+
+  table.Begin(a.bytes, target, kNow + 30);
+  table.Finish(a.bytes, false, kNow + 40);
+  Check(table.Redeem(a.bytes, target, kNow + 40) == STAGING_REDEEM_NOT_READY,
+        "redeem failed");
+  Check(table.Count() == 1, "begin again replaces");
+
+  table.Remove(a.bytes);
+  Check(table.Redeem(a.bytes, target, kNow + 40) == STAGING_REDEEM_UNKNOWN,
+        "redeem removed");
+}
+
+void CheckFull() {
+  StagingTable table;
+  for (uint8_t i = 0; i < STAGING_MAX_ENTRIES; ++i) {
+    Digest digest(i);
+    // The first record changed last.
+    table.Begin(digest.bytes, 1, i ? kNow + i : kNow + 100);
+  }
+  Digest extra(100);
+  table.Begin(extra.bytes, 1, kNow + 200);
+  Digest first(0), second(1);
+  Check(table.Count() == STAGING_MAX_ENTRIES, "full table stays full");
+  Check(table.Find(extra.bytes) && table.Find(first.bytes) &&
+            !table.Find(second.bytes),
+        "full table drops the least recently changed");
+}
+
+void CheckSerialize() {
+  StagingTable table;
+  Digest a(1), b(2);
+  table.Begin(a.bytes, 7, kNow);
+  table.Finish(a.bytes, true, kNow + 1);
+  table.Begin(b.bytes, 8, kNow + 2);
+
+  std::vector<uint8_t> data;
+  table.Serialize(data);
+  StagingTable copy;
+  Check(copy.Deserialize(data.data(), data.size()), "deserialize");
+  const StagingRecord* record = copy.Find(a.bytes);
+  Check(copy.Count() == 2 && record && record->target == 7 &&
+            record->state == STAGING_READY &&
+            record->changedSeconds == kNow + 1,
+        "deserialized records");
+
+  for (size_t i = 0; i < data.size(); ++i) {
+    std::vector<uint8_t> corrupt = data;
+    corrupt[i] ^= 0x01;
+    if (copy.Deserialize(corrupt.data(), corrupt.size())) {
+      Check(false, "deserialize corrupted");
+      break;
+    }
+  }
+  Check(copy.Count() == 0, "left empty by a failed deserialize");
+  for (size_t size = 0; size < data.size(); ++size) {
+    if (copy.Deserialize(data.data(), size)) {
+      Check(false, "deserialize truncated");
+      break;
+    }
+  }
+}
+
+void CheckTarget() {
+  Check(HashStagingTarget(L"C:\\Program Files\\Aveo") ==
+            HashStagingTarget(L"c:\\PROGRAM FILES\\aveo\\"),
+        "target ignores case and a trailing backslash");
+  Check(HashStagingTarget(L"C:\\Aveo") != HashStagingTarget(L"C:\\Aveo2"),
+        "targets differ");
+}
+
+void CheckToken() {
+  std::wstring hex;
+  for (int i = 0; i < INSTALLER_DIGEST_LENGTH; ++i) {
+    hex += i % 2 ? L"aB" : L"09";
+  }
+  uint8_t digest[INSTALLER_DIGEST_LENGTH];
+  Check(ParseStagedToken((STAGED_TOKEN_PREFIX + hex).c_str(), digest) &&
+            digest[0] == 0x09 && digest[1] == 0xab,
+        "ParseStagedToken");
+
+  const std::wstring invalid[] = {
+      hex,
+      L"staged:",
+      STAGED_TOKEN_PREFIX + hex.substr(1),
+      STAGED_TOKEN_PREFIX + hex + L"0",
+      STAGED_TOKEN_PREFIX + hex.substr(0, hex.size() - 1) + L"g",
+      L"C:\\staged:" + hex,
+  };
+  for (const std::wstring& token : invalid) {
+    Check(!ParseStagedToken(token.c_str(), digest), "invalid staged token");
+  }
+}
+
+}  // namespace
+
+int main() {
+  CheckRedeem();
+  CheckFull();
+  CheckSerialize();
+  CheckTarget();
+  CheckToken();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
@@ -0,0 +1,124 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks that update status records read back as they were written, and
+ * that torn or corrupted records are rejected.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "updatestatus.h"
+
+namespace {
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+UpdateStatusRecord MakeRecord(uint32_t state, uint64_t sequence) {
+  UpdateStatusRecord record;
+  record.state = state;
+  record.errorCode = -2;
+  for (size_t i = 0; i < UPDATE_STATUS_ID_LENGTH; ++i) {
+    record.id[i] = static_cast<uint8_t>(sequence + i);
+  }
+  record.createdTime = 1700000000;
+  record.updatedTime = 1700000000 + sequence;
+  record.progress = UPDATE_PROGRESS_STARTED;
+  record.sequence = sequence;
+  return record;
+}
+
+bool SameRecord(const UpdateStatusRecord& a, const UpdateStatusRecord& b) {
+  return a.state == b.state && a.errorCode == b.errorCode &&
+         !memcmp(a.id, b.id, UPDATE_STATUS_ID_LENGTH) &&
+         a.createdTime == b.createdTime && a.updatedTime == b.updatedTime &&
+         a.progress == b.progress && a.sequence == b.sequence;
+}
+
+void CheckRoundTrip() {
+  for (uint32_t state = UPDATE_STATUS_PENDING; state <= UPDATE_STATUS_FAILED;
+       ++state) {
+    UpdateStatusRecord record = MakeRecord(state, state * 100);
+    uint8_t data[UPDATE_STATUS_RECORD_SIZE];
+    SerializeUpdateStatus(record, data);
+    UpdateStatusRecord parsed;
+    Check(ParseUpdateStatus(data, sizeof(data), parsed) &&
+              SameRecord(record, parsed),
+          "round trip");
+  }
+}
+
+void CheckRejected() {
+  uint8_t data[UPDATE_STATUS_RECORD_SIZE];
+  SerializeUpdateStatus(MakeRecord(UPDATE_STATUS_APPLYING, 1), data);
+  UpdateStatusRecord parsed;
+
+  Check(!ParseUpdateStatus(data, sizeof(data) - 1, parsed),
+        "shorter than a record");
+  uint8_t longer[UPDATE_STATUS_RECORD_SIZE + 1] = {0};
+  memcpy(longer, data, sizeof(data));
+  Check(!ParseUpdateStatus(longer, sizeof(longer), parsed),
+        "longer than a record");
+
+  for (size_t i = 0; i < sizeof(data); ++i) {
+    for (int bit = 0; bit < 8; ++bit) {
+      uint8_t corrupt[UPDATE_STATUS_RECORD_SIZE];
+      memcpy(corrupt, data, sizeof(data));
+      corrupt[i] ^= static_cast<uint8_t>(1 << bit);
+      if (ParseUpdateStatus(corrupt, sizeof(corrupt), parsed)) {
+        Check(false, "corrupted record");
+        return;
+      }
+    }
+  }
+
+  // A state which is out of range is rejected even when sealed.
+  UpdateStatusRecord unknown = MakeRecord(UPDATE_STATUS_FAILED + 1, 1);
+  SerializeUpdateStatus(unknown, data);
+  Check(!ParseUpdateStatus(data, sizeof(data), parsed), "unknown state");
+}
+
+/**
+ * A write which was cut short leaves the start of the new record in front of
+ * the rest of the old one.
+ */
+void CheckTorn() {
+  uint8_t before[UPDATE_STATUS_RECORD_SIZE];
+  uint8_t after[UPDATE_STATUS_RECORD_SIZE];
+  SerializeUpdateStatus(MakeRecord(UPDATE_STATUS_APPLYING, 1), before);
+  SerializeUpdateStatus(MakeRecord(UPDATE_STATUS_SUCCEEDED, 2), after);
+  UpdateStatusRecord parsed;
+  for (size_t split = 1; split < UPDATE_STATUS_RECORD_SIZE; ++split) {
+    uint8_t torn[UPDATE_STATUS_RECORD_SIZE];
+    memcpy(torn, after, split);
+    memcpy(torn + split, before + split, sizeof(torn) - split);
+    // Where the records start the same, the torn one is the old one.
+    if (memcmp(torn, before, sizeof(torn)) &&
+        memcmp(torn, after, sizeof(torn)) &&
+        ParseUpdateStatus(torn, sizeof(torn), parsed)) {
+      Check(false, "torn record");
+      return;
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  CheckRoundTrip();
+  CheckRejected();
+  CheckTorn();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
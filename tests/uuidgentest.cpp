@@ -0,0 +1,138 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Checks the layout and the ordering of the UUIDs UuidGenerator makes, with
+ * a clock and random bytes which are given to it.
+ *
+ * It prints each failure and exits with the number of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "uuidgen.h"
+
+namespace {
+
+int gFailures = 0;
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    ++gFailures;
+    printf("FAIL %s\n", what);
+  }
+}
+
+class FakeEntropySource : public UuidEntropySource {
+ public:
+  FakeEntropySource()
+      : mNowMS(0x0123456789ab), mFill(0xff), mFills(0), mFails(false) {}
+
+  bool FillRandom(uint8_t* buffer, size_t size) override {
+    if (mFails) {
+      return false;
+    }
+    ++mFills;
+    memset(buffer, mFill, size);
+    return true;
+  }
+
+  uint64_t NowMS() override { return mNowMS; }
+
+  uint64_t mNowMS;
+  uint8_t mFill;
+  int mFills;
+  bool mFails;
+};
+
+uint64_t TimestampOf(const uint8_t uuid[UUID_BYTES]) {
+  uint64_t ms = 0;
+  for (int i = 0; i < 6; ++i) {
+    ms = (ms << 8) | uuid[i];
+  }
+  return ms;
+}
+
+uint16_t CounterOf(const uint8_t uuid[UUID_BYTES]) {
+  return static_cast<uint16_t>(((uuid[6] & 0x0f) << 8) | uuid[7]);
+}
+
+void CheckLayout() {
+  FakeEntropySource source;
+  UuidGenerator generator(source);
+  uint8_t uuid[UUID_BYTES];
+  Check(generator.Generate(uuid), "Generate");
+  Check(TimestampOf(uuid) == source.mNowMS, "timestamp");
+  Check((uuid[6] >> 4) == 7, "version 7");
+  Check((uuid[8] & 0xc0) == 0x80, "RFC 9562 variant");
+  // A new millisecond starts the counter in the lower half of its range.
+  Check(CounterOf(uuid) == 0x7ff, "counter start");
+
+  wchar_t str[UUID_STRING_LENGTH];
+  FormatUuid(uuid, str);
+  Check(std::wstring(str) == L"01234567-89ab-77ff-bfff-ffffffffffff",
+        "FormatUuid");
+}
+
+void CheckOrdering() {
+  FakeEntropySource source;
+  source.mFill = 0;
+  UuidGenerator generator(source);
+  uint8_t previous[UUID_BYTES];
+  generator.Generate(previous);
+
+  // Within one millisecond the counter keeps them in order, and once it runs
+  // out the timestamp moves ahead of the clock.
+  bool ordered = true;
+  for (int i = 0; i < 0x1000 + 10; ++i) {
+    uint8_t uuid[UUID_BYTES];
+    generator.Generate(uuid);
+    ordered = ordered && memcmp(previous, uuid, 8) < 0;
+    memcpy(previous, uuid, UUID_BYTES);
+  }
+  Check(ordered, "ordered within a millisecond");
+  Check(TimestampOf(previous) == source.mNowMS + 1,
+        "counter overflow moves the timestamp on");
+
+  // A clock which goes back doesn't break the order either.
+  source.mNowMS -= 1000;
+  uint8_t uuid[UUID_BYTES];
+  generator.Generate(uuid);
+  Check(memcmp(previous, uuid, 8) < 0, "ordered when the clock goes back");
+
+  source.mNowMS += 2000;
+  generator.Generate(uuid);
+  Check(TimestampOf(uuid) == source.mNowMS && CounterOf(uuid) == 0,
+        "new millisecond");
+}
+
+void CheckPool() {
+  FakeEntropySource source;
+  UuidGenerator generator(source);
+  uint8_t uuid[UUID_BYTES];
+  // Each UUID takes 10 random bytes.
+  for (int i = 0; i < UUID_RANDOM_POOL_SIZE / 10; ++i) {
+    generator.Generate(uuid);
+  }
+  Check(source.mFills == 1, "random bytes come from the pool");
+  generator.Generate(uuid);
+  Check(source.mFills == 2, "pool refilled");
+
+  FakeEntropySource failing;
+  failing.mFails = true;
+  UuidGenerator failingGenerator(failing);
+  Check(!failingGenerator.Generate(uuid), "no random bytes");
+}
+
+}  // namespace
+
+int main() {
+  CheckLayout();
+  CheckOrdering();
+  CheckPool();
+  printf("%d failures\n", gFailures);
+  return gFailures;
+}
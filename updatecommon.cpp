@@ -1,9 +1,5 @@
 #if defined(XP_WIN)
 #  include <windows.h>
-#  include <shlobj.h>
-#  ifndef RRF_SUBKEY_WOW6464KEY
-#    define RRF_SUBKEY_WOW6464KEY 0x00010000
-#  endif
 
 // This struct isn't in any SDK header, so this definition was copied from:
 // https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/ntifs/ns-ntifs-_reparse_data_buffer
@@ -42,92 +38,547 @@ typedef struct _REPARSE_DATA_BUFFER {
 #include "updatecommon.h"
 #ifdef XP_WIN
 #  include "updatehelper.h"
+#  include "pathvalidation.h"
+#  include "knownlocations.h"
 #endif
 
-UpdateLog::UpdateLog() : logFP(nullptr), mDstFilePath(L"\0") {}
+UpdateLog::UpdateLog()
+    : mLogFile(nullptr),
+      mIsOpen(false),
+      mFileSize(0),
+      mMaxFileSize(0),
+      mRollover(nullptr),
+      mRecordFile(nullptr),
+      mRenderer(nullptr),
+      mWriterThread(nullptr),
+      mWakeEvent(nullptr),
+      mEnqueuePos(0),
+      mDequeuePos(0),
+      mFlushTarget(0),
+      mDropped(0),
+      mWriterIdle(false),
+      mStopping(false),
+      mOverflowPolicy(LOG_OVERFLOW_BLOCK),
+      mDurablePos(0),
+      mClosed(true),
+      mDstFilePath(L"\0") {
+  InitializeSRWLock(&mWriteLock);
+  InitializeConditionVariable(&mDurable);
+}
 
 void UpdateLog::Init(TCHAR* logFilePath) {
-  if (logFP) {
+  if (mIsOpen.load()) {
     return;
   }
 
   // When the path is over the length limit disable logging by not opening the
-  // file and not setting logFP.
+  // file and not setting mLogFile.
   size_t dstFilePathLen = wcslen(logFilePath);
-  if (dstFilePathLen > 0 && dstFilePathLen < MAXPATHLEN - 1) {
-    wcsncpy_s(mDstFilePath, MAXPATHLEN, logFilePath, MAXPATHLEN - 1);
+  if (dstFilePathLen == 0 || dstFilePathLen >= MAXPATHLEN - 1) {
+    return;
+  }
+  wcsncpy_s(mDstFilePath, MAXPATHLEN, logFilePath, MAXPATHLEN - 1);
+
+  HANDLE logFile;
 #if defined(XP_WIN) || defined(XP_MACOSX)
-    _wfopen_s(&logFP, mDstFilePath, L"w");
+  logFile = CreateFileW(mDstFilePath, GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
 #else
-    // On platforms that have an updates directory in the installation directory
-    // (e.g. platforms other than Windows and Mac) the update log is written to
-    // a temporary file and then to the update log file. This is needed since
-    // the installation directory is moved during a replace request. This can be
-    // removed when the platform's updates directory is located outside of the
-    // installation directory.
-    logFP = tmpfile();
+  // On platforms that have an updates directory in the installation directory
+  // (e.g. platforms other than Windows and Mac) the update log is written to
+  // a temporary file and then to the update log file. This is needed since
+  // the installation directory is moved during a replace request. This can be
+  // removed when the platform's updates directory is located outside of the
+  // installation directory.
+  WCHAR tmpDir[MAX_PATH + 1];
+  WCHAR tmpPath[MAX_PATH + 1];
+  logFile = INVALID_HANDLE_VALUE;
+  if (GetTempPathW(MAX_PATH + 1, tmpDir) &&
+      GetTempFileNameW(tmpDir, L"log", 0, tmpPath)) {
+    logFile = CreateFileW(tmpPath, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                          nullptr);
+  }
 #endif
+  if (INVALID_HANDLE_VALUE == logFile) {
+    return;
+  }
+
+  if (!mSlots) {
+    mSlots.reset(new LogSlot[LOG_RING_SLOTS]);
+    mBatch.reset(new char[LOG_BATCH_SIZE]);
+    mRecordBatch.reset(new char[LOG_BATCH_SIZE]);
+  }
+  for (size_t i = 0; i < LOG_RING_SLOTS; ++i) {
+    mSlots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  mEnqueuePos.store(0, std::memory_order_relaxed);
+  mDequeuePos = 0;
+  mFlushTarget.store(0, std::memory_order_relaxed);
+  mDropped.store(0, std::memory_order_relaxed);
+  mDurablePos = 0;
+  mFileSize = 0;
+  mStopping.store(false);
+  mWriterIdle.store(false);
+
+  // The writer thread uses the file right away. It is started before the log
+  // opens, so nothing is logged before callers can tell whether it runs.
+  // Without a writer thread each line is written as it is logged.
+  AcquireSRWLockExclusive(&mWriteLock);
+  mLogFile = logFile;
+  mClosed = false;
+  ReleaseSRWLockExclusive(&mWriteLock);
+  if (!mWakeEvent) {
+    mWakeEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+  }
+  if (mWakeEvent) {
+    mWriterThread.store(
+        CreateThread(nullptr, 0, WriterThreadProc, this, 0, nullptr));
+  }
+  mIsOpen.store(true);
+}
+
+/**
+ * Opens the file binary records are appended to. A file which doesn't start
+ * with fileHeader, or which has grown past maxFileSize, is started over. Must
+ * be called after Init and before any record is logged.
+ *
+ * @param recordFilePath The file to append the records to
+ * @param fileHeader     What the file starts with
+ * @param fileHeaderSize The size of @fileHeader in bytes
+ * @param maxFileSize    The size past which the file is started over
+ */
+void UpdateLog::InitRecords(TCHAR* recordFilePath, const void* fileHeader,
+                            DWORD fileHeaderSize, ULONGLONG maxFileSize) {
+  if (!mIsOpen.load() || mRecordFile.load()) {
+    return;
+  }
+
+  HANDLE recordFile =
+      CreateFileW(recordFilePath, GENERIC_READ | GENERIC_WRITE,
+                  FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                  nullptr);
+  if (INVALID_HANDLE_VALUE == recordFile) {
+    return;
+  }
+
+  BYTE existingHeader[64];
+  DWORD readAmount = 0;
+  LARGE_INTEGER existingSize;
+  bool headerMatches =
+      GetFileSizeEx(recordFile, &existingSize) &&
+      static_cast<ULONGLONG>(existingSize.QuadPart) <= maxFileSize &&
+      fileHeaderSize <= sizeof(existingHeader) &&
+      ReadFile(recordFile, existingHeader, fileHeaderSize, &readAmount,
+               nullptr) &&
+      readAmount == fileHeaderSize &&
+      !memcmp(existingHeader, fileHeader, fileHeaderSize);
+
+  LARGE_INTEGER offset = {};
+  if (!headerMatches) {
+    DWORD wrote = 0;
+    if (!SetFilePointerEx(recordFile, offset, nullptr, FILE_BEGIN) ||
+        !SetEndOfFile(recordFile) ||
+        !WriteFile(recordFile, fileHeader, fileHeaderSize, &wrote, nullptr) ||
+        wrote != fileHeaderSize) {
+      CloseHandle(recordFile);
+      return;
+    }
+  } else if (!SetFilePointerEx(recordFile, offset, nullptr, FILE_END)) {
+    CloseHandle(recordFile);
+    return;
   }
+  mRecordFile.store(recordFile);
 }
 
+/**
+ * Writes the lines logged so far and closes the log. Threads may still be
+ * logging, lines they log after the log closed are dropped.
+ */
 void UpdateLog::Finish() {
-  if (!logFP) {
+  if (!mIsOpen.exchange(false)) {
     return;
   }
 
-  fclose(logFP);
-  logFP = nullptr;
+  HANDLE writerThread = mWriterThread.load();
+  if (writerThread) {
+    mStopping.store(true);
+    SetEvent(mWakeEvent);
+    WaitForSingleObject(writerThread, INFINITE);
+  }
+
+  AcquireSRWLockExclusive(&mWriteLock);
+  mWriterThread.store(nullptr);
+  // Lines published by threads which were logging while the writer stopped.
+  WriteReadyLines();
+  FlushFileBuffers(mLogFile);
+  HANDLE recordFile = mRecordFile.exchange(nullptr);
+  if (recordFile) {
+    FlushFileBuffers(recordFile);
+    CloseHandle(recordFile);
+  }
+  CloseHandle(mLogFile);
+  mLogFile = nullptr;
+  mClosed = true;
+  mDurablePos = mDequeuePos;
+  ReleaseSRWLockExclusive(&mWriteLock);
+  WakeAllConditionVariable(&mDurable);
+
+  if (writerThread) {
+    CloseHandle(writerThread);
+  }
 }
 
+/**
+ * Waits until every line logged before the call is written and flushed to
+ * disk.
+ */
 void UpdateLog::Flush() {
-  if (!logFP) {
+  if (!mIsOpen.load()) {
     return;
   }
 
-  fflush(logFP);
+  size_t target = mEnqueuePos.load();
+  if (!mWriterThread.load()) {
+    AcquireSRWLockExclusive(&mWriteLock);
+    if (!mClosed) {
+      FlushFileBuffers(mLogFile);
+      HANDLE recordFile = mRecordFile.load();
+      if (recordFile) {
+        FlushFileBuffers(recordFile);
+      }
+    }
+    ReleaseSRWLockExclusive(&mWriteLock);
+    return;
+  }
+
+  size_t requested = mFlushTarget.load();
+  while (requested < target &&
+         !mFlushTarget.compare_exchange_weak(requested, target)) {
+  }
+  SetEvent(mWakeEvent);
+
+  // A line published after the writer stopped is only written by Finish.
+  AcquireSRWLockExclusive(&mWriteLock);
+  while (mDurablePos < target && !mClosed) {
+    SleepConditionVariableSRW(&mDurable, &mWriteLock, INFINITE, 0);
+  }
+  ReleaseSRWLockExclusive(&mWriteLock);
 }
 
 void UpdateLog::Printf(const char* fmt, ...) {
-  if (!logFP) {
+  if (!mIsOpen.load(std::memory_order_relaxed)) {
     return;
   }
 
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(logFP, fmt, ap);
-  fprintf(logFP, "\n");
+  Append("", fmt, ap, "");
   va_end(ap);
-#if defined(XP_WIN) && defined(_DEBUG)
-  // When the updater crashes on Windows the log file won't be flushed and this
-  // can make it easier to debug what is going on.
-  fflush(logFP);
-#endif
 }
 
 void UpdateLog::WarnPrintf(const char* fmt, ...) {
-  if (!logFP) {
+  if (!mIsOpen.load(std::memory_order_relaxed)) {
     return;
   }
 
   va_list ap;
   va_start(ap, fmt);
-  fprintf(logFP, "*** Warning: ");
-  vfprintf(logFP, fmt, ap);
-  fprintf(logFP, "***\n");
+  Append("*** Warning: ", fmt, ap, "***");
   va_end(ap);
-#if defined(XP_WIN) && defined(_DEBUG)
-  // When the updater crashes on Windows the log file won't be flushed and this
-  // can make it easier to debug what is going on.
-  fflush(logFP);
-#endif
 }
 
-#ifdef XP_WIN
-// Deleter for use with unique_ptr
-struct CoTaskMemFreeDeleter {
-    void operator()(void* aPtr) { ::CoTaskMemFree(aPtr); }
-};
+/**
+ * Claims the next free slot of the ring for a new line.
+ *
+ * @param  pos Out parameter for the position of the line
+ * @return The slot or nullptr when the ring is full.
+ */
+UpdateLog::LogSlot* UpdateLog::ClaimSlot(size_t& pos) {
+  pos = mEnqueuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    LogSlot* slot = &mSlots[pos & (LOG_RING_SLOTS - 1)];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    intptr_t difference =
+        static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (difference == 0) {
+      if (mEnqueuePos.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+        return slot;
+      }
+    } else if (difference < 0) {
+      return nullptr;
+    } else {
+      pos = mEnqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Claims a slot for a new line, applying the overflow policy when the ring
+ * is full.
+ *
+ * @param  pos Out parameter for the position of the line
+ * @return The slot or nullptr if the line is dropped.
+ */
+UpdateLog::LogSlot* UpdateLog::AcquireSlot(size_t& pos) {
+  LogSlot* slot = ClaimSlot(pos);
+  while (!slot) {
+    if (LOG_OVERFLOW_DROP == mOverflowPolicy) {
+      mDropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    if (mWriterThread.load()) {
+      SetEvent(mWakeEvent);
+      Sleep(1);
+    } else {
+      AcquireSRWLockExclusive(&mWriteLock);
+      bool closed = mClosed;
+      if (!closed) {
+        WriteReadyLines();
+      }
+      ReleaseSRWLockExclusive(&mWriteLock);
+      if (closed) {
+        return nullptr;
+      }
+    }
+    slot = ClaimSlot(pos);
+  }
+  return slot;
+}
+
+/**
+ * Hands a filled in slot over to the writer.
+ */
+void UpdateLog::Publish(LogSlot* slot, size_t pos) {
+  slot->sequence.store(pos + 1, std::memory_order_release);
+
+  if (!mWriterThread.load()) {
+    AcquireSRWLockExclusive(&mWriteLock);
+    if (!mClosed) {
+      WriteReadyLines();
+    }
+    ReleaseSRWLockExclusive(&mWriteLock);
+  } else if (mWriterIdle.load()) {
+    SetEvent(mWakeEvent);
+  }
+}
+
+void UpdateLog::Append(const char* prefix, const char* fmt, va_list ap,
+                       const char* suffix) {
+  size_t pos;
+  LogSlot* slot = AcquireSlot(pos);
+  if (!slot) {
+    return;
+  }
+
+  // Leave room for the suffix and the line break.
+  size_t prefixLen = strlen(prefix);
+  size_t suffixLen = strlen(suffix);
+  size_t available = LOG_LINE_MAX - prefixLen - suffixLen - 1;
+  memcpy(slot->text, prefix, prefixLen);
+  int formatted =
+      _vsnprintf_s(slot->text + prefixLen, available, _TRUNCATE, fmt, ap);
+  size_t length = prefixLen + strlen(slot->text + prefixLen);
+  const size_t markerLen = sizeof(LOG_TRUNCATED_MARKER) - 1;
+  if (formatted < 0 && length - prefixLen >= markerLen) {
+    length -= markerLen;
+    memcpy(slot->text + length, LOG_TRUNCATED_MARKER, markerLen);
+    length += markerLen;
+  }
+  memcpy(slot->text + length, suffix, suffixLen);
+  length += suffixLen;
+  slot->text[length++] = '\n';
+  slot->length = static_cast<DWORD>(length);
+  slot->isRecord = false;
+  Publish(slot, pos);
+}
 
+/**
+ * Logs a binary record. Records larger than LOG_LINE_MAX are dropped.
+ */
+void UpdateLog::AppendRecord(const void* record, DWORD recordSize) {
+  if (!mIsOpen.load(std::memory_order_relaxed) || recordSize > LOG_LINE_MAX) {
+    return;
+  }
+
+  size_t pos;
+  LogSlot* slot = AcquireSlot(pos);
+  if (!slot) {
+    return;
+  }
+  memcpy(slot->text, record, recordSize);
+  slot->length = recordSize;
+  slot->isRecord = true;
+  Publish(slot, pos);
+}
+
+void UpdateLog::WriteBatch(HANDLE file, const char* data, DWORD length) {
+  while (length) {
+    DWORD wrote = 0;
+    if (!WriteFile(file, data, length, &wrote, nullptr) || !wrote) {
+      // There is nowhere left to report this, the lines are lost.
+      return;
+    }
+    data += wrote;
+    length -= wrote;
+    if (file == mLogFile) {
+      mFileSize += wrote;
+    }
+  }
+}
+
+/**
+ * Continues the log in the next file once the current one reached its size
+ * limit. The last line of the old file points to the new one.
+ */
+void UpdateLog::RollOver() {
+  WCHAR nextPath[MAX_PATH + 1] = {L'\0'};
+  HANDLE nextFile = INVALID_HANDLE_VALUE;
+  if (mRollover(nextPath)) {
+    nextFile = CreateFileW(nextPath, GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  }
+  if (INVALID_HANDLE_VALUE == nextFile) {
+    // Try again once another mMaxFileSize bytes were written.
+    mFileSize = 0;
+    return;
+  }
+
+  char line[MAX_PATH * 2 + 32];
+  int length = sprintf_s(line, sizeof(line), "Log continues in %ls\r\n",
+                         nextPath);
+  if (length > 0) {
+    WriteBatch(mLogFile, line, static_cast<DWORD>(length));
+  }
+  FlushFileBuffers(mLogFile);
+  CloseHandle(mLogFile);
+  mLogFile = nextFile;
+  mFileSize = 0;
+  wcsncpy_s(mDstFilePath, MAXPATHLEN, nextPath, MAXPATHLEN - 1);
+}
+
+/**
+ * Writes every line that is ready, in order, batching as many of them into
+ * each WriteFile call as fit. Line breaks are written as CRLF like the text
+ * mode stream the log used to be.
+ */
+void UpdateLog::WriteReadyLines() {
+  char* batch = mBatch.get();
+  DWORD batchLength = 0;
+  HANDLE recordFile = mRecordFile.load();
+  char* recordBatch = mRecordBatch.get();
+  DWORD recordBatchLength = 0;
+
+  unsigned long dropped = mDropped.exchange(0, std::memory_order_relaxed);
+  if (dropped) {
+    batchLength = static_cast<DWORD>(
+        sprintf_s(batch, LOG_BATCH_SIZE,
+                  "*** Warning: %lu log lines were dropped***\r\n", dropped));
+  }
+
+  for (;;) {
+    LogSlot& slot = mSlots[mDequeuePos & (LOG_RING_SLOTS - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != mDequeuePos + 1) {
+      break;
+    }
+
+    const char* text = slot.text;
+    DWORD textLength = slot.length;
+    char rendered[LOG_LINE_MAX];
+    if (slot.isRecord) {
+      if (recordFile) {
+        if (recordBatchLength + slot.length > LOG_BATCH_SIZE) {
+          WriteBatch(recordFile, recordBatch, recordBatchLength);
+          recordBatchLength = 0;
+        }
+        memcpy(recordBatch + recordBatchLength, slot.text, slot.length);
+        recordBatchLength += slot.length;
+      }
+
+      textLength = 0;
+      if (mRenderer) {
+        textLength = mRenderer(reinterpret_cast<const BYTE*>(slot.text),
+                               slot.length, rendered, LOG_LINE_MAX - 1);
+        if (textLength > LOG_LINE_MAX - 1) {
+          textLength = LOG_LINE_MAX - 1;
+        }
+        rendered[textLength++] = '\n';
+      }
+      text = rendered;
+    }
+
+    if (batchLength + 2 * textLength > LOG_BATCH_SIZE) {
+      WriteBatch(mLogFile, batch, batchLength);
+      batchLength = 0;
+    }
+    for (DWORD i = 0; i < textLength; ++i) {
+      if (text[i] == '\n') {
+        batch[batchLength++] = '\r';
+      }
+      batch[batchLength++] = text[i];
+    }
+
+    slot.sequence.store(mDequeuePos + LOG_RING_SLOTS,
+                        std::memory_order_release);
+    ++mDequeuePos;
+  }
+
+  WriteBatch(mLogFile, batch, batchLength);
+  if (recordBatchLength) {
+    WriteBatch(recordFile, recordBatch, recordBatchLength);
+  }
+
+  if (mRollover && mMaxFileSize && mFileSize >= mMaxFileSize) {
+    RollOver();
+  }
+}
+
+void UpdateLog::RunWriter() {
+  ULONGLONG lastDurableFlush = GetTickCount64();
+  for (;;) {
+    bool stopping = mStopping.load();
+    WriteReadyLines();
+
+    // Written lines survive the service crashing, flushing them to disk
+    // makes them survive the machine going down too.
+    ULONGLONG now = GetTickCount64();
+    if (mDequeuePos != mDurablePos &&
+        (stopping || mFlushTarget.load() > mDurablePos ||
+         now - lastDurableFlush >= LOG_DURABLE_FLUSH_INTERVAL_MS)) {
+      FlushFileBuffers(mLogFile);
+      HANDLE recordFile = mRecordFile.load();
+      if (recordFile) {
+        FlushFileBuffers(recordFile);
+      }
+      lastDurableFlush = now;
+      AcquireSRWLockExclusive(&mWriteLock);
+      mDurablePos = mDequeuePos;
+      ReleaseSRWLockExclusive(&mWriteLock);
+      WakeAllConditionVariable(&mDurable);
+    }
+
+    if (stopping) {
+      return;
+    }
+
+    // Check for a line again after going idle, a line logged before that
+    // didn't wake us.
+    mWriterIdle.store(true);
+    LogSlot& next = mSlots[mDequeuePos & (LOG_RING_SLOTS - 1)];
+    if (next.sequence.load(std::memory_order_acquire) != mDequeuePos + 1) {
+      WaitForSingleObject(mWakeEvent, LOG_DURABLE_FLUSH_INTERVAL_MS);
+    }
+    mWriterIdle.store(false);
+  }
+}
+
+DWORD WINAPI UpdateLog::WriterThreadProc(LPVOID param) {
+  static_cast<UpdateLog*>(param)->RunWriter();
+  return 0;
+}
+
+#ifdef XP_WIN
 /**
  * Determine if a path contains symlinks or junctions to disallowed locations
  *
@@ -141,6 +592,8 @@ bool PathContainsInvalidLinks(wchar_t* const fullPath) {
   wchar_t* remainingPath = nullptr;
   wchar_t* nextToken = wcstok_s(pathCopy, L"\\", &remainingPath);
   wchar_t* partialPath = nextToken;
+  // Only allocated once a reparse point is found, and then reused.
+  std::unique_ptr<UINT8[]> byteBuffer;
 
   while (nextToken) {
     if ((GetFileAttributesW(partialPath) & FILE_ATTRIBUTE_REPARSE_POINT) != 0) {
@@ -158,8 +611,10 @@ bool PathContainsInvalidLinks(wchar_t* const fullPath) {
         }
       }
 
-      std::unique_ptr<UINT8[]> byteBuffer =
-          std::make_unique<UINT8[]>(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
+      if (!byteBuffer) {
+        byteBuffer =
+            std::make_unique<UINT8[]>(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
+      }
       ZeroMemory(byteBuffer.get(), MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
       REPARSE_DATA_BUFFER* buffer = (REPARSE_DATA_BUFFER*)byteBuffer.get();
       DWORD bytes = 0;
@@ -213,135 +668,40 @@ bool PathContainsInvalidLinks(wchar_t* const fullPath) {
 /**
  * Determine if a path is located within Program Files, either native or x86
  *
+ * Both Program Files directories are resolved once per process, see
+ * KnownLocations, so this only has to get the long path of fullPath.
+ *
  * @param fullPath  The full path to check.
  * @return true if fullPath begins with either Program Files directory,
  *         false if it does not or if an error is encountered
  */
 bool IsProgramFilesPath(TCHAR* fullPath) {
   LOG(("IsProgramFilesPath %ls", fullPath));
-  // Make sure we don't try to compare against a short path.
-  DWORD longInstallPathChars = GetLongPathNameW(fullPath, nullptr, 0);
-  if (longInstallPathChars == 0) {
-    LOG_WARN(("Failed because short path"));
-    return false;
-  }
-  std::unique_ptr<wchar_t[]> longInstallPath =
-      std::make_unique<wchar_t[]>(longInstallPathChars);
-  if (!GetLongPathNameW(fullPath, longInstallPath.get(),
-                        longInstallPathChars)) {
-    LOG_WARN(("Failed to get long path name"));
-    return false;
-  }
-
-  // First check for Program Files (x86).
-  {
-    PWSTR programFiles32PathRaw = nullptr;
-    // FOLDERID_ProgramFilesX86 gets native Program Files directory on a 32-bit
-    // OS or the (x86) directory on a 64-bit OS regardless of this binary's
-    // bitness.
-    if (FAILED(SHGetKnownFolderPath(FOLDERID_ProgramFilesX86, 0, nullptr,
-                                    &programFiles32PathRaw))) {
-      // That call should never fail on any supported OS version.
-      LOG_WARN(("Failed SHGetKnownFolderPath"));
+  // Make sure we don't try to compare against a short path. Most paths fit
+  // the stack buffer, so GetLongPathNameW is usually called once.
+  wchar_t longPathBuf[MAXPATHLEN];
+  std::unique_ptr<wchar_t[]> longPathHeap;
+  wchar_t* longInstallPath = longPathBuf;
+  DWORD longInstallPathChars =
+      GetLongPathNameW(fullPath, longPathBuf, ARRAYSIZE(longPathBuf));
+  if (longInstallPathChars >= ARRAYSIZE(longPathBuf)) {
+    longPathHeap = std::make_unique<wchar_t[]>(longInstallPathChars);
+    longInstallPath = longPathHeap.get();
+    if (!GetLongPathNameW(fullPath, longInstallPath, longInstallPathChars)) {
+      LOG_WARN(("Failed to get long path name"));
       return false;
     }
-    std::unique_ptr<wchar_t, CoTaskMemFreeDeleter>
-        programFiles32Path(programFiles32PathRaw);
-    // We need this path to have a trailing slash so our prefix test doesn't
-    // match on a different folder which happens to have a name beginning with
-    // the prefix we're looking for but then also more characters after that.
-    size_t length = wcslen(programFiles32Path.get());
-    if (length == 0) {
-      LOG_WARN(("Failed length"));
-      return false;
-    }
-    if (programFiles32Path.get()[length - 1] == L'\\') {
-      if (_wcsnicmp(longInstallPath.get(), programFiles32Path.get(), length) ==
-          0) {
-        return true;
-      }
-    } else {
-      // Allocate space for a copy of the string along with a terminator and one
-      // extra character for the trailing backslash.
-      length += 1;
-      auto programFiles32PathWithSlash =
-          std::make_unique<wchar_t[]>(length + 1);
-
-      mywcsprintf(programFiles32PathWithSlash.get(), length + 1, L"%s\\",
-                   programFiles32Path.get());
-
-      if (_wcsnicmp(longInstallPath.get(), programFiles32PathWithSlash.get(),
-                   length) == 0) {
-        return true;
-      }
-    }
-  }
-
-  // If we didn't find (x86), check for the native Program Files.
-  {
-    // In case we're a 32-bit binary on 64-bit Windows, we now have a problem
-    // getting the right "native" Program Files path, which is that there is no
-    // FOLDERID_* value that returns that path. So we always read that one out
-    // of its canonical registry location instead. If we're on a 32-bit OS, this
-    // will be the same path that we just checked. First get the buffer size to
-    // allocate for the path.
-    DWORD length = 0;
-    if (RegGetValueW(HKEY_LOCAL_MACHINE,
-                     L"Software\\Microsoft\\Windows\\CurrentVersion",
-                     L"ProgramFilesDir", RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY,
-                     nullptr, nullptr, &length) != ERROR_SUCCESS) {
-      LOG_WARN(("Failed getting native Program Files length"));
-      return false;
-    }
-    // RegGetValue returns the length including the terminator, but it's in
-    // bytes, so convert that to characters.
-    DWORD lengthChars = (length / sizeof(wchar_t));
-    if (lengthChars <= 1) {
-      LOG_WARN(("Failed length native"));
-      return false;
-    }
-    auto programFilesNativePath =
-        std::make_unique<wchar_t[]>(lengthChars);
-
-    // Now actually read the value.
-    if (RegGetValueW(
-            HKEY_LOCAL_MACHINE, L"Software\\Microsoft\\Windows\\CurrentVersion",
-            L"ProgramFilesDir", RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY, nullptr,
-            programFilesNativePath.get(), &length) != ERROR_SUCCESS) {
-      LOG_WARN(("Failed getting native Program Files"));
-      return false;
-    }
-    size_t nativePathStrLen =
-        wcsnlen_s(programFilesNativePath.get(), lengthChars);
-    if (nativePathStrLen == 0) {
-      LOG_WARN(("Failed length native path"));
-      return false;
-    }
-
-    // As before, append a backslash if there isn't one already.
-    if (programFilesNativePath.get()[nativePathStrLen - 1] == L'\\') {
-      if (_wcsnicmp(longInstallPath.get(), programFilesNativePath.get(),
-                   nativePathStrLen) == 0) {
-        return true;
-      }
-    } else {
-      // Allocate space for a copy of the string along with a terminator and one
-      // extra character for the trailing backslash.
-      nativePathStrLen += 1;
-      auto programFilesNativePathWithSlash =
-          std::make_unique<wchar_t[]>(nativePathStrLen + 1);
-
-      mywcsprintf(programFilesNativePathWithSlash.get(), nativePathStrLen + 1,
-                   L"%s\\", programFilesNativePath.get());
-
-      if (_wcsnicmp(longInstallPath.get(), programFilesNativePathWithSlash.get(),
-                   nativePathStrLen) == 0) {
-        return true;
-      }
-    }
+  } else if (longInstallPathChars == 0) {
+    LOG_WARN(("Failed because short path"));
+    return false;
   }
 
-  return false;
+  KnownLocations& locations = KnownLocations::GetDefault();
+  // First check for Program Files (x86), then for the native Program Files.
+  return locations.Contains(KNOWN_LOCATION_PROGRAM_FILES_X86,
+                            longInstallPath) ||
+         locations.Contains(KNOWN_LOCATION_PROGRAM_FILES_NATIVE,
+                            longInstallPath);
 }
 #endif
 
@@ -399,7 +759,7 @@ bool IsValidFullPath(TCHAR* origFullPath) {
     }
   }
 
-  if (PathContainsInvalidLinks(canonicalPath)) {
+  if (!PathHasOnlyAllowedLinks(canonicalPath)) {
     LOG_WARN(("Path contains invalid links"));
     return false;
   }
@@ -6,6 +6,8 @@
 #define UPDATECOMMON_H
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <atomic>
 #include <memory>
 #include <windows.h>
 
@@ -44,6 +46,45 @@ struct HandleModuleDeleter {
 };
 typedef std::unique_ptr<HMODULE, HandleModuleDeleter> autoModuleHandle;
 
+// Longest line the log keeps, counting its prefix and line break. A longer
+// line from Printf or WarnPrintf is cut short and ends in
+// LOG_TRUNCATED_MARKER. Binary records longer than this are dropped.
+#define LOG_LINE_MAX 1024
+#define LOG_TRUNCATED_MARKER "[truncated]"
+// Lines waiting for the writer thread, must be a power of 2.
+#define LOG_RING_SLOTS 256
+// How much the writer thread hands to a single WriteFile call.
+#define LOG_BATCH_SIZE (64 * 1024)
+// Written lines are flushed to disk at least this often.
+#define LOG_DURABLE_FLUSH_INTERVAL_MS 1000
+
+// Renders a binary log record as a line of text, see SetRecordRenderer.
+// Returns the length of the text, which doesn't need to be terminated.
+typedef DWORD (*LogRecordRenderer)(const BYTE* record, DWORD recordSize,
+                                   char* text, DWORD textSize);
+
+// Obtains the path of the file the log continues in once the current one
+// reaches its size limit, see SetRollover.
+typedef BOOL (*LogRolloverHandler)(LPWSTR nextLogPath);
+
+// What to do with a line when the writer thread has fallen behind.
+enum LogOverflowPolicy {
+  // Drop the line, the writer reports how many lines were dropped.
+  LOG_OVERFLOW_DROP,
+  // Wait for the writer thread to make room.
+  LOG_OVERFLOW_BLOCK
+};
+
+/**
+ * The log is written by a background thread. Printf and WarnPrintf format
+ * the line straight into a slot of a lock-free ring and return, the writer
+ * thread writes whatever lines are ready with a single WriteFile call and
+ * flushes them to disk periodically and on Flush.
+ *
+ * Binary records logged with AppendRecord go through the same ring, they are
+ * written to the record file given to InitRecords and, when a renderer is
+ * set, rendered into the text log by the writer thread.
+ */
 class UpdateLog {
  public:
   static UpdateLog& GetPrimaryLog() {
@@ -52,16 +93,87 @@ class UpdateLog {
   }
 
   void Init(TCHAR* logFilePath);
+  void InitRecords(TCHAR* recordFilePath, const void* fileHeader,
+                   DWORD fileHeaderSize, ULONGLONG maxFileSize);
   void Finish();
   void Flush();
   void Printf(const char* fmt, ...);
   void WarnPrintf(const char* fmt, ...);
+  void AppendRecord(const void* record, DWORD recordSize);
+  void SetOverflowPolicy(LogOverflowPolicy policy) { mOverflowPolicy = policy; }
+  void SetRecordRenderer(LogRecordRenderer renderer) { mRenderer = renderer; }
+  // Must be called before Init.
+  void SetRollover(ULONGLONG maxFileSize, LogRolloverHandler handler) {
+    mMaxFileSize = maxFileSize;
+    mRollover = handler;
+  }
 
-  ~UpdateLog() { Finish(); }
+  ~UpdateLog() {
+    Finish();
+    if (mWakeEvent) {
+      CloseHandle(mWakeEvent);
+    }
+  }
 
  protected:
   UpdateLog();
-  FILE* logFP;
+
+ private:
+  struct LogSlot {
+    // pos + 1 once the line for pos is ready to be written and
+    // pos + LOG_RING_SLOTS once the slot can take the next line.
+    std::atomic<size_t> sequence;
+    DWORD length;
+    bool isRecord;
+    char text[LOG_LINE_MAX];
+  };
+
+  void Append(const char* prefix, const char* fmt, va_list ap,
+              const char* suffix);
+  LogSlot* ClaimSlot(size_t& pos);
+  LogSlot* AcquireSlot(size_t& pos);
+  void Publish(LogSlot* slot, size_t pos);
+  void WriteReadyLines();
+  void WriteBatch(HANDLE file, const char* data, DWORD length);
+  void RollOver();
+  void RunWriter();
+  static DWORD WINAPI WriterThreadProc(LPVOID param);
+
+  // Only used by the writer thread while there is one, and otherwise under
+  // mWriteLock. Replaced by the writer when the log rolls over.
+  HANDLE mLogFile;
+  std::atomic<bool> mIsOpen;
+  ULONGLONG mFileSize;
+  ULONGLONG mMaxFileSize;
+  LogRolloverHandler mRollover;
+  // Set by InitRecords while the writer thread may already be running.
+  std::atomic<HANDLE> mRecordFile;
+  LogRecordRenderer mRenderer;
+  // Only cleared under mWriteLock once the writer thread exited, so a
+  // caller which sees no writer thread can take over writing the lines.
+  std::atomic<HANDLE> mWriterThread;
+  // Kept for the lifetime of the log, so waking the writer is safe even
+  // while it is finishing.
+  HANDLE mWakeEvent;
+  std::unique_ptr<LogSlot[]> mSlots;
+  std::unique_ptr<char[]> mBatch;
+  std::unique_ptr<char[]> mRecordBatch;
+  std::atomic<size_t> mEnqueuePos;
+  // Only touched by whoever writes the lines.
+  size_t mDequeuePos;
+  std::atomic<size_t> mFlushTarget;
+  std::atomic<unsigned long> mDropped;
+  std::atomic<bool> mWriterIdle;
+  std::atomic<bool> mStopping;
+  LogOverflowPolicy mOverflowPolicy;
+  // Guards mDurablePos and mClosed, and writing lines when there is no
+  // writer thread.
+  SRWLOCK mWriteLock;
+  CONDITION_VARIABLE mDurable;
+  size_t mDurablePos;
+  // Set by Finish once the files are closed. Lines logged by threads which
+  // were still logging then are dropped.
+  bool mClosed;
   TCHAR mDstFilePath[MAXPATHLEN];
 };
 
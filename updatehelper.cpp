@@ -4,11 +4,10 @@
 
 #include <windows.h>
 
-// Needed for CreateToolhelp32Snapshot
-#include <tlhelp32.h>
-
 #include <stdio.h>
+#include <algorithm>
 #include <memory>
+#include <vector>
 #include <direct.h>
 #include "shlobj.h"
 
@@ -23,6 +22,12 @@
 #  include "uachelper.h"
 
 #include "updatecommon.h"
+#include "servicewait.h"
+#include "processlist.h"
+#include "retrypolicy.h"
+#include "knownlocations.h"
+#include "updatestatus.h"
+#include "uuidgen.h"
 
 BOOL PathGetSiblingFilePath(LPWSTR destinationBuffer, LPCWSTR siblingFilePath,
                             LPCWSTR newFileName);
@@ -63,38 +68,18 @@ BOOL PathGetSiblingFilePath(LPWSTR destinationBuffer, LPCWSTR siblingFilePath,
  * @return TRUE if successful
  */
 BOOL GetSecureOutputDirectoryPath(LPWSTR outBuf) {
-  PWSTR progFilesX86;
-  if (FAILED(SHGetKnownFolderPath(FOLDERID_ProgramFilesX86, KF_FLAG_CREATE,
-                                  nullptr, &progFilesX86))) {
+  // Resolved and created once per process, see KnownLocations.
+  KnownLocations& locations = KnownLocations::GetDefault();
+  std::wstring secureOutputDir;
+  if (!locations.EnsureCreated(KNOWN_LOCATION_SECURE_OUTPUT) ||
+      !locations.GetPath(KNOWN_LOCATION_SECURE_OUTPUT, secureOutputDir)) {
     return FALSE;
   }
-  if (wcslen(progFilesX86) > MAX_PATH) {
-    CoTaskMemFree(progFilesX86);
+  // PathAppendSafe would not have made a path this long either.
+  if (secureOutputDir.size() >= MAX_PATH) {
     return FALSE;
   }
-  wcsncpy_s(outBuf, MAX_PATH + 1, progFilesX86, MAX_PATH);
-  CoTaskMemFree(progFilesX86);
-
-  if (!PathAppendSafe(outBuf, L"Aveo System\\Update Service")) {
-      return FALSE;
-  }
-
-  // Create the Update Service directory in case it doesn't exist.
-  if (!CreateDirectoryW(outBuf, nullptr) &&
-      GetLastError() != ERROR_ALREADY_EXISTS) {
-      return FALSE;
-  }
-
-  if (!PathAppendSafe(outBuf, L"UpdateLogs")) {
-      return FALSE;
-  }
-
-  // Create the secure update output directory in case it doesn't exist.
-  if (!CreateDirectoryW(outBuf, nullptr) &&
-      GetLastError() != ERROR_ALREADY_EXISTS) {
-      return FALSE;
-  }
-
+  wcsncpy_s(outBuf, MAX_PATH + 1, secureOutputDir.c_str(), MAX_PATH);
   return TRUE;
 }
 
@@ -199,58 +184,160 @@ BOOL GetSecureOutputFilePath(LPCWSTR patchDirPath, LPCWSTR fileExt,
 }
 
 /**
- * Writes a UUID to the ID file in the secure output directory. This is used by
- * the unelevated updater to determine whether an existing update status file in
- * the secure output directory has been updated.
+ * Removes the update status and log files from the secure output directory.
  *
  * @param  patchDirPath
  *         The path to the update patch directory.
+ */
+void RemoveSecureOutputFiles(LPCWSTR patchDirPath) {
+  WCHAR filePath[MAX_PATH + 1] = {L'\0'};
+  if (GetSecureOutputFilePath(patchDirPath, L".id", filePath)) {
+    (void)_wremove(filePath);
+  }
+  if (GetSecureOutputFilePath(patchDirPath, L".status", filePath)) {
+    (void)_wremove(filePath);
+  }
+  if (GetSecureOutputFilePath(patchDirPath, L".log", filePath)) {
+    (void)_wremove(filePath);
+  }
+}
+
+/**
+ * Obtains the path of the status record of an installation in the secure
+ * output directory. The record is named by the hash of the installation path,
+ * like the registry key of the installation.
+ *
+ * Example
+ * Installation directory parameter:
+ *   C:\Program Files (x86)\Aveo Systems\Mira Connect
+ * Destination buffer value:
+ *   C:\Program Files\Aveo Systems\Update Service\UpdateLogs\
+ *       0123456789ABCDEF0123456789ABCDEF.record
+ *
+ * @param  installDir
+ *         The installation being updated.
+ * @param  outBuf
+ *         A buffer of size MAX_PATH + 1 to store the result.
  * @return TRUE if successful
  */
-BOOL WriteSecureIDFile(LPCWSTR patchDirPath) {
-  WCHAR uuidString[MAX_PATH + 1] = {L'\0'};
-  if (!GetUUIDString(uuidString)) {
+static BOOL GetSecureStatusRecordPath(LPCWSTR installDir, LPWSTR outBuf) {
+  WCHAR registryPath[MAX_PATH + 1] = {L'\0'};
+  if (!CalculateRegistryPathFromFilePath(installDir, registryPath)) {
     return FALSE;
   }
-
-  WCHAR idFilePath[MAX_PATH + 1] = {L'\0'};
-  if (!GetSecureOutputFilePath(patchDirPath, L".id", idFilePath)) {
+  WCHAR recordName[MAX_PATH + 1] = {L'\0'};
+  wcsncpy_s(recordName, MAX_PATH + 1, PathFindFileNameW(registryPath),
+            MAX_PATH);
+  if (wcslen(recordName) + wcslen(UPDATE_STATUS_RECORD_EXT) > MAX_PATH) {
     return FALSE;
   }
+  wcsncat_s(recordName, MAX_PATH + 1, UPDATE_STATUS_RECORD_EXT,
+            MAX_PATH - wcslen(recordName));
 
-  FILE* idFile;
-  errno_t error = _wfopen_s(&idFile, idFilePath, L"wb+");
-  if (error != 0 || idFile == nullptr) {
+  if (!GetSecureOutputDirectoryPath(outBuf)) {
     return FALSE;
   }
+  return PathAppendSafe(outBuf, recordName);
+}
 
-  if (fprintf(idFile, "%ls\n", uuidString) == -1) {
-    fclose(idFile);
+/**
+ * Gives a status record the ID and times of a new update attempt.
+ *
+ * @return TRUE if successful
+ */
+static BOOL StartStatusRecord(UpdateStatusRecord& record) {
+  static_assert(UUID_BYTES == UPDATE_STATUS_ID_LENGTH, "A UUID is an ID");
+  if (!UuidGenerator::GetDefault().Generate(record.id)) {
     return FALSE;
   }
+  record.createdTime = GetUpdateStatusTime();
+  record.progress = UPDATE_PROGRESS_NONE;
+  return TRUE;
+}
 
-  fclose(idFile);
+/**
+ * Starts the status record of an update of an installation with a new ID,
+ * in the pending state.
+ *
+ * @param  installDir
+ *         The installation being updated.
+ * @return TRUE if successful
+ */
+BOOL BeginSecureStatusRecord(LPCWSTR installDir) {
+  WCHAR recordPath[MAX_PATH + 1] = {L'\0'};
+  if (!GetSecureStatusRecordPath(installDir, recordPath)) {
+    return FALSE;
+  }
 
-  return TRUE;
+  // The sequence carries on from an earlier record, so a reader which saw it
+  // notices the change even before comparing the ID.
+  UpdateStatusRecord record;
+  uint64_t sequence = 0;
+  if (ReadUpdateStatusFile(recordPath, record)) {
+    sequence = record.sequence + 1;
+  }
+  if (!StartStatusRecord(record)) {
+    return FALSE;
+  }
+  record.state = UPDATE_STATUS_PENDING;
+  record.errorCode = 0;
+  record.updatedTime = record.createdTime;
+  record.sequence = sequence;
+  return WriteUpdateStatusFile(recordPath, record);
 }
 
 /**
- * Removes the update status and log files from the secure output directory.
+ * Updates the status record of an update of an installation. The record is
+ * started if BeginSecureStatusRecord wasn't called for it.
  *
- * @param  patchDirPath
- *         The path to the update patch directory.
+ * @param  installDir
+ *         The installation being updated.
+ * @param  state
+ *         The state of the update
+ * @param  errorCode
+ *         The error code of a failed update, otherwise 0
+ * @param  progress
+ *         The last step of the update which was reached
+ * @return TRUE if successful
  */
-void RemoveSecureOutputFiles(LPCWSTR patchDirPath) {
-  WCHAR filePath[MAX_PATH + 1] = {L'\0'};
-  if (GetSecureOutputFilePath(patchDirPath, L".id", filePath)) {
-    (void)_wremove(filePath);
+BOOL WriteSecureStatusRecord(LPCWSTR installDir, UpdateStatusState state,
+                             int errorCode, UpdateStatusProgress progress) {
+  WCHAR recordPath[MAX_PATH + 1] = {L'\0'};
+  if (!GetSecureStatusRecordPath(installDir, recordPath)) {
+    return FALSE;
   }
-  if (GetSecureOutputFilePath(patchDirPath, L".status", filePath)) {
-    (void)_wremove(filePath);
+
+  UpdateStatusRecord record;
+  if (ReadUpdateStatusFile(recordPath, record)) {
+    ++record.sequence;
+  } else {
+    record.sequence = 0;
+    if (!StartStatusRecord(record)) {
+      return FALSE;
+    }
   }
-  if (GetSecureOutputFilePath(patchDirPath, L".log", filePath)) {
-    (void)_wremove(filePath);
+  record.state = state;
+  record.errorCode = errorCode;
+  record.progress = progress;
+  record.updatedTime = GetUpdateStatusTime();
+  return WriteUpdateStatusFile(recordPath, record);
+}
+
+/**
+ * Reads the status record of the last update of an installation.
+ *
+ * @param  installDir
+ *         The installation being updated.
+ * @param  record
+ *         Set to the record
+ * @return FALSE if there is no valid record.
+ */
+BOOL ReadSecureStatusRecord(LPCWSTR installDir, UpdateStatusRecord& record) {
+  WCHAR recordPath[MAX_PATH + 1] = {L'\0'};
+  if (!GetSecureStatusRecordPath(installDir, recordPath)) {
+    return FALSE;
   }
+  return ReadUpdateStatusFile(recordPath, record);
 }
 
 /**
@@ -383,27 +470,26 @@ StartServiceCommand(int argc, LPCWSTR* argv) {
   }
 
   // Get a handle to the service.
-  SC_HANDLE service = OpenServiceW(serviceManager, SVC_NAME, SERVICE_START);
+  SC_HANDLE service = OpenServiceW(serviceManager, SVC_NAME,
+                                   SERVICE_START | SERVICE_QUERY_STATUS);
   if (!service) {
     CloseServiceHandle(serviceManager);
     return 17002;
   }
 
-  // Wait at most 5 seconds trying to start the service in case of errors
-  // like ERROR_SERVICE_DATABASE_LOCKED or ERROR_SERVICE_REQUEST_TIMEOUT.
-  const DWORD maxWaitMS = 5000;
-  DWORD currentWaitMS = 0;
-  DWORD lastError = ERROR_SUCCESS;
-  while (currentWaitMS < maxWaitMS) {
-    BOOL result = StartServiceW(service, argc, argv);
-    if (result) {
-      lastError = ERROR_SUCCESS;
-      break;
-    } else {
-      lastError = GetLastError();
+  // Retry for a while in case of errors like ERROR_SERVICE_DATABASE_LOCKED
+  // or ERROR_SERVICE_REQUEST_TIMEOUT.
+  RetryStats stats;
+  DWORD lastError = StartServiceWithRetry(service, argc, argv, stats);
+  if (ERROR_SUCCESS != lastError || stats.attempts > 1) {
+    LOG(("StartServiceW took %u attempts in %u ms.  (%lu)", stats.attempts,
+         stats.elapsedMS, lastError));
+    for (uint32_t i = 0;
+         i < stats.attempts && i < RETRY_RECORDED_ATTEMPTS_MAX; ++i) {
+      const RetryAttempt& attempt = stats.recorded[i];
+      LOG(("  attempt %u at %u ms took %u ms.  (%u)", i + 1, attempt.startMS,
+           attempt.durationMS, attempt.error));
     }
-    Sleep(100);
-    currentWaitMS += 100;
   }
   CloseServiceHandle(service);
   CloseServiceHandle(serviceManager);
@@ -440,43 +526,6 @@ LaunchServiceSoftwareUpdateCommand(int argc, LPCWSTR* argv) {
   return ret;
 }
 
-/**
- * Writes a specific failure code for the update status to a file in the secure
- * output directory. The status file's name without the '.' separator and
- * extension is the same as the update directory name.
- *
- * @param  patchDirPath
- *         The path of the update patch directory.
- * @param  errorCode
- *         Error code to set
- * @return TRUE if successful
- */
-BOOL WriteStatusFailure(LPCWSTR patchDirPath, int errorCode) {
-  WCHAR statusFilePath[MAX_PATH + 1] = {L'\0'};
-  if (!GetSecureOutputFilePath(patchDirPath, L".status", statusFilePath)) {
-    return FALSE;
-  }
-
-  HANDLE hStatusFile = CreateFileW(statusFilePath, GENERIC_WRITE, 0, nullptr,
-                                   CREATE_ALWAYS, 0, nullptr);
-  if (hStatusFile == INVALID_HANDLE_VALUE) {
-    return FALSE;
-  }
-
-  char failure[32];
-  sprintf_s(failure, 32, "failed: %d", errorCode);
-  DWORD toWrite = static_cast<DWORD>(strlen(failure));
-  DWORD wrote;
-  BOOL ok = WriteFile(hStatusFile, failure, toWrite, &wrote, nullptr);
-  CloseHandle(hStatusFile);
-
-  if (!ok || wrote != toWrite) {
-    return FALSE;
-  }
-
-  return TRUE;
-}
-
 /**
  * Waits for a service to enter a stopped state.
  * This function does not stop the service, it just blocks until the service
@@ -511,9 +560,6 @@ BOOL WriteStatusFailure(LPCWSTR patchDirPath, int errorCode) {
  */
 DWORD
 WaitForServiceStop(LPCWSTR serviceName, DWORD maxWaitSeconds) {
-  // 0x000000CF is defined above to be not set
-  DWORD lastServiceState = 0x000000CF;
-
   // Get a handle to the SCM database.
   SC_HANDLE serviceManager = OpenSCManager(
       nullptr, nullptr, SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
@@ -549,60 +595,19 @@ WaitForServiceStop(LPCWSTR serviceName, DWORD maxWaitSeconds) {
     }
   }
 
-  DWORD currentWaitMS = 0;
-  SERVICE_STATUS_PROCESS ssp;
-  ssp.dwCurrentState = lastServiceState;
-  while (currentWaitMS < maxWaitSeconds * 1000) {
-    DWORD bytesNeeded;
-    if (!QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp,
-                              sizeof(SERVICE_STATUS_PROCESS), &bytesNeeded)) {
-      DWORD lastError = GetLastError();
-      switch (lastError) {
-        case ERROR_INVALID_HANDLE:
-          ssp.dwCurrentState = 0x000000D9;
-          break;
-        case ERROR_ACCESS_DENIED:
-          ssp.dwCurrentState = 0x000000DA;
-          break;
-        case ERROR_INSUFFICIENT_BUFFER:
-          ssp.dwCurrentState = 0x000000DB;
-          break;
-        case ERROR_INVALID_PARAMETER:
-          ssp.dwCurrentState = 0x000000DC;
-          break;
-        case ERROR_INVALID_LEVEL:
-          ssp.dwCurrentState = 0x000000DD;
-          break;
-        case ERROR_SHUTDOWN_IN_PROGRESS:
-          ssp.dwCurrentState = 0x000000DE;
-          break;
-        // These 3 errors can occur when the service is not yet stopped but
-        // it is stopping.
-        case ERROR_INVALID_SERVICE_CONTROL:
-        case ERROR_SERVICE_CANNOT_ACCEPT_CTRL:
-        case ERROR_SERVICE_NOT_ACTIVE:
-          currentWaitMS += 50;
-          Sleep(50);
-          continue;
-        default:
-          ssp.dwCurrentState = 0x000000DF;
-      }
-
-      // We couldn't query the status so just break out
-      break;
-    }
-
-    // The service is already in use.
-    if (ssp.dwCurrentState == SERVICE_STOPPED) {
-      break;
-    }
-    currentWaitMS += 50;
-    Sleep(50);
+  DWORD lastServiceState;
+  uint32_t elapsedMS = 0;
+  {
+    // Wakes up as soon as the SCM reports the service stopped. The service
+    // handle is closed along with the source.
+    ScmServiceStateSource source(service);
+    lastServiceState = WaitForServiceState(source, SERVICE_STOPPED,
+                                           maxWaitSeconds * 1000, elapsedMS);
   }
-
-  lastServiceState = ssp.dwCurrentState;
-  CloseServiceHandle(service);
   CloseServiceHandle(serviceManager);
+  if (SERVICE_STOPPED == lastServiceState) {
+    LOG(("Service stopped after %u ms.", elapsedMS));
+  }
   return lastServiceState;
 }
 
@@ -617,32 +622,138 @@ WaitForServiceStop(LPCWSTR serviceName, DWORD maxWaitSeconds) {
  **/
 DWORD
 IsProcessRunning(LPCWSTR filename) {
-  // Take a snapshot of all processes in the system.
-  HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
-  if (INVALID_HANDLE_VALUE == snapshot) {
-    return GetLastError();
+  ProcessIdMap running;
+  DWORD lastError = FindRunningProcesses(&filename, 1, running);
+  if (ERROR_SUCCESS != lastError) {
+    return lastError;
   }
+  return running[filename].empty() ? ERROR_NOT_FOUND : ERROR_SUCCESS;
+}
 
-  PROCESSENTRY32W processEntry;
-  processEntry.dwSize = sizeof(PROCESSENTRY32W);
-  if (!Process32FirstW(snapshot, &processEntry)) {
-    DWORD lastError = GetLastError();
-    CloseHandle(snapshot);
+/**
+ * Logs which executables of an installation are running before it is
+ * updated, since the updater has to stop them or replace them in use. Every
+ * executable is looked for in the same process snapshot.
+ *
+ * @param  installDir The installation being updated
+ * @param  updater    The updater, other instances of it are looked for too
+ * @return ERROR_SUCCESS, or a Win32 system error code if the processes
+ *         could not be enumerated.
+ */
+DWORD LogRunningInstallationProcesses(LPCWSTR installDir, LPCWSTR updater) {
+  std::vector<std::wstring> names;
+  WCHAR pattern[MAX_PATH + 1] = {L'\0'};
+  wcsncpy_s(pattern, MAX_PATH + 1, installDir, MAX_PATH);
+  if (PathAppendSafe(pattern, L"*.exe")) {
+    WIN32_FIND_DATAW findData;
+    HANDLE find = FindFirstFileExW(pattern, FindExInfoBasic, &findData,
+                                   FindExSearchNameMatch, nullptr, 0);
+    if (INVALID_HANDLE_VALUE != find) {
+      do {
+        if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+          names.push_back(findData.cFileName);
+        }
+      } while (FindNextFileW(find, &findData));
+      FindClose(find);
+    }
+  }
+  names.push_back(PathFindFileNameW(updater));
+
+  std::vector<LPCWSTR> filenames;
+  for (const std::wstring& name : names) {
+    filenames.push_back(name.c_str());
+  }
+  ProcessIdMap running;
+  DWORD lastError =
+      FindRunningProcesses(filenames.data(), filenames.size(), running);
+  if (ERROR_SUCCESS != lastError) {
     return lastError;
   }
+  for (const auto& entry : running) {
+    if (!entry.second.empty()) {
+      LOG(("%ls is running in %zu processes, the first is %lu.",
+           entry.first.c_str(), entry.second.size(), entry.second[0]));
+    }
+  }
+  return ERROR_SUCCESS;
+}
 
-  do {
-    if (_wcsicmp(filename, processEntry.szExeFile) == 0) {
-      CloseHandle(snapshot);
-      return ERROR_SUCCESS;
+// How often a wait for an application to exit looks for instances which
+// were started since.
+#define PROCESS_RESCAN_INTERVAL_MS 1000
+
+struct WatchedProcess {
+  DWORD processId;
+  autoHandle process;
+};
+
+/**
+ * Opens a handle to wait on for every running instance of an application
+ * which isn't watched yet.
+ *
+ * An instance which exited stays listed for as long as anything holds a
+ * handle to it, and its process ID isn't reused until then. It is kept in
+ * exited, so it isn't opened and found signaled over and over, until it is
+ * no longer listed.
+ *
+ * @param  filename    The application to look for
+ * @param  watched     The instances being watched
+ * @param  exited      The instances which exited but are still listed
+ * @param  unwatchable Set to TRUE if an instance could not be opened
+ * @return ERROR_SUCCESS, or a Win32 system error code if the processes
+ *         could not be enumerated.
+ */
+static DWORD WatchNewInstances(LPCWSTR filename,
+                               std::vector<WatchedProcess>& watched,
+                               std::vector<DWORD>& exited,
+                               BOOL& unwatchable) {
+  unwatchable = FALSE;
+  ProcessIdMap running;
+  DWORD lastError = FindRunningProcesses(&filename, 1, running);
+  if (ERROR_SUCCESS != lastError) {
+    return lastError;
+  }
+
+  const std::vector<DWORD>& instances = running[filename];
+  exited.erase(std::remove_if(exited.begin(), exited.end(),
+                              [&instances](DWORD processId) {
+                                return std::find(instances.begin(),
+                                                 instances.end(),
+                                                 processId) == instances.end();
+                              }),
+               exited.end());
+
+  for (DWORD processId : instances) {
+    auto known = std::find_if(watched.begin(), watched.end(),
+                              [processId](const WatchedProcess& w) {
+                                return w.processId == processId;
+                              });
+    if (known != watched.end() ||
+        std::find(exited.begin(), exited.end(), processId) != exited.end()) {
+      continue;
     }
-  } while (Process32NextW(snapshot, &processEntry));
-  CloseHandle(snapshot);
-  return ERROR_NOT_FOUND;
+
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, processId);
+    if (process) {
+      if (WaitForSingleObject(process, 0) == WAIT_OBJECT_0) {
+        CloseHandle(process);
+        exited.push_back(processId);
+      } else {
+        watched.push_back({processId, autoHandle(process)});
+      }
+    } else if (GetLastError() != ERROR_INVALID_PARAMETER) {
+      // ERROR_INVALID_PARAMETER means it already exited.
+      unwatchable = TRUE;
+    }
+  }
+  return ERROR_SUCCESS;
 }
 
 /**
- * Waits for the specified application to exit.
+ * Waits for the specified application to exit. Every running instance is
+ * waited on through a process handle, so an exit is noticed right away.
+ * The processes are only enumerated again to find instances which were
+ * started in the meantime.
  *
  * @param filename   The application to wait for.
  * @param maxSeconds The maximum amount of seconds to wait for all
@@ -653,20 +764,57 @@ IsProcessRunning(LPCWSTR filename) {
  */
 DWORD
 WaitForProcessExit(LPCWSTR filename, DWORD maxSeconds) {
-  DWORD applicationRunningError = WAIT_TIMEOUT;
-  for (DWORD i = 0; i < maxSeconds; i++) {
-    DWORD applicationRunningError = IsProcessRunning(filename);
-    if (ERROR_NOT_FOUND == applicationRunningError) {
+  ULONGLONG start = GetTickCount64();
+  ULONGLONG maxWaitMS = maxSeconds * 1000ULL;
+  std::vector<WatchedProcess> watched;
+  std::vector<DWORD> exited;
+  for (;;) {
+    // Stop watching the instances which exited.
+    watched.erase(std::remove_if(watched.begin(), watched.end(),
+                                 [&exited](const WatchedProcess& w) {
+                                   if (WaitForSingleObject(w.process.get(),
+                                                           0) !=
+                                       WAIT_OBJECT_0) {
+                                     return false;
+                                   }
+                                   exited.push_back(w.processId);
+                                   return true;
+                                 }),
+                  watched.end());
+
+    BOOL unwatchable = FALSE;
+    DWORD applicationRunningError =
+        WatchNewInstances(filename, watched, exited, unwatchable);
+    if (ERROR_SUCCESS == applicationRunningError && watched.empty() &&
+        !unwatchable) {
       return ERROR_SUCCESS;
     }
-    Sleep(1000);
-  }
 
-  if (ERROR_SUCCESS == applicationRunningError) {
-    return WAIT_TIMEOUT;
-  }
+    ULONGLONG elapsedMS = GetTickCount64() - start;
+    if (elapsedMS >= maxWaitMS) {
+      return ERROR_SUCCESS == applicationRunningError
+                 ? WAIT_TIMEOUT
+                 : applicationRunningError;
+    }
+
+    DWORD waitMS = static_cast<DWORD>(
+        std::min<ULONGLONG>(maxWaitMS - elapsedMS, PROCESS_RESCAN_INTERVAL_MS));
+    if (watched.empty() || unwatchable) {
+      // Without a handle to every instance, this can only poll.
+      Sleep(waitMS);
+      continue;
+    }
 
-  return applicationRunningError;
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    DWORD handleCount = 0;
+    for (const WatchedProcess& w : watched) {
+      if (handleCount == MAXIMUM_WAIT_OBJECTS) {
+        break;
+      }
+      handles[handleCount++] = w.process.get();
+    }
+    WaitForMultipleObjects(handleCount, handles, TRUE, waitMS);
+  }
 }
 
 /**
@@ -2,9 +2,10 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include "updatestatus.h"
+
 BOOL StartServiceUpdate();
 DWORD LaunchServiceSoftwareUpdateCommand(int argc, LPCWSTR* argv);
-BOOL WriteStatusFailure(LPCWSTR updateDirPath, int errorCode);
 DWORD WaitForServiceStop(LPCWSTR serviceName, DWORD maxWaitSeconds);
 BOOL DoesFallbackKeyExist();
 BOOL IsLocalFile(LPCWSTR file, BOOL& isLocal);
@@ -12,10 +13,14 @@ DWORD StartServiceCommand(int argc, LPCWSTR* argv);
 BOOL IsUnpromptedElevation(BOOL& isUnpromptedElevation);
 DWORD WaitForProcessExit(LPCWSTR filename, DWORD maxSeconds);
 DWORD IsProcessRunning(LPCWSTR filename);
+DWORD LogRunningInstallationProcesses(LPCWSTR installDir, LPCWSTR updater);
 BOOL GetSecureOutputDirectoryPath(LPWSTR outBuf);
 BOOL GetSecureOutputFilePath(LPCWSTR patchDirPath, LPCWSTR fileExt,
                              LPWSTR outBuf);
-BOOL WriteSecureIDFile(LPCWSTR patchDirPath);
+BOOL BeginSecureStatusRecord(LPCWSTR installDir);
+BOOL WriteSecureStatusRecord(LPCWSTR installDir, UpdateStatusState state,
+                             int errorCode, UpdateStatusProgress progress);
+BOOL ReadSecureStatusRecord(LPCWSTR installDir, UpdateStatusRecord& record);
 void RemoveSecureOutputFiles(LPCWSTR patchDirPath);
 
 #define PATCH_DIR_PATH L"\\updates"
@@ -0,0 +1,130 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+
+#include "updaterjob.h"
+#include "updatehelper.h"
+
+// JOBOBJECT_IO_RATE_CONTROL_INFORMATION and its setter are only available
+// from Windows 10 on, so they are looked up at runtime.
+struct IoRateControlInformation {
+  LONG64 maxIops;
+  LONG64 maxBandwidth;
+  LONG64 reservationIops;
+  PCWSTR volumeName;
+  ULONG baseIoSize;
+  ULONG controlFlags;
+};
+#define IO_RATE_CONTROL_ENABLE 0x1
+typedef DWORD(WINAPI* SetIoRateControlInformationJobObjectFunc)(
+    HANDLE job, IoRateControlInformation* information);
+
+#define FILETIME_TICKS_PER_MILLISECOND 10000ULL
+
+static DWORD ReadServiceDWORD(LPCWSTR valueName) {
+  DWORD value = 0;
+  DWORD size = sizeof(value);
+  LONG retCode = RegGetValueW(HKEY_LOCAL_MACHINE, BASE_SERVICE_REG_KEY,
+                              valueName,
+                              RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+                              nullptr, &value, &size);
+  return ERROR_SUCCESS == retCode ? value : 0;
+}
+
+/**
+ * Reads the limits for the updater, see UPDATER_CPU_RATE_VALUE and
+ * UPDATER_IO_BANDWIDTH_VALUE.
+ */
+void GetUpdaterJobLimits(UpdaterJobLimits& limits) {
+  limits.cpuRatePercent = ReadServiceDWORD(UPDATER_CPU_RATE_VALUE);
+  if (limits.cpuRatePercent > 100) {
+    limits.cpuRatePercent = 0;
+  }
+  limits.ioBandwidth = ReadServiceDWORD(UPDATER_IO_BANDWIDTH_VALUE);
+}
+
+/**
+ * Creates the job. Limits which can't be applied are logged and skipped,
+ * the updater still runs without them.
+ *
+ * The job is not killed when its handle is closed, the updater may well
+ * outlive the service it is updating.
+ */
+BOOL UpdaterJob::Create(const UpdaterJobLimits& limits) {
+  mJob.reset(CreateJobObjectW(nullptr, nullptr));
+  if (!mJob) {
+    LOG_WARN(("Could not create the updater job.  (%lu)", GetLastError()));
+    return FALSE;
+  }
+
+  if (limits.cpuRatePercent) {
+    JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuRate = {};
+    cpuRate.ControlFlags =
+        JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+    // In hundredths of a percent
+    cpuRate.CpuRate = limits.cpuRatePercent * 100;
+    if (!SetInformationJobObject(mJob.get(), JobObjectCpuRateControlInformation,
+                                 &cpuRate, sizeof(cpuRate))) {
+      LOG_WARN(("Could not limit the updater CPU rate to %lu%%.  (%lu)",
+                limits.cpuRatePercent, GetLastError()));
+    }
+  }
+
+  if (limits.ioBandwidth) {
+    auto setIoRateControl =
+        reinterpret_cast<SetIoRateControlInformationJobObjectFunc>(
+            GetProcAddress(GetModuleHandleW(L"kernel32.dll"),
+                           "SetIoRateControlInformationJobObject"));
+    IoRateControlInformation ioRate = {};
+    ioRate.maxBandwidth = limits.ioBandwidth;
+    // No volume name sets the default for every volume.
+    ioRate.controlFlags = IO_RATE_CONTROL_ENABLE;
+    DWORD result = setIoRateControl
+                       ? setIoRateControl(mJob.get(), &ioRate)
+                       : ERROR_CALL_NOT_IMPLEMENTED;
+    if (ERROR_SUCCESS != result) {
+      LOG_WARN(("Could not limit the updater IO bandwidth to %lu bytes/s.  "
+                "(%lu)",
+                limits.ioBandwidth, result));
+    }
+  }
+  return TRUE;
+}
+
+BOOL UpdaterJob::Assign(HANDLE process) {
+  return mJob && AssignProcessToJobObject(mJob.get(), process);
+}
+
+BOOL UpdaterJob::Sample(UpdaterUsage& usage) const {
+  JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting;
+  JOBOBJECT_EXTENDED_LIMIT_INFORMATION extended;
+  if (!mJob ||
+      !QueryInformationJobObject(mJob.get(),
+                                 JobObjectBasicAndIoAccountingInformation,
+                                 &accounting, sizeof(accounting), nullptr) ||
+      !QueryInformationJobObject(mJob.get(),
+                                 JobObjectExtendedLimitInformation, &extended,
+                                 sizeof(extended), nullptr)) {
+    return FALSE;
+  }
+
+  usage.totalProcesses = accounting.BasicInfo.TotalProcesses;
+  usage.activeProcesses = accounting.BasicInfo.ActiveProcesses;
+  usage.cpuTimeMS = static_cast<ULONGLONG>(
+                        accounting.BasicInfo.TotalUserTime.QuadPart +
+                        accounting.BasicInfo.TotalKernelTime.QuadPart) /
+                    FILETIME_TICKS_PER_MILLISECOND;
+  usage.readBytes = accounting.IoInfo.ReadTransferCount;
+  usage.writeBytes = accounting.IoInfo.WriteTransferCount;
+  usage.peakMemory = extended.PeakJobMemoryUsed;
+  return TRUE;
+}
+
+/**
+ * Terminates every process in the job.
+ */
+BOOL UpdaterJob::Terminate(UINT exitCode) {
+  return mJob && TerminateJobObject(mJob.get(), exitCode);
+}
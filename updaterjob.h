@@ -0,0 +1,50 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _UPDATERJOB_H_
+#define _UPDATERJOB_H_
+
+#include <windows.h>
+#include "updatecommon.h"
+
+// DWORDs under BASE_SERVICE_REG_KEY which limit the updater so it doesn't
+// starve the room control server. Unset or 0 means no limit.
+// The share of the CPU the updater may use, in percent.
+#define UPDATER_CPU_RATE_VALUE L"UpdaterCpuRate"
+// The disk bandwidth the updater may use, in bytes per second.
+#define UPDATER_IO_BANDWIDTH_VALUE L"UpdaterIoBandwidth"
+
+struct UpdaterJobLimits {
+  DWORD cpuRatePercent;
+  DWORD ioBandwidth;
+};
+
+// What the updater and every process it started used so far.
+struct UpdaterUsage {
+  DWORD totalProcesses;
+  DWORD activeProcesses;
+  ULONGLONG cpuTimeMS;
+  ULONGLONG readBytes;
+  ULONGLONG writeBytes;
+  ULONGLONG peakMemory;
+};
+
+/**
+ * A Job Object holding the updater and the processes it starts, so their
+ * resource use can be read and the whole tree can be terminated.
+ */
+class UpdaterJob {
+ public:
+  BOOL Create(const UpdaterJobLimits& limits);
+  BOOL Assign(HANDLE process);
+  BOOL Sample(UpdaterUsage& usage) const;
+  BOOL Terminate(UINT exitCode);
+
+ private:
+  autoHandle mJob;
+};
+
+void GetUpdaterJobLimits(UpdaterJobLimits& limits);
+
+#endif
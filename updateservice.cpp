@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <wchar.h>
 #include <shlobj.h>
+#include <future>
 
 #include "serviceinstall.h"
 #include "updateservice.h"
@@ -13,6 +14,9 @@
 #include "registrycertificates.h"
 #include "updatecommon.h"
 #include "updateutils_win.h"
+#include "eventlog.h"
+#include "logrotation.h"
+#include "commandpipe.h"
 
  // Link w/ subsystem windows so we don't get a console when executing
  // this binary through the installer.
@@ -21,10 +25,33 @@
 SERVICE_STATUS gSvcStatus = { 0 };
 SERVICE_STATUS_HANDLE gSvcStatusHandle = nullptr;
 HANDLE gWorkDoneEvent = nullptr;
+// Set when the service is asked to stop while it is resident.
+HANDLE gStopEvent = nullptr;
 bool gServiceControlStopping = false;
 
 // logs are pretty small, about 20 lines, so 10 seems reasonable.
 #define LOGS_TO_KEEP 10
+// A log which grows past this continues in the next numbered log.
+#define LOG_MAX_FILE_SIZE (4 * 1024 * 1024)
+// How long the service waits for old logs to be pruned before it stops.
+#define PRUNE_WAIT_MS 2000
+// The kept logs may not take up more than this together.
+#define LOGS_MAX_TOTAL_SIZE (32 * 1024 * 1024)
+
+// Hands out the numbered service logs, see SvcMain.
+static LogRotation* gLogRotation = nullptr;
+
+// A DWORD under BASE_SERVICE_REG_KEY. When it is set the service stays
+// running for that many milliseconds after its last command, taking further
+// commands over the command pipe instead of being started for each one.
+#define RESIDENT_IDLE_TIMEOUT_VALUE L"ResidentIdleTimeout"
+// The most commands waiting to run while the service is resident.
+#define RESIDENT_QUEUE_MAX 8
+
+// How long the SCM is told to wait for each stop checkpoint, and how often
+// one is reported.
+#define STOP_WAIT_HINT_MS 1000
+#define STOP_CHECKPOINT_INTERVAL_MS 500
 
 BOOL GetLogDirectoryPath(WCHAR* path);
 
@@ -102,6 +129,19 @@ int wmain(int argc, WCHAR** argv) {
         return 0;
     }
 
+    // Renders an event log as text, or as one JSON object per line:
+    // decode-events <event log> <output file> [json]
+    if (!lstrcmpi(argv[1], L"decode-events")) {
+        if (argc < 4) {
+            return 1;
+        }
+        EventRenderMode mode = EVENT_RENDER_TEXT;
+        if (argc > 4 && !lstrcmpi(argv[4], L"json")) {
+            mode = EVENT_RENDER_JSON;
+        }
+        return DecodeEventLogFile(argv[2], argv[3], mode) ? 0 : 1;
+    }
+
     SERVICE_TABLE_ENTRYW DispatchTable[] = {
         {const_cast<LPWSTR>(SVC_NAME),
          (LPSERVICE_MAIN_FUNCTIONW)SvcMain},  // -Wwritable-strings
@@ -139,54 +179,98 @@ BOOL GetLogDirectoryPath(WCHAR* path) {
 }
 
 /**
- * Calculated a backup path based on the log number.
+ * Obtains the path of the next numbered service log.
  *
- * @param  path      The out buffer to store the log path of size MAX_PATH + 1
- * @param  basePath  The base directory where the calculated path should go
- * @param  logNumber The log number, 0 == updater.log
+ * @param  path The out buffer for the log path of size MAX_PATH + 1
  * @return TRUE if successful.
  */
-BOOL GetBackupLogPath(LPWSTR path, LPCWSTR basePath, int logNumber) {
-    WCHAR logName[64] = { L'\0' };
-    wcsncpy_s(path, MAX_PATH + 1, basePath, sizeof(logName) / sizeof(logName[0]) - 1);
-    if (logNumber <= 0) {
-        swprintf(logName, sizeof(logName) / sizeof(logName[0]),
-            L"updateservice.log");
-    }
-    else {
-        swprintf(logName, sizeof(logName) / sizeof(logName[0]),
-            L"updateservice-%d.log", logNumber);
-    }
-    return PathAppendSafe(path, logName);
+static BOOL GetNextLogPath(LPWSTR path) {
+    return gLogRotation && gLogRotation->NextLogPath(path);
 }
 
 /**
- * Moves the old log files out of the way before a new one is written.
- * If you for example keep 3 logs, then this function will do:
- *   updater2.log -> updater3.log
- *   updater1.log -> updater2.log
- *   updater.log -> updater1.log
- * Which clears room for a new updater.log in the basePath directory
+ * Obtains the resident idle timeout, see RESIDENT_IDLE_TIMEOUT_VALUE.
  *
- * @param basePath      The base directory path where log files are stored
- * @param numLogsToKeep The number of logs to keep
+ * @return the timeout in milliseconds, 0 if the service isn't resident.
  */
-void BackupOldLogs(LPCWSTR basePath, int numLogsToKeep) {
-    WCHAR oldPath[MAX_PATH + 1];
-    WCHAR newPath[MAX_PATH + 1];
-    for (int i = numLogsToKeep; i >= 1; i--) {
-        if (!GetBackupLogPath(oldPath, basePath, i - 1)) {
-            continue;
-        }
+static DWORD GetResidentIdleTimeout() {
+    DWORD idleTimeoutMS = 0;
+    DWORD size = sizeof(idleTimeoutMS);
+    LONG retCode = RegGetValueW(HKEY_LOCAL_MACHINE, BASE_SERVICE_REG_KEY,
+        RESIDENT_IDLE_TIMEOUT_VALUE, RRF_RT_REG_DWORD | RRF_SUBKEY_WOW6464KEY,
+        nullptr, &idleTimeoutMS, &size);
+    return ERROR_SUCCESS == retCode ? idleTimeoutMS : 0;
+}
 
-        if (!GetBackupLogPath(newPath, basePath, i)) {
-            continue;
-        }
+/**
+ * Runs a command which came in over the command pipe the same way as the
+ * command the service was started with.
+ */
+static bool RunQueuedCommand(const ServiceCommandArgs& args) {
+    ServiceCommandArgs argsCopy(args);
+    std::vector<LPWSTR> argv;
+    // argv[0] would be the service name had the service been started
+    argv.push_back(const_cast<LPWSTR>(SVC_NAME));
+    for (std::wstring& arg : argsCopy) {
+        argv.push_back(&arg[0]);
+    }
+    return ExecuteServiceCommand(static_cast<int>(argv.size()), argv.data()) !=
+           FALSE;
+}
 
-        if (!MoveFileExW(oldPath, newPath, MOVEFILE_REPLACE_EXISTING)) {
-            continue;
-        }
+/**
+ * Runs the command the service was started with and then keeps the service
+ * running, taking the commands sent over the command pipe until none came
+ * for idleTimeoutMS or the service is stopped.
+ *
+ * The start command is the first one queued, so commands sent while it runs
+ * wait behind it instead of being turned away.
+ *
+ * @param  commandPipe The pipe from CreateCommandPipe
+ * @return The result of the start command.
+ */
+static BOOL RunResident(HANDLE commandPipe, DWORD argc, LPWSTR* argv,
+                        DWORD idleTimeoutMS) {
+    LOG(("Staying resident, idle timeout: %lu ms.", idleTimeoutMS));
+    std::promise<bool> startCommand;
+    std::future<bool> startResult = startCommand.get_future();
+    // Only touched by the one worker, which takes the start command first.
+    bool startCommandRan = false;
+    // Commands run one at a time since they share the secure updater path.
+    CommandDispatcher dispatcher(
+        [&](const ServiceCommandArgs& args) {
+            bool result = RunQueuedCommand(args);
+            if (!startCommandRan) {
+                startCommandRan = true;
+                startCommand.set_value(result);
+            }
+            return result;
+        },
+        RESIDENT_QUEUE_MAX, 1);
+
+    ServiceCommandArgs startArgs;
+    for (DWORD i = 1; i < argc; ++i) {
+        startArgs.push_back(argv[i]);
+    }
+    if (!dispatcher.Submit(std::move(startArgs))) {
+        dispatcher.Stop();
+        return ExecuteServiceCommand(argc, argv);
+    }
+
+    if (!RunCommandPipe(commandPipe, dispatcher, idleTimeoutMS, gStopEvent)) {
+        LOG_WARN(("Could not take service commands over the command pipe."));
+    }
+    // Even when stopping, the start command runs to the end like it did
+    // before the service could be resident. Only later commands are dropped.
+    BOOL success = startResult.get() ? TRUE : FALSE;
+    // No more commands are taken, so the service is stopping from here on.
+    // A client which finds it stopping waits for it to stop and starts it
+    // again, instead of taking it for busy.
+    if (!gServiceControlStopping) {
+        ReportSvcStatus(SERVICE_STOP_PENDING, NO_ERROR, STOP_WAIT_HINT_MS);
     }
+    dispatcher.Stop();
+    return success;
 }
 
 /**
@@ -222,12 +306,24 @@ void StartTerminationThread() {
  * Main entry point when running as a service.
  */
 void WINAPI SvcMain(DWORD argc, LPWSTR* argv) {
-    // Setup logging, and backup the old logs
+    // Setup logging. Each run logs to the next numbered log, the old logs
+    // are pruned once the service is running.
     WCHAR logFilePath[MAX_PATH + 1];
     if (GetLogDirectoryPath(logFilePath)) {
-        BackupOldLogs(logFilePath, LOGS_TO_KEEP);
-        if (PathAppendSafe(logFilePath, L"updateservice.log")) {
+        // Keep the current log and LOGS_TO_KEEP older ones.
+        static LogRotation logRotation(logFilePath, L"updateservice",
+                                       LOGS_TO_KEEP + 1, LOGS_MAX_TOTAL_SIZE);
+        gLogRotation = &logRotation;
+        WCHAR eventLogPath[MAX_PATH + 1];
+        wcsncpy_s(eventLogPath, MAX_PATH + 1, logFilePath, MAX_PATH);
+        if (logRotation.NextLogPath(logFilePath)) {
+            UpdateLog::GetPrimaryLog().SetRollover(LOG_MAX_FILE_SIZE,
+                                                   GetNextLogPath);
             LogInit(logFilePath);
+            // Events keep being appended across runs so they can be
+            // collected in bulk.
+            InitEventLog(PathAppendSafe(eventLogPath, L"updateservice.events")
+                         ? eventLogPath : nullptr);
         }
     }
 
@@ -260,14 +356,39 @@ void WINAPI SvcMain(DWORD argc, LPWSTR* argv) {
         return;
     }
 
+    // Created before the command runs, so a stop which comes in while it
+    // runs reaches the command pipe.
+    gStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+    // A resident service creates its command pipe before it reports that it
+    // is running, so a client never finds it running without the pipe.
+    DWORD idleTimeoutMS = GetResidentIdleTimeout();
+    autoHandle commandPipe;
+    if (idleTimeoutMS && gStopEvent) {
+        commandPipe.reset(CreateCommandPipe());
+    }
+
     // Initialization complete and we're about to start working on
     // the actual command.  Report the service state as running to the SCM.
     ReportSvcStatus(SERVICE_RUNNING, NO_ERROR, 0);
 
+    if (gLogRotation && !gLogRotation->StartPruning()) {
+        LOG_WARN(("Could not start pruning old logs.  (%lu)", GetLastError()));
+    }
+
     // The service command was executed, stop logging and set an event
     // to indicate the work is done in case someone is waiting on a
     // service stop operation.
-    BOOL success = ExecuteServiceCommand(argc, argv);
+    BOOL success;
+    if (commandPipe && !gServiceControlStopping) {
+        success = RunResident(commandPipe.get(), argc, argv, idleTimeoutMS);
+    } else {
+        success = ExecuteServiceCommand(argc, argv);
+    }
+    commandPipe.reset();
+    if (gLogRotation && !gLogRotation->FinishPruning(PRUNE_WAIT_MS)) {
+        LOG_WARN(("Old logs are still being pruned."));
+    }
     LogFinish();
 
     SetEvent(gWorkDoneEvent);
@@ -320,9 +441,12 @@ void ReportSvcStatus(DWORD currentState, DWORD exitCode, DWORD waitHint) {
  * returning, this function does the service stop work for the SvcCtrlHandler.
  */
 DWORD WINAPI StopServiceAndWaitForCommandThread(LPVOID) {
+    // Wakes up as soon as the work is done, and otherwise only often enough
+    // to report progress within the wait hint.
     do {
-        ReportSvcStatus(SERVICE_STOP_PENDING, NO_ERROR, 1000);
-    } while (WaitForSingleObject(gWorkDoneEvent, 100) == WAIT_TIMEOUT);
+        ReportSvcStatus(SERVICE_STOP_PENDING, NO_ERROR, STOP_WAIT_HINT_MS);
+    } while (WaitForSingleObject(gWorkDoneEvent, STOP_CHECKPOINT_INTERVAL_MS) ==
+             WAIT_TIMEOUT);
     CloseHandle(gWorkDoneEvent);
     gWorkDoneEvent = nullptr;
     ReportSvcStatus(SERVICE_STOPPED, NO_ERROR, 0);
@@ -346,7 +470,10 @@ void WINAPI SvcCtrlHandler(DWORD dwCtrl) {
     case SERVICE_CONTROL_SHUTDOWN:
     case SERVICE_CONTROL_STOP: {
         gServiceControlStopping = true;
-        ReportSvcStatus(SERVICE_STOP_PENDING, NO_ERROR, 1000);
+        ReportSvcStatus(SERVICE_STOP_PENDING, NO_ERROR, STOP_WAIT_HINT_MS);
+        if (gStopEvent) {
+            SetEvent(gStopEvent);
+        }
 
         // The SvcCtrlHandler thread should not spend more than 30 seconds in
         // shutdown so we spawn a new thread for stopping the service
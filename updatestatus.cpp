@@ -0,0 +1,128 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string.h>
+
+#include "sealedfile.h"
+#include "updatestatus.h"
+
+#define UPDATE_STATUS_MAGIC 0x53535541  // "AUSS"
+#define UPDATE_STATUS_VERSION 1
+#define UPDATE_STATUS_SEAL_OFFSET (UPDATE_STATUS_RECORD_SIZE - SEAL_SIZE)
+
+/**
+ * Lays a record out in its little endian file format, sealed with a
+ * checksum over the rest of it.
+ */
+void SerializeUpdateStatus(const UpdateStatusRecord& record,
+                           uint8_t data[UPDATE_STATUS_RECORD_SIZE]) {
+  Write32(data, UPDATE_STATUS_MAGIC);
+  Write32(data + 4, UPDATE_STATUS_VERSION);
+  Write32(data + 8, record.state);
+  Write32(data + 12, static_cast<uint32_t>(record.errorCode));
+  memcpy(data + 16, record.id, UPDATE_STATUS_ID_LENGTH);
+  Write64(data + 32, record.createdTime);
+  Write64(data + 40, record.updatedTime);
+  Write64(data + 48, record.progress);
+  Write64(data + 56, record.sequence);
+  Write64(data + UPDATE_STATUS_SEAL_OFFSET,
+          Fnv1a64(data, UPDATE_STATUS_SEAL_OFFSET));
+}
+
+/**
+ * @return false if the data isn't exactly one record or its seal doesn't
+ *         match, as it won't for a torn or corrupted record.
+ */
+bool ParseUpdateStatus(const uint8_t* data, size_t size,
+                       UpdateStatusRecord& record) {
+  if (size != UPDATE_STATUS_RECORD_SIZE ||
+      Read32(data) != UPDATE_STATUS_MAGIC ||
+      Read32(data + 4) != UPDATE_STATUS_VERSION ||
+      !HasValidSeal(data, size)) {
+    return false;
+  }
+  uint32_t state = Read32(data + 8);
+  if (state < UPDATE_STATUS_PENDING || state > UPDATE_STATUS_FAILED) {
+    return false;
+  }
+  record.state = state;
+  record.errorCode = static_cast<int32_t>(Read32(data + 12));
+  memcpy(record.id, data + 16, UPDATE_STATUS_ID_LENGTH);
+  record.createdTime = Read64(data + 32);
+  record.updatedTime = Read64(data + 40);
+  record.progress = Read64(data + 48);
+  record.sequence = Read64(data + 56);
+  return true;
+}
+
+#ifdef _WIN32
+#include "updatecommon.h"
+
+// FILETIME is in 100 nanosecond intervals since 1601.
+#define FILETIME_TICKS_PER_SECOND 10000000ULL
+#define FILETIME_UNIX_EPOCH_SECONDS 11644473600ULL
+
+uint64_t GetUpdateStatusTime() {
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  ULARGE_INTEGER ticks;
+  ticks.LowPart = now.dwLowDateTime;
+  ticks.HighPart = now.dwHighDateTime;
+  return ticks.QuadPart / FILETIME_TICKS_PER_SECOND -
+         FILETIME_UNIX_EPOCH_SECONDS;
+}
+
+/**
+ * Replaces the record at path, so it is always either the previous or the new
+ * one, even across a crash.
+ *
+ * @return TRUE if successful
+ */
+BOOL WriteUpdateStatusFile(LPCWSTR path, const UpdateStatusRecord& record) {
+  uint8_t data[UPDATE_STATUS_RECORD_SIZE];
+  SerializeUpdateStatus(record, data);
+  return WriteFileAtomically(path, data, sizeof(data));
+}
+
+/**
+ * Reads a record through a read only mapping of its file. The record is
+ * copied out and the view unmapped before it is parsed, so a reader holds up
+ * the writer's replace of the file for as little as possible. A record which
+ * is torn, or of the wrong size, fails its seal.
+ *
+ * @return FALSE if there is no record, or it is torn or corrupted.
+ */
+BOOL ReadUpdateStatusFile(LPCWSTR path, UpdateStatusRecord& record) {
+  uint8_t data[UPDATE_STATUS_RECORD_SIZE];
+  {
+    autoHandle statusFile(CreateFileW(
+        path, GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+        OPEN_EXISTING, 0, nullptr));
+    if (INVALID_HANDLE_VALUE == statusFile.get()) {
+      return FALSE;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(statusFile.get(), &size) ||
+        size.QuadPart != UPDATE_STATUS_RECORD_SIZE) {
+      return FALSE;
+    }
+
+    autoHandle mapping(CreateFileMappingW(statusFile.get(), nullptr,
+                                          PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping) {
+      return FALSE;
+    }
+    const void* view = MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0,
+                                     UPDATE_STATUS_RECORD_SIZE);
+    if (!view) {
+      return FALSE;
+    }
+    memcpy(data, view, UPDATE_STATUS_RECORD_SIZE);
+    UnmapViewOfFile(view);
+  }
+  return ParseUpdateStatus(data, UPDATE_STATUS_RECORD_SIZE, record) ? TRUE
+                                                                     : FALSE;
+}
+#endif
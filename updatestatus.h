@@ -0,0 +1,61 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _UPDATESTATUS_H_
+#define _UPDATESTATUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The status of the last update of an installation is kept in one fixed size
+// record in the secure output directory, see GetSecureStatusRecordPath.
+#define UPDATE_STATUS_RECORD_EXT L".record"
+#define UPDATE_STATUS_RECORD_SIZE 72
+#define UPDATE_STATUS_ID_LENGTH 16
+
+enum UpdateStatusState {
+  UPDATE_STATUS_PENDING = 1,
+  UPDATE_STATUS_APPLYING = 2,
+  UPDATE_STATUS_SUCCEEDED = 3,
+  UPDATE_STATUS_FAILED = 4
+};
+
+// The steps of an update, in the order they are reached.
+enum UpdateStatusProgress {
+  UPDATE_PROGRESS_NONE = 0,
+  // The updater was copied to the installer store and verified.
+  UPDATE_PROGRESS_VERIFIED = 1,
+  UPDATE_PROGRESS_STARTED = 2,
+  UPDATE_PROGRESS_EXITED = 3
+};
+
+struct UpdateStatusRecord {
+  uint32_t state;
+  int32_t errorCode;
+  // A new ID is given to each attempt, so a record left by an earlier one is
+  // told apart from the current one.
+  uint8_t id[UPDATE_STATUS_ID_LENGTH];
+  // Seconds since the Unix epoch.
+  uint64_t createdTime;
+  uint64_t updatedTime;
+  // The last UpdateStatusProgress step which was reached.
+  uint64_t progress;
+  // Counts the writes of the record, so a reader can tell it changed.
+  uint64_t sequence;
+};
+
+void SerializeUpdateStatus(const UpdateStatusRecord& record,
+                           uint8_t data[UPDATE_STATUS_RECORD_SIZE]);
+bool ParseUpdateStatus(const uint8_t* data, size_t size,
+                       UpdateStatusRecord& record);
+
+#ifdef _WIN32
+#include <windows.h>
+
+BOOL WriteUpdateStatusFile(LPCWSTR path, const UpdateStatusRecord& record);
+BOOL ReadUpdateStatusFile(LPCWSTR path, UpdateStatusRecord& record);
+uint64_t GetUpdateStatusTime();
+#endif
+
+#endif
@@ -5,6 +5,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "updateutils_win.h"
+#include "uuidgen.h"
 #include <errno.h>
 #include <shlwapi.h>
 #include <string.h>
@@ -19,7 +20,6 @@
 // This section implements the minimum set of dirent APIs used by updater.cpp on
 // Windows.  If updater.cpp is modified to use more of this API, we need to
 // implement those parts here too.
-static dirent gDirEnt;
 
 DIR::DIR(const WCHAR* path) : findHandle(INVALID_HANDLE_VALUE) {
   memset(name, 0, sizeof(name));
@@ -33,7 +33,13 @@ DIR::~DIR() {
   }
 }
 
-dirent::dirent() { d_name[0] = L'\0'; }
+dirent::dirent()
+    : d_attributes(0),
+      d_size(0),
+      d_creationTime(),
+      d_lastWriteTime() {
+  d_name[0] = L'\0';
+}
 
 DIR* opendir(const WCHAR* path) { return new DIR(path); }
 
@@ -42,6 +48,15 @@ int closedir(DIR* dir) {
   return 0;
 }
 
+/**
+ * Reads the next entry of a directory.
+ *
+ * The entries are fetched in large batches and without their short names,
+ * which nothing here uses.
+ *
+ * @return The entry, which stays valid until the next readdir or closedir of
+ *         dir, or null at the end or on errors.
+ */
 dirent* readdir(DIR* dir) {
   WIN32_FIND_DATAW data;
   if (dir->findHandle != INVALID_HANDLE_VALUE) {
@@ -54,7 +69,10 @@ dirent* readdir(DIR* dir) {
     }
   } else {
     // Reading the first directory entry
-    dir->findHandle = FindFirstFileW(dir->name, &data);
+    dir->findHandle =
+        FindFirstFileExW(dir->name, FindExInfoBasic, &data,
+                         FindExSearchNameMatch, nullptr,
+                         FIND_FIRST_EX_LARGE_FETCH);
     if (dir->findHandle == INVALID_HANDLE_VALUE) {
       if (GetLastError() == ERROR_FILE_NOT_FOUND) {
         errno = ENOENT;
@@ -64,13 +82,19 @@ dirent* readdir(DIR* dir) {
       return 0;
     }
   }
+  dirent& entry = dir->entry;
   size_t direntBufferLength =
-      sizeof(gDirEnt.d_name) / sizeof(gDirEnt.d_name[0]);
-  wcsncpy_s(gDirEnt.d_name, direntBufferLength, data.cFileName, direntBufferLength - 1);
+      sizeof(entry.d_name) / sizeof(entry.d_name[0]);
+  wcsncpy_s(entry.d_name, direntBufferLength, data.cFileName, direntBufferLength - 1);
   // wcsncpy does not guarantee a null-terminated string if the source string is
   // too long.
-  gDirEnt.d_name[direntBufferLength - 1] = '\0';
-  return &gDirEnt;
+  entry.d_name[direntBufferLength - 1] = '\0';
+  entry.d_attributes = data.dwFileAttributes;
+  entry.d_size = (static_cast<ULONGLONG>(data.nFileSizeHigh) << 32) |
+                 data.nFileSizeLow;
+  entry.d_creationTime = data.ftCreationTime;
+  entry.d_lastWriteTime = data.ftLastWriteTime;
+  return &entry;
 }
 
 /**
@@ -89,35 +113,20 @@ BOOL PathAppendSafe(LPWSTR base, LPCWSTR extra) {
 }
 
 /**
- * Obtains a uuid as a wide string.
+ * Obtains a uuid as a wide string. The uuids are version 7, so they sort by
+ * the time they were made, see UuidGenerator.
  *
  * @param  outBuf
  *         A buffer of size MAX_PATH + 1 to store the result.
  * @return TRUE if successful
  */
 BOOL GetUUIDString(LPWSTR outBuf) {
-  UUID uuid;
-  RPC_WSTR uuidString = nullptr;
-
-  // Note: the return value of UuidCreate should always be RPC_S_OK on systems
-  // after Win2K / Win2003 due to the network hardware address no longer being
-  // used to create the UUID.
-  if (UuidCreate(&uuid) != RPC_S_OK) {
-    return FALSE;
-  }
-  if (UuidToStringW(&uuid, &uuidString) != RPC_S_OK) {
-    return FALSE;
-  }
-  if (!uuidString) {
+  static_assert(UUID_LEN == UUID_STRING_LENGTH, "UUID_LEN is the string size");
+  uint8_t uuid[UUID_BYTES];
+  if (!UuidGenerator::GetDefault().Generate(uuid)) {
     return FALSE;
   }
-
-  if (wcslen(reinterpret_cast<LPCWSTR>(uuidString)) > MAX_PATH) {
-    return FALSE;
-  }
-  wcsncpy_s(outBuf, MAX_PATH + 1, reinterpret_cast<LPCWSTR>(uuidString), MAX_PATH);
-  RpcStringFreeW(&uuidString);
-
+  FormatUuid(uuid, outBuf);
   return TRUE;
 }
 
@@ -20,16 +20,25 @@
 
 #include <windows.h>
 
+// Besides the name, each entry has what FindFirstFileExW returns for it, so
+// callers don't need another call per entry to get it.
+struct dirent {
+  dirent();
+  WCHAR d_name[MAX_PATH + 1];
+  DWORD d_attributes;
+  ULONGLONG d_size;
+  FILETIME d_creationTime;
+  FILETIME d_lastWriteTime;
+};
+
+// Each DIR has its own entry, so directories can be read on several threads
+// at once. One DIR must not be read on two threads at once.
 struct DIR {
   explicit DIR(const WCHAR* path);
   ~DIR();
   HANDLE findHandle;
   WCHAR name[MAX_PATH + 1];
-};
-
-struct dirent {
-  dirent();
-  WCHAR d_name[MAX_PATH + 1];
+  dirent entry;
 };
 
 DIR* opendir(const WCHAR* path);
@@ -0,0 +1,124 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string.h>
+
+#include "uuidgen.h"
+
+#define UUID_COUNTER_MAX 0xFFF
+// A new millisecond starts the counter in the lower half of its range, so
+// at least that many more UUIDs fit in it.
+#define UUID_COUNTER_START_MASK 0x7FF
+
+UuidGenerator::UuidGenerator(UuidEntropySource& source)
+    : mSource(source),
+      mLastMS(0),
+      mCounter(0),
+      mPoolUsed(UUID_RANDOM_POOL_SIZE) {}
+
+/**
+ * Takes random bytes from the pool, refilling it when it runs out. The
+ * caller holds mLock.
+ */
+bool UuidGenerator::TakeRandom(uint8_t* buffer, size_t size) {
+  if (mPoolUsed + size > UUID_RANDOM_POOL_SIZE) {
+    if (!mSource.FillRandom(mPool, UUID_RANDOM_POOL_SIZE)) {
+      return false;
+    }
+    mPoolUsed = 0;
+  }
+  memcpy(buffer, mPool + mPoolUsed, size);
+  mPoolUsed += size;
+  return true;
+}
+
+/**
+ * @return false if no random bytes could be had.
+ */
+bool UuidGenerator::Generate(uint8_t uuid[UUID_BYTES]) {
+  std::lock_guard<std::mutex> lock(mLock);
+  // 2 bytes for the counter of a new millisecond, 8 for the rest.
+  uint8_t random[10];
+  if (!TakeRandom(random, sizeof(random))) {
+    return false;
+  }
+
+  uint64_t now = mSource.NowMS();
+  if (now > mLastMS) {
+    mLastMS = now;
+    mCounter = ((random[0] << 8) | random[1]) & UUID_COUNTER_START_MASK;
+  } else if (mCounter < UUID_COUNTER_MAX) {
+    ++mCounter;
+  } else {
+    ++mLastMS;
+    mCounter = ((random[0] << 8) | random[1]) & UUID_COUNTER_START_MASK;
+  }
+
+  for (int i = 0; i < 6; ++i) {
+    uuid[i] = static_cast<uint8_t>(mLastMS >> (8 * (5 - i)));
+  }
+  uuid[6] = static_cast<uint8_t>(0x70 | (mCounter >> 8));
+  uuid[7] = static_cast<uint8_t>(mCounter);
+  memcpy(uuid + 8, random + 2, 8);
+  // The RFC 9562 variant.
+  uuid[8] = static_cast<uint8_t>(0x80 | (uuid[8] & 0x3F));
+  return true;
+}
+
+/**
+ * Formats a UUID in its lowercase 8-4-4-4-12 string form, as UuidToStringW
+ * did.
+ */
+void FormatUuid(const uint8_t uuid[UUID_BYTES],
+                wchar_t str[UUID_STRING_LENGTH]) {
+  static const wchar_t kHexDigits[] = L"0123456789abcdef";
+  wchar_t* out = str;
+  for (int i = 0; i < UUID_BYTES; ++i) {
+    if (i == 4 || i == 6 || i == 8 || i == 10) {
+      *out++ = L'-';
+    }
+    *out++ = kHexDigits[uuid[i] >> 4];
+    *out++ = kHexDigits[uuid[i] & 0xF];
+  }
+  *out = L'\0';
+}
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bcrypt.h>
+
+#pragma comment(lib, "bcrypt.lib")
+
+// FILETIME is in 100 nanosecond intervals since 1601.
+#define FILETIME_TICKS_PER_MS 10000ULL
+#define FILETIME_UNIX_EPOCH_MS 11644473600000ULL
+
+namespace {
+
+class SystemUuidEntropySource : public UuidEntropySource {
+ public:
+  bool FillRandom(uint8_t* buffer, size_t size) override {
+    return BCRYPT_SUCCESS(BCryptGenRandom(nullptr, buffer,
+                                          static_cast<ULONG>(size),
+                                          BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+  }
+
+  uint64_t NowMS() override {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    ULARGE_INTEGER ticks;
+    ticks.LowPart = now.dwLowDateTime;
+    ticks.HighPart = now.dwHighDateTime;
+    return ticks.QuadPart / FILETIME_TICKS_PER_MS - FILETIME_UNIX_EPOCH_MS;
+  }
+};
+
+}  // namespace
+
+UuidGenerator& UuidGenerator::GetDefault() {
+  static SystemUuidEntropySource source;
+  static UuidGenerator defaultGenerator(source);
+  return defaultGenerator;
+}
+#endif
@@ -0,0 +1,61 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _UUIDGEN_H_
+#define _UUIDGEN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+
+#define UUID_BYTES 16
+// The 36 characters of the string form and a terminator.
+#define UUID_STRING_LENGTH 37
+// Random bytes fetched from the source at once.
+#define UUID_RANDOM_POOL_SIZE 512
+
+/**
+ * Where UuidGenerator gets its random bytes and time from.
+ */
+class UuidEntropySource {
+ public:
+  virtual ~UuidEntropySource() {}
+
+  virtual bool FillRandom(uint8_t* buffer, size_t size) = 0;
+  // Milliseconds since the Unix epoch.
+  virtual uint64_t NowMS() = 0;
+};
+
+/**
+ * Generates version 7 UUIDs: a millisecond timestamp followed by random
+ * bits, so they sort by when they were made.
+ *
+ * Within a process they are strictly increasing. A UUID made in the same
+ * millisecond as the previous one, or after the clock went back, keeps the
+ * previous timestamp and increments the 12 bit counter after it. When the
+ * counter runs out the timestamp is moved a millisecond ahead.
+ */
+class UuidGenerator {
+ public:
+  static UuidGenerator& GetDefault();
+
+  explicit UuidGenerator(UuidEntropySource& source);
+
+  bool Generate(uint8_t uuid[UUID_BYTES]);
+
+ private:
+  bool TakeRandom(uint8_t* buffer, size_t size);
+
+  UuidEntropySource& mSource;
+  std::mutex mLock;
+  uint64_t mLastMS;
+  uint16_t mCounter;
+  uint8_t mPool[UUID_RANDOM_POOL_SIZE];
+  size_t mPoolUsed;
+};
+
+void FormatUuid(const uint8_t uuid[UUID_BYTES],
+                wchar_t str[UUID_STRING_LENGTH]);
+
+#endif
@@ -0,0 +1,273 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <windows.h>
+#include <shlwapi.h>
+#include <string.h>
+#include <string>
+
+#include "verifycache.h"
+#include "sealedfile.h"
+#include "updatecommon.h"
+#include "updateutils_win.h"
+
+#define VERIFY_CACHE_MAGIC 0x43565541  // "AUVC"
+#define VERIFY_CACHE_VERSION 1
+
+// FILETIME is in 100 nanosecond intervals.
+#define FILETIME_TICKS_PER_SECOND 10000000ULL
+
+struct VerificationCacheHeader {
+  DWORD magic;
+  DWORD version;
+  DWORD count;
+};
+
+static ULONGLONG FileTimeToTicks(const FILETIME& time) {
+  ULARGE_INTEGER ticks;
+  ticks.LowPart = time.dwLowDateTime;
+  ticks.HighPart = time.dwHighDateTime;
+  return ticks.QuadPart;
+}
+
+/**
+ * Obtains the path of the verification cache file, alongside the secure
+ * updater in the update subdirectory of the service binary.
+ *
+ * @param  path A buffer of size MAX_PATH + 1 to store the result.
+ * @return TRUE if successful
+ */
+static BOOL GetVerificationCachePath(LPWSTR path) {
+  if (!GetModuleFileNameW(nullptr, path, MAX_PATH) ||
+      !PathRemoveFileSpecW(path) || !PathAppendSafe(path, L"update")) {
+    return FALSE;
+  }
+  CreateDirectoryW(path, nullptr);
+  return PathAppendSafe(path, L"verifycache.dat");
+}
+
+/**
+ * Determines the size, last write time and SHA-256 digest of a file. The
+ * caller should hold the handle without write sharing for as long as the
+ * identity is relied upon.
+ *
+ * @param  file     A handle opened with GENERIC_READ
+ * @param  identity Out parameter for the identity of the file
+ * @return TRUE if successful
+ */
+BOOL GetSignedFileIdentity(HANDLE file, SignedFileIdentity& identity) {
+  ZeroMemory(&identity, sizeof(identity));
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize)) {
+    return FALSE;
+  }
+  identity.fileSize = static_cast<ULONGLONG>(fileSize.QuadPart);
+
+  if (!GetFileTime(file, nullptr, nullptr, &identity.lastWriteTime)) {
+    return FALSE;
+  }
+
+  return HashFileHandle(file, identity.digest);
+}
+
+/**
+ * The default path, or an empty one if it can't be determined.
+ */
+static std::wstring GetDefaultVerificationCachePath() {
+  WCHAR path[MAX_PATH + 1] = {L'\0'};
+  if (!GetVerificationCachePath(path)) {
+    return std::wstring();
+  }
+  return path;
+}
+
+VerificationCache& VerificationCache::GetDefault() {
+  static VerificationCache defaultCache(
+      GetDefaultVerificationCachePath().c_str());
+  return defaultCache;
+}
+
+/**
+ * @param cacheFilePath The file to keep the cache in. If this is empty the
+ *                      cache never finds or stores anything.
+ */
+VerificationCache::VerificationCache(LPCWSTR cacheFilePath)
+    : mLoaded(false), mCount(0) {
+  wcsncpy_s(mPath, MAX_PATH + 1, cacheFilePath, MAX_PATH);
+}
+
+/**
+ * Reads the cache file. A missing, unreadable or unrecognized file is
+ * treated as an empty cache.
+ *
+ * @return TRUE if the cache can be used.
+ */
+BOOL VerificationCache::Load() {
+  if (mLoaded) {
+    return TRUE;
+  }
+  if (!mPath[0]) {
+    return FALSE;
+  }
+  mLoaded = true;
+  mCount = 0;
+
+  autoHandle cacheFile(CreateFileW(mPath, GENERIC_READ, FILE_SHARE_READ,
+                                   nullptr, OPEN_EXISTING, 0, nullptr));
+  if (INVALID_HANDLE_VALUE == cacheFile.get()) {
+    return TRUE;
+  }
+
+  VerificationCacheHeader header;
+  DWORD readAmount;
+  if (!ReadFile(cacheFile.get(), &header, sizeof(header), &readAmount,
+                nullptr) ||
+      readAmount != sizeof(header) || header.magic != VERIFY_CACHE_MAGIC ||
+      header.version != VERIFY_CACHE_VERSION ||
+      header.count > VERIFY_CACHE_MAX_ENTRIES) {
+    LOG_WARN(("Ignoring unrecognized verification cache: %ls", mPath));
+    return TRUE;
+  }
+
+  DWORD entriesSize = header.count * sizeof(VerificationCacheEntry);
+  if (!ReadFile(cacheFile.get(), mEntries, entriesSize, &readAmount,
+                nullptr) ||
+      readAmount != entriesSize) {
+    LOG_WARN(("Ignoring truncated verification cache: %ls", mPath));
+    return TRUE;
+  }
+
+  // Make sure the strings are terminated no matter what the file holds.
+  for (DWORD i = 0; i < header.count; ++i) {
+    mEntries[i].name[VERIFY_CACHE_NAME_LENGTH - 1] = L'\0';
+    mEntries[i].issuer[VERIFY_CACHE_NAME_LENGTH - 1] = L'\0';
+  }
+  mCount = header.count;
+  return TRUE;
+}
+
+/**
+ * Replaces the cache file so a reader never sees a partially written cache.
+ *
+ * @return TRUE if successful
+ */
+BOOL VerificationCache::Save() {
+  VerificationCacheHeader header = {VERIFY_CACHE_MAGIC, VERIFY_CACHE_VERSION,
+                                    mCount};
+  const uint8_t* headerBytes = reinterpret_cast<const uint8_t*>(&header);
+  const uint8_t* entryBytes = reinterpret_cast<const uint8_t*>(mEntries);
+  std::vector<uint8_t> data(headerBytes, headerBytes + sizeof(header));
+  data.insert(data.end(), entryBytes,
+              entryBytes + mCount * sizeof(VerificationCacheEntry));
+  return WriteFileAtomically(mPath, data.data(), data.size());
+}
+
+int VerificationCache::Find(const SignedFileIdentity& identity) const {
+  for (DWORD i = 0; i < mCount; ++i) {
+    const SignedFileIdentity& cached = mEntries[i].identity;
+    if (cached.fileSize == identity.fileSize &&
+        CompareFileTime(&cached.lastWriteTime, &identity.lastWriteTime) == 0 &&
+        memcmp(cached.digest, identity.digest, SHA256_DIGEST_LENGTH) == 0) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+/**
+ * Looks up a previous successful verification of a file with exactly the
+ * same identity. Expired entries are dropped.
+ *
+ * @param  identity The identity of the file being verified
+ * @param  entry    Out parameter for the cached verification
+ * @return TRUE if a valid cached verification was found.
+ */
+BOOL VerificationCache::Lookup(const SignedFileIdentity& identity,
+                               VerificationCacheEntry& entry) {
+  if (!Load()) {
+    return FALSE;
+  }
+
+  int index = Find(identity);
+  if (index < 0) {
+    return FALSE;
+  }
+
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  ULONGLONG nowTicks = FileTimeToTicks(now);
+  ULONGLONG verifiedTicks = FileTimeToTicks(mEntries[index].verifiedTime);
+  // An entry from the future means the clock was changed, don't trust it.
+  if (verifiedTicks > nowTicks ||
+      nowTicks - verifiedTicks >
+          VERIFY_CACHE_TTL_SECONDS * FILETIME_TICKS_PER_SECOND) {
+    LOG(("Cached signature verification expired."));
+    Remove(identity);
+    return FALSE;
+  }
+
+  entry = mEntries[index];
+  return TRUE;
+}
+
+/**
+ * Remembers a successful verification, replacing the oldest entry if the
+ * cache is full.
+ *
+ * @param  identity The identity of the file that was verified
+ * @param  name     The name of the allowed certificate the file matched
+ * @param  issuer   The issuer of the allowed certificate the file matched
+ * @return TRUE if the cache file was updated.
+ */
+BOOL VerificationCache::Store(const SignedFileIdentity& identity,
+                              LPCWSTR name, LPCWSTR issuer) {
+  if (!Load()) {
+    return FALSE;
+  }
+
+  int index = Find(identity);
+  if (index < 0) {
+    if (mCount < VERIFY_CACHE_MAX_ENTRIES) {
+      index = static_cast<int>(mCount++);
+    } else {
+      index = 0;
+      for (DWORD i = 1; i < mCount; ++i) {
+        if (CompareFileTime(&mEntries[i].verifiedTime,
+                            &mEntries[index].verifiedTime) < 0) {
+          index = static_cast<int>(i);
+        }
+      }
+    }
+  }
+
+  VerificationCacheEntry& entry = mEntries[index];
+  ZeroMemory(&entry, sizeof(entry));
+  entry.identity = identity;
+  GetSystemTimeAsFileTime(&entry.verifiedTime);
+  entry.trustResult = ERROR_SUCCESS;
+  wcsncpy_s(entry.name, VERIFY_CACHE_NAME_LENGTH, name ? name : L"",
+            _TRUNCATE);
+  wcsncpy_s(entry.issuer, VERIFY_CACHE_NAME_LENGTH, issuer ? issuer : L"",
+            _TRUNCATE);
+  return Save();
+}
+
+/**
+ * Forgets any verification of a file with this identity.
+ */
+void VerificationCache::Remove(const SignedFileIdentity& identity) {
+  if (!Load()) {
+    return;
+  }
+
+  int index = Find(identity);
+  if (index < 0) {
+    return;
+  }
+
+  mEntries[index] = mEntries[mCount - 1];
+  --mCount;
+  Save();
+}
@@ -0,0 +1,67 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _VERIFYCACHE_H_
+#define _VERIFYCACHE_H_
+
+#include <windows.h>
+#include "filehash.h"
+
+// Successful signature checks are remembered for this long. After that the
+// file is checked from scratch again even if it hasn't changed.
+#define VERIFY_CACHE_TTL_SECONDS (24 * 60 * 60)
+#define VERIFY_CACHE_MAX_ENTRIES 16
+#define VERIFY_CACHE_NAME_LENGTH 256
+
+/**
+ * What identifies the contents of a file for the verification cache. The
+ * size and last write time are only used to invalidate entries early, a
+ * cached result is never used unless the digest matches too.
+ */
+struct SignedFileIdentity {
+  BYTE digest[SHA256_DIGEST_LENGTH];
+  ULONGLONG fileSize;
+  FILETIME lastWriteTime;
+};
+
+struct VerificationCacheEntry {
+  SignedFileIdentity identity;
+  FILETIME verifiedTime;
+  DWORD trustResult;
+  // The allowed certificate the file matched when it was verified.
+  WCHAR name[VERIFY_CACHE_NAME_LENGTH];
+  WCHAR issuer[VERIFY_CACHE_NAME_LENGTH];
+};
+
+BOOL GetSignedFileIdentity(HANDLE file, SignedFileIdentity& identity);
+
+/**
+ * A small file backed cache of successful signature verifications. The
+ * cache file lives in the service's own directory so only an administrator
+ * can alter it.
+ */
+class VerificationCache {
+ public:
+  static VerificationCache& GetDefault();
+
+  explicit VerificationCache(LPCWSTR cacheFilePath);
+
+  BOOL Lookup(const SignedFileIdentity& identity,
+              VerificationCacheEntry& entry);
+  BOOL Store(const SignedFileIdentity& identity, LPCWSTR name,
+             LPCWSTR issuer);
+  void Remove(const SignedFileIdentity& identity);
+
+ private:
+  BOOL Load();
+  BOOL Save();
+  int Find(const SignedFileIdentity& identity) const;
+
+  WCHAR mPath[MAX_PATH + 1];
+  bool mLoaded;
+  DWORD mCount;
+  VerificationCacheEntry mEntries[VERIFY_CACHE_MAX_ENTRIES];
+};
+
+#endif
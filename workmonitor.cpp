@@ -18,19 +18,29 @@
 #include "serviceinstall.h"
 #include "updatecommon.h"
 #include "servicebase.h"
+#include "allowlist.h"
+#include "eventlog.h"
+#include "peresource.h"
 #include "registrycertificates.h"
 #include "uachelper.h"
 #include "updatehelper.h"
 #include "pathhash.h"
 #include "updatererrors.h"
 #include "updateutils_win.h"
+#include "updaterjob.h"
+#include "outputcapture.h"
+#include "installerstore.h"
+#include "stagedupdates.h"
+#include "uuidgen.h"
 
 // Wait 15 minutes for an update operation to run at most.
 // Updates usually take less than a minute so this seems like a
 // significantly large and safe amount of time to wait.
 static const int TIME_TO_WAIT_ON_UPDATER = 15 * 60 * 1000;
-BOOL PathGetSiblingFilePath(LPWSTR destinationBuffer, LPCWSTR siblingFilePath,
-                            LPCWSTR newFileName);
+// How often the resource use of the updater is logged while it runs.
+static const DWORD UPDATER_SAMPLE_INTERVAL_MS = 10 * 1000;
+// How long the output of the updater is read after it exited.
+static const DWORD UPDATER_OUTPUT_GRACE_MS = 5 * 1000;
 
 /**
  * Gets the installation directory from the arguments passed to updater.exe.
@@ -69,53 +79,103 @@ BOOL StartUpdateProcess(int argc, LPWSTR* argv, LPCWSTR installDir,
   processStarted = FALSE;
 
   LOG(("Starting update process as the service in session 0."));
-  STARTUPINFOW si;
+  STARTUPINFOEXW si;
   PROCESS_INFORMATION pi;
 
   ZeroMemory(&si, sizeof(si));
   ZeroMemory(&pi, sizeof(pi));
-  si.cb = sizeof(si);
-  si.lpDesktop = const_cast<LPWSTR>(L"winsta0\\Default");  // -Wwritable-strings
+  si.StartupInfo.cb = sizeof(si.StartupInfo);
+  si.StartupInfo.lpDesktop = const_cast<LPWSTR>(L"winsta0\\Default");  // -Wwritable-strings
 
   // The updater command line is of the form:
   // updater.exe /S /D=<install path>
 
-  wchar_t switches[7] = L"/S /D=";
-  auto args = MakeCommandLine(argc - 1, argv + 1);
-
-  wchar_t format[] = L"%ls %ls%ls";
-  // + 1 to allocated length for terminating null and + 1 for space between
-  size_t len = wcslen(argv[0]) + wcslen(switches) + wcslen(args.get()) + 2;
-  auto cmdLine = std::make_unique<wchar_t[]>(len);
-  mywcsprintf(cmdLine.get(), len, format, argv[0], switches, args.get());
+  // Built in place, only a command line longer than this goes on the heap.
+  wchar_t cmdLineStorage[2 * MAX_PATH + 64];
+  CommandLineBuilder cmdLine(cmdLineStorage, _countof(cmdLineStorage));
+  cmdLine.AppendText(argv[0]);
+  cmdLine.AppendText(L" /S /D=");
+  cmdLine.AppendArgs(argc - 1, argv + 1);
 
   // Setting the desktop to blank will ensure no GUI is displayed
-  si.lpDesktop = const_cast<LPWSTR>(L"");  // -Wwritable-strings
-  si.dwFlags |= STARTF_USESHOWWINDOW;
-  si.wShowWindow = SW_HIDE;
-
-  LOG(("Starting %ls with cmdline: %ls", argv[0], cmdLine.get()));
-  processStarted =
-      CreateProcessW(argv[0], cmdLine.get(), nullptr, nullptr, FALSE,
-                     CREATE_DEFAULT_ERROR_MODE, nullptr, nullptr, &si, &pi);
+  si.StartupInfo.lpDesktop = const_cast<LPWSTR>(L"");  // -Wwritable-strings
+  si.StartupInfo.dwFlags |= STARTF_USESHOWWINDOW;
+  si.StartupInfo.wShowWindow = SW_HIDE;
+
+  // The output of the updater goes to the log. Without it the updater still
+  // runs, it just inherits nothing.
+  OutputCapture output;
+  BOOL capturing = output.PrepareStartupInfo(si);
+
+  // The updater runs in a job so the processes it starts can be accounted
+  // for and terminated along with it. It is started suspended so it can't
+  // start any before it is in the job.
+  UpdaterJobLimits limits;
+  GetUpdaterJobLimits(limits);
+  UpdaterJob job;
+  BOOL jobCreated = job.Create(limits);
+
+  LOG_EVENT(UPDATER_STARTING, argv[0], cmdLine.Get());
+  processStarted = CreateProcessW(
+      argv[0], cmdLine.Get(), nullptr, nullptr, capturing,
+      CREATE_DEFAULT_ERROR_MODE | CREATE_SUSPENDED |
+          (capturing ? EXTENDED_STARTUPINFO_PRESENT : 0),
+      nullptr, nullptr, &si.StartupInfo, &pi);
 
   BOOL updateWasSuccessful = FALSE;
   if (processStarted) {
+    BOOL inJob = jobCreated && job.Assign(pi.hProcess);
+    if (jobCreated && !inJob) {
+      LOG_WARN(("Could not put the updater in its job.  (%lu)",
+                GetLastError()));
+    }
+    if (capturing) {
+      output.Start();
+    }
+    ResumeThread(pi.hThread);
+    WriteSecureStatusRecord(installDir, UPDATE_STATUS_APPLYING, 0,
+                            UPDATE_PROGRESS_STARTED);
+
     BOOL processTerminated = FALSE;
     BOOL noProcessExitCode = FALSE;
+    DWORD returnCode = 0;
     // Wait for the updater process to finish
     LOG(("Process was started... waiting on result."));
-    DWORD waitRes = WaitForSingleObject(pi.hProcess, TIME_TO_WAIT_ON_UPDATER);
+    ULONGLONG start = GetTickCount64();
+    DWORD waitRes = WAIT_TIMEOUT;
+    UpdaterUsage usage;
+    for (;;) {
+      ULONGLONG elapsed = GetTickCount64() - start;
+      if (elapsed >= static_cast<ULONGLONG>(TIME_TO_WAIT_ON_UPDATER)) {
+        break;
+      }
+      DWORD waitMS = static_cast<DWORD>(TIME_TO_WAIT_ON_UPDATER - elapsed);
+      if (inJob && waitMS > UPDATER_SAMPLE_INTERVAL_MS) {
+        waitMS = UPDATER_SAMPLE_INTERVAL_MS;
+      }
+      waitRes = WaitForSingleObject(pi.hProcess, waitMS);
+      if (WAIT_TIMEOUT != waitRes) {
+        break;
+      }
+      if (inJob && job.Sample(usage)) {
+        LOG_EVENT(UPDATER_USAGE, usage.activeProcesses, usage.totalProcesses,
+                  usage.cpuTimeMS, usage.readBytes, usage.writeBytes,
+                  usage.peakMemory);
+      }
+    }
+
     if (WAIT_TIMEOUT == waitRes) {
       // We waited a long period of time for updater.exe and it never finished
-      // so kill it.
-      TerminateProcess(pi.hProcess, 1);
+      // so kill it, along with anything it started.
+      LOG_EVENT(UPDATER_TIMED_OUT, TIME_TO_WAIT_ON_UPDATER);
+      if (!inJob || !job.Terminate(1)) {
+        TerminateProcess(pi.hProcess, 1);
+      }
       processTerminated = TRUE;
     } else {
       // Check the return code of updater.exe to make sure we get 0
-      DWORD returnCode;
       if (GetExitCodeProcess(pi.hProcess, &returnCode)) {
-        LOG(("Process finished with return code %lu.", returnCode));
+        LOG_EVENT(UPDATER_FINISHED, returnCode);
         // updater returns 0 if successful.
         updateWasSuccessful = (returnCode == 0);
       } else {
@@ -123,14 +183,37 @@ BOOL StartUpdateProcess(int argc, LPWSTR* argv, LPCWSTR installDir,
         noProcessExitCode = TRUE;
       }
     }
+    output.Finish(UPDATER_OUTPUT_GRACE_MS);
+    if (inJob && job.Sample(usage)) {
+      LOG_EVENT(UPDATER_USAGE, usage.activeProcesses, usage.totalProcesses,
+                usage.cpuTimeMS, usage.readBytes, usage.writeBytes,
+                usage.peakMemory);
+    }
     CloseHandle(pi.hProcess);
     CloseHandle(pi.hThread);
+
+    int errorCode = 0;
+    if (processTerminated) {
+      errorCode = SERVICE_STILL_APPLYING_TERMINATED;
+    } else if (noProcessExitCode) {
+      errorCode = SERVICE_STILL_APPLYING_NO_EXIT_CODE;
+    } else if (!updateWasSuccessful) {
+      errorCode = static_cast<int>(returnCode);
+    }
+    WriteSecureStatusRecord(
+        installDir,
+        updateWasSuccessful ? UPDATE_STATUS_SUCCEEDED : UPDATE_STATUS_FAILED,
+        errorCode, UPDATE_PROGRESS_EXITED);
   } else {
     DWORD lastError = GetLastError();
     LOG_WARN(
         ("Could not create process as current user, "
          "updaterPath: %ls; cmdLine: %ls.  (%lu)",
-         argv[0], cmdLine.get(), lastError));
+         argv[0], cmdLine.Get(), lastError));
+    WriteSecureStatusRecord(installDir, UPDATE_STATUS_FAILED,
+                            SERVICE_UPDATER_COULD_NOT_BE_STARTED,
+                            UPDATE_PROGRESS_VERIFIED);
+    SetLastError(lastError);
   }
 
   return updateWasSuccessful;
@@ -146,7 +229,7 @@ BOOL StartUpdateProcess(int argc, LPWSTR* argv, LPCWSTR installDir,
  * @return true if updater is the path to a valid updater
  */
 static bool UpdaterIsValid(LPWSTR updater, LPWSTR installDir) {
-    LOG(("Checking updater validity: %ls", updater));
+    LOG_EVENT(UPDATER_CHECKING, updater);
   // Make sure the path to the updater to use for the update is local.
   // We do this check to make sure that file locking is available for
   // race condition security checks.
@@ -167,45 +250,17 @@ static bool UpdaterIsValid(LPWSTR updater, LPWSTR installDir) {
 
   // Check to make sure the updater.exe module has the unique updater identity.
   // This is a security measure to make sure that the signed executable that
-  // we will run is actually an updater.
-  bool result = true;
-  autoModuleHandle updaterModule(LoadLibraryEx(updater, nullptr, LOAD_LIBRARY_AS_DATAFILE));
-  if (!updaterModule.get()) {
-    LOG_WARN(("updater.exe module could not be loaded. (%lu)", GetLastError()));
-    return false;
-  }
-  HRSRC hRes = FindResourceA(
-      updaterModule.get(),
-      MAKEINTRESOURCEA(IDS_UPDATER_IDENTITY),
-      MAKEINTRESOURCEA(IDS_UPDATER_IDENTITY));
-  if (!hRes) {
+  // we will run is actually an updater. The resource is read in place from a
+  // read only view of the file through the handle that is locking it, so the
+  // image is never loaded.
+  BOOL identityMatches = FALSE;
+  if (!DoesPEFileResourceMatch(noWriteLock.get(), IDS_UPDATER_IDENTITY,
+                               IDS_UPDATER_IDENTITY, UPDATER_IDENTITY_STRING,
+                               identityMatches)) {
       LOG_WARN(("Error finding installer identity  (%ld)", GetLastError()));
       return false;
   }
-  HGLOBAL hResInfo = LoadResource(updaterModule.get(), hRes);
-  if (!hResInfo) {
-      LOG_WARN(("Error loading installer identity  (%ld)", GetLastError()));
-      return false;
-  }
-  DWORD size = SizeofResource(updaterModule.get(), hRes);
-  if (size == 0) {
-      LOG_WARN(("Error getting size of installer identity  (%ld)", GetLastError()));
-      return false;
-  }
-  LPVOID hResData = LockResource(hResInfo);
-  if (!hResData)
-  {
-      LOG_WARN(("Error locking installer identity   (%ld)", GetLastError()));
-      return false;
-  }
-  auto charData = std::make_unique<char[]>(size);
-  charData.get()[size - 1] = '\0';
-  DWORD i = 0;
-  while (i < size) {
-      charData.get()[i] = static_cast<char*>(hResData)[i];
-      i++;
-  }
-  if (strcmp(charData.get(), UPDATER_IDENTITY_STRING)) {
+  if (!identityMatches) {
       LOG_WARN(("The updater.exe identity string is not valid."));
       return false;
   }
@@ -238,6 +293,12 @@ BOOL ProcessSoftwareUpdateCommand(DWORD argc, LPWSTR* argv) {
   }
 
   if (UpdaterIsValid(argv[0], installDir)) {
+    WriteSecureStatusRecord(installDir, UPDATE_STATUS_APPLYING, 0,
+                            UPDATE_PROGRESS_VERIFIED);
+    DWORD lastError = LogRunningInstallationProcesses(installDir, argv[0]);
+    if (ERROR_SUCCESS != lastError) {
+      LOG_WARN(("Could not look for running processes.  (%lu)", lastError));
+    }
     BOOL updateProcessWasStarted = FALSE;
     if (StartUpdateProcess(argc, argv, installDir, updateProcessWasStarted)) {
       LOG(("updater.exe was launched and run successfully!"));
@@ -258,86 +319,98 @@ BOOL ProcessSoftwareUpdateCommand(DWORD argc, LPWSTR* argv) {
         ("Could not start process due to certificate check error on "
          "updater.exe.  (%lu)",
          GetLastError()));
+    WriteSecureStatusRecord(installDir, UPDATE_STATUS_FAILED,
+                            SERVICE_UPDATER_SIGN_ERROR, UPDATE_PROGRESS_NONE);
   }
 
   return result;
 }
 
 /**
- * Obtains the updater path alongside a subdir of the service binary.
- * The purpose of this function is to return a path that is likely high
- * integrity and therefore more safe to execute code from.
+ * Gets the installation directory of a software-update or stage command
+ * and checks the installation is one the service may update.
  *
- * @param serviceUpdaterPath Out parameter for the path where the updater
- *                           should be copied to.
- * @return TRUE if a file path was obtained.
+ * @param  argc       The number of arguments in argv
+ * @param  argv       The service command line arguments, argv[2] names the
+ *                    updater and argv[3] is the installation directory
+ * @param  installDir Out parameter for the installation directory
+ * @return TRUE if the command may go ahead.
  */
-BOOL GetSecureUpdaterPath(WCHAR serviceUpdaterPath[MAX_PATH + 1]) {
-  if (!GetModuleFileNameW(nullptr, serviceUpdaterPath, MAX_PATH)) {
-    LOG_WARN(
-        ("Could not obtain module filename when attempting to "
-         "use a secure updater path.  (%lu)",
-         GetLastError()));
-    return FALSE;
-  }
-
-  if (!PathRemoveFileSpecW(serviceUpdaterPath)) {
+static BOOL GetCommandInstallDir(int argc, LPWSTR* argv,
+                                 WCHAR installDir[MAX_PATH + 1]) {
+  if (argc <= 3 || !IsValidFullPath(argv[3])) {
     LOG_WARN(
-        ("Couldn't remove file spec when attempting to use a secure "
-         "updater path.  (%lu)",
-         GetLastError()));
+        ("The install directory path is not valid for this application."));
     return FALSE;
   }
 
-  if (!PathAppendSafe(serviceUpdaterPath, L"update")) {
-    LOG_WARN(
-        ("Couldn't append file spec when attempting to use a secure "
-         "updater path.  (%lu)",
-         GetLastError()));
+  if (!GetInstallationDir(argc - 2, argv + 2, installDir)) {
+    LOG_WARN(("Could not get the installation directory"));
     return FALSE;
   }
-
-  CreateDirectoryW(serviceUpdaterPath, nullptr);
-
-  if (!PathAppendSafe(serviceUpdaterPath, L"updater.exe")) {
-    LOG_WARN(
-        ("Couldn't append file spec when attempting to use a secure "
-         "updater path.  (%lu)",
-         GetLastError()));
-    return FALSE;
+  LOG(("installDir = %ls", installDir));
+
+  if (!DoesFallbackKeyExist()) {
+    WCHAR updateServiceKey[MAX_PATH + 1];
+    if (CalculateRegistryPathFromFilePath(installDir,
+                                          updateServiceKey)) {
+      LOG(("Checking for update service registry key: '%ls'",
+           updateServiceKey));
+      // This also reads the allowed certificates the updater is checked
+      // against later.
+      const AllowedCertificateList* allowedCertificates = nullptr;
+      if (AllowlistSnapshot::GetDefault().Get(
+              updateServiceKey, allowedCertificates) != ERROR_SUCCESS) {
+        LOG_WARN(("The update service registry key does not exist."));
+        return FALSE;
+      }
+    } else {
+      return FALSE;
+    }
   }
-
   return TRUE;
 }
 
 /**
- * Deletes the passed in updater path and the associated updater.ini file.
+ * Gets a verified copy of an updater into the installer store.
+ *
+ * An installer which was copied and verified before is used from the
+ * installer store without copying it again. Its signature is still checked
+ * when it is run, against the allowed certificates of today.
  *
- * @param serviceUpdaterPath The path to delete.
- * @return TRUE if a file was deleted.
+ * @param  updater    The updater named by the command
+ * @param  installDir The installation being updated
+ * @param  hashed     TRUE if digest holds the digest of updater
+ * @param  digest     The digest of updater, set to that of the copy
+ * @param  path       Out parameter for the path of the stored copy
+ * @param  background TRUE to copy in background I/O mode
+ * @return TRUE if the stored copy can be run.
  */
-BOOL DeleteSecureUpdater(WCHAR serviceUpdaterPath[MAX_PATH + 1]) {
-  BOOL result = FALSE;
-  if (serviceUpdaterPath[0]) {
-    result = DeleteFileW(serviceUpdaterPath);
-    if (!result && GetLastError() != ERROR_PATH_NOT_FOUND &&
-        GetLastError() != ERROR_FILE_NOT_FOUND) {
-      LOG_WARN(("Could not delete service updater path: '%ls'.",
-                serviceUpdaterPath));
-    }
+static BOOL StoreUpdater(LPWSTR updater, LPWSTR installDir, BOOL hashed,
+                         BYTE digest[SHA256_DIGEST_LENGTH],
+                         WCHAR path[MAX_PATH + 1], BOOL background) {
+  InstallerStore& store = InstallerStore::GetDefault();
+  if (hashed && store.Lookup(digest, path)) {
+    LOG(("Using the stored copy of the updater: %ls", path));
+    return TRUE;
+  }
 
-    WCHAR updaterINIPath[MAX_PATH + 1] = {L'\0'};
-    if (PathGetSiblingFilePath(updaterINIPath, serviceUpdaterPath,
-                               L"updater.ini")) {
-      result = DeleteFileW(updaterINIPath);
-      if (!result && GetLastError() != ERROR_PATH_NOT_FOUND &&
-          GetLastError() != ERROR_FILE_NOT_FOUND) {
-        LOG_WARN(("Could not delete service updater INI path: '%ls'.",
-                  updaterINIPath));
-      }
-    }
+  if (!UpdaterIsValid(updater, installDir)) {
+    return FALSE;
   }
-  return result;
+  // Copy the updater into the store so that a low integrity process cannot
+  // replace it at any point and use that for the update. The source is only
+  // read once and the copy is hashed back and checked against it. It also
+  // makes DLL injection attacks harder.
+  if (!store.Add(updater, digest, path, background)) {
+    LOG_WARN(("Could not copy path to secure location.  (%lu)",
+              GetLastError()));
+    return FALSE;
+  }
+  LOG(("updater.exe was copied and compared successfully to the "
+       "installation directory updater.exe: %ls",
+       path));
+  return TRUE;
 }
 
 /**
@@ -351,7 +424,7 @@ BOOL DeleteSecureUpdater(WCHAR serviceUpdaterPath[MAX_PATH + 1]) {
  */
 BOOL ExecuteServiceCommand(int argc, LPWSTR* argv) {
   for (int i = 0; i < argc; i++) {
-      LOG(("arg[%d] = %ls", i, argv[i]));
+      LOG_EVENT(SERVICE_ARGUMENT, i, argv[i]);
   }
   if (argc < 2) {
     LOG_WARN(
@@ -363,7 +436,7 @@ BOOL ExecuteServiceCommand(int argc, LPWSTR* argv) {
   // unique ID in the log.
   WCHAR uuidString[MAX_PATH + 1] = {L'\0'};
   if (GetUUIDString(uuidString)) {
-    LOG(("Executing service command %ls, ID: %ls", argv[1], uuidString));
+    LOG_EVENT(SERVICE_COMMAND_STARTED, argv[1], uuidString);
   } else {
     // The ID is only used by tests, so failure to allocate it isn't fatal.
     LOG(("Executing service command %ls", argv[1]));
@@ -371,99 +444,129 @@ BOOL ExecuteServiceCommand(int argc, LPWSTR* argv) {
 
   BOOL result = FALSE;
   if (!lstrcmpi(argv[1], L"software-update")) {
-    if (argc <= 3 || !IsValidFullPath(argv[3])
-    ) {
-      LOG_WARN(
-          ("The install directory path is not valid for this application."));
+    WCHAR installDir[MAX_PATH + 1] = {L'\0'};
+    if (!GetCommandInstallDir(argc, argv, installDir)) {
       return FALSE;
     }
 
-    // Use the passed in command line arguments for the path to updater.exe. 
-    // Then we copy that updater.exe to the directory of the
-    // update service so that a low integrity process cannot
-    // replace the updater.exe at any point and use that for the update.
-    // It also makes DLL injection attacks harder.
-    WCHAR installDir[MAX_PATH + 1] = {L'\0'};
-    if (!GetInstallationDir(argc - 2, argv + 2, installDir)) {
-      LOG_WARN(("Could not get the installation directory"));
-      return FALSE;
+    // An update which was pending or applying when the service went away
+    // never got to record how it ended.
+    UpdateStatusRecord lastStatus;
+    if (ReadSecureStatusRecord(installDir, lastStatus) &&
+        (UPDATE_STATUS_PENDING == lastStatus.state ||
+         UPDATE_STATUS_APPLYING == lastStatus.state)) {
+      WCHAR lastId[UUID_STRING_LENGTH];
+      FormatUuid(lastStatus.id, lastId);
+      LOG_WARN(("Update %ls of %ls did not finish, it reached step %llu.",
+                lastId, installDir, lastStatus.progress));
     }
-    LOG(("installDir = %ls", installDir));
-
-    if (!DoesFallbackKeyExist()) {
-      WCHAR updateServiceKey[MAX_PATH + 1];
-      if (CalculateRegistryPathFromFilePath(installDir,
-                                            updateServiceKey)) {
-        LOG(("Checking for update service registry key: '%ls'",
-             updateServiceKey));
-        HKEY baseKey = nullptr;
-        if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, updateServiceKey, 0,
-                          KEY_READ | KEY_WOW64_64KEY,
-                          &baseKey) != ERROR_SUCCESS) {
-          LOG_WARN(("The update service registry key does not exist."));
-          return FALSE;
-        }
-        RegCloseKey(baseKey);
-      } else {
-        return FALSE;
-      }
+    if (!BeginSecureStatusRecord(installDir)) {
+      LOG_WARN(("Could not write the status of the update.  (%lu)",
+                GetLastError()));
     }
-    result = UpdaterIsValid(argv[2], installDir);
 
-    if (result) {
-      WCHAR secureUpdaterPath[MAX_PATH + 1] = {L'\0'};
-      if (result) {
-        result = GetSecureUpdaterPath(secureUpdaterPath);  // Does its own logging
-      }
-      if (result) {
-        LOG(("Using this path for updating: %ls", secureUpdaterPath));
-        DeleteSecureUpdater(secureUpdaterPath);
-        result = CopyFileW(argv[2], secureUpdaterPath, FALSE);
+    // The updater is named by its path, or by the token of an installer
+    // which was staged before.
+    BYTE updaterDigest[SHA256_DIGEST_LENGTH];
+    WCHAR secureUpdaterPath[MAX_PATH + 1] = {L'\0'};
+    BOOL staged = ParseStagedToken(argv[2], updaterDigest);
+    if (staged) {
+      StagingRedeemResult redeemed =
+          StagedUpdates::GetDefault().Redeem(updaterDigest, installDir);
+      if (STAGING_REDEEM_OK != redeemed) {
+        LOG_WARN(("The staged updater %ls can't be used.  (%d)", argv[2],
+                  static_cast<int>(redeemed)));
+        return FALSE;
       }
-
+      // Only the integrity of the stored copy is checked again here.
+      result = InstallerStore::GetDefault().Lookup(updaterDigest,
+                                                   secureUpdaterPath);
       if (!result) {
-        LOG_WARN(
-            ("Could not copy path to secure location.  (%lu)", GetLastError()));
+        LOG_WARN(("The staged updater %ls is no longer stored.", argv[2]));
+        StagedUpdates::GetDefault().Remove(updaterDigest);
       } else {
-        // Verify that the updater.exe that we will be executing from the
-        // secure path is the same as the source we copied from.
-        BOOL updaterIsCorrect;
-        if (!VerifySameFiles(argv[2], secureUpdaterPath, updaterIsCorrect)) {
-            LOG_WARN(
-                ("Error checking if the updaters are the same.\n"
-                    "Path 1: %ls\nPath 2: %ls",
-                    argv[2], secureUpdaterPath));
-            return false;
-        }
-
-        if (!updaterIsCorrect) {
-            LOG_WARN(
-                ("The updaters do not match, updater will not run.\n"
-                    "Path 1: %ls\nPath 2: %ls",
-                    argv[2], secureUpdaterPath));
-            return false;
-        }
-
-        LOG(
-            ("updater.exe was compared successfully to the installation directory"
-                " updater.exe."));
+        LOG(("Using the staged updater: %ls", secureUpdaterPath));
+      }
+    } else {
+      result = StoreUpdater(argv[2], installDir,
+                            HashUpdaterFile(argv[2], updaterDigest),
+                            updaterDigest, secureUpdaterPath, FALSE);
+    }
 
-        // We obtained the path, copied it successfully, and verified the copy,
-        // so update the path to use for the service update.
-        argv[2] = secureUpdaterPath;
-        result = ProcessSoftwareUpdateCommand(argc - 2, argv + 2);
-        DeleteSecureUpdater(secureUpdaterPath);
+    if (!result) {
+      WriteSecureStatusRecord(installDir, UPDATE_STATUS_FAILED,
+                              SERVICE_COULD_NOT_COPY_UPDATER,
+                              UPDATE_PROGRESS_NONE);
+    } else {
+      // Use the verified copy for the service update.
+      argv[2] = secureUpdaterPath;
+      result = ProcessSoftwareUpdateCommand(argc - 2, argv + 2);
+      if (result && staged) {
+        StagedUpdates::GetDefault().Remove(updaterDigest);
       }
     }
     // We might not reach here if the service install succeeded
     // because the service self updates itself and the service
     // installer will stop the service.
+  } else if (!lstrcmpi(argv[1], L"stage")) {
+    WCHAR installDir[MAX_PATH + 1] = {L'\0'};
+    if (!GetCommandInstallDir(argc, argv, installDir)) {
+      return FALSE;
+    }
+
+    // Staging runs ahead of the maintenance window, so its I/O yields to
+    // the room control server. Background mode is per thread, the copy
+    // enters it on its own threads.
+    BOOL background =
+        SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    BYTE updaterDigest[SHA256_DIGEST_LENGTH];
+    WCHAR secureUpdaterPath[MAX_PATH + 1] = {L'\0'};
+    if (!HashUpdaterFile(argv[2], updaterDigest)) {
+      LOG_WARN(("Could not read the updater to stage: %ls  (%lu)", argv[2],
+                GetLastError()));
+    } else {
+      StagedUpdates& stagedUpdates = StagedUpdates::GetDefault();
+      stagedUpdates.Begin(updaterDigest, installDir);
+      BYTE storedDigest[SHA256_DIGEST_LENGTH];
+      memcpy(storedDigest, updaterDigest, SHA256_DIGEST_LENGTH);
+      result = StoreUpdater(argv[2], installDir, TRUE, storedDigest,
+                            secureUpdaterPath, TRUE);
+      if (result &&
+          memcmp(storedDigest, updaterDigest, SHA256_DIGEST_LENGTH) != 0) {
+        LOG_WARN(("The updater changed while it was staged: %ls", argv[2]));
+        result = FALSE;
+      }
+      if (result) {
+        // Staging has time to spare, so the stored copy is also compared
+        // byte for byte with the updater it was made from.
+        BOOL sameContent = FALSE;
+        if (!VerifySameFiles(argv[2], secureUpdaterPath, sameContent)) {
+          LOG_WARN(("Could not compare the stored copy of the updater: %ls  "
+                    "(%lu)", secureUpdaterPath, GetLastError()));
+          result = FALSE;
+        } else if (!sameContent) {
+          LOG_WARN(("The stored copy of the updater differs from %ls",
+                    argv[2]));
+          result = FALSE;
+        }
+      }
+      stagedUpdates.Finish(updaterDigest, result);
+      if (result) {
+        WCHAR token[SHA256_DIGEST_LENGTH * 2 + 1];
+        FormatInstallerDigest(updaterDigest, token);
+        LOG(("Staged %ls for %ls as %ls%ls", argv[2], installDir,
+             STAGED_TOKEN_PREFIX, token));
+      }
+    }
+    if (background) {
+      SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    }
   } else {
-    LOG_WARN(("Service command not recognized: %ls.", argv[1]));
+    LOG_EVENT(SERVICE_COMMAND_UNKNOWN, argv[1]);
     // result is already set to FALSE
   }
 
-  LOG(("Service command %ls complete with result: %ls.", argv[1],
-       (result ? L"Success" : L"Failure")));
+  LOG_EVENT(SERVICE_COMMAND_FINISHED, argv[1],
+            (result ? L"Success" : L"Failure"));
   return result;
 }